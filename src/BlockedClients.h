@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ServerBase.h"
+
+/* Connections blocked in blpop. Each key has a queue of the connections
+ * waiting on it in the order they blocked, so data is handed to the one
+ * that waited longest. A connection keeps the keys it waits on, see
+ * Conn::blocked_keys, and one with a timeout is also kept by deadline so
+ * the event loop can sleep until the first of them instead of polling */
+
+class BlockedClients {
+ private:
+  std::unordered_map<std::string, std::deque<Conn*>> waiters_;
+  std::set<std::pair<uint64_t, Conn*>> deadlines_;
+  size_t size_ = 0;
+
+ public:
+  inline size_t size() const noexcept { return size_; }
+
+  void block(Conn* conn, const std::vector<std::string>& keys,
+             uint64_t deadline_ns) {
+    /* Parks conn on keys until unblock, deadline_ns 0 is no timeout */
+    for (const std::string& key : keys) {
+      if (std::find(conn->blocked_keys.begin(), conn->blocked_keys.end(),
+                    key) != conn->blocked_keys.end()) {
+        continue;
+      }
+      conn->blocked_keys.push_back(key);
+      waiters_[key].push_back(conn);
+    }
+    conn->blocked_deadline_ns = deadline_ns;
+    if (deadline_ns > 0) deadlines_.emplace(deadline_ns, conn);
+    ++size_;
+  }
+
+  void unblock(Conn* conn) {
+    for (const std::string& key : conn->blocked_keys) {
+      auto it = waiters_.find(key);
+      std::deque<Conn*>& queue = it->second;
+      queue.erase(std::find(queue.begin(), queue.end(), conn));
+      if (queue.empty()) waiters_.erase(it);
+    }
+    if (conn->blocked_deadline_ns > 0) {
+      deadlines_.erase({conn->blocked_deadline_ns, conn});
+    }
+    conn->blocked_keys.clear();
+    conn->blocked_deadline_ns = 0;
+    --size_;
+  }
+
+  Conn* first(const std::string& key) const {
+    /* The connection waiting longest on key, null if none */
+    auto it = waiters_.find(key);
+    return it == waiters_.end() ? nullptr : it->second.front();
+  }
+
+  Conn* expired(uint64_t now_ns) const {
+    /* A connection whose timeout has passed, null if none */
+    if (deadlines_.empty() || deadlines_.begin()->first > now_ns) {
+      return nullptr;
+    }
+    return deadlines_.begin()->second;
+  }
+
+  int timeout_ms(uint64_t now_ns) const {
+    /* Poll timeout until the next deadline, -1 if there is none */
+    if (deadlines_.empty()) return -1;
+    uint64_t deadline_ns = deadlines_.begin()->first;
+    if (deadline_ns <= now_ns) return 0;
+    return static_cast<int>((deadline_ns - now_ns + 999999) / 1000000);
+  }
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Hash64.h"
+#include "Varint.h"
+
+/* Scalable blocked Bloom filter. An item only touches one 64 byte block, a
+ * single cache line: the high half of its hash picks the block and the low
+ * half sets one bit in each of the block's 8 words, the bit chosen by
+ * multiplying it with a per word odd constant. The 8 words are independent
+ * so the loops over them vectorize. Blocks cost more bits per item than a
+ * classic filter at the same error rate, filter_blocks sizes them for it.
+ *
+ * Once a filter holds its capacity a filter twice as large is added, with
+ * half the error rate so that the rate of all of them stays below twice the
+ * requested one. An item is in the filter if any of them has it */
+
+class Bloom {
+ public:
+  static constexpr double DEFAULT_ERROR_RATE = 0.01;
+  static constexpr uint64_t DEFAULT_CAPACITY = 1000;
+  static constexpr double MIN_ERROR_RATE = 1e-6;
+  static constexpr uint64_t MAX_CAPACITY = 1ULL << 28;
+  static constexpr size_t BLOCK_BITS = 512;
+
+ private:
+  struct alignas(64) Block {
+    uint64_t words[8];
+  };
+
+  struct Filter {
+    std::vector<Block> blocks;
+    uint64_t capacity = 0;
+    uint64_t count = 0;
+  };
+
+  static constexpr uint32_t SALT[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+                                       0xa2b7289dU, 0x705495c7U, 0x2df1424bU,
+                                       0x9efc4947U, 0x5c6bfb31U};
+
+  double error_rate_ = DEFAULT_ERROR_RATE;
+  std::vector<Filter> filters_;
+  uint64_t size_ = 0;  // items added
+
+  static double block_error_rate(double items_per_block) {
+    /* Chance that an item is found in a block it was not added to, with a
+     * Poisson number of items in the block that each set one of the 64
+     * bits of every word */
+    double p_items = std::exp(-items_per_block);  // of j items, from j = 0
+    double rate = 0;
+    size_t max_items = static_cast<size_t>(4 * items_per_block) + 64;
+    for (size_t j = 0; j <= max_items; ++j) {
+      double word_set = 1 - std::pow(1 - 1.0 / 64, static_cast<double>(j));
+      rate += p_items * std::pow(word_set, 8);
+      p_items *= items_per_block / static_cast<double>(j + 1);
+    }
+    return rate;
+  }
+
+  static size_t filter_blocks(uint64_t capacity, double error_rate) {
+    /* Fewest blocks for capacity items at error_rate, starting from the
+     * bits a classic filter would need */
+    double bits = -static_cast<double>(capacity) * std::log(error_rate) /
+                  (M_LN2 * M_LN2);
+    size_t n = static_cast<size_t>(std::ceil(bits / BLOCK_BITS));
+    if (n == 0) n = 1;
+    while (block_error_rate(static_cast<double>(capacity) / n) > error_rate) {
+      n += n / 32 + 1;
+    }
+    return n;
+  }
+
+  static inline void masks(uint32_t h, uint64_t (&out)[8]) {
+    for (size_t i = 0; i < 8; ++i) out[i] = 1ULL << ((h * SALT[i]) >> 26);
+  }
+
+  static inline size_t block_index(const Filter& f, uint64_t h) {
+    return static_cast<size_t>(((h >> 32) * f.blocks.size()) >> 32);
+  }
+
+  static bool contains(const Filter& f, uint64_t h) {
+    uint64_t mask[8];
+    masks(static_cast<uint32_t>(h), mask);
+    const Block& b = f.blocks[block_index(f, h)];
+    uint64_t missing = 0;
+    for (size_t i = 0; i < 8; ++i) missing |= mask[i] & ~b.words[i];
+    return missing == 0;
+  }
+
+  static void insert(Filter& f, uint64_t h) {
+    uint64_t mask[8];
+    masks(static_cast<uint32_t>(h), mask);
+    Block& b = f.blocks[block_index(f, h)];
+    for (size_t i = 0; i < 8; ++i) b.words[i] |= mask[i];
+  }
+
+  void add_filter(uint64_t capacity) {
+    double rate = error_rate_ * std::pow(0.5, filters_.size());
+    if (rate < MIN_ERROR_RATE) rate = MIN_ERROR_RATE;
+    Filter& f = filters_.emplace_back();
+    f.capacity = capacity;
+    f.blocks.resize(filter_blocks(capacity, rate));
+  }
+
+ public:
+  Bloom(double error_rate = DEFAULT_ERROR_RATE,
+        uint64_t capacity = DEFAULT_CAPACITY)
+      : error_rate_(error_rate) {
+    add_filter(capacity);
+  }
+
+  inline uint64_t size() const noexcept { return size_; }
+  inline size_t filters() const noexcept { return filters_.size(); }
+
+  size_t bytes() const noexcept {
+    size_t n = 0;
+    for (const Filter& f : filters_) n += f.blocks.size() * sizeof(Block);
+    return n;
+  }
+
+  static bool valid_params(double error_rate, uint64_t capacity) {
+    return error_rate >= MIN_ERROR_RATE && error_rate < 1 && capacity > 0 &&
+           capacity <= MAX_CAPACITY;
+  }
+
+  bool contains(std::string_view item) const {
+    uint64_t h = hash64(item);
+    for (const Filter& f : filters_) {
+      if (contains(f, h)) return true;
+    }
+    return false;
+  }
+
+  bool add(std::string_view item) {
+    /* Returns false if the item may have been added already */
+    uint64_t h = hash64(item);
+    for (const Filter& f : filters_) {
+      if (contains(f, h)) return false;
+    }
+    if (filters_.back().count == filters_.back().capacity) {
+      uint64_t capacity = filters_.back().capacity * 2;
+      add_filter(capacity < MAX_CAPACITY ? capacity : MAX_CAPACITY);
+    }
+    insert(filters_.back(), h);
+    ++filters_.back().count;
+    ++size_;
+    return true;
+  }
+
+  std::string encode() const {
+    /* The error rate's 8 bytes, then for every filter its varint capacity,
+     * count and number of blocks followed by the blocks */
+    std::string out(reinterpret_cast<const char*>(&error_rate_), 8);
+    uint8_t buf[10];
+    for (const Filter& f : filters_) {
+      for (uint64_t v : {f.capacity, f.count,
+                         static_cast<uint64_t>(f.blocks.size())}) {
+        out.append(reinterpret_cast<const char*>(buf), put_varint(buf, v));
+      }
+      out.append(reinterpret_cast<const char*>(f.blocks.data()),
+                 f.blocks.size() * sizeof(Block));
+    }
+    return out;
+  }
+
+  static bool decode(std::string_view data, Bloom& out) {
+    /* Replaces out with an encode() result, false if data is malformed */
+    if (data.size() < 8) return false;
+    double error_rate;
+    memcpy(&error_rate, data.data(), 8);
+    if (!valid_params(error_rate, 1)) return false;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data()) + 8;
+    const uint8_t* end = reinterpret_cast<const uint8_t*>(data.data()) +
+                         data.size();
+    std::vector<Filter> filters;
+    uint64_t size = 0;
+    while (p < end) {
+      Filter& f = filters.emplace_back();
+      uint64_t n_blocks = 0;
+      if (!get_varint(p, end, f.capacity) || !get_varint(p, end, f.count) ||
+          !get_varint(p, end, n_blocks) || f.capacity == 0 ||
+          f.count > f.capacity || n_blocks == 0 ||
+          n_blocks > static_cast<size_t>(end - p) / sizeof(Block)) {
+        return false;
+      }
+      f.blocks.resize(n_blocks);
+      memcpy(f.blocks.data(), p, n_blocks * sizeof(Block));
+      p += n_blocks * sizeof(Block);
+      size += f.count;
+    }
+    if (filters.empty()) return false;
+    out.error_rate_ = error_rate;
+    out.filters_ = std::move(filters);
+    out.size_ = size;
+    return true;
+  }
+};
@@ -64,8 +64,28 @@ struct alignas(64) Buffer {
     }
   }
 
-  void append(uint8_t* msg, uint32_t msg_len) {
-    assert(msg_len > 0);
+  bool shrink(size_t sz) {
+    /* Reallocates to sz bytes, rounded up to a multiple of 64, if that is less
+     * than the current capacity and still fits the data. Returns false if
+     * nothing changed */
+    sz = (sz + 63U) & ~63U;
+    size_t data_sz = size();
+    if (sz >= capacity() || sz < data_sz) return false;
+
+    uint8_t* t = static_cast<uint8_t*>(std::aligned_alloc(64, sz));
+    if (data_sz > 0) memcpy(t, data_start_, data_sz);
+    std::free(buf_start_);
+
+    buf_start_ = t;
+    buf_end_ = buf_start_ + sz;
+    data_start_ = buf_start_;
+    data_end_ = data_start_ + data_sz;
+    return true;
+  }
+
+  uint8_t* prepare_append(size_t msg_len) {
+    /* Makes room for msg_len more bytes and returns where they go, they are
+     * part of the data once commit_append is called */
     size_t avail_back = buf_end_ - data_end_;
     size_t avail_front = data_start_ - buf_start_;
     size_t total_req = msg_len + 4;
@@ -101,8 +121,14 @@ struct alignas(64) Buffer {
       }
     }
 
-    // now we have ensured there is room at the back and can add the msg
-    memcpy(data_end_, msg, msg_len);
-    data_end_ += msg_len;
+    return data_end_;
+  }
+
+  inline void commit_append(size_t msg_len) noexcept { data_end_ += msg_len; }
+
+  void append(const uint8_t* msg, uint32_t msg_len) {
+    assert(msg_len > 0);
+    memcpy(prepare_append(msg_len), msg, msg_len);
+    commit_append(msg_len);
   }
 };
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Chain of fixed-size segments for data too large to be handled well by a
+ * contiguous Buffer. Growing never moves bytes that were already written,
+ * segments come from a per-thread pool and are reference counted, so a range
+ * of the chain can be split off or shared with another chain (e.g. a stored
+ * value and the output of every client reading it) without copying. Only a
+ * segment that is not shared is ever written to */
+
+static constexpr size_t SEGMENT_SIZE = 64 * 1024;
+
+struct SegmentBlock {
+  std::atomic<uint32_t> refs{1};
+  alignas(64) uint8_t data[SEGMENT_SIZE];
+};
+
+class SegmentPool {
+  /* Free list of blocks, one pool per thread so allocation never locks. A
+   * block may be released on a different thread than it was allocated on */
+ private:
+  static constexpr size_t MAX_CACHED = 64;  // 4 MiB per thread
+
+  std::vector<SegmentBlock*> free_;
+
+ public:
+  ~SegmentPool() {
+    for (SegmentBlock* block : free_) delete block;
+  }
+
+  static SegmentPool& local() {
+    thread_local SegmentPool pool;
+    return pool;
+  }
+
+  inline size_t cached() const noexcept { return free_.size(); }
+
+  SegmentBlock* allocate() {
+    if (free_.empty()) return new SegmentBlock;
+    SegmentBlock* block = free_.back();
+    free_.pop_back();
+    block->refs.store(1, std::memory_order_relaxed);
+    return block;
+  }
+
+  void release(SegmentBlock* block) {
+    if (free_.size() < MAX_CACHED) {
+      free_.push_back(block);
+    } else {
+      delete block;
+    }
+  }
+};
+
+class SegmentRef {
+  /* Counted reference to bytes [begin, end) of a block */
+ private:
+  SegmentBlock* block_ = nullptr;
+  uint32_t begin_ = 0;
+  uint32_t end_ = 0;
+
+  void unref() noexcept {
+    if (block_ && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      SegmentPool::local().release(block_);
+    }
+    block_ = nullptr;
+  }
+
+ public:
+  SegmentRef() = default;
+
+  explicit SegmentRef(SegmentBlock* block) : block_(block) {}
+
+  SegmentRef(const SegmentRef& other)
+      : block_(other.block_), begin_(other.begin_), end_(other.end_) {
+    if (block_) block_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  SegmentRef(SegmentRef&& other) noexcept
+      : block_(other.block_), begin_(other.begin_), end_(other.end_) {
+    other.block_ = nullptr;
+  }
+
+  SegmentRef& operator=(SegmentRef other) noexcept {
+    std::swap(block_, other.block_);
+    std::swap(begin_, other.begin_);
+    std::swap(end_, other.end_);
+    return *this;
+  }
+
+  ~SegmentRef() { unref(); }
+
+  inline const uint8_t* data() const noexcept { return block_->data + begin_; }
+  inline size_t size() const noexcept { return end_ - begin_; }
+
+  inline bool unique() const noexcept {
+    return block_->refs.load(std::memory_order_acquire) == 1;
+  }
+
+  // room after end_, only writable when the block is not shared
+  inline uint8_t* tail() const noexcept { return block_->data + end_; }
+  inline size_t tail_room() const noexcept { return SEGMENT_SIZE - end_; }
+
+  inline void grow(size_t n) noexcept { end_ += static_cast<uint32_t>(n); }
+  inline void shrink_front(size_t n) noexcept {
+    begin_ += static_cast<uint32_t>(n);
+  }
+  inline void truncate(size_t n) noexcept {
+    end_ = begin_ + static_cast<uint32_t>(n);
+  }
+};
+
+class BufferChain {
+ private:
+  std::deque<SegmentRef> segs_;
+  std::vector<SegmentRef> reserved_;  // handed out by prepare_read
+  size_t size_ = 0;
+
+  inline bool tail_writable() const noexcept {
+    return !segs_.empty() && segs_.back().tail_room() > 0 &&
+           segs_.back().unique();
+  }
+
+ public:
+  BufferChain() = default;
+
+  // copies share the segments
+  BufferChain(const BufferChain& other) = default;
+  BufferChain& operator=(const BufferChain& other) = default;
+
+  BufferChain(BufferChain&& other) noexcept
+      : segs_(std::move(other.segs_)),
+        reserved_(std::move(other.reserved_)),
+        size_(std::exchange(other.size_, 0)) {}
+
+  BufferChain& operator=(BufferChain&& other) noexcept {
+    segs_ = std::move(other.segs_);
+    reserved_ = std::move(other.reserved_);
+    size_ = std::exchange(other.size_, 0);
+    return *this;
+  }
+
+  inline size_t size() const noexcept { return size_; }
+  inline bool empty() const noexcept { return size_ == 0; }
+  inline size_t n_segments() const noexcept { return segs_.size(); }
+
+  inline void clear() noexcept {
+    segs_.clear();
+    reserved_.clear();
+    size_ = 0;
+  }
+
+  void append(const uint8_t* data, size_t len) {
+    /* Copies len bytes to the end, filling the last segment first */
+    while (len > 0) {
+      if (!tail_writable()) {
+        segs_.emplace_back(SegmentPool::local().allocate());
+      }
+      SegmentRef& seg = segs_.back();
+      size_t n = std::min(len, seg.tail_room());
+      memcpy(seg.tail(), data, n);
+      seg.grow(n);
+      size_ += n;
+      data += n;
+      len -= n;
+    }
+  }
+
+  void append_shared(const BufferChain& other) {
+    /* Appends other's bytes without copying them, both chains then refer to
+     * the same segments */
+    for (const SegmentRef& seg : other.segs_) {
+      if (seg.size() > 0) segs_.push_back(seg);
+    }
+    size_ += other.size_;
+  }
+
+  void consume(size_t n) {
+    assert(n <= size_);
+    size_ -= n;
+    while (n > 0) {
+      SegmentRef& seg = segs_.front();
+      if (n < seg.size()) {
+        seg.shrink_front(n);
+        return;
+      }
+      n -= seg.size();
+      segs_.pop_front();
+    }
+    while (!segs_.empty() && segs_.front().size() == 0) segs_.pop_front();
+  }
+
+  void copy_out(size_t offset, void* dst, size_t n) const {
+    /* Copies n bytes starting at offset into dst */
+    assert(offset + n <= size_);
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    for (const SegmentRef& seg : segs_) {
+      if (n == 0) break;
+      if (offset >= seg.size()) {
+        offset -= seg.size();
+        continue;
+      }
+      size_t take = std::min(n, seg.size() - offset);
+      memcpy(out, seg.data() + offset, take);
+      out += take;
+      n -= take;
+      offset = 0;
+    }
+  }
+
+  BufferChain split_front(size_t n) {
+    /* Moves the first n bytes into a new chain. Whole segments are moved, a
+     * segment cut in two is shared by both chains */
+    assert(n <= size_);
+    BufferChain front;
+    front.size_ = n;
+    size_ -= n;
+    while (n > 0) {
+      SegmentRef& seg = segs_.front();
+      if (n < seg.size()) {
+        front.segs_.push_back(seg);
+        front.segs_.back().truncate(n);
+        seg.shrink_front(n);
+        break;
+      }
+      n -= seg.size();
+      front.segs_.push_back(std::move(seg));
+      segs_.pop_front();
+    }
+    return front;
+  }
+
+  size_t prepare_read(struct iovec* iov, size_t max_iov, size_t want) {
+    /* Fills iov with room for exactly min(want, room in max_iov segments)
+     * bytes for readv, call commit_read with the number of bytes read */
+    reserved_.clear();
+    size_t n_iov = 0;
+    if (tail_writable() && want > 0 && max_iov > 0) {
+      size_t n = std::min(want, segs_.back().tail_room());
+      iov[n_iov++] = {segs_.back().tail(), n};
+      want -= n;
+    }
+    while (want > 0 && n_iov < max_iov) {
+      reserved_.emplace_back(SegmentPool::local().allocate());
+      size_t n = std::min(want, SEGMENT_SIZE);
+      iov[n_iov++] = {reserved_.back().tail(), n};
+      want -= n;
+    }
+    return n_iov;
+  }
+
+  void commit_read(size_t n) {
+    /* Makes the first n bytes of the last prepare_read part of the chain */
+    size_ += n;
+    if (tail_writable()) {
+      size_t take = std::min(n, segs_.back().tail_room());
+      segs_.back().grow(take);
+      n -= take;
+    }
+    for (SegmentRef& seg : reserved_) {
+      if (n == 0) break;
+      size_t take = std::min(n, SEGMENT_SIZE);
+      seg.grow(take);
+      segs_.push_back(std::move(seg));
+      n -= take;
+    }
+    reserved_.clear();
+  }
+
+  size_t fill_iov(struct iovec* iov, size_t max_iov) const {
+    /* Points iov at the first max_iov segments for writev */
+    size_t n_iov = 0;
+    for (const SegmentRef& seg : segs_) {
+      if (n_iov == max_iov) break;
+      iov[n_iov++] = {const_cast<uint8_t*>(seg.data()), seg.size()};
+    }
+    return n_iov;
+  }
+
+  template <typename Fn>
+  void for_each_segment(Fn&& fn) const {
+    for (const SegmentRef& seg : segs_) fn(seg.data(), seg.size());
+  }
+
+  std::string to_string() const {
+    std::string out(size_, '\0');
+    copy_out(0, out.data(), size_);
+    return out;
+  }
+};
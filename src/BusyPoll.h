@@ -0,0 +1,74 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+/* Low-latency mode of the event loop. Before blocking in poll the loop spins
+ * on non-blocking poll calls for up to window_ns(), a request arriving in that
+ * window is served without the cost of a wakeup. The window adapts to the
+ * arrival rate: it doubles while events keep arriving shortly after the loop
+ * gave up spinning, and halves when the loop blocked for longer than the
+ * largest window, so an idle server stops burning its core */
+
+class BusyPollWindow {
+ public:
+  static constexpr uint64_t MIN_WINDOW_NS = 5000;  // first window after idle
+
+ private:
+  uint64_t max_ns_;  // 0 disables spinning
+  uint64_t window_ns_ = 0;
+  uint64_t hits_ = 0;    // events found while spinning
+  uint64_t misses_ = 0;  // spins that ended in a blocking poll
+  uint64_t spin_ns_ = 0;
+
+ public:
+  explicit BusyPollWindow(uint64_t max_us) : max_ns_(max_us * 1000) {}
+
+  inline bool enabled() const noexcept { return max_ns_ > 0; }
+
+  inline uint64_t window_ns() const noexcept { return window_ns_; }
+
+  void record(uint64_t spun_ns, uint64_t waited_ns, bool hit) {
+    /* spun_ns of waited_ns in total were spent spinning, hit is true when
+     * the spin found the event */
+    spin_ns_ += spun_ns;
+    if (hit) {
+      ++hits_;
+      return;
+    }
+    if (spun_ns > 0) ++misses_;
+
+    // the event came waited_ns - spun_ns after the loop stopped spinning
+    if (waited_ns - spun_ns <= max_ns_) {
+      window_ns_ = std::clamp(window_ns_ * 2, MIN_WINDOW_NS, max_ns_);
+    } else {
+      window_ns_ /= 2;
+      if (window_ns_ < MIN_WINDOW_NS) window_ns_ = 0;
+    }
+  }
+
+  void reset() { hits_ = misses_ = spin_ns_ = 0; }
+
+  std::string report() const {
+    /* "field:value" lines in the format of LoopMonitor::report */
+    std::string out;
+    out += "busy_poll_max_usec:" + std::to_string(max_ns_ / 1000) + "\n";
+    out += "busy_poll_window_usec:" + std::to_string(window_ns_ / 1000) + "\n";
+    out += "busy_poll_hits:" + std::to_string(hits_) + "\n";
+    out += "busy_poll_misses:" + std::to_string(misses_) + "\n";
+    out += "busy_poll_spin_usec:" + std::to_string(spin_ns_ / 1000) + "\n";
+    return out;
+  }
+};
+
+inline bool pin_current_thread(int cpu) {
+  /* Restricts the calling thread to cpu, returns false if that failed */
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Buffer.h"
+#include "Compression.h"
+#include "Protocol.h"
+
+/* AsyncClient pipelines any number of requests over one connection. Requests
+ * are encoded into a shared queue by the calling threads and a dedicated I/O
+ * thread writes out everything queued since its last write with a single
+ * send, so requests issued close together are batched automatically.
+ * Replies arrive in request order and complete the matching future or
+ * callback on the I/O thread. Pub/sub messages arrive in between and go to
+ * the handler set with on_message */
+
+// reply used to complete requests whose connection went away
+inline const std::string CONNECTION_LOST = "ERR connection lost";
+
+class AsyncClient {
+ public:
+  using Callback = std::function<void(Reply&&)>;
+  // "message <channel> <payload>" or "pmessage <pattern> <channel> <payload>"
+  using MessageHandler = std::function<void(std::vector<std::string>&&)>;
+
+ private:
+  int fd_ = -1;
+  int wake_fd_ = -1;  // eventfd used to wake the I/O thread
+  std::thread io_thread_;
+  std::atomic<bool> stop_{false};
+
+  std::mutex mtx_;  // protects everything below
+  std::vector<uint8_t> queued_;   // encoded requests not yet sent
+  std::deque<Callback> pending_;  // one per request sent or queued, in order
+  bool closed_ = false;
+  MessageHandler on_message_;  // messages are dropped while unset
+
+  void wake() {
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t rv = write(wake_fd_, &one, sizeof(one));
+  }
+
+  void fail_all() {
+    /* Completes every outstanding request with an error once the connection
+     * is gone */
+    std::deque<Callback> failed;
+    {
+      std::scoped_lock lock(mtx_);
+      closed_ = true;
+      failed.swap(pending_);
+      queued_.clear();
+    }
+    for (auto& cb : failed) cb({Status::Error, CONNECTION_LOST});
+  }
+
+  bool complete_replies(Buffer& read_buf) {
+    /* Parses every complete reply in read_buf, returns false on a malformed
+     * reply */
+    while (read_buf.size() >= 8) {
+      uint32_t resp_len = 0;
+      memcpy(&resp_len, read_buf.data(), 4U);
+      if (resp_len < 4) return false;
+      if (4 + static_cast<size_t>(resp_len) > read_buf.size()) break;
+
+      Reply reply;
+      memcpy(&reply.status, read_buf.data() + 4U, 4U);
+      reply.data.assign(reinterpret_cast<const char*>(read_buf.data() + 8U),
+                        resp_len - 4);
+      read_buf.consume(4 + resp_len);
+
+      if (reply.status == Status::Message) {
+        std::vector<std::string> msg;
+        if (!decode_strings(reply.data, msg)) return false;
+        MessageHandler handler;
+        {
+          std::scoped_lock lock(mtx_);
+          handler = on_message_;
+        }
+        if (handler) handler(std::move(msg));
+        continue;
+      }
+
+      if (reply.status == Status::Compressed) {
+        // asked for with "client compression on"
+        uint32_t raw_len = 0;
+        if (reply.data.size() < 4) return false;
+        memcpy(&raw_len, reply.data.data(), 4U);
+        std::string raw(raw_len, '\0');
+        if (!lz_decompress(
+                reinterpret_cast<const uint8_t*>(reply.data.data()) + 4,
+                reply.data.size() - 4, reinterpret_cast<uint8_t*>(raw.data()),
+                raw_len)) {
+          return false;
+        }
+        reply = {Status::Valid, std::move(raw)};
+      }
+
+      Callback cb;
+      {
+        std::scoped_lock lock(mtx_);
+        if (pending_.empty()) return false;  // reply nobody asked for
+        cb = std::move(pending_.front());
+        pending_.pop_front();
+      }
+      cb(std::move(reply));
+    }
+    return true;
+  }
+
+  void io_loop() {
+    std::vector<uint8_t> sending;
+    size_t sent = 0;
+    Buffer read_buf{64 * 1024};
+    uint8_t temp_buffer[64 * 1024];
+
+    while (!stop_.load(std::memory_order_relaxed)) {
+      // pick up everything queued since the last write as one batch
+      if (sent == sending.size()) {
+        sending.clear();
+        sent = 0;
+        std::scoped_lock lock(mtx_);
+        sending.swap(queued_);
+      }
+
+      while (sent < sending.size()) {
+        ssize_t rv = send(fd_, sending.data() + sent, sending.size() - sent,
+                          MSG_NOSIGNAL);
+        if (rv < 0 && errno == EAGAIN) break;
+        if (rv <= 0) return fail_all();
+        sent += rv;
+      }
+
+      struct pollfd pfds[2] = {{fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+      if (sent < sending.size()) pfds[0].events |= POLLOUT;
+      if (poll(pfds, 2, -1) < 0 && errno != EINTR) return fail_all();
+
+      if (pfds[1].revents & POLLIN) {
+        uint64_t val;
+        [[maybe_unused]] ssize_t rv = read(wake_fd_, &val, sizeof(val));
+      }
+
+      if (pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+        ssize_t rv;
+        while ((rv = recv(fd_, temp_buffer, sizeof(temp_buffer), 0)) > 0) {
+          read_buf.append(temp_buffer, static_cast<uint32_t>(rv));
+        }
+        // replies that arrived before the connection closed still complete
+        bool closed = rv == 0 || errno != EAGAIN;
+        if (!complete_replies(read_buf) || closed) return fail_all();
+      }
+    }
+
+    fail_all();
+  }
+
+  void start() {
+    /* Runs the I/O thread on the connected fd_ */
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL, 0) | O_NONBLOCK);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK);
+    io_thread_ = std::thread(&AsyncClient::io_loop, this);
+  }
+
+ public:
+  AsyncClient(const std::string& host, uint16_t port) {
+    fd_ = connect_tcp(host, port);
+    if (fd_ < 0) {
+      throw std::runtime_error("Failed to connect to " + host + ":" +
+                               std::to_string(port));
+    }
+
+    int flag = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    start();
+  }
+
+  // connects to a Unix domain socket, "@name" is in the abstract namespace
+  explicit AsyncClient(const std::string& unix_path) {
+    fd_ = connect_unix(unix_path);
+    if (fd_ < 0) {
+      throw std::runtime_error("Failed to connect to " + unix_path);
+    }
+    start();
+  }
+
+  ~AsyncClient() {
+    stop_ = true;
+    wake();
+    io_thread_.join();
+    close(wake_fd_);
+    close(fd_);
+  }
+
+  AsyncClient(const AsyncClient&) = delete;
+  AsyncClient& operator=(const AsyncClient&) = delete;
+
+  bool connected() {
+    std::scoped_lock lock(mtx_);
+    return !closed_;
+  }
+
+  void on_message(MessageHandler handler) {
+    /* handler runs on the I/O thread for every pub/sub message, set it
+     * before subscribing */
+    std::scoped_lock lock(mtx_);
+    on_message_ = std::move(handler);
+  }
+
+  void call(const std::vector<std::string>& cmd, Callback cb) {
+    /* Queues cmd, cb runs on the I/O thread once its reply arrives */
+    bool queued = false;
+    bool was_idle = false;
+    {
+      std::scoped_lock lock(mtx_);
+      if (!closed_) {
+        was_idle = queued_.empty();
+        encode_request(cmd, queued_);
+        pending_.push_back(std::move(cb));
+        queued = true;
+      }
+    }
+
+    if (!queued) {
+      cb({Status::Error, CONNECTION_LOST});
+    } else if (was_idle) {
+      wake();  // otherwise a wakeup is already on its way
+    }
+  }
+
+  std::future<Reply> call(const std::vector<std::string>& cmd) {
+    auto promise = std::make_shared<std::promise<Reply>>();
+    std::future<Reply> fut = promise->get_future();
+    call(cmd,
+         [promise](Reply&& reply) { promise->set_value(std::move(reply)); });
+    return fut;
+  }
+};
+
+class ClientPool {
+  /* Fixed number of AsyncClients to one server, handed out round robin.
+   * Connections that broke are replaced the next time they come up */
+ private:
+  std::string host_;
+  uint16_t port_;
+  std::mutex mtx_;
+  std::vector<std::shared_ptr<AsyncClient>> clients_;
+  size_t next_ = 0;
+
+ public:
+  ClientPool(const std::string& host, uint16_t port, size_t size)
+      : host_(host), port_(port) {
+    for (size_t i = 0; i < size; ++i) {
+      clients_.push_back(std::make_shared<AsyncClient>(host_, port_));
+    }
+  }
+
+  std::shared_ptr<AsyncClient> get() {
+    std::scoped_lock lock(mtx_);
+    std::shared_ptr<AsyncClient>& client = clients_[next_];
+    next_ = (next_ + 1) % clients_.size();
+    if (!client->connected()) {
+      client = std::make_shared<AsyncClient>(host_, port_);
+    }
+    return client;
+  }
+
+  std::future<Reply> call(const std::vector<std::string>& cmd) {
+    return get()->call(cmd);
+  }
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/* Hash-slot cluster bookkeeping. The keyspace is split into CLUSTER_SLOTS
+ * slots and every slot is owned by exactly one node. A slot can additionally
+ * be migrating (on its current owner) or importing (on the node it is moving
+ * to) while its keys are moved over in batches */
+
+static constexpr uint16_t CLUSTER_SLOTS = 16384;
+
+namespace detail {
+constexpr std::array<uint16_t, 256> make_crc16_table() {
+  // CRC16-CCITT (XMODEM), polynomial 0x1021
+  std::array<uint16_t, 256> table{};
+  for (uint16_t i = 0; i < 256; ++i) {
+    uint16_t crc = static_cast<uint16_t>(i << 8);
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021)
+                           : static_cast<uint16_t>(crc << 1);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+inline constexpr auto CRC16_TABLE = make_crc16_table();
+}  // namespace detail
+
+inline uint16_t crc16(std::string_view data) {
+  uint16_t crc = 0;
+  for (unsigned char c : data) {
+    crc = static_cast<uint16_t>((crc << 8) ^
+                                detail::CRC16_TABLE[((crc >> 8) ^ c) & 0xFF]);
+  }
+  return crc;
+}
+
+inline uint16_t key_hash_slot(std::string_view key) {
+  /* If key contains a non-empty {tag} only the tag is hashed, this lets
+   * related keys be forced into the same slot */
+  size_t open = key.find('{');
+  if (open != std::string_view::npos) {
+    size_t close = key.find('}', open + 1);
+    if (close != std::string_view::npos && close != open + 1) {
+      key = key.substr(open + 1, close - open - 1);
+    }
+  }
+  return crc16(key) & (CLUSTER_SLOTS - 1);
+}
+
+struct ClusterNode {
+  std::string host;
+  uint16_t port = 0;
+
+  std::string addr() const { return host + ":" + std::to_string(port); }
+
+  static ClusterNode parse(const std::string& addr) {
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+      throw std::invalid_argument("Invalid node address " + addr);
+    }
+    return {addr.substr(0, colon),
+            static_cast<uint16_t>(std::stoi(addr.substr(colon + 1)))};
+  }
+};
+
+class ClusterState {
+ private:
+  std::vector<ClusterNode> nodes_;
+  int self_ = -1;  // index into nodes_, -1 when cluster mode is off
+  std::array<int16_t, CLUSTER_SLOTS> slot_owner_{};
+  std::unordered_map<uint16_t, int> migrating_;  // slot -> target node
+  std::unordered_map<uint16_t, int> importing_;  // slot -> source node
+
+ public:
+  ClusterState() = default;
+
+  ClusterState(const std::vector<std::string>& node_addrs, uint16_t self_port) {
+    /* Every node is started with the same node list, slots are initially
+     * split into equal contiguous ranges in list order. A node finds itself
+     * in the list by its listening port */
+    for (const auto& addr : node_addrs) {
+      nodes_.push_back(ClusterNode::parse(addr));
+      if (nodes_.back().port == self_port) {
+        self_ = static_cast<int>(nodes_.size()) - 1;
+      }
+    }
+    if (self_ < 0) {
+      throw std::invalid_argument("Own port missing from cluster node list");
+    }
+
+    size_t n = nodes_.size();
+    for (size_t slot = 0; slot < CLUSTER_SLOTS; ++slot) {
+      slot_owner_[slot] = static_cast<int16_t>(slot * n / CLUSTER_SLOTS);
+    }
+  }
+
+  inline bool enabled() const noexcept { return self_ >= 0; }
+  inline int self() const noexcept { return self_; }
+  inline int owner(uint16_t slot) const noexcept { return slot_owner_[slot]; }
+  inline const ClusterNode& node(int idx) const { return nodes_[idx]; }
+
+  int migrating_to(uint16_t slot) const {
+    auto it = migrating_.find(slot);
+    return it == migrating_.end() ? -1 : it->second;
+  }
+
+  int importing_from(uint16_t slot) const {
+    auto it = importing_.find(slot);
+    return it == importing_.end() ? -1 : it->second;
+  }
+
+  int find_or_add_node(const std::string& addr) {
+    ClusterNode node = ClusterNode::parse(addr);
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      if (nodes_[i].host == node.host && nodes_[i].port == node.port) {
+        return static_cast<int>(i);
+      }
+    }
+    nodes_.push_back(std::move(node));
+    return static_cast<int>(nodes_.size()) - 1;
+  }
+
+  void set_migrating(uint16_t slot, int node) { migrating_[slot] = node; }
+  void set_importing(uint16_t slot, int node) { importing_[slot] = node; }
+
+  void set_owner(uint16_t slot, int node) {
+    /* Final step of a migration, also clears any migration state */
+    slot_owner_[slot] = static_cast<int16_t>(node);
+    migrating_.erase(slot);
+    importing_.erase(slot);
+  }
+
+  void set_stable(uint16_t slot) {
+    migrating_.erase(slot);
+    importing_.erase(slot);
+  }
+
+  std::string slots_info() const {
+    /* One "<first> <last> <host> <port>" line per contiguous slot range */
+    std::string info;
+    uint16_t start = 0;
+    for (uint32_t slot = 1; slot <= CLUSTER_SLOTS; ++slot) {
+      if (slot < CLUSTER_SLOTS && slot_owner_[slot] == slot_owner_[start]) {
+        continue;
+      }
+      const ClusterNode& n = nodes_[slot_owner_[start]];
+      info += std::to_string(start) + " " + std::to_string(slot - 1) + " " +
+              n.host + " " + std::to_string(n.port) + "\n";
+      start = static_cast<uint16_t>(slot);
+    }
+    return info;
+  }
+};
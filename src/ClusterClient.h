@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Client.h"
+#include "Cluster.h"
+#include "Protocol.h"
+
+class ClusterClient {
+  /* Cluster-aware client. Keeps a copy of the slot map so that requests go
+   * straight to the node owning their key, MOVED replies update the map and
+   * ASK replies are followed once without updating it */
+ private:
+  static constexpr int MAX_REDIRECTS = 5;
+
+  std::vector<ClusterNode> nodes_;
+  std::vector<std::unique_ptr<AsyncClient>> conns_;  // lazily opened
+  std::array<int16_t, CLUSTER_SLOTS> slot_node_{};
+
+  int node_index(const std::string& addr) {
+    ClusterNode node = ClusterNode::parse(addr);
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      if (nodes_[i].host == node.host && nodes_[i].port == node.port) {
+        return static_cast<int>(i);
+      }
+    }
+    nodes_.push_back(std::move(node));
+    conns_.emplace_back();
+    return static_cast<int>(nodes_.size()) - 1;
+  }
+
+  bool call_node(int idx, const std::vector<std::string>& cmd, Reply& reply) {
+    /* Sends cmd to one node and waits for the reply, returns false if the
+     * node could not be reached */
+    try {
+      if (!conns_[idx] || !conns_[idx]->connected()) {
+        conns_[idx] = std::make_unique<AsyncClient>(nodes_[idx].host,
+                                                    nodes_[idx].port);
+      }
+    } catch (const std::runtime_error&) {
+      return false;
+    }
+
+    reply = conns_[idx]->call(cmd).get();
+    return conns_[idx]->connected();
+  }
+
+ public:
+  ClusterClient(const std::string& host, uint16_t port) {
+    node_index(host + ":" + std::to_string(port));
+    refresh_slots();
+  }
+
+  void refresh_slots() {
+    /* Loads the slot map from the first reachable node */
+    Reply reply;
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      if (!call_node(static_cast<int>(i), {"cluster", "slots"}, reply) ||
+          reply.status != Status::Valid) {
+        continue;
+      }
+
+      std::istringstream lines(reply.data);
+      uint32_t first = 0, last = 0;
+      std::string host, port;
+      while (lines >> first >> last >> host >> port) {
+        int idx = node_index(host + ":" + port);
+        for (uint32_t slot = first; slot <= last && slot < CLUSTER_SLOTS;
+             ++slot) {
+          slot_node_[slot] = static_cast<int16_t>(idx);
+        }
+      }
+      return;
+    }
+    throw std::runtime_error("No cluster node reachable");
+  }
+
+  inline const ClusterNode& slot_owner(uint16_t slot) const {
+    return nodes_[slot_node_[slot]];
+  }
+
+  Reply call(const std::vector<std::string>& cmd) {
+    /* Sends a command to the node serving its key (cmd[1]), following up to
+     * MAX_REDIRECTS redirects */
+    int idx = cmd.size() > 1 ? slot_node_[key_hash_slot(cmd[1])] : 0;
+    bool asking = false;
+    Reply reply;
+
+    for (int i = 0; i <= MAX_REDIRECTS; ++i) {
+      if (asking && !call_node(idx, {"asking"}, reply)) break;
+      if (!call_node(idx, cmd, reply)) break;
+      if (reply.status != Status::Moved && reply.status != Status::Ask) {
+        return reply;
+      }
+
+      // redirect data is "<slot> <host>:<port>"
+      std::istringstream iss(reply.data);
+      uint32_t slot = 0;
+      std::string addr;
+      iss >> slot >> addr;
+      idx = node_index(addr);
+      asking = reply.status == Status::Ask;
+      if (!asking && slot < CLUSTER_SLOTS) {
+        slot_node_[slot] = static_cast<int16_t>(idx);
+      }
+    }
+
+    return {Status::Error, "ERR cluster request failed"};
+  }
+
+  void migrate_slot(uint16_t slot, const std::string& target_addr,
+                    size_t batch_size = 100) {
+    /* Moves slot to target_addr while it keeps serving requests: the slot is
+     * marked importing on the target and migrating on the source, its keys are
+     * moved in batches and finally every known node is told the new owner */
+    int source = slot_node_[slot];
+    int target = node_index(target_addr);
+    std::string slot_str = std::to_string(slot);
+    std::string batch_str = std::to_string(batch_size);
+    Reply reply;
+
+    auto check = [&](int idx, const std::vector<std::string>& cmd) {
+      if (!call_node(idx, cmd, reply) || reply.status != Status::Valid) {
+        throw std::runtime_error("Slot migration failed: " + reply.data);
+      }
+    };
+
+    check(target, {"cluster", "setslot", slot_str, "importing",
+                   nodes_[source].addr()});
+    check(source,
+          {"cluster", "setslot", slot_str, "migrating", target_addr});
+    do {
+      check(source, {"cluster", "migrate", target_addr, slot_str, batch_str});
+    } while (reply.data != "0");
+
+    check(target, {"cluster", "setslot", slot_str, "node", target_addr});
+    check(source, {"cluster", "setslot", slot_str, "node", target_addr});
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      int idx = static_cast<int>(i);
+      if (idx == source || idx == target) continue;
+      call_node(idx, {"cluster", "setslot", slot_str, "node", target_addr},
+                reply);
+    }
+    slot_node_[slot] = static_cast<int16_t>(target);
+  }
+};
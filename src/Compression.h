@@ -0,0 +1,191 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/* Byte-oriented LZ77 codec in the LZ4 block format. A block is a run of
+ * sequences, each a token byte with 4 bits of literal length and 4 bits of
+ * match length, the literals, and a 2 byte little endian offset back into
+ * the output followed by the match. Lengths of 15 continue in extra bytes
+ * that are added up until one is below 255. The last sequence has literals
+ * only, and the last 5 bytes of the input are always literals.
+ *
+ * The compressor is greedy with a single 4096 entry hash table of 4 byte
+ * sequences and skips ahead faster the longer it finds no match, so
+ * incompressible data costs little. Decompression checks every length
+ * against both buffers and never writes past out_size */
+
+static constexpr size_t LZ_MIN_MATCH = 4;
+static constexpr size_t LZ_LAST_LITERALS = 5;
+static constexpr size_t LZ_MATCH_LIMIT = 12;  // no match starts this late
+static constexpr size_t LZ_MAX_OFFSET = 65535;
+static constexpr uint32_t LZ_HASH_BITS = 12;
+
+inline size_t lz_compress_bound(size_t n) { return n + n / 255 + 16; }
+
+namespace lz_detail {
+
+inline uint32_t load32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint64_t load64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint32_t hash(uint32_t seq) {
+  return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+inline uint8_t* put_length(uint8_t* op, size_t len) {
+  /* Extra bytes of a length that did not fit its 4 bits */
+  for (; len >= 255; len -= 255) *op++ = 255;
+  *op++ = static_cast<uint8_t>(len);
+  return op;
+}
+
+inline bool get_length(const uint8_t*& ip, const uint8_t* end, size_t& len) {
+  uint8_t b;
+  do {
+    if (ip == end) return false;
+    b = *ip++;
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+}  // namespace lz_detail
+
+inline size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst,
+                          size_t cap) {
+  /* Compresses n bytes into dst, returns the compressed size or 0 if it
+   * would not fit in cap bytes */
+  using namespace lz_detail;
+  uint32_t table[1U << LZ_HASH_BITS] = {};
+  const uint8_t* dst_end = dst + cap;
+  uint8_t* op = dst;
+  size_t anchor = 0;
+
+  auto emit = [&](size_t lit_len, size_t offset, size_t match_len) {
+    /* Literals src[anchor, anchor + lit_len), then a match unless
+     * match_len is 0 */
+    size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if (static_cast<size_t>(dst_end - op) < worst) return false;
+    uint8_t* token = op++;
+    *token = static_cast<uint8_t>((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, src + anchor, lit_len);
+    op += lit_len;
+    if (match_len == 0) return true;
+
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    size_t ml = match_len - LZ_MIN_MATCH;
+    *token |= static_cast<uint8_t>(ml < 15 ? ml : 15);
+    if (ml >= 15) op = put_length(op, ml - 15);
+    return true;
+  };
+
+  if (n > LZ_MATCH_LIMIT) {
+    const size_t match_end = n - LZ_LAST_LITERALS;
+    size_t ip = 0;
+    while (ip < n - LZ_MATCH_LIMIT) {
+      uint32_t seq = load32(src + ip);
+      uint32_t& slot = table[hash(seq)];
+      size_t ref = slot;
+      slot = static_cast<uint32_t>(ip);
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || load32(src + ref) != seq) {
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      size_t len = LZ_MIN_MATCH;
+      while (ip + len + 8 <= match_end) {
+        uint64_t diff = load64(src + ip + len) ^ load64(src + ref + len);
+        if (diff) {
+          len += static_cast<size_t>(std::countr_zero(diff)) >> 3;
+          goto matched;
+        }
+        len += 8;
+      }
+      while (ip + len < match_end && src[ip + len] == src[ref + len]) ++len;
+    matched:
+      if (!emit(ip - anchor, ip - ref, len)) return 0;
+      ip += len;
+      anchor = ip;
+      if (ip < n - LZ_MATCH_LIMIT) {
+        // the position right before the next search, cheap extra matches
+        table[hash(load32(src + ip - 2))] = static_cast<uint32_t>(ip - 2);
+      }
+    }
+  }
+
+  if (!emit(n - anchor, 0, 0)) return 0;
+  return static_cast<size_t>(op - dst);
+}
+
+inline bool lz_decompress(const uint8_t* src, size_t n, uint8_t* dst,
+                          size_t out_size) {
+  /* Decompresses a block into exactly out_size bytes, returns false if the
+   * block is malformed or does not decompress to out_size */
+  using namespace lz_detail;
+  const uint8_t* ip = src;
+  const uint8_t* end = src + n;
+  size_t op = 0;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && !get_length(ip, end, lit_len)) return false;
+    if (lit_len > static_cast<size_t>(end - ip) || lit_len > out_size - op) {
+      return false;
+    }
+    if (lit_len <= 16 && end - ip >= 16 && out_size - op >= 16) {
+      memcpy(dst + op, ip, 16);  // the bytes past lit_len are overwritten
+    } else {
+      memcpy(dst + op, ip, lit_len);
+    }
+    ip += lit_len;
+    op += lit_len;
+    if (ip == end) break;  // the last sequence has no match
+
+    if (end - ip < 2) return false;
+    size_t offset = ip[0] | static_cast<size_t>(ip[1]) << 8;
+    ip += 2;
+    size_t match_len = (token & 15U) + LZ_MIN_MATCH;
+    if ((token & 15U) == 15 && !get_length(ip, end, match_len)) return false;
+    if (offset == 0 || offset > op || match_len > out_size - op) return false;
+
+    uint8_t* out = dst + op;
+    const uint8_t* ref = out - offset;
+    op += match_len;
+    if (offset >= 8 && out_size - op >= 8) {
+      // 8 byte steps never read bytes the same step writes, the last one
+      // may write up to 7 bytes past the match that later ones overwrite
+      for (uint8_t* stop = out + match_len; out < stop; out += 8, ref += 8) {
+        memcpy(out, ref, 8);
+      }
+    } else {
+      while (match_len-- > 0) *out++ = *ref++;
+    }
+  }
+  return op == out_size;
+}
+
+inline std::string lz_compress(const std::string& str) {
+  /* Compressed copy of str, empty if it does not compress */
+  std::string out(str.size(), '\0');
+  size_t n = lz_compress(reinterpret_cast<const uint8_t*>(str.data()),
+                         str.size(), reinterpret_cast<uint8_t*>(out.data()),
+                         str.size() > 0 ? str.size() - 1 : 0);
+  out.resize(n);
+  out.shrink_to_fit();
+  return out;
+}
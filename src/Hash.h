@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "Varint.h"
+
+/* Fields of a hash value. A small hash is a single packed string of
+ * varint field length | field | varint value length | value entries that
+ * is scanned linearly, a few cache lines instead of a node and two strings
+ * per field. It converts to an unordered_map once it would hold more than
+ * PACKED_MAX_FIELDS fields or a field or value longer than PACKED_MAX_LEN
+ * bytes, and never converts back */
+
+class Hash {
+ public:
+  static constexpr size_t PACKED_MAX_FIELDS = 32;
+  static constexpr size_t PACKED_MAX_LEN = 64;
+
+ private:
+  using Table = std::unordered_map<std::string, std::string>;
+
+  std::string packed_;
+  std::unique_ptr<Table> table_;  // set once converted
+  size_t size_ = 0;
+  size_t bytes_ = 0;  // of all fields and values
+
+  struct Entry {
+    size_t start;  // of the entry in packed_
+    size_t value_start;  // of the value's length
+    size_t end;
+    std::string_view field;
+    std::string_view value;
+  };
+
+  bool next(size_t pos, Entry& e) const {
+    /* Decodes the packed entry at pos, false at the end */
+    if (pos >= packed_.size()) return false;
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(packed_.data());
+    const uint8_t* p = base + pos;
+    e.start = pos;
+    size_t field_len = get_varint(p);
+    e.field = {reinterpret_cast<const char*>(p), field_len};
+    p += field_len;
+    e.value_start = static_cast<size_t>(p - base);
+    size_t value_len = get_varint(p);
+    e.value = {reinterpret_cast<const char*>(p), value_len};
+    e.end = static_cast<size_t>(p - base) + value_len;
+    return true;
+  }
+
+  bool find_packed(std::string_view field, Entry& e) const {
+    for (size_t pos = 0; next(pos, e); pos = e.end) {
+      if (e.field == field) return true;
+    }
+    return false;
+  }
+
+  static void append_str(std::string& out, std::string_view s) {
+    uint8_t len[10];
+    out.append(reinterpret_cast<const char*>(len), put_varint(len, s.size()));
+    out.append(s);
+  }
+
+  void convert() {
+    /* Moves the packed entries into a table */
+    table_ = std::make_unique<Table>();
+    table_->reserve(size_ + 1);
+    Entry e;
+    for (size_t pos = 0; next(pos, e); pos = e.end) {
+      table_->emplace(e.field, e.value);
+    }
+    std::string().swap(packed_);
+  }
+
+ public:
+  inline size_t size() const noexcept { return size_; }
+  inline size_t bytes() const noexcept { return bytes_; }
+  inline bool packed() const noexcept { return table_ == nullptr; }
+
+  bool get(std::string_view field, std::string_view& value) const {
+    if (table_) {
+      auto it = table_->find(std::string(field));
+      if (it == table_->end()) return false;
+      value = it->second;
+      return true;
+    }
+    Entry e;
+    if (!find_packed(field, e)) return false;
+    value = e.value;
+    return true;
+  }
+
+  bool set(std::string_view field, std::string_view value) {
+    /* Sets field, returns true if it is new */
+    if (!table_ && (field.size() > PACKED_MAX_LEN ||
+                    value.size() > PACKED_MAX_LEN)) {
+      convert();
+    }
+
+    if (!table_) {
+      Entry e;
+      if (find_packed(field, e)) {
+        std::string encoded;
+        append_str(encoded, value);
+        packed_.replace(e.value_start, e.end - e.value_start, encoded);
+        bytes_ = bytes_ - e.value.size() + value.size();
+        return false;
+      }
+      if (size_ < PACKED_MAX_FIELDS) {
+        append_str(packed_, field);
+        append_str(packed_, value);
+        ++size_;
+        bytes_ += field.size() + value.size();
+        return true;
+      }
+      convert();
+    }
+
+    auto [it, added] = table_->try_emplace(std::string(field));
+    if (added) {
+      ++size_;
+      bytes_ += field.size();
+    } else {
+      bytes_ -= it->second.size();
+    }
+    it->second.assign(value);
+    bytes_ += value.size();
+    return added;
+  }
+
+  bool erase(std::string_view field) {
+    if (table_) {
+      auto it = table_->find(std::string(field));
+      if (it == table_->end()) return false;
+      bytes_ -= it->first.size() + it->second.size();
+      table_->erase(it);
+    } else {
+      Entry e;
+      if (!find_packed(field, e)) return false;
+      bytes_ -= e.field.size() + e.value.size();
+      packed_.erase(e.start, e.end - e.start);
+    }
+    --size_;
+    return true;
+  }
+
+  template <typename Fn>
+  void for_each(Fn&& fn) const {
+    /* fn(field, value) for every field, the hash must not change */
+    if (table_) {
+      for (const auto& [field, value] : *table_) fn(field, value);
+      return;
+    }
+    Entry e;
+    for (size_t pos = 0; next(pos, e); pos = e.end) fn(e.field, e.value);
+  }
+
+  std::string encode() const {
+    /* Every field in the packed format, whatever the encoding */
+    if (!table_) return packed_;
+    std::string out;
+    for_each([&](std::string_view field, std::string_view value) {
+      append_str(out, field);
+      append_str(out, value);
+    });
+    return out;
+  }
+
+  static bool decode(std::string_view data, Hash& out) {
+    /* Sets the fields of an encode() result in out, false if data is
+     * malformed */
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+    const uint8_t* end = p + data.size();
+    while (p < end) {
+      uint64_t field_len = 0;
+      if (!get_varint(p, end, field_len) ||
+          field_len > static_cast<size_t>(end - p)) {
+        return false;
+      }
+      std::string_view field(reinterpret_cast<const char*>(p), field_len);
+      p += field_len;
+      uint64_t value_len = 0;
+      if (!get_varint(p, end, value_len) ||
+          value_len > static_cast<size_t>(end - p)) {
+        return false;
+      }
+      out.set(field, {reinterpret_cast<const char*>(p), value_len});
+      p += value_len;
+    }
+    return true;
+  }
+};
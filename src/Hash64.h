@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+/* 64-bit hash of a byte string for the sketches of Bloom.h and
+ * HyperLogLog.h, whose encodings depend on it so it must not change
+ * between builds the way std::hash may. Each step is a folded 64x64->128
+ * multiply of 8 or 16 input bytes with the state, as in wyhash, and every
+ * output bit depends on every input bit */
+
+namespace hash64_detail {
+
+static constexpr uint64_t K0 = 0xa0761d6478bd642fULL;
+static constexpr uint64_t K1 = 0xe7037ed1a0b428dbULL;
+static constexpr uint64_t K2 = 0x8ebc6af09c88c6e3ULL;
+static constexpr uint64_t K3 = 0x589965cc75374cc3ULL;
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+inline uint64_t load64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+}  // namespace hash64_detail
+
+inline uint64_t hash64(std::string_view str, uint64_t seed = 0) {
+  using namespace hash64_detail;
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(str.data());
+  size_t n = str.size();
+  uint64_t h = seed ^ mix(n ^ K0, K1);
+  for (; n >= 16; n -= 16, p += 16) {
+    h = mix(load64(p) ^ K1, load64(p + 8) ^ h);
+  }
+  if (n >= 8) {
+    h = mix(load64(p) ^ K2, h ^ K0);
+    n -= 8;
+    p += 8;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, p, n);
+  h = mix(tail ^ K3, h ^ K1 ^ n);
+  return mix(h ^ K0, h ^ K2);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+/* Log-linear histogram in the style of HdrHistogram. Every power of two range
+ * is split into 2^(PRECISION_BITS - 1) equal sub-buckets, so any recorded
+ * value is reported with a relative error below 1 / 2^(PRECISION_BITS - 1)
+ * (0.8% for the default of 8 bits) while the whole range up to max_value only
+ * needs a few thousand counters. Recording is a couple of shifts and an
+ * increment */
+
+class LatencyHistogram {
+ private:
+  static constexpr uint32_t PRECISION_BITS = 8;
+  static constexpr uint64_t SUB_BUCKETS = 1ULL << PRECISION_BITS;
+  static constexpr uint64_t HALF_SUB_BUCKETS = SUB_BUCKETS >> 1;
+
+  std::vector<uint64_t> counts_;
+  uint64_t max_value_;
+  uint64_t total_count_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+  long double sum_ = 0;
+
+ public:
+  static constexpr size_t bucket_index(uint64_t value) noexcept {
+    if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+    uint32_t shift = std::bit_width(value) - PRECISION_BITS;
+    return static_cast<size_t>(shift * HALF_SUB_BUCKETS + (value >> shift));
+  }
+
+  static constexpr uint64_t bucket_value(size_t idx) noexcept {
+    /* Highest value that maps to bucket idx */
+    if (idx < SUB_BUCKETS) return idx;
+    uint64_t shift = idx / HALF_SUB_BUCKETS - 1;
+    uint64_t mantissa = idx - shift * HALF_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+  // default range covers one hour in nanoseconds
+  explicit LatencyHistogram(uint64_t max_value = 3600ULL * 1000000000ULL)
+      : counts_(bucket_index(max_value) + 1), max_value_(max_value) {}
+
+  inline uint64_t count() const noexcept { return total_count_; }
+  inline uint64_t min() const noexcept { return total_count_ ? min_ : 0; }
+  inline uint64_t max() const noexcept { return max_; }
+
+  inline double mean() const noexcept {
+    return total_count_ ? static_cast<double>(sum_ / total_count_) : 0.0;
+  }
+
+  inline void record(uint64_t value, uint64_t n = 1) noexcept {
+    value = std::min(value, max_value_);
+    counts_[bucket_index(value)] += n;
+    total_count_ += n;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    sum_ += static_cast<long double>(value) * n;
+  }
+
+  void merge(const LatencyHistogram& other) {
+    if (counts_.size() < other.counts_.size()) {
+      counts_.resize(other.counts_.size());
+      max_value_ = other.max_value_;
+    }
+    for (size_t i = 0; i < other.counts_.size(); ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    total_count_ += other.total_count_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    sum_ += other.sum_;
+  }
+
+  void reset() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    total_count_ = 0;
+    min_ = UINT64_MAX;
+    max_ = 0;
+    sum_ = 0;
+  }
+
+  uint64_t percentile(double pct) const {
+    /* Smallest recorded value such that pct percent of all values are at or
+     * below it, reported as the upper edge of its bucket */
+    if (total_count_ == 0) return 0;
+    double target = std::clamp(pct, 0.0, 100.0) / 100.0 * total_count_;
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(target + 0.5));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min(bucket_value(i), max_);
+    }
+    return max_;
+  }
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "SlowLog.h"
+
+/* Count-min sketch of key access frequencies. Every key maps to one counter
+ * per row, the smallest of them is an estimate that is never below the true
+ * count. Increments are conservative, only the counters at the minimum are
+ * raised, which keeps the overestimate from collisions small */
+
+class CountMinSketch {
+ private:
+  static constexpr uint32_t DEPTH = 4;
+
+  uint32_t mask_;  // width - 1, the width is a power of two
+  std::vector<uint32_t> counters_;
+
+  inline uint32_t* slot(uint32_t row, uint64_t h1, uint64_t h2) noexcept {
+    // the rows' hashes are derived from two, see Kirsch and Mitzenmacher
+    size_t col = static_cast<size_t>((h1 + row * h2) & mask_);
+    return &counters_[static_cast<size_t>(row) * (mask_ + 1) + col];
+  }
+
+ public:
+  explicit CountMinSketch(uint32_t width)
+      : mask_(std::bit_ceil(std::max(width, 2U)) - 1),
+        counters_(static_cast<size_t>(DEPTH) * (mask_ + 1)) {}
+
+  uint32_t add(std::string_view key) {
+    /* Counts one access to key, returns its new estimate */
+    uint64_t h1 = std::hash<std::string_view>{}(key);
+    uint64_t h2 = (h1 >> 32 | h1 << 32) * 0x9e3779b97f4a7c15ULL | 1;
+    uint32_t* slots[DEPTH];
+    uint32_t est = UINT32_MAX;
+    for (uint32_t row = 0; row < DEPTH; ++row) {
+      slots[row] = slot(row, h1, h2);
+      est = std::min(est, *slots[row]);
+    }
+    if (est == UINT32_MAX) return est;
+    for (uint32_t* s : slots) {
+      if (*s == est) *s = est + 1;
+    }
+    return est + 1;
+  }
+
+  void halve() {
+    for (uint32_t& c : counters_) c >>= 1;
+  }
+
+  void clear() { std::fill(counters_.begin(), counters_.end(), 0); }
+};
+
+/* Most accessed keys. One in sample_every keyed commands is counted in a
+ * CountMinSketch, and the keys with the highest estimates are kept in a
+ * small top-k list, so the cost of an unsampled command is a decrement.
+ * Counts are halved every DECAY_SAMPLES samples so the list follows the
+ * current traffic rather than all traffic since the start */
+
+class HotKeys {
+ public:
+  static constexpr uint32_t SKETCH_WIDTH = 4096;
+  static constexpr uint64_t DECAY_SAMPLES = 1 << 17;
+
+ private:
+  uint32_t sample_every_;  // 0 disables sampling
+  uint32_t countdown_;
+  size_t k_;
+  CountMinSketch sketch_{SKETCH_WIDTH};
+  std::vector<std::pair<std::string, uint32_t>> top_;  // unordered
+  uint64_t samples_ = 0;
+
+  void record(const std::string& key) {
+    uint32_t est = sketch_.add(key);
+    if (++samples_ % DECAY_SAMPLES == 0) {
+      sketch_.halve();
+      for (auto& entry : top_) entry.second >>= 1;
+    }
+
+    auto min = top_.end();
+    for (auto it = top_.begin(); it != top_.end(); ++it) {
+      if (it->first == key) {
+        it->second = est;
+        return;
+      }
+      if (min == top_.end() || it->second < min->second) min = it;
+    }
+    if (top_.size() < k_) {
+      top_.emplace_back(key, est);
+    } else if (min != top_.end() && est > min->second) {
+      *min = {key, est};
+    }
+  }
+
+ public:
+  HotKeys(uint32_t sample_every, size_t k)
+      : sample_every_(sample_every), countdown_(sample_every), k_(k) {}
+
+  inline bool enabled() const noexcept { return sample_every_ > 0 && k_ > 0; }
+
+  inline void maybe_record(const std::string& key) {
+    if (countdown_ == 0 || --countdown_ > 0) return;
+    countdown_ = sample_every_;
+    record(key);
+  }
+
+  inline uint64_t samples() const noexcept { return samples_; }
+
+  void reset() {
+    sketch_.clear();
+    top_.clear();
+    samples_ = 0;
+  }
+
+  std::string report(size_t count) const {
+    /* Hottest count keys, one per line as "<estimated accesses> <key>".
+     * Estimates are scaled by the sample rate */
+    auto sorted = top_;
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+      return a.second > b.second;
+    });
+    std::string out;
+    for (size_t i = 0; i < sorted.size() && i < count; ++i) {
+      out += std::to_string(uint64_t{sorted[i].second} * sample_every_) +
+             " " + SlowLog::truncate_arg(sorted[i].first) + "\n";
+    }
+    return out;
+  }
+};
+
+/* Largest values, maintained on every write instead of by scanning the
+ * keyspace. The writer passes the old and new size of the value, so a write
+ * that neither was nor becomes one of the k largest returns after a single
+ * comparison. A deleted or shrunk big key is not replaced by the next largest
+ * one until that is written again */
+
+class BigKeys {
+ private:
+  size_t k_;
+  std::vector<std::pair<std::string, size_t>> top_;  // unordered
+  size_t min_size_ = 0;  // smallest listed size once the list is full
+
+  auto find(const std::string& key) {
+    return std::find_if(top_.begin(), top_.end(),
+                        [&](const auto& entry) { return entry.first == key; });
+  }
+
+  void update_min() {
+    min_size_ = 0;
+    if (top_.size() < k_) return;
+    min_size_ = SIZE_MAX;
+    for (const auto& entry : top_) {
+      min_size_ = std::min(min_size_, entry.second);
+    }
+  }
+
+ public:
+  explicit BigKeys(size_t k) : k_(k) {}
+
+  inline size_t size() const noexcept { return top_.size(); }
+
+  void update(const std::string& key, size_t old_size, size_t new_size) {
+    /* key's value changed from old_size bytes to new_size, old_size is 0
+     * for a new key */
+    if (k_ == 0) return;
+    if (top_.size() == k_ && old_size < min_size_ && new_size <= min_size_) {
+      return;
+    }
+
+    auto it = find(key);
+    if (it != top_.end()) {
+      it->second = new_size;
+    } else if (top_.size() < k_) {
+      top_.emplace_back(key, new_size);
+    } else if (new_size > min_size_) {
+      auto min = std::min_element(
+          top_.begin(), top_.end(),
+          [](const auto& a, const auto& b) { return a.second < b.second; });
+      *min = {key, new_size};
+    }
+    update_min();
+  }
+
+  void remove(const std::string& key, size_t old_size) {
+    if (top_.size() == k_ && old_size < min_size_) return;
+    auto it = find(key);
+    if (it == top_.end()) return;
+    *it = std::move(top_.back());
+    top_.pop_back();
+    update_min();
+  }
+
+  void clear() {
+    top_.clear();
+    min_size_ = 0;
+  }
+
+  std::string report(size_t count) const {
+    /* Largest count values, one per line as "<bytes> <key>" */
+    auto sorted = top_;
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+      return a.second > b.second;
+    });
+    std::string out;
+    for (size_t i = 0; i < sorted.size() && i < count; ++i) {
+      out += std::to_string(sorted[i].second) + " " +
+             SlowLog::truncate_arg(sorted[i].first) + "\n";
+    }
+    return out;
+  }
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Hash64.h"
+
+/* HyperLogLog distinct count with 2^14 registers, about 0.81% standard
+ * error. An item's hash picks a register with its low 14 bits and the
+ * register keeps the most trailing zeros plus one seen in the other 50.
+ *
+ * A sketch starts sparse, a sorted vector of its non-zero registers as
+ * index << 6 | value, and turns dense once that would exceed SPARSE_MAX
+ * entries: 6 bits for each register packed into 12 KiB. The count uses
+ * Ertl's improved raw estimator, which needs no bias tables and holds from
+ * a handful of items to billions, and is cached until the next change */
+
+class HyperLogLog {
+ public:
+  static constexpr int P = 14;
+  static constexpr size_t M = size_t{1} << P;  // registers
+  static constexpr int Q = 64 - P;  // hash bits counted, values are 1..Q+1
+  static constexpr size_t DENSE_BYTES = M * 6 / 8;
+  static constexpr size_t SPARSE_MAX = 768;  // a quarter of the dense size
+
+ private:
+  std::vector<uint32_t> sparse_;
+  std::string dense_;  // DENSE_BYTES + 1 so reads may span 2 bytes
+  mutable int64_t cached_count_ = 0;  // -1 once stale
+
+  inline uint8_t get_dense(size_t i) const {
+    size_t bit = i * 6;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(dense_.data());
+    unsigned v = p[bit / 8] | static_cast<unsigned>(p[bit / 8 + 1]) << 8;
+    return static_cast<uint8_t>((v >> (bit % 8)) & 63U);
+  }
+
+  inline void set_dense(size_t i, uint8_t val) {
+    size_t bit = i * 6;
+    uint8_t* p = reinterpret_cast<uint8_t*>(dense_.data());
+    unsigned v = p[bit / 8] | static_cast<unsigned>(p[bit / 8 + 1]) << 8;
+    v = (v & ~(63U << (bit % 8))) | static_cast<unsigned>(val) << (bit % 8);
+    p[bit / 8] = static_cast<uint8_t>(v);
+    p[bit / 8 + 1] = static_cast<uint8_t>(v >> 8);
+  }
+
+  void to_dense() {
+    dense_.assign(DENSE_BYTES + 1, '\0');
+    for (uint32_t e : sparse_) set_dense(e >> 6, e & 63U);
+    std::vector<uint32_t>().swap(sparse_);
+  }
+
+  bool update(size_t i, uint8_t val) {
+    /* Raises register i to val, returns true if it changed */
+    if (!dense()) {
+      uint32_t entry = static_cast<uint32_t>(i << 6 | val);
+      auto it = std::lower_bound(sparse_.begin(), sparse_.end(),
+                                 static_cast<uint32_t>(i << 6));
+      if (it != sparse_.end() && (*it >> 6) == i) {
+        if ((*it & 63U) >= val) return false;
+        *it = entry;
+        return true;
+      }
+      if (sparse_.size() < SPARSE_MAX) {
+        sparse_.insert(it, entry);
+        return true;
+      }
+      to_dense();
+    }
+    if (get_dense(i) >= val) return false;
+    set_dense(i, val);
+    return true;
+  }
+
+  static double sigma(double x) {
+    if (x == 1) return INFINITY;
+    double y = 1, z = x, prev;
+    do {
+      x *= x;
+      prev = z;
+      z += x * y;
+      y += y;
+    } while (z != prev);
+    return z;
+  }
+
+  static double tau(double x) {
+    if (x == 0 || x == 1) return 0;
+    double y = 1, z = 1 - x, prev;
+    do {
+      x = std::sqrt(x);
+      prev = z;
+      y *= 0.5;
+      z -= (1 - x) * (1 - x) * y;
+    } while (z != prev);
+    return z / 3;
+  }
+
+ public:
+  inline bool dense() const noexcept { return !dense_.empty(); }
+
+  size_t bytes() const noexcept {
+    return dense() ? dense_.size() : sparse_.size() * sizeof(uint32_t);
+  }
+
+  bool add(std::string_view item) {
+    /* Returns true if a register changed, the count may have gone up */
+    uint64_t h = hash64(item);
+    size_t i = h & (M - 1);
+    uint64_t rest = (h >> P) | (uint64_t{1} << Q);  // at most Q zeros
+    uint8_t val = static_cast<uint8_t>(std::countr_zero(rest) + 1);
+    if (!update(i, val)) return false;
+    cached_count_ = -1;
+    return true;
+  }
+
+  bool merge(const HyperLogLog& other) {
+    /* Registers become the max of both, returns true if any changed */
+    bool changed = false;
+    if (!other.dense()) {
+      for (uint32_t e : other.sparse_) changed |= update(e >> 6, e & 63U);
+    } else {
+      if (!dense()) to_dense();
+      for (size_t i = 0; i < M; ++i) {
+        uint8_t val = other.get_dense(i);
+        if (val > get_dense(i)) {
+          set_dense(i, val);
+          changed = true;
+        }
+      }
+    }
+    if (changed) cached_count_ = -1;
+    return changed;
+  }
+
+  uint64_t count() const {
+    if (cached_count_ >= 0) return static_cast<uint64_t>(cached_count_);
+    uint32_t hist[Q + 2] = {};
+    if (dense()) {
+      // 4 registers in every 3 bytes
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(dense_.data());
+      for (size_t j = 0; j < DENSE_BYTES; j += 3) {
+        uint32_t v = p[j] | static_cast<uint32_t>(p[j + 1]) << 8 |
+                     static_cast<uint32_t>(p[j + 2]) << 16;
+        ++hist[v & 63U];
+        ++hist[(v >> 6) & 63U];
+        ++hist[(v >> 12) & 63U];
+        ++hist[(v >> 18) & 63U];
+      }
+    } else {
+      hist[0] = static_cast<uint32_t>(M - sparse_.size());
+      for (uint32_t e : sparse_) ++hist[e & 63U];
+    }
+    const double m = static_cast<double>(M);
+    double z = m * tau(1 - hist[Q + 1] / m);
+    for (int k = Q; k >= 1; --k) z = 0.5 * (z + hist[k]);
+    z += m * sigma(hist[0] / m);
+    cached_count_ = std::llround(0.5 / M_LN2 * m * m / z);
+    return static_cast<uint64_t>(cached_count_);
+  }
+
+  std::string encode() const {
+    /* 'd' and the packed registers, or 's' and the sparse entries as 4
+     * byte words */
+    if (dense()) return 'd' + dense_.substr(0, DENSE_BYTES);
+    std::string out(1 + sparse_.size() * sizeof(uint32_t), 's');
+    memcpy(out.data() + 1, sparse_.data(), sparse_.size() * sizeof(uint32_t));
+    return out;
+  }
+
+  static bool decode(std::string_view data, HyperLogLog& out) {
+    /* Replaces out with an encode() result, false if data is malformed */
+    HyperLogLog hll;
+    if (data.size() == 1 + DENSE_BYTES && data[0] == 'd') {
+      hll.dense_.assign(data.substr(1));
+      hll.dense_.push_back('\0');
+      for (size_t i = 0; i < M; ++i) {
+        if (hll.get_dense(i) > Q + 1) return false;
+      }
+    } else if (!data.empty() && data[0] == 's' &&
+               (data.size() - 1) % sizeof(uint32_t) == 0 &&
+               (data.size() - 1) / sizeof(uint32_t) <= SPARSE_MAX) {
+      hll.sparse_.resize((data.size() - 1) / sizeof(uint32_t));
+      memcpy(hll.sparse_.data(), data.data() + 1, data.size() - 1);
+      for (size_t i = 0; i < hll.sparse_.size(); ++i) {
+        uint32_t e = hll.sparse_[i];
+        if ((e >> 6) >= M || (e & 63U) == 0 || (e & 63U) > Q + 1 ||
+            (i > 0 && (hll.sparse_[i - 1] >> 6) >= (e >> 6))) {
+          return false;
+        }
+      }
+    } else {
+      return false;
+    }
+    hll.cached_count_ = -1;
+    out = std::move(hll);
+    return true;
+  }
+};
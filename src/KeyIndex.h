@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "Varint.h"
+
+/* Ordered index of the keys, kept next to the Keyspace hash table for
+ * prefix and range scans. It is a two level B+tree: leaves are packed
+ * strings of sorted varint length | key entries of up to LEAF_BYTES, the
+ * size of a few cache lines, and the inner level is a std::map from each
+ * leaf's lower bound to the leaf. The first leaf's bound is "", no key is
+ * empty, so inserting a smaller key never changes a bound. A leaf splits
+ * in half once it outgrows LEAF_BYTES and merges into a neighbour once
+ * both fit in half of it. A key costs its bytes plus a length byte or two
+ * and a share of one map node per leaf */
+
+class KeyIndex {
+ public:
+  static constexpr size_t LEAF_BYTES = 1024;
+
+ private:
+  using Leaves = std::map<std::string, std::string, std::less<>>;
+
+  // a map node holds the bound and the leaf next to 4 words of tree links
+  static constexpr size_t NODE_BYTES = sizeof(Leaves::value_type) + 32;
+
+  Leaves leaves_;
+  size_t size_ = 0;
+  size_t packed_ = 0;  // bytes of all leaves
+  size_t bounds_ = 0;  // bytes of all bounds
+
+  static inline std::string_view entry(const std::string& leaf, size_t& pos) {
+    /* The key at pos, moves pos past it */
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(leaf.data()) + pos;
+    const uint8_t* start = p;
+    size_t len = get_varint(p);
+    std::string_view key(reinterpret_cast<const char*>(p), len);
+    pos += static_cast<size_t>(p - start) + len;
+    return key;
+  }
+
+  Leaves::iterator leaf_for(std::string_view key) {
+    if (leaves_.empty()) leaves_.emplace("", "");
+    return std::prev(leaves_.upper_bound(key));
+  }
+
+  static bool find(const std::string& leaf, std::string_view key,
+                   size_t& pos) {
+    /* Sets pos to the entry of key or of the first key after it */
+    for (pos = 0; pos < leaf.size();) {
+      size_t next = pos;
+      std::string_view cur = entry(leaf, next);
+      if (cur >= key) return cur == key;
+      pos = next;
+    }
+    return false;
+  }
+
+  void split(Leaves::iterator it) {
+    /* Moves the upper half of an overfull leaf into a new one */
+    std::string& leaf = it->second;
+    size_t pos = 0;
+    size_t mid = 0;
+    while (pos < leaf.size() / 2) {
+      mid = pos;
+      entry(leaf, pos);
+    }
+    if (mid == 0) mid = pos;  // the first key is over half of the leaf
+    if (mid == leaf.size()) return;  // a single key larger than a leaf
+    pos = mid;
+    std::string_view bound = entry(leaf, pos);
+    bounds_ += bound.size();
+    leaves_.emplace_hint(std::next(it), std::string(bound), leaf.substr(mid));
+    leaf.resize(mid);
+  }
+
+  void merge(Leaves::iterator it) {
+    /* Folds a leaf that lost keys into a neighbour if both fit in half a
+     * leaf, the first leaf is never removed */
+    if (it != leaves_.begin()) {
+      auto prev = std::prev(it);
+      if (prev->second.size() + it->second.size() <= LEAF_BYTES / 2 ||
+          it->second.empty()) {
+        prev->second += it->second;
+        bounds_ -= it->first.size();
+        leaves_.erase(it);
+        return;
+      }
+    }
+    auto next = std::next(it);
+    if (next != leaves_.end() &&
+        it->second.size() + next->second.size() <= LEAF_BYTES / 2) {
+      it->second += next->second;
+      bounds_ -= next->first.size();
+      leaves_.erase(next);
+    }
+  }
+
+ public:
+  inline size_t size() const noexcept { return size_; }
+
+  size_t leaves() const noexcept { return leaves_.size(); }
+
+  // without allocator overhead and the spare capacity of leaves
+  size_t bytes() const noexcept {
+    return packed_ + bounds_ + leaves_.size() * NODE_BYTES;
+  }
+
+  bool insert(std::string_view key) {
+    /* Returns false if key is already in the index */
+    auto it = leaf_for(key);
+    size_t pos = 0;
+    if (find(it->second, key, pos)) return false;
+    uint8_t len[10];
+    size_t n = put_varint(len, key.size());
+    it->second.insert(pos, reinterpret_cast<const char*>(len), n);
+    it->second.insert(pos + n, key);
+    ++size_;
+    packed_ += n + key.size();
+    if (it->second.size() > LEAF_BYTES) split(it);
+    return true;
+  }
+
+  bool erase(std::string_view key) {
+    if (leaves_.empty()) return false;
+    auto it = leaf_for(key);
+    size_t pos = 0;
+    if (!find(it->second, key, pos)) return false;
+    size_t end = pos;
+    entry(it->second, end);
+    it->second.erase(pos, end - pos);
+    --size_;
+    packed_ -= end - pos;
+    merge(it);
+    return true;
+  }
+
+  void clear() {
+    leaves_.clear();
+    size_ = packed_ = bounds_ = 0;
+  }
+
+  template <typename Fn>
+  void scan(std::string_view start, Fn&& fn) const {
+    /* fn(key) for the keys from start on in order while it returns true */
+    if (leaves_.empty()) return;
+    auto it = std::prev(leaves_.upper_bound(start));
+    size_t pos = 0;
+    find(it->second, start, pos);
+    for (; it != leaves_.end(); ++it, pos = 0) {
+      while (pos < it->second.size()) {
+        if (!fn(entry(it->second, pos))) return;
+      }
+    }
+  }
+
+  template <typename Fn>
+  void scan_prefix(std::string_view prefix, Fn&& fn) const {
+    /* fn(key) for the keys that start with prefix while it returns true */
+    scan(prefix, [&](std::string_view key) {
+      return key.substr(0, prefix.size()) == prefix && fn(key);
+    });
+  }
+};
@@ -0,0 +1,413 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "Value.h"
+#include "Varint.h"
+
+/* Read-only view of a stored value, valid until the keyspace changes. Small
+ * values are bytes or an integer kept in the entry itself, anything that
+ * needs a Value (segments, compression) is boxed */
+
+class ValueView {
+ public:
+  static constexpr size_t INT_CHARS = 24;  // enough for any int64_t
+
+ private:
+  std::string_view bytes_;
+  const Value* boxed_ = nullptr;
+  int64_t int_ = 0;
+  bool is_int_ = false;
+
+  friend class Keyspace;
+
+ public:
+  inline bool boxed() const noexcept { return boxed_ != nullptr; }
+  inline const Value& value() const noexcept { return *boxed_; }
+
+  // the value as bytes, an integer is formatted into buf of INT_CHARS
+  std::string_view text(char* buf) const {
+    if (!is_int_) return bytes_;
+    auto res = std::to_chars(buf, buf + INT_CHARS, int_);
+    return {buf, static_cast<size_t>(res.ptr - buf)};
+  }
+
+  size_t size() const {
+    if (boxed_) return boxed_->size();
+    char buf[INT_CHARS];
+    return text(buf).size();
+  }
+
+  std::string to_string() const {
+    if (boxed_) return boxed_->to_string();
+    char buf[INT_CHARS];
+    return std::string(text(buf));
+  }
+};
+
+/* The keyspace, an open addressing table of 16 byte slots with linear
+ * probing and backward shift deletion, so it needs no tombstones. An entry
+ * whose key and value fit in 14 bytes is packed into its slot. Any other
+ * entry is one allocation holding a flags byte, varint lengths, the key and
+ * the value, and its slot keeps the pointer next to the key's hash so that
+ * probing rarely follows it. Values that are the decimal form of an integer
+ * are stored as a zigzag varint when that is shorter. A large Value, or one
+ * with segments or compressed bytes, is boxed, its entry holds a pointer to
+ * it so it can be handed to the free thread or shared with the output.
+ *
+ * Slot layout, byte 0 is the tag:
+ *   0x00               empty
+ *   0x01               bytes 1-7 hash >> 8, bytes 8-15 entry pointer
+ *   0x80 | key_len     byte 1 value length, 0x80 | n for an n byte varint
+ *                      integer, bytes 2-15 key then value */
+
+class Keyspace {
+ public:
+  // what a put or erase replaced
+  struct Removed {
+    bool found = false;
+    size_t size = 0;
+    std::unique_ptr<Value> boxed;
+  };
+
+ private:
+  static constexpr uint8_t TAG_EMPTY = 0x00;
+  static constexpr uint8_t TAG_HEAP = 0x01;
+  static constexpr uint8_t TAG_INLINE = 0x80;
+  static constexpr uint8_t INT_FLAG = 0x80;  // of an inline value length
+  static constexpr size_t INLINE_BYTES = 14;
+  static constexpr size_t MIN_CAPACITY = 16;
+  static constexpr size_t BOX_MIN = 512;  // larger strings are moved in
+
+  // flags of a heap entry
+  static constexpr uint8_t ENTRY_STR = 0;
+  static constexpr uint8_t ENTRY_INT = 1;
+  static constexpr uint8_t ENTRY_BOXED = 2;
+
+  struct alignas(16) Slot {
+    uint8_t bytes[16];
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_ = 0;  // capacity - 1, capacity is 0 or a power of two
+  size_t size_ = 0;
+
+  // encoding helpers
+
+  static inline uint64_t zigzag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+  }
+
+  static inline int64_t unzigzag(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+  }
+
+  static inline uint64_t hash(std::string_view key) {
+    return std::hash<std::string_view>{}(key);
+  }
+
+  // slot accessors
+
+  static inline uint8_t tag(const Slot& s) { return s.bytes[0]; }
+
+  static inline uint8_t* entry(const Slot& s) {
+    uint8_t* p;
+    memcpy(&p, s.bytes + 8, sizeof(p));
+    return p;
+  }
+
+  static inline uint64_t heap_hash(const Slot& s) {
+    uint64_t h;
+    memcpy(&h, s.bytes, 8);
+    return h & ~uint64_t{0xFF};
+  }
+
+  static std::string_view slot_key(const Slot& s) {
+    if (tag(s) == TAG_HEAP) {
+      const uint8_t* p = entry(s) + 1;
+      size_t key_len = get_varint(p);
+      get_varint(p);
+      return {reinterpret_cast<const char*>(p), key_len};
+    }
+    return {reinterpret_cast<const char*>(s.bytes + 2),
+            static_cast<size_t>(tag(s) & ~TAG_INLINE)};
+  }
+
+  static void slot_value(const Slot& s, ValueView& out) {
+    out = ValueView();
+    if (tag(s) == TAG_HEAP) {
+      const uint8_t* p = entry(s);
+      uint8_t flags = *p++;
+      size_t key_len = get_varint(p);
+      size_t val_len = get_varint(p);
+      p += key_len;
+      if (flags == ENTRY_BOXED) {
+        memcpy(&out.boxed_, p, sizeof(out.boxed_));
+      } else if (flags == ENTRY_INT) {
+        out.is_int_ = true;
+        out.int_ = unzigzag(get_varint(p));
+      } else {
+        out.bytes_ = {reinterpret_cast<const char*>(p), val_len};
+      }
+      return;
+    }
+
+    size_t key_len = tag(s) & ~TAG_INLINE;
+    const uint8_t* p = s.bytes + 2 + key_len;
+    if (s.bytes[1] & INT_FLAG) {
+      out.is_int_ = true;
+      out.int_ = unzigzag(get_varint(p));
+    } else {
+      out.bytes_ = {reinterpret_cast<const char*>(p), s.bytes[1]};
+    }
+  }
+
+  inline size_t home(uint64_t h) const { return (h >> 8) & mask_; }
+
+  size_t slot_home(const Slot& s) const {
+    return tag(s) == TAG_HEAP ? home(heap_hash(s)) : home(hash(slot_key(s)));
+  }
+
+  static void free_slot(Slot& s) {
+    if (tag(s) == TAG_HEAP) {
+      uint8_t* p = entry(s);
+      if (p[0] == ENTRY_BOXED) {
+        ValueView view;
+        slot_value(s, view);
+        delete view.boxed_;
+      }
+      std::free(p);
+    }
+    s = Slot{};
+  }
+
+  static Slot encode(std::string_view key, uint64_t h, const Value* boxed,
+                     std::string_view val) {
+    /* A slot for key and either boxed or the bytes val */
+    Slot s{};
+    int64_t num = 0;
+    bool is_int = !boxed && parse_int(val, num);
+    uint64_t zz = zigzag(num);
+    if (is_int && varint_size(zz) >= val.size()) is_int = false;
+    size_t val_len = boxed ? sizeof(boxed) : is_int ? varint_size(zz)
+                                                     : val.size();
+
+    if (!boxed && key.size() + val_len <= INLINE_BYTES) {
+      s.bytes[0] = static_cast<uint8_t>(TAG_INLINE | key.size());
+      s.bytes[1] = static_cast<uint8_t>(is_int ? INT_FLAG | val_len : val_len);
+      memcpy(s.bytes + 2, key.data(), key.size());
+      if (is_int) {
+        put_varint(s.bytes + 2 + key.size(), zz);
+      } else {
+        memcpy(s.bytes + 2 + key.size(), val.data(), val.size());
+      }
+      return s;
+    }
+
+    size_t n = 1 + varint_size(key.size()) + varint_size(val_len) +
+               key.size() + val_len;
+    uint8_t* p = static_cast<uint8_t*>(std::malloc(n));
+    if (p == nullptr) throw std::bad_alloc();
+    uint8_t* q = p;
+    *q++ = boxed ? ENTRY_BOXED : is_int ? ENTRY_INT : ENTRY_STR;
+    q += put_varint(q, key.size());
+    q += put_varint(q, val_len);
+    memcpy(q, key.data(), key.size());
+    q += key.size();
+    if (boxed) {
+      memcpy(q, &boxed, sizeof(boxed));
+    } else if (is_int) {
+      put_varint(q, zz);
+    } else {
+      memcpy(q, val.data(), val.size());
+    }
+
+    uint64_t meta = (h & ~uint64_t{0xFF}) | TAG_HEAP;
+    memcpy(s.bytes, &meta, 8);
+    memcpy(s.bytes + 8, &p, sizeof(p));
+    return s;
+  }
+
+  size_t probe(std::string_view key, uint64_t h) const {
+    /* Index of key's slot, or of the empty slot where it would go */
+    uint64_t meta = (h & ~uint64_t{0xFF}) | TAG_HEAP;
+    for (size_t i = home(h);; i = (i + 1) & mask_) {
+      const Slot& s = slots_[i];
+      uint8_t t = tag(s);
+      if (t == TAG_EMPTY) return i;
+      if (t == TAG_HEAP) {
+        uint64_t m;
+        memcpy(&m, s.bytes, 8);
+        if (m == meta && slot_key(s) == key) return i;
+      } else if ((t & ~TAG_INLINE) == key.size() &&
+                 memcmp(s.bytes + 2, key.data(), key.size()) == 0) {
+        return i;
+      }
+    }
+  }
+
+  void grow() {
+    size_t cap = slots_ ? (mask_ + 1) * 2 : MIN_CAPACITY;
+    std::unique_ptr<Slot[]> old = std::move(slots_);
+    size_t old_cap = old ? mask_ + 1 : 0;
+    slots_ = std::make_unique<Slot[]>(cap);
+    mask_ = cap - 1;
+    for (size_t i = 0; i < old_cap; ++i) {
+      if (tag(old[i]) == TAG_EMPTY) continue;
+      size_t j = slot_home(old[i]);
+      while (tag(slots_[j]) != TAG_EMPTY) j = (j + 1) & mask_;
+      slots_[j] = old[i];
+    }
+  }
+
+  Removed take(Slot& s) {
+    /* Describes the entry in s and frees it, a boxed value is handed to the
+     * caller */
+    Removed old;
+    old.found = true;
+    ValueView view;
+    slot_value(s, view);
+    old.size = view.size();
+    if (view.boxed_) {
+      old.boxed.reset(const_cast<Value*>(view.boxed_));
+      std::free(entry(s));
+      s = Slot{};
+    } else {
+      free_slot(s);
+    }
+    return old;
+  }
+
+  Removed put(std::string_view key, const Value* boxed, std::string_view val) {
+    if (size_ + 1 > (mask_ + 1) / 4 * 3) grow();
+    uint64_t h = hash(key);
+    size_t i = probe(key, h);
+    Removed old;
+    if (tag(slots_[i]) == TAG_EMPTY) {
+      ++size_;
+    } else {
+      old = take(slots_[i]);
+    }
+    slots_[i] = encode(key, h, boxed, val);
+    return old;
+  }
+
+ public:
+  static bool parse_int(std::string_view s, int64_t& v) {
+    /* True if s is exactly how v would be printed */
+    if (s.empty() || s.size() > 20) return false;
+    size_t digits = s[0] == '-' ? 1 : 0;
+    if (digits == s.size() || (s[digits] == '0' && s.size() > digits + 1) ||
+        s == "-0") {
+      return false;
+    }
+    auto res = std::from_chars(s.data(), s.data() + s.size(), v);
+    return res.ec == std::errc() && res.ptr == s.data() + s.size();
+  }
+
+  Keyspace() = default;
+
+  Keyspace(Keyspace&& other) noexcept
+      : slots_(std::move(other.slots_)),
+        mask_(std::exchange(other.mask_, 0)),
+        size_(std::exchange(other.size_, 0)) {}
+
+  Keyspace& operator=(Keyspace&& other) noexcept {
+    if (this != &other) {
+      clear();
+      slots_ = std::move(other.slots_);
+      mask_ = std::exchange(other.mask_, 0);
+      size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+  }
+
+  Keyspace(const Keyspace&) = delete;
+  Keyspace& operator=(const Keyspace&) = delete;
+
+  ~Keyspace() { clear(); }
+
+  inline size_t size() const noexcept { return size_; }
+  inline bool empty() const noexcept { return size_ == 0; }
+
+  bool contains(std::string_view key) const {
+    return size_ > 0 && tag(slots_[probe(key, hash(key))]) != TAG_EMPTY;
+  }
+
+  bool find(std::string_view key, ValueView& out) const {
+    if (size_ == 0) return false;
+    const Slot& s = slots_[probe(key, hash(key))];
+    if (tag(s) == TAG_EMPTY) return false;
+    slot_value(s, out);
+    return true;
+  }
+
+  Removed put(std::string_view key, Value&& val) {
+    /* Sets key, returns what it replaced. Values with segments, compressed
+     * bytes, of at least BOX_MIN bytes or of another type than string are
+     * boxed, others are copied into the entry */
+    if (val.type() == ValueType::String && !val.chained() &&
+        !val.compressed() && val.str().size() < BOX_MIN) {
+      return put(key, nullptr, val.str());
+    }
+    Value* boxed = new Value(std::move(val));
+    return put(key, boxed, {});
+  }
+
+  Value* boxed(std::string_view key) {
+    /* The boxed value of key to change in place, null if key does not exist
+     * or is not boxed */
+    ValueView view;
+    if (!find(key, view)) return nullptr;
+    return const_cast<Value*>(view.boxed_);
+  }
+
+  Removed erase(std::string_view key) {
+    if (size_ == 0) return {};
+    size_t i = probe(key, hash(key));
+    if (tag(slots_[i]) == TAG_EMPTY) return {};
+    Removed old = take(slots_[i]);
+    --size_;
+
+    // shift back later entries of the run that may now be closer to home
+    for (size_t j = (i + 1) & mask_; tag(slots_[j]) != TAG_EMPTY;
+         j = (j + 1) & mask_) {
+      size_t k = slot_home(slots_[j]);
+      bool movable = i <= j ? (k <= i || k > j) : (k <= i && k > j);
+      if (movable) {
+        slots_[i] = slots_[j];
+        slots_[j] = Slot{};
+        i = j;
+      }
+    }
+    return old;
+  }
+
+  void clear() {
+    if (!slots_) return;
+    for (size_t i = 0; i <= mask_; ++i) free_slot(slots_[i]);
+    slots_.reset();
+    mask_ = 0;
+    size_ = 0;
+  }
+
+  template <typename Fn>
+  void for_each(Fn&& fn) const {
+    /* fn(key, view) for every entry, the keyspace must not change */
+    if (!slots_) return;
+    ValueView view;
+    for (size_t i = 0; i <= mask_; ++i) {
+      if (tag(slots_[i]) == TAG_EMPTY) continue;
+      slot_value(slots_[i], view);
+      fn(slot_key(slots_[i]), view);
+    }
+  }
+};
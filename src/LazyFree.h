@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "Stats.h"
+
+/* Frees large objects on a background thread so the event loop does not
+ * stall on destructors, e.g. of a huge value or of a whole keyspace dropped
+ * by "flushall async". The loop thread is the only producer and the free
+ * thread the only consumer of a fixed ring, so handing off an object is a
+ * heap allocation, a store and a wakeup of the free thread if it sleeps. When
+ * the ring is full the object is freed inline, a free thread that cannot keep
+ * up must not make the loop's memory grow without bound */
+
+class LazyFreer {
+ public:
+  static constexpr uint64_t QUEUE_SIZE = 1024;
+
+ private:
+  struct Job {
+    void* obj;
+    void (*destroy)(void*);  // null stops the free thread
+  };
+
+  std::array<Job, QUEUE_SIZE> ring_{};
+  alignas(64) std::atomic<uint64_t> head_{0};  // next slot the loop fills
+  alignas(64) std::atomic<uint64_t> tail_{0};  // next slot to be freed
+  ServerStats* stats_;
+  std::thread thread_;
+
+  void run() {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      uint64_t head = head_.load(std::memory_order_acquire);
+      if (head == tail) {
+        head_.wait(head, std::memory_order_acquire);
+        continue;
+      }
+      Job job = ring_[tail % QUEUE_SIZE];
+      if (job.destroy == nullptr) return;
+
+      uint64_t start_ns = monotonic_ns();
+      job.destroy(job.obj);
+      tail_.store(++tail, std::memory_order_release);
+      if (stats_) stats_->lazyfree_done(monotonic_ns() - start_ns);
+    }
+  }
+
+  bool push(Job job) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == QUEUE_SIZE) {
+      return false;
+    }
+    ring_[head % QUEUE_SIZE] = job;
+    head_.store(head + 1, std::memory_order_release);
+    head_.notify_one();
+    return true;
+  }
+
+ public:
+  explicit LazyFreer(ServerStats* stats = nullptr)
+      : stats_(stats), thread_([this]() { run(); }) {}
+
+  LazyFreer(const LazyFreer&) = delete;
+  LazyFreer& operator=(const LazyFreer&) = delete;
+
+  ~LazyFreer() {
+    // everything queued before the stop job is still freed
+    while (!push({nullptr, nullptr})) std::this_thread::yield();
+    thread_.join();
+  }
+
+  // objects handed off and not freed yet
+  inline uint64_t pending() const noexcept {
+    return head_.load(std::memory_order_relaxed) -
+           tail_.load(std::memory_order_relaxed);
+  }
+
+  template <typename T>
+  void defer(T&& obj) {
+    /* Takes obj over and destroys it on the free thread */
+    using Obj = std::remove_cvref_t<T>;
+    Obj* moved = new Obj(std::move(obj));
+    if (stats_) stats_->lazyfree_pending_changed(1);
+    if (!push({moved, [](void* p) { delete static_cast<Obj*>(p); }})) {
+      if (stats_) stats_->lazyfree_pending_changed(-1);
+      delete moved;
+    }
+  }
+};
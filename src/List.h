@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <string>
+#include <string_view>
+
+#include "Varint.h"
+
+/* Elements of a list value, stored as a quicklist: a linked list of chunks
+ * that each pack up to CHUNK_BYTES of elements into one string, rather than
+ * a node per element. An element is its varint length, its bytes and the
+ * length's varint bytes again in reverse order, so a chunk can be walked
+ * from either end. Pops from the front only move the chunk's head offset,
+ * and pushes to the front reuse that room before they shift the chunk */
+
+class List {
+ public:
+  static constexpr size_t CHUNK_BYTES = 4096;
+
+ private:
+  struct Chunk {
+    std::string data;  // elements start at head
+    size_t head = 0;
+    size_t count = 0;
+
+    inline size_t used() const noexcept { return data.size() - head; }
+  };
+
+  std::list<Chunk> chunks_;
+  size_t size_ = 0;
+  size_t bytes_ = 0;  // of all elements
+
+  static inline size_t encoded_size(size_t len) {
+    return 2 * varint_size(len) + len;
+  }
+
+  static void encode(uint8_t* p, std::string_view elem) {
+    size_t n = put_varint(p, elem.size());
+    memcpy(p + n, elem.data(), elem.size());
+    uint8_t* back = p + n + elem.size();
+    for (size_t i = 0; i < n; ++i) back[i] = p[n - 1 - i];
+  }
+
+  static std::string_view decode_front(const uint8_t*& p) {
+    /* The element at p, moves p past it */
+    size_t len = get_varint(p);
+    std::string_view elem(reinterpret_cast<const char*>(p), len);
+    p += len + varint_size(len);
+    return elem;
+  }
+
+  static std::string_view decode_back(const uint8_t*& end) {
+    /* The element ending at end, moves end back to its start */
+    uint64_t len = 0;
+    size_t n = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t b = *--end;
+      ++n;
+      len |= static_cast<uint64_t>(b & 0x7F) << shift;
+      if (b < 0x80) break;
+    }
+    end -= len;
+    std::string_view elem(reinterpret_cast<const char*>(end), len);
+    end -= n;
+    return elem;
+  }
+
+  void add_chunk(Chunk& chunk) {
+    /* The first chunk grows with its elements so a short list stays small,
+     * later ones are full sized from the start instead of growing by
+     * doubling and wasting up to half of their capacity */
+    if (chunks_.size() > 1) chunk.data.reserve(CHUNK_BYTES);
+  }
+
+  static inline const uint8_t* raw(const std::string& data) {
+    return reinterpret_cast<const uint8_t*>(data.data());
+  }
+
+  static inline uint8_t* raw(std::string& data) {
+    return reinterpret_cast<uint8_t*>(data.data());
+  }
+
+ public:
+  inline size_t size() const noexcept { return size_; }
+  inline size_t bytes() const noexcept { return bytes_; }
+  inline bool empty() const noexcept { return size_ == 0; }
+
+  void push_back(std::string_view elem) {
+    size_t n = encoded_size(elem.size());
+    if (chunks_.empty() || chunks_.back().used() + n > CHUNK_BYTES) {
+      add_chunk(chunks_.emplace_back());
+    }
+    Chunk& chunk = chunks_.back();
+    size_t pos = chunk.data.size();
+    chunk.data.resize(pos + n);
+    encode(raw(chunk.data) + pos, elem);
+    ++chunk.count;
+    ++size_;
+    bytes_ += elem.size();
+  }
+
+  void push_front(std::string_view elem) {
+    size_t n = encoded_size(elem.size());
+    if (chunks_.empty() || chunks_.front().used() + n > CHUNK_BYTES) {
+      add_chunk(chunks_.emplace_front());
+    }
+    Chunk& chunk = chunks_.front();
+    if (chunk.head < n) {
+      chunk.data.insert(chunk.head, n - chunk.head, '\0');
+      chunk.head = n;
+    }
+    chunk.head -= n;
+    encode(raw(chunk.data) + chunk.head, elem);
+    ++chunk.count;
+    ++size_;
+    bytes_ += elem.size();
+  }
+
+  bool pop_front(std::string& out) {
+    if (chunks_.empty()) return false;
+    Chunk& chunk = chunks_.front();
+    const uint8_t* p = raw(chunk.data) + chunk.head;
+    std::string_view elem = decode_front(p);
+    out.assign(elem);
+    chunk.head = static_cast<size_t>(p - raw(chunk.data));
+    if (--chunk.count == 0) chunks_.pop_front();
+    --size_;
+    bytes_ -= out.size();
+    return true;
+  }
+
+  bool pop_back(std::string& out) {
+    if (chunks_.empty()) return false;
+    Chunk& chunk = chunks_.back();
+    const uint8_t* end = raw(chunk.data) + chunk.data.size();
+    std::string_view elem = decode_back(end);
+    out.assign(elem);
+    chunk.data.resize(static_cast<size_t>(end - raw(chunk.data)));
+    if (--chunk.count == 0) chunks_.pop_back();
+    --size_;
+    bytes_ -= out.size();
+    return true;
+  }
+
+  template <typename Fn>
+  void for_range(int64_t start, int64_t stop, Fn&& fn) const {
+    /* fn(elem) for the elements from start to stop inclusive, negative
+     * indexes count from the end like in lrange */
+    int64_t n = static_cast<int64_t>(size_);
+    if (start < 0) start = std::max<int64_t>(n + start, 0);
+    if (stop < 0) stop += n;
+    if (stop >= n) stop = n - 1;
+    if (start > stop) return;
+
+    size_t skip = static_cast<size_t>(start);
+    size_t left = static_cast<size_t>(stop - start + 1);
+    for (const Chunk& chunk : chunks_) {
+      if (skip >= chunk.count) {
+        skip -= chunk.count;
+        continue;
+      }
+      const uint8_t* p = raw(chunk.data) + chunk.head;
+      for (size_t i = 0; i < chunk.count && left > 0; ++i) {
+        std::string_view elem = decode_front(p);
+        if (skip > 0) {
+          --skip;
+          continue;
+        }
+        fn(elem);
+        --left;
+      }
+      if (left == 0) return;
+    }
+  }
+
+  template <typename Fn>
+  void for_each(Fn&& fn) const {
+    for_range(0, -1, fn);
+  }
+
+  std::string encode() const {
+    /* Every element as varint length | bytes, front to back */
+    std::string out;
+    for_each([&](std::string_view elem) {
+      uint8_t len[10];
+      out.append(reinterpret_cast<const char*>(len),
+                 put_varint(len, elem.size()));
+      out.append(elem);
+    });
+    return out;
+  }
+
+  static bool decode(std::string_view data, List& out) {
+    /* Appends the elements of an encode() result to out, false if data is
+     * malformed */
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+    const uint8_t* end = p + data.size();
+    while (p < end) {
+      uint64_t len = 0;
+      if (!get_varint(p, end, len) || len > static_cast<size_t>(end - p)) {
+        return false;
+      }
+      out.push_back({reinterpret_cast<const char*>(p), len});
+      p += len;
+    }
+    return true;
+  }
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+
+#include "Histogram.h"
+
+/* Per-iteration metrics of an event loop: time blocked in poll, time spent
+ * processing the ready fds, how many were ready and how many bytes were moved.
+ * An iteration whose processing exceeds the budget is a stall, every client
+ * of the loop waited at least that long. Stalls are kept for the loopstats
+ * command and reported on stderr at most once a second */
+
+class LoopMonitor {
+ public:
+  static constexpr size_t MAX_STALLS = 32;  // recent stalls kept
+
+  struct Iteration {
+    uint64_t start_ns = 0;  // when poll was entered
+    uint64_t poll_ns = 0;
+    uint64_t process_ns = 0;
+    uint32_t ready = 0;
+    uint64_t bytes = 0;
+  };
+
+ private:
+  static constexpr uint64_t REPORT_INTERVAL_NS = 1000000000ULL;
+
+  uint64_t budget_ns_;  // 0 disables the watchdog
+  uint64_t iterations_ = 0;
+  uint64_t poll_ns_ = 0;
+  uint64_t process_ns_ = 0;
+  uint64_t ready_ = 0;
+  uint64_t bytes_ = 0;
+  uint64_t n_stalls_ = 0;
+  uint64_t unreported_stalls_ = 0;
+  uint64_t next_report_ns_ = 0;
+  LatencyHistogram process_hist_;
+  std::deque<Iteration> stalls_;  // newest first
+
+ public:
+  explicit LoopMonitor(uint64_t budget_us) : budget_ns_(budget_us * 1000) {}
+
+  void record(const Iteration& it) {
+    ++iterations_;
+    poll_ns_ += it.poll_ns;
+    process_ns_ += it.process_ns;
+    ready_ += it.ready;
+    bytes_ += it.bytes;
+    process_hist_.record(it.process_ns);
+
+    if (budget_ns_ == 0 || it.process_ns <= budget_ns_) return;
+
+    ++n_stalls_;
+    stalls_.push_front(it);
+    if (stalls_.size() > MAX_STALLS) stalls_.pop_back();
+
+    ++unreported_stalls_;
+    uint64_t now_ns = it.start_ns + it.poll_ns + it.process_ns;
+    if (now_ns >= next_report_ns_) {
+      std::cerr << "Event loop stall: " << it.process_ns / 1000
+                << " us processing " << it.ready << " ready fds and "
+                << it.bytes << " bytes, budget " << budget_ns_ / 1000
+                << " us (" << unreported_stalls_ << " stalls since last report)"
+                << std::endl;
+      unreported_stalls_ = 0;
+      next_report_ns_ = now_ns + REPORT_INTERVAL_NS;
+    }
+  }
+
+  void reset() {
+    iterations_ = poll_ns_ = process_ns_ = ready_ = bytes_ = n_stalls_ = 0;
+    process_hist_.reset();
+    stalls_.clear();
+  }
+
+  std::string report() const {
+    /* "field:value" lines followed by one "stall:" line per recent stall
+     * "<start ns> <poll us> <process us> <ready fds> <bytes>" */
+    std::string out;
+    out += "iterations:" + std::to_string(iterations_) + "\n";
+    out += "poll_usec:" + std::to_string(poll_ns_ / 1000) + "\n";
+    out += "process_usec:" + std::to_string(process_ns_ / 1000) + "\n";
+    out += "ready_fds:" + std::to_string(ready_) + "\n";
+    out += "bytes:" + std::to_string(bytes_) + "\n";
+    out += "process_p99_usec:" +
+           std::to_string(process_hist_.percentile(99) / 1000) + "\n";
+    out += "process_max_usec:" + std::to_string(process_hist_.max() / 1000) +
+           "\n";
+    out += "budget_usec:" + std::to_string(budget_ns_ / 1000) + "\n";
+    out += "stalls:" + std::to_string(n_stalls_) + "\n";
+    for (const Iteration& it : stalls_) {
+      out += "stall:" + std::to_string(it.start_ns) + " " +
+             std::to_string(it.poll_ns / 1000) + " " +
+             std::to_string(it.process_ns / 1000) + " " +
+             std::to_string(it.ready) + " " + std::to_string(it.bytes) + "\n";
+    }
+    return out;
+  }
+};
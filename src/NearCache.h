@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Client.h"
+
+/* Client-side cache of get replies kept coherent by the server. The
+ * connection turns tracking on, see Tracking.h, and every invalidation the
+ * server pushes drops the key from the local copy. A cached get is answered
+ * without a round trip.
+ *
+ * Replies and invalidations are both handled on the client's I/O thread in
+ * the order the server sent them, so a value is never stored after the
+ * invalidation that made it stale. While the connection is down nothing can
+ * be invalidated, the cache is emptied and gets fail */
+
+class NearCache {
+ private:
+  AsyncClient client_;
+  size_t max_entries_;
+
+  std::mutex mtx_;  // protects everything below
+  std::unordered_map<std::string, std::string> cache_;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+
+  void on_message(std::vector<std::string>&& msg) {
+    if (msg.empty() || msg[0] != "invalidate") return;
+    std::scoped_lock lock(mtx_);
+    if (msg.size() == 1) {
+      cache_.clear();  // every key
+    } else {
+      cache_.erase(msg[1]);
+    }
+  }
+
+  void store(const std::string& key, const std::string& val) {
+    std::scoped_lock lock(mtx_);
+    if (cache_.size() >= max_entries_ && !cache_.count(key)) {
+      // an arbitrary entry, the server keeps tracking it which is harmless
+      cache_.erase(cache_.begin());
+    }
+    cache_[key] = val;
+  }
+
+ public:
+  // bcast_prefixes turns on broadcast mode, the server then invalidates
+  // every key with one of them instead of remembering what was read. An
+  // empty prefix matches every key
+  NearCache(const std::string& host, uint16_t port, size_t max_entries,
+            const std::vector<std::string>& bcast_prefixes = {})
+      : client_(host, port), max_entries_(max_entries) {
+    client_.on_message(
+        [this](std::vector<std::string>&& msg) { on_message(std::move(msg)); });
+
+    std::vector<std::string> cmd = {"client", "tracking", "on"};
+    if (!bcast_prefixes.empty()) cmd.push_back("bcast");
+    for (const std::string& prefix : bcast_prefixes) {
+      if (prefix.empty()) continue;  // bcast alone covers every key
+      cmd.push_back("prefix");
+      cmd.push_back(prefix);
+    }
+    Reply reply = client_.call(cmd).get();
+    if (reply.status != Status::Valid) {
+      throw std::runtime_error("Failed to turn on tracking: " + reply.data);
+    }
+  }
+
+  Reply get(const std::string& key) {
+    bool connected = client_.connected();
+    {
+      std::scoped_lock lock(mtx_);
+      if (!connected) {
+        cache_.clear();
+        return {Status::Error, CONNECTION_LOST};
+      }
+      auto it = cache_.find(key);
+      if (it != cache_.end()) {
+        ++hits_;
+        return {Status::Valid, it->second};
+      }
+      ++misses_;
+    }
+
+    // stored on the I/O thread, ordered with the invalidations
+    auto promise = std::make_shared<std::promise<Reply>>();
+    std::future<Reply> fut = promise->get_future();
+    client_.call({"get", key}, [this, key, promise](Reply&& reply) {
+      if (reply.status == Status::Valid) store(key, reply.data);
+      promise->set_value(std::move(reply));
+    });
+    Reply reply = fut.get();
+    if (reply.status == Status::Error && reply.data == CONNECTION_LOST) {
+      std::scoped_lock lock(mtx_);
+      cache_.clear();
+    }
+    return reply;
+  }
+
+  // anything else goes straight to the server, writes invalidate the
+  // cached copy through tracking like writes of other clients
+  std::future<Reply> call(const std::vector<std::string>& cmd) {
+    return client_.call(cmd);
+  }
+
+  size_t size() {
+    std::scoped_lock lock(mtx_);
+    return cache_.size();
+  }
+
+  uint64_t hits() {
+    std::scoped_lock lock(mtx_);
+    return hits_;
+  }
+
+  uint64_t misses() {
+    std::scoped_lock lock(mtx_);
+    return misses_;
+  }
+};
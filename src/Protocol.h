@@ -0,0 +1,197 @@
+#pragma once
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Wire-level definitions shared by the servers and the client side code.
+ *
+ * request:  msg_len | n_strs | len1 | str1 | len2 | str2 | ...
+ * response: resp_len | status | data
+ *
+ * Moved and Ask are cluster redirects whose data is "<slot> <host>:<port>".
+ * Message is pushed to pub/sub subscribers without a request, its data is
+ * n_strs | len1 | str1 | ... holding "message <channel> <payload>" or
+ * "pmessage <pattern> <channel> <payload>". Compressed is a get reply to a
+ * client that asked for compressed values, its data is
+ * raw_len | LZ block of the value, see Compression.h. Replies holding
+ * several strings, e.g. of hmget and hgetall, are Valid with data
+ * n_strs | len1 | str1 | ..., which decode_strings reads. The reply of exec
+ * is such a list with a string of status | data per queued command, which
+ * decode_replies reads */
+
+enum class Status : uint32_t {
+  Valid,
+  Invalid,
+  Error,
+  Close,
+  Moved,
+  Ask,
+  Message,
+  Compressed
+};
+
+struct Reply {
+  Status status = Status::Error;
+  std::string data;
+};
+
+template <typename StrList>
+void encode_request(const StrList& cmd, std::vector<uint8_t>& out) {
+  /* Appends cmd to out in the request format */
+  size_t start = out.size();
+  uint32_t msg_len = 4;
+  for (const auto& s : cmd) msg_len += 4 + static_cast<uint32_t>(s.size());
+  uint32_t n_strs = static_cast<uint32_t>(cmd.size());
+
+  out.resize(start + 4 + msg_len);
+  uint8_t* p = out.data() + start;
+  memcpy(p, &msg_len, 4);
+  memcpy(p + 4, &n_strs, 4);
+  p += 8;
+  for (const auto& s : cmd) {
+    uint32_t len = static_cast<uint32_t>(s.size());
+    memcpy(p, &len, 4);
+    memcpy(p + 4, s.data(), len);
+    p += 4 + len;
+  }
+}
+
+inline void encode_request(std::initializer_list<std::string_view> cmd,
+                           std::vector<uint8_t>& out) {
+  encode_request<std::initializer_list<std::string_view>>(cmd, out);
+}
+
+inline bool decode_strings(const std::string& data,
+                           std::vector<std::string>& strs) {
+  /* Reverse of the n_strs | len1 | str1 | ... part of encode_request, returns
+   * false if data is malformed */
+  size_t pos = 4;
+  uint32_t n_strs = 0;
+  if (data.size() < 4) return false;
+  memcpy(&n_strs, data.data(), 4);
+  strs.clear();
+  while (strs.size() < n_strs) {
+    uint32_t len = 0;
+    if (data.size() - pos < 4) return false;
+    memcpy(&len, data.data() + pos, 4);
+    pos += 4;
+    if (data.size() - pos < len) return false;
+    strs.emplace_back(data, pos, len);
+    pos += len;
+  }
+  return pos == data.size();
+}
+
+inline bool decode_replies(const std::string& data,
+                           std::vector<Reply>& replies) {
+  /* The replies of the commands run by exec, returns false if data is
+   * malformed */
+  std::vector<std::string> strs;
+  if (!decode_strings(data, strs)) return false;
+  replies.clear();
+  for (std::string& str : strs) {
+    if (str.size() < 4) return false;
+    Reply& reply = replies.emplace_back();
+    memcpy(&reply.status, str.data(), 4);
+    reply.data = str.substr(4);
+  }
+  return true;
+}
+
+inline bool send_all(int fd, const void* buf, size_t n_bytes) {
+  /* Ensures that all n_bytes are written, send is not guarenteed to write all
+   * of them. Only meant for blocking sockets */
+  const uint8_t* p = static_cast<const uint8_t*>(buf);
+  while (n_bytes) {
+    ssize_t rv = send(fd, p, n_bytes, MSG_NOSIGNAL);
+    if (rv <= 0) return false;
+    n_bytes -= rv;
+    p += rv;
+  }
+  return true;
+}
+
+inline bool recv_all(int fd, void* buf, size_t n_bytes) {
+  /* Ensures that all n_bytes are read, recv is not guarenteed to return all
+   * of them. Only meant for blocking sockets */
+  uint8_t* p = static_cast<uint8_t*>(buf);
+  while (n_bytes) {
+    ssize_t rv = recv(fd, p, n_bytes, 0);
+    if (rv <= 0) return false;  // error or unexpected EOF
+    n_bytes -= rv;
+    p += rv;
+  }
+  return true;
+}
+
+inline int connect_tcp(const std::string& host, uint16_t port,
+                       int timeout_ms = 0) {
+  /* Opens a blocking TCP connection, returns the fd or -1 on failure. A
+   * non-zero timeout_ms bounds the connect and every later send and recv */
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = nullptr;
+  std::string port_str = std::to_string(port);
+  if (getaddrinfo(host.c_str(), port_str.c_str(), &hints, &res) != 0) {
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0 && timeout_ms > 0) {
+    struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+  int rv = fd < 0 ? -1 : connect(fd, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  if (rv != 0) {
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+inline socklen_t unix_sockaddr(const std::string& path,
+                               struct sockaddr_un& addr) {
+  /* Fills addr for a Unix domain socket, a path starting with '@' names a
+   * socket in the abstract namespace. Returns the address length or 0 if the
+   * path does not fit */
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) return 0;
+
+  memcpy(addr.sun_path, path.data(), path.size());
+  if (path[0] == '@') {
+    // no terminating null, every byte of the name is significant
+    addr.sun_path[0] = '\0';
+    return static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) +
+                                  path.size());
+  }
+  return static_cast<socklen_t>(sizeof(addr));
+}
+
+inline int connect_unix(const std::string& path) {
+  /* Opens a blocking Unix domain connection, returns the fd or -1 */
+  struct sockaddr_un addr;
+  socklen_t addrlen = unix_sockaddr(path, addr);
+  if (addrlen == 0) return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), addrlen) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <fnmatch.h>
+
+#include <algorithm>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "BufferChain.h"
+#include "Protocol.h"
+#include "ServerBase.h"
+#include "Value.h"
+
+/* Channel and pattern subscriptions of the event loop's connections. A
+ * published message is encoded once into a BufferChain, every receiver's
+ * output then shares its segments, so the payload is never copied per
+ * subscriber. Each connection also keeps the names it is subscribed to, see
+ * Conn::channels, so closing it does not scan every channel */
+
+class PubSub {
+ private:
+  using Subscribers = std::unordered_map<std::string, std::vector<Conn*>>;
+
+  Subscribers channels_;
+  Subscribers patterns_;
+
+  static bool add(Subscribers& subs, std::vector<std::string>& names,
+                  Conn* conn, const std::string& name) {
+    if (std::find(names.begin(), names.end(), name) != names.end()) {
+      return false;
+    }
+    names.push_back(name);
+    subs[name].push_back(conn);
+    return true;
+  }
+
+  static bool remove(Subscribers& subs, std::vector<std::string>& names,
+                     Conn* conn, const std::string& name) {
+    auto it = std::find(names.begin(), names.end(), name);
+    if (it == names.end()) return false;
+    names.erase(it);
+
+    auto sub = subs.find(name);
+    std::vector<Conn*>& conns = sub->second;
+    auto pos = std::find(conns.begin(), conns.end(), conn);
+    *pos = conns.back();
+    conns.pop_back();
+    if (conns.empty()) subs.erase(sub);
+    return true;
+  }
+
+ public:
+  static BufferChain encode_message(
+      std::initializer_list<std::string_view> head, const Value& payload) {
+    /* A complete Status::Message response, see Protocol.h. A chained payload
+     * is shared, not copied */
+    uint32_t n_strs = static_cast<uint32_t>(head.size()) + 1;
+    uint32_t resp_len = 4 + 4 + 4 + static_cast<uint32_t>(payload.size());
+    for (std::string_view s : head) {
+      resp_len += 4 + static_cast<uint32_t>(s.size());
+    }
+
+    BufferChain out;
+    uint32_t hdr[3] = {resp_len, static_cast<uint32_t>(Status::Message),
+                       n_strs};
+    out.append(reinterpret_cast<const uint8_t*>(hdr), sizeof(hdr));
+    for (std::string_view s : head) {
+      uint32_t len = static_cast<uint32_t>(s.size());
+      out.append(reinterpret_cast<const uint8_t*>(&len), 4U);
+      out.append(reinterpret_cast<const uint8_t*>(s.data()), len);
+    }
+    uint32_t len = static_cast<uint32_t>(payload.size());
+    out.append(reinterpret_cast<const uint8_t*>(&len), 4U);
+    if (payload.chained()) {
+      out.append_shared(payload.chain());
+    } else {
+      out.append(reinterpret_cast<const uint8_t*>(payload.str().data()),
+                 payload.str().size());
+    }
+    return out;
+  }
+
+  // the subscribe calls return the connection's number of subscriptions
+  size_t subscribe(Conn* conn, const std::string& channel) {
+    add(channels_, conn->channels, conn, channel);
+    return conn->channels.size() + conn->patterns.size();
+  }
+
+  size_t psubscribe(Conn* conn, const std::string& pattern) {
+    add(patterns_, conn->patterns, conn, pattern);
+    return conn->channels.size() + conn->patterns.size();
+  }
+
+  size_t unsubscribe(Conn* conn, const std::string& channel) {
+    remove(channels_, conn->channels, conn, channel);
+    return conn->channels.size() + conn->patterns.size();
+  }
+
+  size_t punsubscribe(Conn* conn, const std::string& pattern) {
+    remove(patterns_, conn->patterns, conn, pattern);
+    return conn->channels.size() + conn->patterns.size();
+  }
+
+  void unsubscribe_all(Conn* conn) {
+    while (!conn->channels.empty()) {
+      remove(channels_, conn->channels, conn, conn->channels.back());
+    }
+    while (!conn->patterns.empty()) {
+      remove(patterns_, conn->patterns, conn, conn->patterns.back());
+    }
+  }
+
+  inline size_t n_channels() const noexcept { return channels_.size(); }
+  inline size_t n_patterns() const noexcept { return patterns_.size(); }
+
+  template <typename Deliver>
+  size_t publish(const std::string& channel, const Value& payload,
+                 Deliver&& deliver) {
+    /* Calls deliver(conn, msg) for every receiver of the message, returns
+     * how many there were. Channel subscribers share one encoded message,
+     * each matching pattern gets its own since it names the pattern */
+    size_t receivers = 0;
+    auto it = channels_.find(channel);
+    if (it != channels_.end()) {
+      BufferChain msg = encode_message({"message", channel}, payload);
+      for (Conn* conn : it->second) deliver(conn, msg);
+      receivers += it->second.size();
+    }
+
+    for (const auto& [pattern, conns] : patterns_) {
+      if (fnmatch(pattern.c_str(), channel.c_str(), 0) != 0) continue;
+      BufferChain msg =
+          encode_message({"pmessage", pattern, channel}, payload);
+      for (Conn* conn : conns) deliver(conn, msg);
+      receivers += conns.size();
+    }
+    return receivers;
+  }
+};
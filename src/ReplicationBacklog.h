@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "Buffer.h"
+
+/* Fixed-size ring buffer holding the most recent bytes of the replication
+ * stream. Offsets are absolute positions in the stream since the leader
+ * started, so a follower that reconnects with an offset still covered by the
+ * backlog can resume without a full resync */
+
+class ReplicationBacklog {
+ private:
+  std::vector<uint8_t> buf_;
+  uint64_t end_offset_ = 0;  // offset one past the last byte appended
+  size_t size_ = 0;          // number of valid bytes currently held
+
+ public:
+  explicit ReplicationBacklog(size_t capacity) : buf_(capacity) {}
+
+  inline size_t capacity() const noexcept { return buf_.size(); }
+  inline uint64_t start_offset() const noexcept { return end_offset_ - size_; }
+  inline uint64_t end_offset() const noexcept { return end_offset_; }
+
+  inline bool contains(uint64_t offset) const noexcept {
+    return offset >= start_offset() && offset <= end_offset_;
+  }
+
+  void append(const uint8_t* data, size_t len) {
+    size_t cap = buf_.size();
+    end_offset_ += len;
+    if (len >= cap) {
+      // only the newest cap bytes can be kept
+      data += len - cap;
+      len = cap;
+    }
+
+    size_t pos = static_cast<size_t>((end_offset_ - len) % cap);
+    size_t first = std::min(len, cap - pos);
+    memcpy(buf_.data() + pos, data, first);
+    memcpy(buf_.data(), data + first, len - first);
+    size_ = std::min(cap, size_ + len);
+  }
+
+  template <typename Out>
+  void copy_from(uint64_t offset, Out& out) const {
+    /* Appends every byte from offset to the end of the stream into out */
+    assert(contains(offset));
+    size_t cap = buf_.size();
+    size_t len = static_cast<size_t>(end_offset_ - offset);
+    if (len == 0) return;
+
+    size_t pos = static_cast<size_t>(offset % cap);
+    size_t first = std::min(len, cap - pos);
+    out.append(buf_.data() + pos, static_cast<uint32_t>(first));
+    if (len > first) {
+      out.append(buf_.data(), static_cast<uint32_t>(len - first));
+    }
+  }
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+/* Drop-in alternative to Buffer that never compacts. The storage is a power of
+ * two ring whose pages are mapped twice, back to back, so the bytes between
+ * head and tail are always contiguous in memory even when they wrap around the
+ * end of the ring. data() can therefore be handed to the parser exactly like
+ * Buffer's, while append only ever copies the new bytes. Growing still needs
+ * a copy into a larger ring */
+
+class RingBuffer {
+ private:
+  uint8_t* base_ = nullptr;  // first of the two mappings
+  size_t cap_ = 0;           // power of two and a multiple of the page size
+  uint64_t head_ = 0;        // data is [head_, tail_), both only increase
+  uint64_t tail_ = 0;
+
+  static size_t round_capacity(size_t sz) {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return std::bit_ceil(std::max(sz, page));
+  }
+
+  static uint8_t* map_mirrored(size_t cap) {
+    /* Reserves 2 * cap of address space and maps the same cap bytes of an
+     * anonymous file into both halves. The file descriptor is not needed once
+     * the pages are mapped */
+    int fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+    if (fd < 0) throw std::bad_alloc();
+    if (ftruncate(fd, static_cast<off_t>(cap)) != 0) {
+      close(fd);
+      throw std::bad_alloc();
+    }
+
+    void* base = mmap(nullptr, 2 * cap, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool ok = base != MAP_FAILED;
+    for (size_t half = 0; ok && half < 2; ++half) {
+      void* p = static_cast<uint8_t*>(base) + half * cap;
+      ok = mmap(p, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                0) != MAP_FAILED;
+    }
+    close(fd);
+
+    if (!ok) {
+      if (base != MAP_FAILED) munmap(base, 2 * cap);
+      throw std::bad_alloc();
+    }
+    return static_cast<uint8_t*>(base);
+  }
+
+  void remap(size_t new_cap) {
+    /* Moves the data into a new ring of new_cap bytes */
+    uint8_t* t = map_mirrored(new_cap);
+    size_t data_sz = size();
+    if (data_sz > 0) memcpy(t, data(), data_sz);
+    munmap(base_, 2 * cap_);
+
+    base_ = t;
+    cap_ = new_cap;
+    head_ = 0;
+    tail_ = data_sz;
+  }
+
+ public:
+  explicit RingBuffer(size_t sz)
+      : base_(map_mirrored(round_capacity(sz))), cap_(round_capacity(sz)) {}
+
+  ~RingBuffer() { munmap(base_, 2 * cap_); }
+
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+  RingBuffer(RingBuffer&&) = delete;
+  RingBuffer& operator=(RingBuffer&&) = delete;
+
+  inline size_t size() const noexcept {
+    return static_cast<size_t>(tail_ - head_);
+  }
+
+  inline size_t capacity() const noexcept { return cap_; }
+
+  inline uint8_t* data() const noexcept {
+    return base_ + (head_ & (cap_ - 1));
+  }
+
+  // for debugging purposes
+  void print_data() const {
+    std::cout << "RingBuffer: {";
+    for (size_t i = 0; i < size(); ++i) std::cout << data()[i];
+    std::cout << "}\n";
+  }
+
+  inline void clear() noexcept { head_ = tail_ = 0; }
+
+  void consume(size_t sz) {
+    assert(sz <= size());
+    head_ += sz;
+  }
+
+  bool shrink(size_t sz) {
+    /* Moves the data into a smaller ring of at least sz bytes, rounded like the
+     * constructor does, if that still fits it. Returns false if nothing
+     * changed */
+    size_t new_cap = round_capacity(std::max(sz, size()));
+    if (new_cap >= cap_) return false;
+    remap(new_cap);
+    return true;
+  }
+
+  uint8_t* prepare_append(size_t msg_len) {
+    /* Makes room for msg_len more bytes and returns where they go, they are
+     * part of the data once commit_append is called */
+    if (size() + msg_len > cap_) [[unlikely]] {
+      size_t new_cap = cap_;
+      while (new_cap < size() + msg_len) new_cap <<= 1;
+      remap(new_cap);
+    }
+
+    // may run past the end of the ring into the mirror, which is the start
+    return base_ + (tail_ & (cap_ - 1));
+  }
+
+  inline void commit_append(size_t msg_len) noexcept { tail_ += msg_len; }
+
+  void append(const uint8_t* msg, uint32_t msg_len) {
+    assert(msg_len > 0);
+    memcpy(prepare_append(msg_len), msg, msg_len);
+    commit_append(msg_len);
+  }
+};
@@ -3,28 +3,120 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 
+#include <initializer_list>
+#include <string>
+#include <string_view>
 #include <vector>
 
-#include "buffer.h"
-
-enum class Status : uint32_t { Valid, Invalid, Error, Close };
+#include "Buffer.h"
+#include "BufferChain.h"
+#include "Protocol.h"
+#include "RingBuffer.h"
+#include "Transaction.h"
 
 struct Response {
   Status status = Status::Valid;
   Buffer data{64};
+
+  void append(std::string_view s) {
+    if (s.empty()) return;
+    data.append(reinterpret_cast<const uint8_t*>(s.data()),
+                static_cast<uint32_t>(s.size()));
+  }
 };
 
+// Client is a regular connection, Replica is a follower attached to this
+// server and Leader is this server's own link to the leader it follows
+enum class ConnKind : uint8_t { Client, Replica, Leader };
+
+// buffers of client connections, builds with RING_BUFFER defined use the
+// mirrored ring which never compacts, see RingBuffer.h
+#ifdef RING_BUFFER
+using ConnBuffer = RingBuffer;
+#else
+using ConnBuffer = Buffer;
+#endif
+
+// initial size of connection buffers, idle connections shrink back to it
+static constexpr size_t CONN_BUF_SIZE = 256;
+
+// requests at least this large are received into segments, see Conn, and
+// their arguments at least LARGE_ARG_BYTES long are stored without copies
+static constexpr uint32_t LARGE_MSG_BYTES = 256 * 1024;
+static constexpr uint32_t LARGE_ARG_BYTES = 64 * 1024;
+
 struct Conn {
   /* Struct that contains all relevant data for an open connection */
 
   int fd = -1;  // -1 means connection closed
+  uint64_t id = 0;  // unique for the server's lifetime unlike fd
+  ConnKind kind = ConnKind::Client;
 
   bool want_read = false;
   bool want_write = false;
   bool want_close = false;
+  bool asking = false;  // next command may target a slot being imported
+  bool input_pending = false;  // read_buf holds requests left for later
+  bool tracking = false;  // sent invalidations of keys read, see Tracking.h
+  bool tracking_bcast = false;  // of keys with its prefixes instead
+  bool accept_compressed = false;  // gets compressed values as they are
+
+  ConnBuffer write_buf{CONN_BUF_SIZE};
+  ConnBuffer read_buf{CONN_BUF_SIZE};
+
+  // a request of at least LARGE_MSG_BYTES is read into read_chain instead of
+  // read_buf, large_msg_len is its msg_len while that is in progress
+  BufferChain read_chain;
+  uint32_t large_msg_len = 0;
 
-  Buffer write_buf{256};
-  Buffer read_buf{256};
+  // output that follows write_buf, used once a reply shares the segments of
+  // a large value. While it is non-empty all output goes here to keep order
+  BufferChain write_chain;
+
+  // memory accounting, see ServerEventLoop::reclaim_buffers
+  uint64_t created_ns = 0;
+  uint64_t last_active_ns = 0;       // last successful read or write
+  uint64_t soft_limit_since_ns = 0;  // 0 while under the soft output limit
+  size_t read_peak = 0;   // largest read_buf and write_buf sizes since the
+  size_t write_peak = 0;  // last reclaim pass
+  size_t snapshot_bytes = 0;  // full resync output not yet written, these
+                              // bytes do not count toward output limits
+  size_t base_memory = memory();
+  size_t reported_memory = 0;  // last memory() added to the server's total
+
+  // pub/sub subscriptions, see PubSub
+  std::vector<std::string> channels;
+  std::vector<std::string> patterns;
+
+  inline bool subscribed() const noexcept {
+    return !channels.empty() || !patterns.empty();
+  }
+
+  // keys a blpop waits on, see BlockedClients. No other request runs until
+  // it is served or times out, 0 is no timeout
+  std::vector<std::string> blocked_keys;
+  uint64_t blocked_deadline_ns = 0;
+
+  inline bool blocked() const noexcept { return !blocked_keys.empty(); }
+
+  // multi, exec and watch, see Transaction.h
+  Transaction tx;
+
+  inline bool has_output() const noexcept {
+    return write_buf.size() > 0 || !write_chain.empty();
+  }
+
+  inline size_t output_size() const noexcept {
+    return write_buf.size() + write_chain.size();
+  }
+
+  inline size_t memory() const noexcept {
+    /* Buffer capacity plus the bytes held in chains. Segments of a large
+     * value shared with write_chain are counted although the value owns them
+     * too */
+    return read_buf.capacity() + write_buf.capacity() + read_chain.size() +
+           write_chain.size();
+  }
 
   Conn() = default;
 };
@@ -35,11 +127,12 @@ class ServerBase {
  protected:
   uint16_t port_;
   int64_t server_fd_;
+  std::vector<int> listen_fds_;  // server_fd_ first, then Unix domain sockets
 
   /* Need to parse client_msg which follows:
    * n_strs | len1 | str1 | len2 | str2 | ...
    * " | " is there for readability and is not actually in the msg */
-  int parse_msg(Buffer& read_buf, std::vector<std::string>& client_cmd) {
+  int parse_msg(ConnBuffer& read_buf, std::vector<std::string>& client_cmd) {
     size_t rel_buf_idx = 4U;  // offset from msg_len
 
     uint32_t n_strs = 0;
@@ -63,6 +156,52 @@ class ServerBase {
     return 0;
   }
 
+  template <typename StrList, typename Out>
+  static void encode_cmd(const StrList& cmd, Out& out) {
+    /* Serializes cmd into the same format that parse_msg reads:
+     * msg_len | n_strs | len1 | str1 | ... */
+    uint32_t msg_len = 4;
+    for (const auto& s : cmd) {
+      msg_len += 4 + static_cast<uint32_t>(s.size());
+    }
+    uint32_t n_strs = static_cast<uint32_t>(cmd.size());
+    out.append(reinterpret_cast<const uint8_t*>(&msg_len), 4U);
+    out.append(reinterpret_cast<const uint8_t*>(&n_strs), 4U);
+
+    for (const auto& s : cmd) {
+      uint32_t str_len = static_cast<uint32_t>(s.size());
+      out.append(reinterpret_cast<const uint8_t*>(&str_len), 4U);
+      if (str_len > 0) {
+        out.append(reinterpret_cast<const uint8_t*>(s.data()), str_len);
+      }
+    }
+  }
+
+  template <typename Out>
+  static void encode_cmd(std::initializer_list<std::string_view> cmd,
+                         Out& out) {
+    encode_cmd<std::initializer_list<std::string_view>, Out>(cmd, out);
+  }
+
+  template <typename Out>
+  static void write_response(Out& write_buf, Status status,
+                             const uint8_t* data, uint32_t data_len) {
+    /* Response format is resp_len | status | data where resp_len counts the
+     * status and data bytes */
+    uint32_t resp_len = 4 + data_len;
+    write_buf.append(reinterpret_cast<const uint8_t*>(&resp_len), 4U);
+    write_buf.append(reinterpret_cast<const uint8_t*>(&status), 4U);
+    if (data_len > 0) write_buf.append(data, data_len);
+  }
+
+  template <typename Out>
+  static void write_response(Out& write_buf, Status status,
+                             const std::string& data) {
+    write_response(write_buf, status,
+                   reinterpret_cast<const uint8_t*>(data.data()),
+                   static_cast<uint32_t>(data.size()));
+  }
+
   void fd_set_nb(int fd) {
     /* Sets fd to non-blocking mode */
     fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
@@ -99,11 +238,51 @@ class ServerBase {
     return server_fd;
   }
 
+  int64_t setup_unix_socket(const std::string& path) {
+    /* Listens on a Unix domain socket, see unix_sockaddr for the path. Local
+     * clients skip the TCP stack but share the same Conn handling */
+    struct sockaddr_un addr;
+    socklen_t addrlen = unix_sockaddr(path, addr);
+    if (addrlen == 0) {
+      std::cerr << "Invalid unix socket path " << path << "\n";
+      return -1;
+    }
+
+    // a socket file left behind by an earlier run would fail the bind
+    if (path[0] != '@') unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (bind(fd, (const struct sockaddr*)&addr, addrlen) != 0) {
+      std::cerr << "Failed to bind to " << path << "\n";
+      close(fd);
+      return -1;
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+      std::cerr << "Failed to listen on " << path << "\n";
+      close(fd);
+      return -1;
+    }
+
+    fd_set_nb(fd);
+    return fd;
+  }
+
  public:
-  ServerBase(int port) : port_(port) {
+  ServerBase(int port, const std::vector<std::string>& unix_paths = {})
+      : port_(port) {
     server_fd_ = setup_socket();
     if (server_fd_ < 0) {
       throw std::runtime_error("Failed to open server socket\n");
     }
+    listen_fds_.push_back(static_cast<int>(server_fd_));
+
+    for (const std::string& path : unix_paths) {
+      int64_t fd = setup_unix_socket(path);
+      if (fd < 0) {
+        for (int listen_fd : listen_fds_) close(listen_fd);
+        throw std::runtime_error("Failed to open unix socket " + path + "\n");
+      }
+      listen_fds_.push_back(static_cast<int>(fd));
+    }
   }
 };
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* Runtime options shared by the server executables. Every field has a default
+ * so that tests and benchmarks can construct servers with just a port */
+
+// pending output a connection may hold before it is disconnected: at any time
+// hard bytes, or soft bytes for soft_seconds in a row. 0 disables a limit
+struct OutputLimit {
+  size_t hard = 0;
+  size_t soft = 0;
+  uint64_t soft_seconds = 0;
+};
+
+struct ServerConfig {
+  uint16_t port = 1234;
+
+  // extra listeners on Unix domain sockets, "@name" is in the abstract
+  // namespace
+  std::vector<std::string> unix_sockets;
+
+  // replication: when leader_host is non-empty the server runs as a read-only
+  // follower of leader_host:leader_port
+  std::string leader_host;
+  uint16_t leader_port = 0;
+  size_t repl_backlog_size = 1 << 20;
+
+  // cluster mode: "host:port" of every node, including this one
+  std::vector<std::string> cluster_nodes;
+
+  // per-command latency histograms, call counts are always kept
+  bool latency_tracking = true;
+
+  // commands slower than slowlog_slower_than_us are logged, negative disables
+  int64_t slowlog_slower_than_us = 10000;
+  size_t slowlog_max_len = 128;
+
+  // event loop iterations busier than this are reported as stalls, 0 disables
+  uint64_t loop_budget_us = 100000;
+
+  // empty connection buffers are shrunk back to their initial size once the
+  // connection has been idle for conn_idle_ms (0 disables), and buffers larger
+  // than conn_buf_keep to twice their recent peak use
+  uint64_t conn_idle_ms = 2000;
+  size_t conn_buf_keep = 16 * 1024;
+
+  // at most conn_cmd_budget commands of one connection run per event loop
+  // iteration (0 is unlimited), the rest of a pipeline waits for the next
+  // one. Reading pauses while pending output is at least write_high_watermark
+  // (0 disables). A watermark below a hard output limit means a pipelining
+  // client is paused before it can reach that limit
+  size_t conn_cmd_budget = 256;
+  size_t write_high_watermark = 256 * 1024;
+
+  // low-latency mode: the event loop spins for up to busy_poll_us before
+  // blocking in poll (0 disables), see BusyPoll.h. Accepted sockets get
+  // SO_BUSY_POLL of socket_busy_poll_us where the kernel allows it, and the
+  // loop thread is pinned to cpu unless it is negative
+  uint64_t busy_poll_us = 0;
+  uint32_t socket_busy_poll_us = 0;
+  int cpu = -1;
+
+  // keys whose readers are remembered for client-side caching, see
+  // Tracking.h
+  size_t tracking_table_max_keys = 1000000;
+
+  // one in hotkeys_sample keyed commands is counted for the hotkeys report
+  // (0 disables), hotkeys_top keys are kept by it and by bigkeys, see
+  // HotKeys.h
+  uint32_t hotkeys_sample = 10;
+  size_t hotkeys_top = 16;
+
+  // deleted or overwritten values of at least lazyfree_threshold bytes are
+  // freed on a background thread (0 frees everything inline), see
+  // LazyFree.h
+  size_t lazyfree_threshold = 256 * 1024;
+
+  // string values of at least compress_threshold bytes are stored
+  // compressed when that pays off (0 disables), see Compression.h
+  size_t compress_threshold = 0;
+
+  // an ordered index of the keys for keys, scan and range, see KeyIndex.h.
+  // It costs about the keys' bytes again and a few hundred ns per new key
+  bool key_index = false;
+
+  // replicas may fall behind by a full resync, see handle_psync. Clients
+  // with pub/sub subscriptions use pubsub_output_limit
+  OutputLimit client_output_limit;
+  OutputLimit replica_output_limit{256 << 20, 64 << 20, 60};
+  OutputLimit pubsub_output_limit{32 << 20, 8 << 20, 60};
+};
+
+inline void print_usage(const char* prog) {
+  std::cerr << "Usage: " << prog << " [options]\n"
+            << "  --port <port>               port to listen on\n"
+            << "  --unix-socket <path>        also listen on a unix socket,\n"
+            << "                              @name is abstract, repeatable\n"
+            << "  --replicaof <host> <port>   run as a follower of a leader\n"
+            << "  --repl-backlog-size <bytes> size of the replication backlog\n"
+            << "  --cluster <host:port,...>   cluster mode with these nodes\n"
+            << "  --no-latency-tracking       only count commands in info\n"
+            << "  --slowlog-slower-than <us>  slowlog threshold, -1 disables\n"
+            << "  --slowlog-max-len <n>       slowlog entries kept\n"
+            << "  --loop-budget <us>          stall budget, 0 disables\n"
+            << "  --conn-idle-ms <ms>         shrink buffers of idle clients\n"
+            << "  --conn-buf-keep <bytes>     buffer size kept while active\n"
+            << "  --conn-cmd-budget <n>       commands per client per turn,\n"
+            << "                              0 is unlimited\n"
+            << "  --write-high-watermark <bytes>\n"
+            << "                              output that pauses reads,\n"
+            << "                              0 disables\n"
+            << "  --busy-poll <us>            spin before blocking, 0 disables\n"
+            << "  --socket-busy-poll <us>     SO_BUSY_POLL of client sockets\n"
+            << "  --cpu <n>                   pin the event loop to a cpu\n"
+            << "  --tracking-table-max-keys <n>\n"
+            << "                              keys tracked for client caches\n"
+            << "  --hotkeys-sample <n>        sample 1 in n keyed commands,\n"
+            << "                              0 disables\n"
+            << "  --hotkeys-top <n>           hot and big keys reported\n"
+            << "  --lazyfree-threshold <bytes>\n"
+            << "                              values freed in the background,\n"
+            << "                              0 frees inline\n"
+            << "  --compress-threshold <bytes>\n"
+            << "                              values stored compressed,\n"
+            << "                              0 disables\n"
+            << "  --key-index                 keep keys ordered for scans\n"
+            << "  --client-output-limit <hard> <soft> <seconds>\n"
+            << "  --replica-output-limit <hard> <soft> <seconds>\n"
+            << "  --pubsub-output-limit <hard> <soft> <seconds>\n"
+            << "                              output limits in bytes, 0 off\n";
+}
+
+inline void parse_output_limit(char** args, OutputLimit& limit) {
+  limit.hard = std::strtoull(args[0], nullptr, 10);
+  limit.soft = std::strtoull(args[1], nullptr, 10);
+  limit.soft_seconds = std::strtoull(args[2], nullptr, 10);
+}
+
+inline bool parse_server_args(int argc, char** argv, ServerConfig& config) {
+  /* Parses command line options into config, returns false on bad input */
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_val = i + 1 < argc;
+
+    if (arg == "--port" && has_val) {
+      config.port = static_cast<uint16_t>(std::atoi(argv[++i]));
+    } else if (arg == "--unix-socket" && has_val) {
+      config.unix_sockets.push_back(argv[++i]);
+    } else if (arg == "--replicaof" && i + 2 < argc) {
+      config.leader_host = argv[++i];
+      config.leader_port = static_cast<uint16_t>(std::atoi(argv[++i]));
+    } else if (arg == "--repl-backlog-size" && has_val) {
+      config.repl_backlog_size = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--cluster" && has_val) {
+      std::istringstream nodes(argv[++i]);
+      std::string node;
+      while (std::getline(nodes, node, ',')) {
+        if (!node.empty()) config.cluster_nodes.push_back(node);
+      }
+    } else if (arg == "--no-latency-tracking") {
+      config.latency_tracking = false;
+    } else if (arg == "--slowlog-slower-than" && has_val) {
+      config.slowlog_slower_than_us = std::strtoll(argv[++i], nullptr, 10);
+    } else if (arg == "--slowlog-max-len" && has_val) {
+      config.slowlog_max_len = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--loop-budget" && has_val) {
+      config.loop_budget_us = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--conn-idle-ms" && has_val) {
+      config.conn_idle_ms = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--conn-buf-keep" && has_val) {
+      config.conn_buf_keep = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--conn-cmd-budget" && has_val) {
+      config.conn_cmd_budget = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--write-high-watermark" && has_val) {
+      config.write_high_watermark = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--busy-poll" && has_val) {
+      config.busy_poll_us = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--socket-busy-poll" && has_val) {
+      config.socket_busy_poll_us =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--cpu" && has_val) {
+      config.cpu = std::atoi(argv[++i]);
+    } else if (arg == "--tracking-table-max-keys" && has_val) {
+      config.tracking_table_max_keys = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--hotkeys-sample" && has_val) {
+      config.hotkeys_sample =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--hotkeys-top" && has_val) {
+      config.hotkeys_top = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--lazyfree-threshold" && has_val) {
+      config.lazyfree_threshold = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--compress-threshold" && has_val) {
+      config.compress_threshold = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--key-index") {
+      config.key_index = true;
+    } else if (arg == "--client-output-limit" && i + 3 < argc) {
+      parse_output_limit(argv + i + 1, config.client_output_limit);
+      i += 3;
+    } else if (arg == "--replica-output-limit" && i + 3 < argc) {
+      parse_output_limit(argv + i + 1, config.replica_output_limit);
+      i += 3;
+    } else if (arg == "--pubsub-output-limit" && i + 3 < argc) {
+      parse_output_limit(argv + i + 1, config.pubsub_output_limit);
+      i += 3;
+    } else {
+      print_usage(argv[0]);
+      return false;
+    }
+  }
+  return true;
+}
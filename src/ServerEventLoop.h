@@ -1,49 +1,1984 @@
 #pragma once
 
 #include <arpa/inet.h>
+#include <fnmatch.h>
 #include <poll.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <sstream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
+#include "BlockedClients.h"
 #include "Buffer.h"
+#include "BusyPoll.h"
+#include "Cluster.h"
+#include "HotKeys.h"
+#include "KeyIndex.h"
+#include "Keyspace.h"
+#include "LazyFree.h"
+#include "LoopMonitor.h"
+#include "PubSub.h"
+#include "ReplicationBacklog.h"
 #include "ServerBase.h"
+#include "ServerConfig.h"
+#include "SlowLog.h"
+#include "Stats.h"
+#include "Tracking.h"
+#include "Value.h"
 
 class ServerEventLoop final : private ServerBase {
  private:
-  std::unordered_map<std::string, std::string> server_data_;
+  using Clock = std::chrono::steady_clock;
+  static constexpr auto LEADER_RETRY_INTERVAL = std::chrono::seconds(1);
+  static constexpr uint64_t RECLAIM_INTERVAL_NS = 100000000ULL;
+  static constexpr int MIGRATE_TIMEOUT_MS = 1000;  // per socket operation
+  static constexpr double MAX_BLOCK_TIMEOUT_S = 1e8;  // blpop, in ns it fits
 
-  void respond_to_client(std::vector<std::string>& client_cmd,
-                         Buffer& write_buf) {
+  Keyspace server_data_;
+  ServerConfig config_;
+  std::vector<Conn*> conn_list_;  // key = fd, val = connection info
+  uint64_t next_conn_id_ = 1;
+
+  // connection memory, see reclaim_buffers
+  uint64_t loop_now_ns_ = monotonic_ns();  // when the last poll returned
+  uint64_t next_reclaim_ns_ = 0;
+  bool reclaim_pending_ = false;  // some connection holds grown buffers
+
+  // connections with requests left over by their command budget, see
+  // process_input
+  std::vector<Conn*> pending_input_;
+
+  // leader side of replication, every write is appended to backlog_ and
+  // streamed to all attached replicas_
+  std::string replid_;
+  ReplicationBacklog backlog_;
+  std::vector<Conn*> replicas_;
+  Buffer repl_scratch_{256};
+
+  // follower side of replication
+  Conn* leader_conn_ = nullptr;
+  bool awaiting_sync_reply_ = false;
+  std::string leader_replid_ = "?";
+  uint64_t leader_offset_ = 0;
+  uint64_t snapshot_remaining_ = 0;  // bytes of a full resync left to apply
+  Clock::time_point next_leader_retry_{};
+
+  // cluster mode, keys of a migrating slot that still have to be moved are
+  // collected by a single keyspace scan on the first batch of that slot
+  ClusterState cluster_;
+  std::unordered_map<uint16_t, std::vector<std::string>> migrating_keys_;
+
+  PubSub pubsub_;
+  BlockedClients blocked_;
+
+  // all commands run on the loop thread so a single shard is enough
+  ServerStats stats_;
+  StatsShard* stats_shard_;
+
+  // a command or loop iteration this slow delays every client
+  SlowLog slowlog_;
+  LoopMonitor loop_monitor_;
+  uint64_t loop_bytes_ = 0;  // bytes moved in the current iteration
+  BusyPollWindow busy_poll_;
+
+  // readers of keys cached by clients, see Tracking.h
+  TrackingTable tracking_;
+
+  // versions of keys watched by transactions, see Transaction.h
+  WatchTable watches_;
+
+  // sampled access counts and the largest values, see HotKeys.h
+  HotKeys hot_keys_;
+  BigKeys big_keys_;
+
+  // keys in order for keys, scan and range, with --key-index
+  KeyIndex key_index_;
+
+  // frees large values and flushed keyspaces off the loop thread
+  LazyFreer lazy_free_;
+
+  inline bool is_follower() const noexcept {
+    return !config_.leader_host.empty();
+  }
+
+  static std::string generate_replid() {
+    std::mt19937_64 rng(std::random_device{}());
+    static constexpr char hex[] = "0123456789abcdef";
+    std::string id(40, '0');
+    for (char& c : id) c = hex[rng() & 15U];
+    return id;
+  }
+
+  bool apply_write(const std::vector<std::string>& client_cmd,
+                   Value* large_val = nullptr) {
+    /* Applies a mutating command, returns true if the keyspace changed.
+     * large_val replaces client_cmd[2] for a set received in segments */
+    if (client_cmd[0] == "flushall") {
+      flush_keyspace(client_cmd.size() == 2 && client_cmd[1] == "async");
+      return true;
+    }
+    if (is_hash_write(client_cmd[0])) {
+      Response ignored;  // the leader already replied
+      return hash_write(client_cmd, ignored);
+    }
+    if (is_list_write(client_cmd[0])) {
+      Response ignored;
+      return list_write(client_cmd, ignored);
+    }
+    if (is_sketch_write(client_cmd[0])) {
+      Response ignored;
+      return sketch_write(client_cmd, ignored);
+    }
+    if (client_cmd[0] == "restore" && is_typed_restore(client_cmd)) {
+      Response ignored;
+      return restore_typed(client_cmd, ignored);
+    }
+    const std::string& key = client_cmd[1];
+    if (client_cmd[0] == "set") {
+      store_value(key, large_val ? std::move(*large_val)
+                                 : pack_value(client_cmd[2]));
+      return true;
+    }
+    // del and unlink
+    return erase_value(key);
+  }
+
+  Value pack_value(const std::string& str) const {
+    /* A string value, compressed if it is at least compress_threshold bytes
+     * and that saves an eighth of it, see Compression.h */
+    if (config_.compress_threshold == 0 ||
+        str.size() < config_.compress_threshold) {
+      return Value(str);
+    }
+    std::string block = lz_compress(str);
+    if (block.empty() || block.size() > str.size() - str.size() / 8) {
+      return Value(str);
+    }
+    return Value::compressed(std::move(block), str.size());
+  }
+
+  void store_value(const std::string& key, Value&& val) {
+    /* Sets key and keeps the big key list up to date */
+    size_t new_size = val.size();
+    if (val.compressed()) {
+      stats_.compression_changed(1, val.size() - val.stored_size());
+    }
+    Keyspace::Removed old = server_data_.put(key, std::move(val));
+    if (old.boxed) free_value(std::move(*old.boxed));
+    big_keys_.update(key, old.size, new_size);
+    if (config_.key_index && !old.found) {
+      key_index_.insert(key);
+      stats_.key_index_changed(key_index_.bytes());
+    }
+    key_changed(key);
+  }
+
+  bool erase_value(const std::string& key) {
+    /* Deletes key, false if it does not exist */
+    Keyspace::Removed old = server_data_.erase(key);
+    if (!old.found) return false;
+    big_keys_.remove(key, old.size);
+    if (old.boxed) free_value(std::move(*old.boxed));
+    if (config_.key_index) {
+      key_index_.erase(key);
+      stats_.key_index_changed(key_index_.bytes());
+    }
+    key_changed(key);
+    return true;
+  }
+
+  void free_value(Value&& val) {
+    /* Drops a value that was deleted or overwritten, a large one on the
+     * free thread, see LazyFree.h */
+    if (val.compressed()) {
+      stats_.compression_changed(
+          -1, -static_cast<int64_t>(val.size() - val.stored_size()));
+    }
+    if (config_.lazyfree_threshold > 0 &&
+        val.size() >= config_.lazyfree_threshold) {
+      lazy_free_.defer(std::move(val));
+    } else {
+      Value dropped(std::move(val));
+    }
+  }
+
+  void flush_keyspace(bool async) {
+    /* Deletes every key. async hands the old keyspace to the free thread,
+     * the loop then only pays for allocating an empty table */
+    if (async && !server_data_.empty()) {
+      lazy_free_.defer(std::move(server_data_));
+    }
+    server_data_.clear();
+    big_keys_.clear();
+    key_index_.clear();
+    if (config_.key_index) stats_.key_index_changed(0);
+    stats_.compression_reset();
+    keyspace_replaced();
+  }
+
+  void send_invalidation(const TrackingTable::Reader& reader,
+                         const std::string* key) {
+    /* Pushes "invalidate <key>" to a tracking reader that is still around,
+     * a null key means every key */
+    if (static_cast<size_t>(reader.fd) >= conn_list_.size()) return;
+    Conn* conn = conn_list_[reader.fd];
+    if (!conn || conn->id != reader.id || !conn->tracking || conn->want_close) {
+      return;
+    }
+
+    static constexpr std::string_view INVALIDATE = "invalidate";
+    uint32_t key_len = key ? static_cast<uint32_t>(key->size()) : 0;
+    uint32_t hdr[5] = {4 + 4 + 4 + static_cast<uint32_t>(INVALIDATE.size()),
+                       static_cast<uint32_t>(Status::Message), key ? 2U : 1U,
+                       static_cast<uint32_t>(INVALIDATE.size()), key_len};
+    if (key) hdr[0] += 4 + key_len;
+    queue_output(conn, reinterpret_cast<const uint8_t*>(hdr), 16);
+    queue_output(conn, reinterpret_cast<const uint8_t*>(INVALIDATE.data()),
+                 INVALIDATE.size());
+    if (key) {
+      queue_output(conn, reinterpret_cast<const uint8_t*>(&hdr[4]), 4);
+      queue_output(conn, reinterpret_cast<const uint8_t*>(key->data()),
+                   key_len);
+    }
+    conn->want_write = true;
+    enforce_output_limit(conn);
+  }
+
+  void key_changed(const std::string& key) {
+    /* Invalidates key in the client-side caches that may hold it and in
+     * the transactions watching it */
+    watches_.touch(key);
+    if (tracking_.empty()) return;
+    uint64_t sent = 0;
+    tracking_.invalidate(key, [&](const auto& reader, const std::string* k) {
+      send_invalidation(reader, k);
+      ++sent;
+    });
+    stats_.tracking_changed(tracking_.size(), sent);
+  }
+
+  void keyspace_replaced() {
+    /* Every key may have changed, e.g. after a full resync */
+    watches_.touch_all();
+    if (tracking_.empty()) return;
+    uint64_t sent = 0;
+    tracking_.invalidate_all([&](const auto& reader, const std::string* k) {
+      send_invalidation(reader, k);
+      ++sent;
+    });
+    stats_.tracking_changed(tracking_.size(), sent);
+  }
+
+  void track_read(Conn* conn, const std::string& key) {
+    uint64_t sent = 0;
+    tracking_.track(key, conn, [&](const auto& reader, const std::string* k) {
+      send_invalidation(reader, k);
+      ++sent;
+    });
+    stats_.tracking_changed(tracking_.size(), sent);
+  }
+
+  void tracking_command(Conn* conn, const std::vector<std::string>& client_cmd,
+                        Response& resp) {
+    /* client tracking on [bcast] [prefix <prefix>]...
+     * client tracking off */
+    const std::string& mode = client_cmd[2];
+    bool bcast = false;
+    std::vector<std::string> prefixes;
+    for (size_t i = 3; i < client_cmd.size(); ++i) {
+      if (client_cmd[i] == "bcast") {
+        bcast = true;
+      } else if (client_cmd[i] == "prefix" && i + 1 < client_cmd.size()) {
+        prefixes.push_back(client_cmd[++i]);
+      } else {
+        resp.status = Status::Invalid;
+        return;
+      }
+    }
+    if ((mode != "on" && mode != "off") || (mode == "off" && bcast) ||
+        (!prefixes.empty() && !bcast)) {
+      resp.status = Status::Error;
+      resp.append("ERR usage: client tracking on [bcast] [prefix <p>]... | "
+                  "off");
+      return;
+    }
+
+    if (conn->tracking_bcast) tracking_.remove_prefixes(conn);
+    conn->tracking = mode == "on";
+    conn->tracking_bcast = bcast;
+    if (bcast && prefixes.empty()) prefixes.emplace_back();  // every key
+    for (const std::string& prefix : prefixes) {
+      tracking_.add_prefix(conn, prefix);
+    }
+  }
+
+  static void queue_output(Conn* conn, const uint8_t* data, size_t len) {
+    /* Appends to conn's output, see Conn::write_chain for the order */
+    if (len == 0) return;
+    if (conn->write_chain.empty()) {
+      conn->write_buf.append(data, static_cast<uint32_t>(len));
+    } else {
+      conn->write_chain.append(data, len);
+    }
+  }
+
+  template <typename Out>
+  static void encode_set_header(std::string_view key, size_t val_size,
+                                Out& out) {
+    /* Everything of "set key <value>" up to the value, see encode_cmd */
+    uint32_t key_len = static_cast<uint32_t>(key.size());
+    uint32_t val_len = static_cast<uint32_t>(val_size);
+    uint32_t hdr[3] = {4 + (4 + 3) + (4 + key_len) + (4 + val_len), 3, 3};
+    out.append(reinterpret_cast<const uint8_t*>(hdr), 12U);
+    out.append(reinterpret_cast<const uint8_t*>("set"), 3U);
+    out.append(reinterpret_cast<const uint8_t*>(&key_len), 4U);
+    out.append(reinterpret_cast<const uint8_t*>(key.data()), key_len);
+    out.append(reinterpret_cast<const uint8_t*>(&val_len), 4U);
+  }
+
+  void propagate(const std::vector<std::string>& client_cmd,
+                 const Value* large_val = nullptr) {
+    /* Appends a write to the replication stream and queues it on every
+     * replica. The command is serialized once and copied per replica, a
+     * large value is appended after it and shared with the replicas */
+    if (large_val == nullptr) {
+      encode_cmd(client_cmd, repl_scratch_);
+    } else {
+      encode_set_header(client_cmd[1], large_val->size(), repl_scratch_);
+    }
+
+    backlog_.append(repl_scratch_.data(), repl_scratch_.size());
+    if (large_val) {
+      large_val->chain().for_each_segment(
+          [this](const uint8_t* data, size_t len) {
+            backlog_.append(data, len);
+          });
+    }
+    for (Conn* replica : replicas_) {
+      if (replica->want_close) continue;
+      queue_output(replica, repl_scratch_.data(), repl_scratch_.size());
+      if (large_val) replica->write_chain.append_shared(large_val->chain());
+      replica->want_write = true;
+      enforce_output_limit(replica);
+    }
+    repl_scratch_.clear();
+  }
+
+  static bool is_keyed_cmd(const std::string& name) {
+    static const std::unordered_set<std::string> keyed = {
+        "get",    "set",     "del",     "unlink",    "restore",    "hset",
+        "hget",   "hmget",   "hdel",    "hgetall",   "hincrby",    "lpush",
+        "rpush",  "lpop",    "rpop",    "lrange",    "llen",       "blpop",
+        "bf.add", "bf.madd", "pfadd",   "bf.exists", "bf.reserve", "pfcount",
+        "pfmerge", "cas"};
+    return keyed.count(name) > 0;
+  }
+
+  static bool parse_slot(const std::string& str, uint16_t& slot) {
+    char* end = nullptr;
+    unsigned long val = std::strtoul(str.c_str(), &end, 10);
+    if (str.empty() || *end != '\0' || val >= CLUSTER_SLOTS) return false;
+    slot = static_cast<uint16_t>(val);
+    return true;
+  }
+
+  bool route_key(Conn* conn, const std::vector<std::string>& client_cmd,
+                 Response& resp) {
+    /* Returns false and fills resp with a MOVED or ASK redirect when the key
+     * of client_cmd is not served by this node */
+    if (!cluster_.enabled() || client_cmd.size() < 2 ||
+        !is_keyed_cmd(client_cmd[0])) {
+      return true;
+    }
+
+    const std::string& key = client_cmd[1];
+    uint16_t slot = key_hash_slot(key);
+    int redirect_to = cluster_.owner(slot);
+    Status redirect = Status::Moved;
+
+    if (redirect_to == cluster_.self()) {
+      // keys of a migrating slot that already left are served by the target
+      int target = cluster_.migrating_to(slot);
+      if (target < 0 || server_data_.contains(key)) return true;
+      redirect_to = target;
+      redirect = Status::Ask;
+    } else if (cluster_.importing_from(slot) >= 0 &&
+               (conn->asking || client_cmd[0] == "restore")) {
+      return true;
+    }
+
+    resp.status = redirect;
+    resp.append(std::to_string(slot) + " " + cluster_.node(redirect_to).addr());
+    return false;
+  }
+
+  void migrate_slot_batch(const std::string& target_addr, uint16_t slot,
+                          size_t count, Response& resp) {
+    /* Moves up to count keys of slot to the target node. The loop is blocked
+     * for one round trip to the target, which is why keys move in small
+     * batches, and a target that does not answer within MIGRATE_TIMEOUT_MS
+     * fails the batch. Replies with the number of keys moved, 0 once none
+     * are left */
+    if (cluster_.migrating_to(slot) < 0) {
+      resp.status = Status::Error;
+      resp.append("ERR slot is not migrating");
+      return;
+    }
+
+    ClusterNode target = ClusterNode::parse(target_addr);
+    bool loopback = target.host == "127.0.0.1" || target.host == "localhost";
+    if (target.addr() == cluster_.node(cluster_.self()).addr() ||
+        (loopback && target.port == port_)) {
+      // we would wait on ourselves for the whole timeout
+      resp.status = Status::Error;
+      resp.append("ERR cannot migrate a slot to this node");
+      return;
+    }
+
+    auto [it, inserted] = migrating_keys_.try_emplace(slot);
+    std::vector<std::string>& pending = it->second;
+    if (inserted) {
+      server_data_.for_each([&](std::string_view key, const ValueView&) {
+        if (key_hash_slot(key) == slot) pending.emplace_back(key);
+      });
+    }
+
+    Buffer batch{256};
+    std::vector<std::string> moved;
+    while (!pending.empty() && moved.size() < count) {
+      std::string key = std::move(pending.back());
+      pending.pop_back();
+      ValueView val;
+      if (!server_data_.find(key, val)) continue;  // deleted since the scan
+      if (val.boxed() && val.value().type() != ValueType::String) {
+        encode_cmd({"restore", key, encode_typed(val.value()),
+                    type_name(val.value().type())},
+                   batch);
+      } else {
+        encode_cmd({"restore", key, val.to_string()}, batch);
+      }
+      moved.push_back(std::move(key));
+    }
+
+    if (moved.empty()) {
+      migrating_keys_.erase(it);
+      resp.append("0");
+      return;
+    }
+
+    int fd = connect_tcp(target.host, target.port, MIGRATE_TIMEOUT_MS);
+    bool ok = fd >= 0 && send_all(fd, batch.data(), batch.size());
+    for (size_t i = 0; ok && i < moved.size(); ++i) {
+      uint32_t hdr[2] = {};  // resp_len, status
+      ok = recv_all(fd, hdr, sizeof(hdr)) && hdr[0] == 4 &&
+           hdr[1] == static_cast<uint32_t>(Status::Valid);
+    }
+    if (fd >= 0) close(fd);
+
+    if (!ok) {
+      pending.insert(pending.end(), moved.begin(), moved.end());
+      resp.status = Status::Error;
+      resp.append("ERR failed to migrate keys to " + target_addr);
+      return;
+    }
+
+    for (const auto& key : moved) {
+      if (erase_value(key)) propagate({"del", key});
+    }
+    resp.append(std::to_string(moved.size()));
+  }
+
+  void cluster_command(const std::vector<std::string>& client_cmd,
+                       Response& resp) {
+    /* cluster slots
+     * cluster keyslot <key>
+     * cluster setslot <slot> migrating|importing|node <host:port>
+     * cluster setslot <slot> stable
+     * cluster migrate <host:port> <slot> <count> */
+    const size_t n_args = client_cmd.size();
+    const std::string sub = n_args > 1 ? client_cmd[1] : "";
+    uint16_t slot = 0;
+
+    try {
+      if (!cluster_.enabled()) {
+        resp.status = Status::Error;
+        resp.append("ERR cluster mode is disabled");
+      } else if (sub == "slots" && n_args == 2) {
+        resp.append(cluster_.slots_info());
+      } else if (sub == "keyslot" && n_args == 3) {
+        resp.append(std::to_string(key_hash_slot(client_cmd[2])));
+      } else if (sub == "setslot" && n_args == 4 &&
+                 parse_slot(client_cmd[2], slot) && client_cmd[3] == "stable") {
+        cluster_.set_stable(slot);
+        migrating_keys_.erase(slot);
+      } else if (sub == "setslot" && n_args == 5 &&
+                 parse_slot(client_cmd[2], slot)) {
+        int node = cluster_.find_or_add_node(client_cmd[4]);
+        if (client_cmd[3] == "migrating") {
+          cluster_.set_migrating(slot, node);
+        } else if (client_cmd[3] == "importing") {
+          cluster_.set_importing(slot, node);
+        } else if (client_cmd[3] == "node") {
+          cluster_.set_owner(slot, node);
+          migrating_keys_.erase(slot);
+        } else {
+          resp.status = Status::Invalid;
+        }
+      } else if (sub == "migrate" && n_args == 5 &&
+                 parse_slot(client_cmd[3], slot)) {
+        size_t count = std::strtoull(client_cmd[4].c_str(), nullptr, 10);
+        migrate_slot_batch(client_cmd[2], slot, std::max<size_t>(count, 1),
+                           resp);
+      } else {
+        resp.status = Status::Invalid;
+      }
+    } catch (const std::exception& e) {
+      // malformed node addresses
+      resp.status = Status::Error;
+      resp.append(std::string("ERR ") + e.what());
+    }
+  }
+
+  static bool is_subscribe_cmd(const std::string& name) {
+    return name == "subscribe" || name == "unsubscribe" ||
+           name == "psubscribe" || name == "punsubscribe";
+  }
+
+  void subscribe_command(Conn* conn, const std::vector<std::string>& client_cmd,
+                         Response& resp) {
+    /* subscribe|psubscribe <name>...
+     * unsubscribe|punsubscribe [name...], without names from all of them.
+     * Replies with the connection's number of subscriptions */
+    const std::string& cmd = client_cmd[0];
+    bool pattern = cmd[0] == 'p';
+    size_t n = conn->channels.size() + conn->patterns.size();
+    if (cmd.ends_with("unsubscribe")) {
+      std::vector<std::string> names(client_cmd.begin() + 1, client_cmd.end());
+      if (names.empty()) names = pattern ? conn->patterns : conn->channels;
+      for (const std::string& name : names) {
+        n = pattern ? pubsub_.punsubscribe(conn, name)
+                    : pubsub_.unsubscribe(conn, name);
+      }
+    } else if (client_cmd.size() < 2) {
+      resp.status = Status::Invalid;
+      return;
+    } else {
+      for (size_t i = 1; i < client_cmd.size(); ++i) {
+        n = pattern ? pubsub_.psubscribe(conn, client_cmd[i])
+                    : pubsub_.subscribe(conn, client_cmd[i]);
+      }
+    }
+    resp.append(std::to_string(n));
+  }
+
+  size_t publish(const std::string& channel, const Value& payload) {
+    /* Queues the message on every receiver, returns how many there were.
+     * Receivers share its segments, see PubSub */
+    return pubsub_.publish(
+        channel, payload, [this](Conn* sub, const BufferChain& msg) {
+          if (sub->want_close) return;
+          sub->write_chain.append_shared(msg);
+          sub->want_write = true;
+          enforce_output_limit(sub);
+        });
+  }
+
+  std::string role_info() const {
+    if (is_follower()) {
+      return "follower " + config_.leader_host + " " +
+             std::to_string(config_.leader_port) + " " +
+             (leader_conn_ && !awaiting_sync_reply_ ? "up " : "down ") +
+             std::to_string(leader_offset_);
+    }
+    return "leader " + replid_ + " " + std::to_string(backlog_.end_offset()) +
+           " " + std::to_string(replicas_.size());
+  }
+
+  void slowlog_command(const std::vector<std::string>& client_cmd,
+                       Response& resp) {
+    /* slowlog get [count] | len | reset */
+    const std::string& sub = client_cmd[1];
+    if (sub == "get" && client_cmd.size() <= 3) {
+      size_t count = client_cmd.size() == 3
+                         ? std::strtoull(client_cmd[2].c_str(), nullptr, 10)
+                         : 10;
+      resp.append(slowlog_.get(count));
+    } else if (sub == "len" && client_cmd.size() == 2) {
+      resp.append(std::to_string(slowlog_.size()));
+    } else if (sub == "reset" && client_cmd.size() == 2) {
+      slowlog_.reset();
+    } else {
+      resp.status = Status::Error;
+      resp.append("ERR unknown slowlog subcommand");
+    }
+  }
+
+  void keystats_command(const std::vector<std::string>& client_cmd,
+                        Response& resp) {
+    /* hotkeys [count] | reset
+     * bigkeys [count] */
+    bool hot = client_cmd[0] == "hotkeys";
+    if (hot && client_cmd.size() == 2 && client_cmd[1] == "reset") {
+      hot_keys_.reset();
+    } else if (hot && !hot_keys_.enabled()) {
+      resp.status = Status::Error;
+      resp.append("ERR hotkeys sampling is disabled");
+    } else if (client_cmd.size() <= 2) {
+      size_t count = client_cmd.size() == 2
+                         ? std::strtoull(client_cmd[1].c_str(), nullptr, 10)
+                         : 10;
+      resp.append(hot ? hot_keys_.report(count) : big_keys_.report(count));
+    } else {
+      resp.status = Status::Invalid;
+    }
+  }
+
+  static const char* type_name(ValueType type) {
+    switch (type) {
+      case ValueType::Hash:
+        return "hash";
+      case ValueType::List:
+        return "list";
+      case ValueType::Bloom:
+        return "bloom";
+      case ValueType::HyperLogLog:
+        return "hll";
+      default:
+        return "string";
+    }
+  }
+
+  static std::string encode_typed(const Value& val) {
+    /* The data of a restore for a value that is not a string */
+    switch (val.type()) {
+      case ValueType::Hash:
+        return val.hash().encode();
+      case ValueType::List:
+        return val.list().encode();
+      case ValueType::Bloom:
+        return val.bloom().encode();
+      default:
+        return val.hll().encode();
+    }
+  }
+
+  static bool is_typed_restore(const std::vector<std::string>& client_cmd) {
+    return client_cmd.size() == 4 &&
+           (client_cmd[3] == "hash" || client_cmd[3] == "list" ||
+            client_cmd[3] == "bloom" || client_cmd[3] == "hll");
+  }
+
+  static std::vector<std::string_view> rebuild_cmd(std::string_view key,
+                                                   const Value& val,
+                                                   std::string& scratch) {
+    /* The hset or rpush that recreates a hash or list value, it holds views
+     * of val. Sketches have no such command and are sent as a restore of
+     * their encoding, kept in scratch */
+    std::vector<std::string_view> cmd;
+    if (val.type() == ValueType::Hash) {
+      cmd = {"hset", key};
+      val.hash().for_each([&](std::string_view field, std::string_view value) {
+        cmd.push_back(field);
+        cmd.push_back(value);
+      });
+    } else if (val.type() == ValueType::List) {
+      cmd = {"rpush", key};
+      val.list().for_each([&](std::string_view elem) { cmd.push_back(elem); });
+    } else {
+      scratch = encode_typed(val);
+      cmd = {"restore", key, scratch, type_name(val.type())};
+    }
+    return cmd;
+  }
+
+  bool restore_typed(const std::vector<std::string>& client_cmd,
+                     Response& resp) {
+    /* restore <key> <data> hash|list|bloom|hll, data as encode_typed wrote
+     * it. Returns false if data is malformed */
+    const std::string& type = client_cmd[3];
+    const std::string& data = client_cmd[2];
+    Value val;
+    bool ok = false;
+    if (type == "hash") {
+      val = Value::empty_hash();
+      ok = Hash::decode(data, val.hash()) && val.hash().size() > 0;
+    } else if (type == "list") {
+      val = Value::empty_list();
+      ok = List::decode(data, val.list()) && !val.list().empty();
+    } else if (type == "bloom") {
+      val = Value::empty_bloom(Bloom::DEFAULT_ERROR_RATE, 1);
+      ok = Bloom::decode(data, val.bloom());
+    } else {
+      val = Value::empty_hll();
+      ok = HyperLogLog::decode(data, val.hll());
+    }
+    if (!ok) {
+      resp.status = Status::Error;
+      resp.append("ERR malformed value");
+      return false;
+    }
+    store_value(client_cmd[1], std::move(val));
+    return true;
+  }
+
+  static bool is_transaction_cmd(const std::string& name) {
+    return name == "multi" || name == "exec" || name == "discard" ||
+           name == "watch" || name == "unwatch";
+  }
+
+  void queue_command(Conn* conn, const std::vector<std::string>& client_cmd) {
+    /* Queues a command sent after multi and replies QUEUED. One that cannot
+     * run inside a transaction, or is not served by this node, is refused
+     * and fails the transaction */
+    Response resp;
+    const std::string& name = client_cmd[0];
+    if (stats_.command_id(name) == ServerStats::OTHER || name == "psync" ||
+        name == "blpop" || is_subscribe_cmd(name)) {
+      resp.status = Status::Error;
+      resp.append("ERR " + name + " is not allowed in a transaction");
+      conn->tx.failed = true;
+    } else if (route_key(conn, client_cmd, resp)) {
+      conn->tx.queued.push_back(client_cmd);  // the slowlog still needs it
+      resp.append("QUEUED");
+    } else {
+      conn->tx.failed = true;
+    }
+    queue_response(conn, resp);
+  }
+
+  void transaction_command(Conn* conn,
+                           const std::vector<std::string>& client_cmd,
+                           Response& resp) {
+    /* multi | discard | watch <key> [<key> ...] | unwatch
+     * watch is refused inside a transaction, discard drops the queued
+     * commands and the watched keys */
+    Transaction& tx = conn->tx;
+    const std::string& name = client_cmd[0];
+    if (name == "multi" && tx.active) {
+      resp.status = Status::Error;
+      resp.append("ERR multi calls can not be nested");
+    } else if (name == "multi") {
+      tx.active = true;
+    } else if (name == "discard" && !tx.active) {
+      resp.status = Status::Error;
+      resp.append("ERR discard without multi");
+    } else if (name == "watch" && tx.active) {
+      resp.status = Status::Error;
+      resp.append("ERR watch inside multi is not allowed");
+    } else if (name == "watch") {
+      for (size_t i = 1; i < client_cmd.size(); ++i) {
+        watches_.watch(client_cmd[i], tx.watched);
+      }
+    } else if (name == "unwatch") {
+      watches_.unwatch_all(tx.watched);
+    } else {
+      watches_.unwatch_all(tx.watched);
+      tx = Transaction();
+    }
+  }
+
+  void exec_command(Conn* conn, Response& resp) {
+    /* Runs the queued commands back to back and replies with a list of
+     * their replies, see decode_replies. Nothing runs if a command was
+     * refused while queued, or if a watched key changed, the reply is then
+     * Invalid */
+    Transaction& tx = conn->tx;
+    if (!tx.active) {
+      resp.status = Status::Error;
+      resp.append("ERR exec without multi");
+      return;
+    }
+    std::vector<std::vector<std::string>> queued = std::move(tx.queued);
+    bool failed = tx.failed;
+    bool changed = watches_.changed(tx.watched);
+    watches_.unwatch_all(tx.watched);
+    tx = Transaction();
+    if (failed) {
+      resp.status = Status::Error;
+      resp.append("EXECABORT transaction discarded because of earlier errors");
+      return;
+    } else if (changed) {
+      resp.status = Status::Invalid;
+      return;
+    }
+
+    std::vector<std::string> replies;
+    for (std::vector<std::string>& cmd : queued) {
+      respond_to_client(conn, cmd, nullptr, &replies.emplace_back());
+    }
+    append_strings(resp, std::vector<std::string_view>(replies.begin(),
+                                                       replies.end()));
+  }
+
+  bool cas_command(const std::vector<std::string>& client_cmd,
+                   Response& resp) {
+    /* cas <key> <expected> <new>
+     * Sets key to new and replies 1 if it holds expected, otherwise replies
+     * 0. Returns true if the key was set */
+    const std::string& key = client_cmd[1];
+    const std::string& expected = client_cmd[2];
+    ValueView view;
+    if (!server_data_.find(key, view)) {
+      resp.append("0");
+      return false;
+    }
+    if (view.boxed() && view.value().type() != ValueType::String) {
+      wrong_type(resp);
+      return false;
+    }
+    // sizes first so that a large value is not copied to be compared
+    if (view.size() != expected.size() || view.to_string() != expected) {
+      resp.append("0");
+      return false;
+    }
+    store_value(key, pack_value(client_cmd[3]));
+    resp.append("1");
+    return true;
+  }
+
+  static bool is_hash_write(const std::string& name) {
+    return name == "hset" || name == "hdel" || name == "hincrby";
+  }
+
+  static void wrong_type(Response& resp) {
+    resp.status = Status::Error;
+    resp.append("WRONGTYPE key holds a value of another type");
+  }
+
+  static void append_strings(Response& resp,
+                             const std::vector<std::string_view>& strs) {
+    /* A list reply, n_strs | len1 | str1 | ... like a request's strings */
+    uint32_t n_strs = static_cast<uint32_t>(strs.size());
+    resp.data.append(reinterpret_cast<const uint8_t*>(&n_strs), 4U);
+    for (std::string_view str : strs) {
+      uint32_t len = static_cast<uint32_t>(str.size());
+      resp.data.append(reinterpret_cast<const uint8_t*>(&len), 4U);
+      resp.append(str);
+    }
+  }
+
+  static std::string_view literal_prefix(const std::string& pattern) {
+    /* The part of a glob pattern before its first special character */
+    return std::string_view(pattern).substr(0,
+                                            pattern.find_first_of("*?[\\"));
+  }
+
+  void keys_command(const std::string& pattern, Response& resp) {
+    /* keys <pattern>, pattern as in fnmatch. Replies with a list of the
+     * matching keys, in order with the key index, which then only visits
+     * the keys that start with the pattern's literal prefix. Otherwise
+     * every key is visited */
+    std::string_view prefix = literal_prefix(pattern);
+    bool prefix_only = prefix.size() == pattern.size() ||
+                       (prefix.size() + 1 == pattern.size() &&
+                        pattern.back() == '*');
+    std::vector<std::string_view> keys;
+    auto visit = [&](std::string_view key) {
+      if (!key.starts_with(prefix)) return;
+      if (prefix.size() == pattern.size() && key.size() != prefix.size()) {
+        return;
+      }
+      if (prefix_only ||
+          fnmatch(pattern.c_str(), std::string(key).c_str(), 0) == 0) {
+        keys.push_back(key);
+      }
+    };
+    if (config_.key_index) {
+      key_index_.scan_prefix(prefix, [&](std::string_view key) {
+        visit(key);
+        return true;
+      });
+    } else {
+      server_data_.for_each(
+          [&](std::string_view key, const ValueView&) { visit(key); });
+    }
+    append_strings(resp, keys);
+  }
+
+  void scan_command(const std::vector<std::string>& client_cmd,
+                    Response& resp) {
+    /* scan <cursor> [match <pattern>] [count <n>]
+     * Replies with a list of the next cursor and the matching keys among
+     * the next count keys in order, 10 by default. The cursor is 0 to start
+     * and is 0 again once the scan is done, otherwise it is ">" and the last
+     * key visited. A key present for the whole scan is returned once. Only
+     * the keys that start with the pattern's literal prefix are visited */
+    std::string pattern = "*";
+    int64_t count = 10;
+    size_t i = 2;
+    for (; i + 1 < client_cmd.size(); i += 2) {
+      if (client_cmd[i] == "match") {
+        pattern = client_cmd[i + 1];
+      } else if (client_cmd[i] != "count" ||
+                 !Keyspace::parse_int(client_cmd[i + 1], count) ||
+                 count <= 0) {
+        break;
+      }
+    }
+    const std::string& cursor = client_cmd[1];
+    if (i != client_cmd.size() || (cursor != "0" && cursor[0] != '>')) {
+      resp.status = Status::Error;
+      resp.append("ERR syntax error");
+      return;
+    }
+
+    std::string_view after =
+        cursor == "0" ? std::string_view() : std::string_view(cursor).substr(1);
+    std::string_view prefix = literal_prefix(pattern);
+    bool prefix_only = prefix.size() + 1 == pattern.size() &&
+                       pattern.back() == '*';
+    std::string next = "0";
+    std::vector<std::string_view> strs = {next};
+    std::string_view last;
+    int64_t visited = 0;
+    key_index_.scan(std::max(after, prefix), [&](std::string_view key) {
+      if (key == after) return true;
+      if (!key.starts_with(prefix)) return false;
+      if (visited == count) {
+        next = ">" + std::string(last);
+        return false;
+      }
+      ++visited;
+      last = key;
+      if (prefix_only ||
+          fnmatch(pattern.c_str(), std::string(key).c_str(), 0) == 0) {
+        strs.push_back(key);
+      }
+      return true;
+    });
+    strs[0] = next;
+    append_strings(resp, strs);
+  }
+
+  void range_command(const std::vector<std::string>& client_cmd,
+                     Response& resp) {
+    /* range <start> <end> [<count>]
+     * Replies with a list of the keys from start to end inclusive in byte
+     * order, at most count of them if given */
+    int64_t count = 0;
+    if (client_cmd.size() == 4 &&
+        (!Keyspace::parse_int(client_cmd[3], count) || count <= 0)) {
+      resp.status = Status::Error;
+      resp.append("ERR count is not a positive integer");
+      return;
+    }
+    std::string_view end = client_cmd[2];
+    std::vector<std::string_view> keys;
+    key_index_.scan(client_cmd[1], [&](std::string_view key) {
+      if (key > end) return false;
+      keys.push_back(key);
+      return count == 0 || keys.size() < static_cast<size_t>(count);
+    });
+    append_strings(resp, keys);
+  }
+
+  bool hash_write(const std::vector<std::string>& client_cmd,
+                  Response& resp) {
+    /* hset <key> <field> <value> [<field> <value> ...]
+     * hdel <key> <field> [<field> ...]
+     * hincrby <key> <field> <increment>
+     * Returns true if the hash changed. A hash is created by its first field
+     * and deleted with its last one */
+    const std::string& name = client_cmd[0];
+    const size_t n_args = client_cmd.size();
+    if ((name == "hset" && (n_args < 4 || n_args % 2 != 0)) ||
+        (name == "hdel" && n_args < 3) || (name == "hincrby" && n_args != 4)) {
+      resp.status = Status::Invalid;
+      return false;
+    }
+    int64_t incr = 0;
+    if (name == "hincrby" && !Keyspace::parse_int(client_cmd[3], incr)) {
+      resp.status = Status::Error;
+      resp.append("ERR increment is not an integer");
+      return false;
+    }
+
+    const std::string& key = client_cmd[1];
+    Value* val = server_data_.boxed(key);
+    if (val ? val->type() != ValueType::Hash : server_data_.contains(key)) {
+      wrong_type(resp);
+      return false;
+    }
+    Value created;
+    bool exists = val != nullptr;
+    if (!exists) {
+      if (name == "hdel") {
+        resp.append("0");
+        return false;
+      }
+      created = Value::empty_hash();
+      val = &created;
+    }
+    Hash& hash = val->hash();
+    size_t old_size = val->size();
+
+    if (name == "hset") {
+      size_t added = 0;
+      for (size_t i = 2; i < n_args; i += 2) {
+        added += hash.set(client_cmd[i], client_cmd[i + 1]);
+      }
+      resp.append(std::to_string(added));
+    } else if (name == "hdel") {
+      size_t removed = 0;
+      for (size_t i = 2; i < n_args; ++i) removed += hash.erase(client_cmd[i]);
+      resp.append(std::to_string(removed));
+      if (removed == 0) return false;
+    } else {
+      std::string_view current;
+      int64_t num = 0;
+      if (hash.get(client_cmd[2], current) &&
+          !Keyspace::parse_int(current, num)) {
+        resp.status = Status::Error;
+        resp.append("ERR hash value is not an integer");
+        return false;
+      }
+      if (__builtin_add_overflow(num, incr, &num)) {
+        resp.status = Status::Error;
+        resp.append("ERR increment would overflow");
+        return false;
+      }
+      std::string updated = std::to_string(num);
+      hash.set(client_cmd[2], updated);
+      resp.append(updated);
+    }
+
+    if (!exists) {
+      store_value(key, std::move(created));
+    } else if (hash.size() == 0) {
+      big_keys_.update(key, old_size, 0);
+      erase_value(key);
+    } else {
+      big_keys_.update(key, old_size, val->size());
+      key_changed(key);
+    }
+    return true;
+  }
+
+  bool hash_read(const std::vector<std::string>& client_cmd,
+                 Response& resp) {
+    /* hget <key> <field>
+     * hmget <key> <field> [<field> ...]
+     * hgetall <key>
+     * hmget replies with a list that has an empty string for each missing
+     * field, hgetall with a list of fields and values. Returns true if the
+     * key exists */
+    const std::string& name = client_cmd[0];
+    const size_t n_args = client_cmd.size();
+    if ((name == "hget" && n_args != 3) || (name == "hmget" && n_args < 3) ||
+        (name == "hgetall" && n_args != 2)) {
+      resp.status = Status::Invalid;
+      return false;
+    }
+
+    ValueView view;
+    bool found = server_data_.find(client_cmd[1], view);
+    if (found && (!view.boxed() || view.value().type() != ValueType::Hash)) {
+      wrong_type(resp);
+      return true;
+    }
+    const Hash* hash = found ? &view.value().hash() : nullptr;
+
+    std::string_view field_val;
+    if (name == "hget") {
+      if (hash && hash->get(client_cmd[2], field_val)) {
+        resp.append(field_val);
+      } else {
+        resp.status = Status::Invalid;
+      }
+      return found;
+    }
+
+    std::vector<std::string_view> strs;
+    if (name == "hmget") {
+      for (size_t i = 2; i < n_args; ++i) {
+        if (!hash || !hash->get(client_cmd[i], field_val)) field_val = {};
+        strs.push_back(field_val);
+      }
+    } else if (hash) {
+      strs.reserve(2 * hash->size());
+      hash->for_each([&](std::string_view field, std::string_view value) {
+        strs.push_back(field);
+        strs.push_back(value);
+      });
+    }
+    append_strings(resp, strs);
+    return found;
+  }
+
+  static bool is_list_write(const std::string& name) {
+    return name == "lpush" || name == "rpush" || name == "lpop" ||
+           name == "rpop";
+  }
+
+  void pop_list(const std::string& key, Value& val, bool front,
+                std::string& elem) {
+    /* Pops an element of key's non-empty list val, the key goes with its
+     * last element */
+    size_t old_size = val.size();
+    List& list = val.list();
+    if (front) {
+      list.pop_front(elem);
+    } else {
+      list.pop_back(elem);
+    }
+    if (list.empty()) {
+      big_keys_.update(key, old_size, 0);
+      erase_value(key);
+    } else {
+      big_keys_.update(key, old_size, val.size());
+      key_changed(key);
+    }
+  }
+
+  bool list_write(const std::vector<std::string>& client_cmd,
+                  Response& resp) {
+    /* lpush|rpush <key> <elem> [<elem> ...]
+     * lpop|rpop <key>
+     * Pushes reply with the new length, pops with the element. Returns true
+     * if the list changed. A list is created by its first push and deleted
+     * with its last element */
+    const std::string& name = client_cmd[0];
+    bool push = name == "lpush" || name == "rpush";
+    if (push ? client_cmd.size() < 3 : client_cmd.size() != 2) {
+      resp.status = Status::Invalid;
+      return false;
+    }
+
+    const std::string& key = client_cmd[1];
+    Value* val = server_data_.boxed(key);
+    if (val ? val->type() != ValueType::List : server_data_.contains(key)) {
+      wrong_type(resp);
+      return false;
+    }
+    if (!push) {
+      if (!val) {
+        resp.status = Status::Invalid;
+        return false;
+      }
+      std::string elem;
+      pop_list(key, *val, name == "lpop", elem);
+      resp.append(elem);
+      return true;
+    }
+
+    Value created;
+    bool exists = val != nullptr;
+    if (!exists) {
+      created = Value::empty_list();
+      val = &created;
+    }
+    List& list = val->list();
+    size_t old_size = val->size();
+    for (size_t i = 2; i < client_cmd.size(); ++i) {
+      if (name == "lpush") {
+        list.push_front(client_cmd[i]);
+      } else {
+        list.push_back(client_cmd[i]);
+      }
+    }
+    resp.append(std::to_string(list.size()));
+
+    if (!exists) {
+      store_value(key, std::move(created));
+    } else {
+      big_keys_.update(key, old_size, val->size());
+      key_changed(key);
+    }
+    return true;
+  }
+
+  bool list_read(const std::vector<std::string>& client_cmd,
+                 Response& resp) {
+    /* llen <key>
+     * lrange <key> <start> <stop>
+     * lrange replies with a list, negative indexes count from the end.
+     * Returns true if the key exists */
+    const std::string& name = client_cmd[0];
+    if ((name == "llen" && client_cmd.size() != 2) ||
+        (name == "lrange" && client_cmd.size() != 4)) {
+      resp.status = Status::Invalid;
+      return false;
+    }
+    int64_t start = 0;
+    int64_t stop = 0;
+    if (name == "lrange" && (!Keyspace::parse_int(client_cmd[2], start) ||
+                             !Keyspace::parse_int(client_cmd[3], stop))) {
+      resp.status = Status::Error;
+      resp.append("ERR index is not an integer");
+      return false;
+    }
+
+    ValueView view;
+    bool found = server_data_.find(client_cmd[1], view);
+    if (found && (!view.boxed() || view.value().type() != ValueType::List)) {
+      wrong_type(resp);
+      return true;
+    }
+    const List* list = found ? &view.value().list() : nullptr;
+
+    if (name == "llen") {
+      resp.append(std::to_string(list ? list->size() : 0));
+      return found;
+    }
+    std::vector<std::string_view> strs;
+    if (list) {
+      list->for_range(start, stop,
+                      [&](std::string_view elem) { strs.push_back(elem); });
+    }
+    append_strings(resp, strs);
+    return found;
+  }
+
+  void blpop_command(Conn* conn, const std::vector<std::string>& client_cmd,
+                     Response& resp) {
+    /* blpop <key> [<key> ...] <timeout>
+     * Pops the front of the first non-empty list and replies with its key
+     * and the element. If every list is empty conn blocks until a push
+     * serves it, see serve_blocked, or for timeout seconds, 0 is forever,
+     * and then gets Invalid */
+    if (client_cmd.size() < 3) {
+      resp.status = Status::Invalid;
+      return;
+    }
+    const std::string& timeout_str = client_cmd.back();
+    char* end = nullptr;
+    double timeout = strtod(timeout_str.c_str(), &end);
+    if (end != timeout_str.c_str() + timeout_str.size() ||
+        !(timeout >= 0 && timeout <= MAX_BLOCK_TIMEOUT_S)) {
+      resp.status = Status::Error;
+      resp.append("ERR timeout is not a valid number of seconds");
+      return;
+    }
+
+    std::vector<std::string> keys(client_cmd.begin() + 1,
+                                  client_cmd.end() - 1);
+    Value* first = nullptr;
+    size_t first_idx = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      Value* val = server_data_.boxed(keys[i]);
+      if (val ? val->type() != ValueType::List
+              : server_data_.contains(keys[i])) {
+        wrong_type(resp);
+        return;
+      }
+      if (val && !first) {
+        first = val;
+        first_idx = i;
+      }
+    }
+
+    if (first) {
+      const std::string& key = keys[first_idx];
+      std::string elem;
+      pop_list(key, *first, true, elem);
+      propagate({"lpop", key});
+      append_strings(resp, {key, elem});
+      return;
+    }
+    uint64_t deadline_ns =
+        timeout > 0 ? monotonic_ns() + static_cast<uint64_t>(timeout * 1e9)
+                    : 0;
+    blocked_.block(conn, keys, deadline_ns);
+    stats_.blocked_changed(blocked_.size());
+  }
+
+  void serve_blocked(const std::string& key) {
+    /* Hands the front elements of key's list to the connections blocked on
+     * it, the one that waited longest first. Each pop is replicated as an
+     * lpop */
+    if (blocked_.size() == 0) return;
+    while (Conn* conn = blocked_.first(key)) {
+      Value* val = server_data_.boxed(key);
+      if (!val || val->type() != ValueType::List) return;
+      std::string elem;
+      pop_list(key, *val, true, elem);
+      propagate({"lpop", key});
+
+      Response resp;
+      append_strings(resp, {key, elem});
+      unblock(conn, resp);
+    }
+  }
+
+  void expire_blocked() {
+    /* Replies Invalid to the blocked connections whose timeout passed */
+    while (Conn* conn = blocked_.expired(loop_now_ns_)) {
+      Response resp;
+      resp.status = Status::Invalid;
+      unblock(conn, resp);
+    }
+  }
+
+  void unblock(Conn* conn, const Response& resp) {
+    /* Ends conn's blpop with resp, the requests it pipelined after the
+     * blpop run from the next iteration on */
+    blocked_.unblock(conn);
+    stats_.blocked_changed(blocked_.size());
+    queue_response(conn, resp);
+    conn->input_pending = has_request(conn);
+    if (conn->input_pending) pending_input_.push_back(conn);
+    update_conn_memory(conn);
+    update_interest(conn);
+    if (conn->want_write) handle_write(conn);
+  }
+
+  static bool is_sketch_write(const std::string& name) {
+    return name == "bf.reserve" || name == "bf.add" || name == "bf.madd" ||
+           name == "pfadd" || name == "pfmerge";
+  }
+
+  bool sketch_write(const std::vector<std::string>& client_cmd,
+                    Response& resp) {
+    /* bf.reserve <key> <error_rate> <capacity>
+     * bf.add <key> <item>
+     * bf.madd <key> <item> [<item> ...]
+     * pfadd <key> [<item> ...]
+     * pfmerge <dest> [<src> ...]
+     * bf.add replies 1 if the item was not in the filter yet and bf.madd
+     * with a list of those, pfadd 1 if the key was created or the count may
+     * have changed. A missing key is created, a filter with the default
+     * error rate and capacity. Returns true if the keyspace changed */
+    const std::string& name = client_cmd[0];
+    const size_t n_args = client_cmd.size();
+    if ((name == "bf.reserve" && n_args != 4) ||
+        (name == "bf.add" && n_args != 3) ||
+        (name == "bf.madd" && n_args < 3)) {
+      resp.status = Status::Invalid;
+      return false;
+    }
+    bool is_bloom = name[0] == 'b';
+    ValueType type = is_bloom ? ValueType::Bloom : ValueType::HyperLogLog;
+
+    const std::string& key = client_cmd[1];
+    Value* val = server_data_.boxed(key);
+    if (val ? val->type() != type : server_data_.contains(key)) {
+      wrong_type(resp);
+      return false;
+    }
+    // checked before anything changes
+    std::vector<const HyperLogLog*> sources;
+    for (size_t i = 2; name == "pfmerge" && i < n_args; ++i) {
+      ValueView view;
+      if (!server_data_.find(client_cmd[i], view)) continue;
+      if (!view.boxed() || view.value().type() != ValueType::HyperLogLog) {
+        wrong_type(resp);
+        return false;
+      }
+      sources.push_back(&view.value().hll());
+    }
+
+    if (name == "bf.reserve") {
+      char* end = nullptr;
+      double error_rate = strtod(client_cmd[2].c_str(), &end);
+      int64_t capacity = 0;
+      if (val) {
+        resp.status = Status::Error;
+        resp.append("ERR key already exists");
+        return false;
+      }
+      if (end != client_cmd[2].c_str() + client_cmd[2].size() ||
+          !Keyspace::parse_int(client_cmd[3], capacity) || capacity <= 0 ||
+          !Bloom::valid_params(error_rate, static_cast<uint64_t>(capacity))) {
+        resp.status = Status::Error;
+        resp.append("ERR bad error rate or capacity");
+        return false;
+      }
+      store_value(key, Value::empty_bloom(error_rate,
+                                          static_cast<uint64_t>(capacity)));
+      return true;
+    }
+
+    Value created;
+    bool exists = val != nullptr;
+    if (!exists) {
+      created = is_bloom ? Value::empty_bloom(Bloom::DEFAULT_ERROR_RATE,
+                                              Bloom::DEFAULT_CAPACITY)
+                         : Value::empty_hll();
+      val = &created;
+    }
+    size_t old_size = val->size();
+    bool changed = !exists;
+
+    if (name == "bf.add") {
+      bool added = val->bloom().add(client_cmd[2]);
+      resp.append(added ? "1" : "0");
+      changed |= added;
+    } else if (name == "bf.madd") {
+      std::vector<std::string_view> strs;
+      for (size_t i = 2; i < n_args; ++i) {
+        bool added = val->bloom().add(client_cmd[i]);
+        strs.push_back(added ? "1" : "0");
+        changed |= added;
+      }
+      append_strings(resp, strs);
+    } else if (name == "pfadd") {
+      for (size_t i = 2; i < n_args; ++i) {
+        changed |= val->hll().add(client_cmd[i]);
+      }
+      resp.append(changed ? "1" : "0");
+    } else {
+      for (const HyperLogLog* src : sources) changed |= val->hll().merge(*src);
+    }
+    if (!changed) return false;
+
+    if (!exists) {
+      store_value(key, std::move(created));
+    } else {
+      big_keys_.update(key, old_size, val->size());
+      key_changed(key);
+    }
+    return true;
+  }
+
+  bool sketch_read(const std::vector<std::string>& client_cmd,
+                   Response& resp) {
+    /* bf.exists <key> <item>
+     * pfcount <key> [<key> ...]
+     * bf.exists replies 1 if the item may have been added, pfcount with the
+     * distinct count of the union of the keys. Returns true if the first
+     * key exists */
+    const std::string& name = client_cmd[0];
+    const size_t n_args = client_cmd.size();
+    if (name == "bf.exists" && n_args != 3) {
+      resp.status = Status::Invalid;
+      return false;
+    }
+    bool is_bloom = name == "bf.exists";
+    ValueType type = is_bloom ? ValueType::Bloom : ValueType::HyperLogLog;
+
+    std::vector<const Value*> vals;
+    bool found = false;
+    for (size_t i = 1; i < (is_bloom ? 2 : n_args); ++i) {
+      ValueView view;
+      if (!server_data_.find(client_cmd[i], view)) continue;
+      if (!view.boxed() || view.value().type() != type) {
+        wrong_type(resp);
+        return i == 1;
+      }
+      found |= i == 1;
+      vals.push_back(&view.value());
+    }
+
+    if (is_bloom) {
+      bool has = !vals.empty() && vals[0]->bloom().contains(client_cmd[2]);
+      resp.append(has ? "1" : "0");
+    } else if (vals.size() == 1) {
+      resp.append(std::to_string(vals[0]->hll().count()));
+    } else {
+      HyperLogLog merged;
+      for (const Value* v : vals) merged.merge(v->hll());
+      resp.append(std::to_string(merged.count()));
+    }
+    return found;
+  }
+
+  void respond_to_client(Conn* conn, std::vector<std::string>& client_cmd,
+                         Value* large_val = nullptr,
+                         std::string* captured = nullptr) {
+    /* large_val is the value of a set received in segments, see
+     * handle_large_msg. The commands run by exec reply to captured instead
+     * of conn, with status | data */
     Response server_resp;
+    const Value* reply_val = nullptr;  // large value to reply with
+    const Value* packed_val = nullptr;  // compressed value to reply with
 
-    if (client_cmd[0] == "get") {
-      auto it = server_data_.find(client_cmd[1]);
-      if (it == server_data_.end()) {
+    if (!route_key(conn, client_cmd, server_resp)) {
+      // server_resp already holds the redirect
+    } else if (client_cmd[0] == "get") {
+      hot_keys_.maybe_record(client_cmd[1]);
+      ValueView val;
+      bool found = server_data_.find(client_cmd[1], val);
+      if (!found) {
         server_resp.status = Status::Invalid;
+      } else if (!val.boxed()) {
+        char buf[ValueView::INT_CHARS];
+        server_resp.append(val.text(buf));
+      } else if (val.value().type() != ValueType::String) {
+        wrong_type(server_resp);
+      } else if (val.value().chained()) {
+        reply_val = &val.value();
+      } else if (val.value().compressed() &&
+                 (!conn->accept_compressed || captured)) {
+        packed_val = &val.value();
+      } else if (val.value().compressed()) {
+        // sent as is, the client decompresses it, see Status::Compressed
+        uint32_t raw_len = static_cast<uint32_t>(val.value().size());
+        server_resp.status = Status::Compressed;
+        server_resp.data.append(reinterpret_cast<const uint8_t*>(&raw_len), 4);
+        server_resp.append(val.value().str());
+      } else {
+        server_resp.append(val.value().str());
+      }
+      if (found && conn->tracking && !conn->tracking_bcast) {
+        track_read(conn, client_cmd[1]);
+      }
+    } else if (client_cmd[0] == "set" || client_cmd[0] == "del" ||
+               client_cmd[0] == "unlink") {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (is_follower()) {
+        // followers only serve reads, writes must go through the leader
+        server_resp.status = Status::Error;
+        server_resp.append("READONLY follower does not accept writes");
+      } else if (large_val) {
+        apply_write(client_cmd, large_val);
+        ValueView stored;  // boxed, it has segments
+        server_data_.find(client_cmd[1], stored);
+        propagate(client_cmd, &stored.value());
+      } else if (apply_write(client_cmd)) {
+        propagate(client_cmd);
+      }
+    } else if (client_cmd[0] == "cas" && client_cmd.size() == 4) {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (is_follower()) {
+        server_resp.status = Status::Error;
+        server_resp.append("READONLY follower does not accept writes");
+      } else if (cas_command(client_cmd, server_resp)) {
+        propagate({"set", client_cmd[1], client_cmd[3]});
+      }
+    } else if (client_cmd.size() >= 2 && is_hash_write(client_cmd[0])) {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (is_follower()) {
+        server_resp.status = Status::Error;
+        server_resp.append("READONLY follower does not accept writes");
+      } else if (hash_write(client_cmd, server_resp)) {
+        propagate(client_cmd);
+      }
+    } else if (client_cmd.size() >= 2 &&
+               (client_cmd[0] == "hget" || client_cmd[0] == "hmget" ||
+                client_cmd[0] == "hgetall")) {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (hash_read(client_cmd, server_resp) && conn->tracking &&
+          !conn->tracking_bcast) {
+        track_read(conn, client_cmd[1]);
+      }
+    } else if (client_cmd.size() >= 2 && is_list_write(client_cmd[0])) {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (is_follower()) {
+        server_resp.status = Status::Error;
+        server_resp.append("READONLY follower does not accept writes");
+      } else if (list_write(client_cmd, server_resp)) {
+        propagate(client_cmd);
+        serve_blocked(client_cmd[1]);
+      }
+    } else if (client_cmd.size() >= 2 &&
+               (client_cmd[0] == "llen" || client_cmd[0] == "lrange")) {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (list_read(client_cmd, server_resp) && conn->tracking &&
+          !conn->tracking_bcast) {
+        track_read(conn, client_cmd[1]);
+      }
+    } else if (client_cmd[0] == "blpop" && client_cmd.size() >= 2) {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (is_follower()) {
+        server_resp.status = Status::Error;
+        server_resp.append("READONLY follower does not accept writes");
+      } else {
+        blpop_command(conn, client_cmd, server_resp);
+      }
+    } else if (client_cmd.size() >= 2 && is_sketch_write(client_cmd[0])) {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (is_follower()) {
+        server_resp.status = Status::Error;
+        server_resp.append("READONLY follower does not accept writes");
+      } else if (sketch_write(client_cmd, server_resp)) {
+        propagate(client_cmd);
+      }
+    } else if (client_cmd.size() >= 2 && (client_cmd[0] == "bf.exists" ||
+                                          client_cmd[0] == "pfcount")) {
+      hot_keys_.maybe_record(client_cmd[1]);
+      if (sketch_read(client_cmd, server_resp) && conn->tracking &&
+          !conn->tracking_bcast) {
+        track_read(conn, client_cmd[1]);
+      }
+    } else if (client_cmd[0] == "keys" && client_cmd.size() == 2) {
+      keys_command(client_cmd[1], server_resp);
+    } else if ((client_cmd[0] == "scan" && client_cmd.size() >= 2) ||
+               (client_cmd[0] == "range" &&
+                (client_cmd.size() == 3 || client_cmd.size() == 4))) {
+      if (!config_.key_index) {
+        server_resp.status = Status::Error;
+        server_resp.append(
+            "ERR scan and range need the key index, see --key-index");
+      } else if (client_cmd[0] == "scan") {
+        scan_command(client_cmd, server_resp);
       } else {
-        server_resp.data.append(reinterpret_cast<uint8_t*>(&it->second[0]),
-                                static_cast<uint32_t>(it->second.size()));
+        range_command(client_cmd, server_resp);
       }
-    } else if (client_cmd[0] == "set") {
-      server_data_[client_cmd[1]] = client_cmd[2];
-    } else if (client_cmd[0] == "del") {
-      server_data_.erase(client_cmd[1]);
+    } else if (client_cmd[0] == "flushall" &&
+               (client_cmd.size() == 1 ||
+                (client_cmd.size() == 2 && (client_cmd[1] == "async" ||
+                                            client_cmd[1] == "sync")))) {
+      if (is_follower()) {
+        server_resp.status = Status::Error;
+        server_resp.append("READONLY follower does not accept writes");
+      } else {
+        apply_write(client_cmd);
+        propagate(client_cmd);
+      }
+    } else if (client_cmd[0] == "restore" &&
+               (client_cmd.size() == 3 || is_typed_restore(client_cmd))) {
+      // a key sent over by cluster migrate_slot_batch, only accepted while
+      // its slot is being imported
+      if (is_follower()) {
+        server_resp.status = Status::Error;
+        server_resp.append("READONLY follower does not accept writes");
+      } else if (!cluster_.enabled() ||
+                 cluster_.importing_from(key_hash_slot(client_cmd[1])) < 0) {
+        server_resp.status = Status::Error;
+        server_resp.append("ERR restore needs a slot being imported");
+      } else if (client_cmd.size() == 4) {
+        if (restore_typed(client_cmd, server_resp)) {
+          propagate(client_cmd);
+          if (client_cmd[3] == "list") serve_blocked(client_cmd[1]);
+        }
+      } else {
+        store_value(client_cmd[1], pack_value(client_cmd[2]));
+        propagate({"set", client_cmd[1], client_cmd[2]});
+      }
+    } else if (client_cmd[0] == "exec" && client_cmd.size() == 1) {
+      exec_command(conn, server_resp);
+    } else if (is_transaction_cmd(client_cmd[0]) &&
+               (client_cmd[0] == "watch" ? client_cmd.size() >= 2
+                                         : client_cmd.size() == 1)) {
+      transaction_command(conn, client_cmd, server_resp);
+    } else if (client_cmd[0] == "publish" && client_cmd.size() == 3) {
+      size_t receivers =
+          large_val ? publish(client_cmd[1], *large_val)
+                    : publish(client_cmd[1], Value(std::move(client_cmd[2])));
+      server_resp.append(std::to_string(receivers));
+    } else if (is_subscribe_cmd(client_cmd[0])) {
+      subscribe_command(conn, client_cmd, server_resp);
+    } else if (client_cmd[0] == "asking") {
+      // only lets the next command through, see parse_buffer
+    } else if (client_cmd[0] == "cluster") {
+      cluster_command(client_cmd, server_resp);
+    } else if (client_cmd[0] == "role") {
+      server_resp.append(role_info());
+    } else if (client_cmd[0] == "slowlog" && client_cmd.size() >= 2) {
+      slowlog_command(client_cmd, server_resp);
+    } else if (client_cmd[0] == "hotkeys" || client_cmd[0] == "bigkeys") {
+      keystats_command(client_cmd, server_resp);
+    } else if (client_cmd[0] == "loopstats" && client_cmd.size() == 1) {
+      server_resp.append(loop_monitor_.report());
+      if (busy_poll_.enabled()) server_resp.append(busy_poll_.report());
+    } else if (client_cmd[0] == "loopstats" && client_cmd.size() == 2 &&
+               client_cmd[1] == "reset") {
+      loop_monitor_.reset();
+      busy_poll_.reset();
+    } else if (client_cmd[0] == "client" && client_cmd.size() == 2 &&
+               client_cmd[1] == "list") {
+      server_resp.append(client_list());
+    } else if (client_cmd[0] == "client" && client_cmd.size() == 3 &&
+               client_cmd[1] == "compression" &&
+               (client_cmd[2] == "on" || client_cmd[2] == "off")) {
+      conn->accept_compressed = client_cmd[2] == "on";
+    } else if (client_cmd[0] == "client" && client_cmd.size() >= 3 &&
+               client_cmd[1] == "tracking") {
+      tracking_command(conn, client_cmd, server_resp);
+    } else if (client_cmd[0] == "info" && client_cmd.size() <= 2) {
+      server_resp.append(stats_.info(
+          client_cmd.size() == 2 ? client_cmd[1] : "", server_data_.size()));
     } else {
       server_resp.status = Status::Invalid;
     }
 
-    uint32_t resp_len = 4 + static_cast<uint32_t>(server_resp.data.size());
-    write_buf.append(reinterpret_cast<uint8_t*>(&resp_len), 4U);
-    write_buf.append(reinterpret_cast<uint8_t*>(&server_resp.status), 4U);
-    if (server_resp.data.size() > 0) {
-      write_buf.append(server_resp.data.data(),
-                       static_cast<uint32_t>(server_resp.data.size()));
+    if (captured) {
+      const Value* val = reply_val ? reply_val : packed_val;
+      if (val) server_resp.append(val->to_string());
+      captured->assign(reinterpret_cast<const char*>(&server_resp.status), 4);
+      captured->append(reinterpret_cast<const char*>(server_resp.data.data()),
+                       server_resp.data.size());
+    } else if (conn->blocked()) {
+      // replied to once served or timed out, see unblock
+    } else if (reply_val) {
+      // header only, the value's segments are shared with the output
+      uint32_t hdr[2] = {4 + static_cast<uint32_t>(reply_val->size()),
+                         static_cast<uint32_t>(server_resp.status)};
+      queue_output(conn, reinterpret_cast<const uint8_t*>(hdr), sizeof(hdr));
+      conn->write_chain.append_shared(reply_val->chain());
+    } else if (packed_val) {
+      queue_decompressed(conn, *packed_val);
+    } else {
+      queue_response(conn, server_resp);
+    }
+  }
+
+  void queue_response(Conn* conn, const Response& resp) {
+    if (conn->write_chain.empty()) {
+      write_response(conn->write_buf, resp.status, resp.data.data(),
+                     static_cast<uint32_t>(resp.data.size()));
+    } else {
+      write_response(conn->write_chain, resp.status, resp.data.data(),
+                     static_cast<uint32_t>(resp.data.size()));
+    }
+  }
+
+  void queue_decompressed(Conn* conn, const Value& val) {
+    /* Valid reply with a compressed value, decompressed straight into the
+     * output buffer */
+    uint32_t hdr[2] = {4 + static_cast<uint32_t>(val.size()),
+                       static_cast<uint32_t>(Status::Valid)};
+    queue_output(conn, reinterpret_cast<const uint8_t*>(hdr), sizeof(hdr));
+    if (conn->write_chain.empty()) {
+      val.decompress_into(conn->write_buf.prepare_append(val.size()));
+      conn->write_buf.commit_append(val.size());
+    } else {
+      std::string raw = val.to_string();
+      conn->write_chain.append(reinterpret_cast<const uint8_t*>(raw.data()),
+                               raw.size());
+    }
+  }
+
+  std::string client_list() const {
+    /* One line per connection with its buffer sizes and capacities in bytes,
+     * ages in seconds */
+    static constexpr const char* kinds[] = {"client", "replica", "leader"};
+    std::string out;
+    for (const Conn* conn : conn_list_) {
+      if (conn == nullptr) continue;
+      out += "fd=" + std::to_string(conn->fd) +
+             " kind=" + kinds[static_cast<int>(conn->kind)] +
+             " age=" +
+             std::to_string((loop_now_ns_ - conn->created_ns) / 1000000000) +
+             " idle=" +
+             std::to_string((loop_now_ns_ - conn->last_active_ns) /
+                            1000000000) +
+             " qbuf=" + std::to_string(conn->read_buf.size()) +
+             " qbuf-cap=" + std::to_string(conn->read_buf.capacity()) +
+             " qchain=" + std::to_string(conn->read_chain.size()) +
+             " obuf=" + std::to_string(conn->write_buf.size()) +
+             " obuf-cap=" + std::to_string(conn->write_buf.capacity()) +
+             " ochain=" + std::to_string(conn->write_chain.size()) +
+             " tot-mem=" + std::to_string(conn->memory()) + " sub=" +
+             std::to_string(conn->channels.size() + conn->patterns.size()) +
+             "\n";
+    }
+    return out;
+  }
+
+  void update_conn_memory(Conn* conn) {
+    /* Adds the change of conn's memory since the last call to the total */
+    size_t mem = conn->memory();
+    if (mem == conn->reported_memory) return;
+    stats_.conn_memory_changed(static_cast<int64_t>(mem) -
+                               static_cast<int64_t>(conn->reported_memory));
+    conn->reported_memory = mem;
+    if (mem > conn->base_memory) reclaim_pending_ = true;
+  }
+
+  bool output_limit_reached(Conn* conn) {
+    /* True once conn's pending output is over its hard limit, or has been
+     * over its soft limit for soft_seconds. A replica's snapshot is not
+     * counted, a dataset larger than the limit could never be synced */
+    const OutputLimit& limit = conn->kind == ConnKind::Replica
+                                   ? config_.replica_output_limit
+                               : conn->subscribed()
+                                   ? config_.pubsub_output_limit
+                                   : config_.client_output_limit;
+    size_t out = conn->output_size();
+    out -= std::min(out, conn->snapshot_bytes);
+    if (limit.hard > 0 && out >= limit.hard) return true;
+    if (limit.soft == 0 || out < limit.soft) {
+      conn->soft_limit_since_ns = 0;
+      return false;
+    }
+    if (conn->soft_limit_since_ns == 0) {
+      conn->soft_limit_since_ns = loop_now_ns_;
+    }
+    return loop_now_ns_ - conn->soft_limit_since_ns >=
+           limit.soft_seconds * 1000000000ULL;
+  }
+
+  bool enforce_output_limit(Conn* conn) {
+    /* Drops the output of a connection that reached its output limit and
+     * marks it for closing, returns true if it did */
+    conn->write_peak = std::max(conn->write_peak, conn->write_buf.size());
+    if (conn->kind == ConnKind::Leader || !output_limit_reached(conn)) {
+      return false;
+    }
+
+    std::cerr << "Closing fd " << conn->fd << ": " << conn->output_size()
+              << " bytes of pending output reached its limit\n";
+    conn->write_buf.clear();
+    conn->write_chain.clear();
+    conn->want_close = true;
+    stats_.output_limit_disconnected();
+    update_conn_memory(conn);
+    return true;
+  }
+
+  void reclaim_buffer(ConnBuffer& buf, size_t peak, bool idle) {
+    /* Shrinks an empty buffer to its initial size if its connection is idle,
+     * or a buffer larger than conn_buf_keep that used less than half of its
+     * capacity since the last pass to twice that peak */
+    if (buf.size() > 0) return;
+    if (idle) {
+      buf.shrink(CONN_BUF_SIZE);
+    } else if (buf.capacity() > config_.conn_buf_keep &&
+               2 * peak < buf.capacity()) {
+      buf.shrink(std::max(config_.conn_buf_keep, 2 * peak));
+    }
+  }
+
+  void reclaim_buffers() {
+    /* Runs every RECLAIM_INTERVAL_NS while some connection holds more memory
+     * than it started with, so a connection that once received or sent a
+     * large message does not keep its grown buffers for the rest of its life */
+    reclaim_pending_ = false;
+    uint64_t idle_ns = config_.conn_idle_ms * 1000000ULL;
+    for (Conn* conn : conn_list_) {
+      if (conn == nullptr) continue;
+      bool idle = config_.conn_idle_ms > 0 &&
+                  loop_now_ns_ - conn->last_active_ns >= idle_ns;
+      reclaim_buffer(conn->read_buf, conn->read_peak, idle);
+      reclaim_buffer(conn->write_buf, conn->write_peak, idle);
+      conn->read_peak = conn->read_buf.size();
+      conn->write_peak = conn->write_buf.size();
+      update_conn_memory(conn);
+      if (conn->memory() > conn->base_memory) reclaim_pending_ = true;
+    }
+  }
+
+  void handle_psync(Conn* conn, const std::vector<std::string>& client_cmd) {
+    /* psync <replid> <offset> attaches conn as a follower. If the follower was
+     * already following us and offset is still in the backlog only the missing
+     * part of the stream is resent, otherwise a full snapshot is sent first */
+    if (is_follower() || client_cmd.size() != 3) {
+      write_response(conn->write_buf, Status::Error,
+                     "ERR psync is only available on a leader");
+      return;
+    }
+
+    uint64_t offset = std::strtoull(client_cmd[2].c_str(), nullptr, 10);
+    if (client_cmd[1] == replid_ && backlog_.contains(offset)) {
+      write_response(conn->write_buf, Status::Valid,
+                     "continue " + replid_ + " " + std::to_string(offset));
+      backlog_.copy_from(offset, conn->write_buf);
+    } else {
+      // each snapshot entry is sent as "set key val", other types as the
+      // command that rebuilds them, see encode_cmd and rebuild_cmd
+      uint64_t snapshot_bytes = 0;
+      std::string scratch;
+      server_data_.for_each([&](std::string_view key, const ValueView& val) {
+        if (val.boxed() && val.value().type() != ValueType::String) {
+          snapshot_bytes += 4 + 4;
+          for (std::string_view str : rebuild_cmd(key, val.value(), scratch)) {
+            snapshot_bytes += 4 + str.size();
+          }
+          return;
+        }
+        snapshot_bytes += 4 + 4 + (4 + 3) + (4 + key.size()) + (4 + val.size());
+      });
+      write_response(conn->write_buf, Status::Valid,
+                     "fullresync " + replid_ + " " +
+                         std::to_string(backlog_.end_offset()) + " " +
+                         std::to_string(snapshot_bytes));
+      server_data_.for_each([&](std::string_view key, const ValueView& val) {
+        if (val.boxed() && val.value().chained()) {
+          // header only, the value's segments are shared with the output
+          if (conn->write_chain.empty()) {
+            encode_set_header(key, val.size(), conn->write_buf);
+          } else {
+            encode_set_header(key, val.size(), conn->write_chain);
+          }
+          conn->write_chain.append_shared(val.value().chain());
+          return;
+        }
+        if (val.boxed() && val.value().type() != ValueType::String) {
+          std::vector<std::string_view> cmd =
+              rebuild_cmd(key, val.value(), scratch);
+          if (conn->write_chain.empty()) {
+            encode_cmd(cmd, conn->write_buf);
+          } else {
+            encode_cmd(cmd, conn->write_chain);
+          }
+          return;
+        }
+
+        char buf[ValueView::INT_CHARS];
+        std::string raw;  // replicas compress with their own settings
+        std::string_view text;
+        if (!val.boxed()) {
+          text = val.text(buf);
+        } else if (val.value().compressed()) {
+          text = raw = val.value().to_string();
+        } else {
+          text = val.value().str();
+        }
+        if (conn->write_chain.empty()) {
+          encode_cmd({"set", key, text}, conn->write_buf);
+        } else {
+          encode_cmd({"set", key, text}, conn->write_chain);
+        }
+      });
+      conn->snapshot_bytes = conn->output_size();
+    }
+
+    conn->kind = ConnKind::Replica;
+    replicas_.push_back(conn);
+  }
+
+  static bool has_request(const Conn* conn) {
+    /* True if read_buf starts with a complete request */
+    if (conn->read_buf.size() < 4) return false;
+    uint32_t msg_len = 0;
+    memcpy(&msg_len, conn->read_buf.data(), 4);
+    return 4 + static_cast<size_t>(msg_len) <= conn->read_buf.size();
+  }
+
+  inline bool output_paused(const Conn* conn) const noexcept {
+    return config_.write_high_watermark > 0 &&
+           conn->output_size() >= config_.write_high_watermark;
+  }
+
+  void process_input(Conn* conn) {
+    /* Runs at most conn_cmd_budget of the requests in read_buf, fewer once
+     * the output reaches the high watermark. Requests left over are run on
+     * later iterations, one budget per iteration, so a deep pipeline cannot
+     * hold up every other connection */
+    CommandClock clock(stats_shard_, slowlog_.enabled());
+    size_t budget = config_.conn_cmd_budget;
+    for (size_t n = 0; budget == 0 || n < budget; ++n) {
+      if (conn->blocked() || output_paused(conn) ||
+          !parse_buffer(conn, clock) ||
+          enforce_output_limit(conn)) {
+        break;
+      }
+    }
+    conn->input_pending =
+        !conn->want_close && !conn->blocked() && has_request(conn);
+  }
+
+  void run_pending_input() {
+    /* Gives every connection with left over requests and room for output
+     * its next budget */
+    std::vector<Conn*> pending;
+    pending.swap(pending_input_);
+    for (Conn* conn : pending) {
+      if (!conn->want_close && !output_paused(conn)) {
+        process_input(conn);
+        update_conn_memory(conn);
+        update_interest(conn);
+        if (conn->want_write) handle_write(conn);
+      }
+      if (conn->input_pending) pending_input_.push_back(conn);
+    }
+  }
+
+  bool has_runnable_input() const {
+    for (const Conn* conn : pending_input_) {
+      if (!conn->want_close && !output_paused(conn)) return true;
     }
+    return false;
   }
 
-  bool parse_buffer(Conn* conn) {
+  bool parse_buffer(Conn* conn, CommandClock& clock) {
     if (conn->read_buf.size() < 4) return false;
 
     // first 4 bytes of msg stores total size of msg in bytes
@@ -51,6 +1986,12 @@ class ServerEventLoop final : private ServerBase {
     uint32_t msg_len = 0;
     memcpy(&msg_len, static_cast<void*>(conn->read_buf.data()), 4);
     if (4 + msg_len > conn->read_buf.size()) {
+      if (4 + static_cast<size_t>(msg_len) >= LARGE_MSG_BYTES) {
+        // read the rest straight into segments, see handle_read
+        conn->read_chain.append(conn->read_buf.data(), conn->read_buf.size());
+        conn->read_buf.clear();
+        conn->large_msg_len = msg_len;
+      }
       return false;
     }
 
@@ -60,87 +2001,415 @@ class ServerEventLoop final : private ServerBase {
       return false;
     }
 
-    respond_to_client(client_cmd, conn->write_buf);
+    execute_cmd(conn, client_cmd, clock);
     conn->read_buf.consume(msg_len + 4);
 
     return true;
   }
 
-  Conn* handle_accept() {
+  void execute_cmd(Conn* conn, std::vector<std::string>& client_cmd,
+                   CommandClock& clock, Value* large_val = nullptr) {
+    if (conn->tx.active && !is_transaction_cmd(client_cmd[0])) {
+      if (large_val) client_cmd[2] = large_val->to_string();
+      queue_command(conn, client_cmd);
+    } else if (client_cmd[0] == "psync") {
+      handle_psync(conn, client_cmd);
+    } else {
+      respond_to_client(conn, client_cmd, large_val);
+    }
+    slowlog_.maybe_add(client_cmd,
+                       clock.record(stats_.command_id(client_cmd[0])));
+    conn->asking = client_cmd[0] == "asking";
+  }
+
+  void handle_large_msg(Conn* conn) {
+    /* Parses the complete request in read_chain. The value of a set is split
+     * off the chain and stored as is, any other large argument is copied
+     * into a string once */
+    BufferChain& in = conn->read_chain;
+    in.consume(4);  // msg_len
+
+    uint32_t n_strs = 0;
+    in.copy_out(0, &n_strs, 4U);
+    in.consume(4);
+
+    std::vector<std::string> client_cmd;
+    Value large_val;
+    size_t large_idx = 0;
+    while (client_cmd.size() < n_strs) {
+      uint32_t str_len = 0;
+      if (in.size() < 4) break;
+      in.copy_out(0, &str_len, 4U);
+      in.consume(4);
+      if (str_len == 0 || str_len > in.size()) break;
+
+      if (str_len >= LARGE_ARG_BYTES && !large_val.chained()) {
+        large_idx = client_cmd.size();
+        large_val = Value(in.split_front(str_len));
+        client_cmd.emplace_back();
+      } else {
+        client_cmd.emplace_back(str_len, '\0');
+        in.copy_out(0, client_cmd.back().data(), str_len);
+        in.consume(str_len);
+      }
+    }
+
+    bool valid = n_strs > 0 && client_cmd.size() == n_strs && in.empty();
+    in.clear();
+    conn->large_msg_len = 0;
+    if (!valid) {
+      conn->want_close = true;
+      return;
+    }
+
+    CommandClock clock(stats_shard_, slowlog_.enabled());
+    if (large_val.chained() &&
+        (client_cmd[0] == "set" || client_cmd[0] == "publish") &&
+        n_strs == 3 && large_idx == 2) {
+      execute_cmd(conn, client_cmd, clock, &large_val);
+    } else {
+      if (large_val.chained()) client_cmd[large_idx] = large_val.to_string();
+      execute_cmd(conn, client_cmd, clock);
+    }
+  }
+
+  bool handle_sync_reply(Conn* conn) {
+    /* Reply to our psync is either
+     * "fullresync <replid> <offset> <snapshot_bytes>" or
+     * "continue <replid> <offset>" */
+    uint32_t resp_len = 0;
+    Status status;
+    memcpy(&resp_len, conn->read_buf.data(), 4U);
+    memcpy(&status, conn->read_buf.data() + 4U, 4U);
+    if (status != Status::Valid || resp_len < 4) return false;
+
+    std::istringstream iss(std::string(
+        reinterpret_cast<const char*>(conn->read_buf.data() + 8U),
+        resp_len - 4));
+    std::string mode, replid;
+    uint64_t offset = 0, snapshot_bytes = 0;
+    iss >> mode >> replid >> offset;
+
+    if (mode == "fullresync") {
+      iss >> snapshot_bytes;
+      flush_keyspace(config_.lazyfree_threshold > 0);
+      snapshot_remaining_ = snapshot_bytes;
+    } else if (mode != "continue") {
+      return false;
+    }
+
+    leader_replid_ = replid;
+    leader_offset_ = offset;
+    awaiting_sync_reply_ = false;
+    return true;
+  }
+
+  bool parse_leader_stream(Conn* conn) {
+    /* Applies the stream sent by our leader. Streamed commands are never
+     * replied to, the leader does not read from its replicas */
+    if (conn->read_buf.size() < 4) return false;
+
+    uint32_t msg_len = 0;
+    memcpy(&msg_len, static_cast<void*>(conn->read_buf.data()), 4);
+    if (4 + msg_len > conn->read_buf.size()) {
+      return false;
+    }
+
+    if (awaiting_sync_reply_) {
+      if (!handle_sync_reply(conn)) {
+        conn->want_close = true;
+        return false;
+      }
+    } else {
+      std::vector<std::string> client_cmd;
+      if (parse_msg(conn->read_buf, client_cmd) < 0) {
+        conn->want_close = true;
+        return false;
+      }
+      apply_write(client_cmd);
+
+      // snapshot entries are not part of the leader's stream offsets
+      if (snapshot_remaining_ > 0) {
+        snapshot_remaining_ -= 4 + msg_len;
+      } else {
+        leader_offset_ += 4 + msg_len;
+      }
+    }
+
+    conn->read_buf.consume(msg_len + 4);
+    return true;
+  }
+
+  Conn* connect_to_leader() {
+    /* Opens the link to our leader and queues a psync on it */
+    int fd = connect_tcp(config_.leader_host, config_.leader_port);
+    if (fd < 0) return nullptr;
+
+    fd_set_nb(fd);
+    Conn* conn = new Conn;
+    conn->fd = fd;
+    conn->kind = ConnKind::Leader;
+    conn->want_write = true;
+    encode_cmd({"psync", leader_replid_, std::to_string(leader_offset_)},
+               conn->write_buf);
+    awaiting_sync_reply_ = true;
+    return conn;
+  }
+
+  int maintain_leader_link(std::vector<Conn*>& conn_list) {
+    /* Reconnects to the leader if needed, returns the poll timeout in ms */
+    if (!is_follower() || leader_conn_ != nullptr) return -1;
+
+    auto now = Clock::now();
+    if (now >= next_leader_retry_) {
+      leader_conn_ = connect_to_leader();
+      if (leader_conn_ != nullptr) {
+        track_conn(conn_list, leader_conn_);
+        return -1;
+      }
+      next_leader_retry_ = now + LEADER_RETRY_INTERVAL;
+    }
+
+    return static_cast<int>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            next_leader_retry_ - now)
+            .count());
+  }
+
+  void track_conn(std::vector<Conn*>& conn_list, Conn* conn) {
+    if (conn_list.size() <= static_cast<size_t>(conn->fd)) {
+      conn_list.resize(conn->fd + 1);
+    }
+    conn_list[conn->fd] = conn;
+    conn->id = next_conn_id_++;
+    conn->created_ns = conn->last_active_ns = loop_now_ns_;
+    update_conn_memory(conn);
+  }
+
+  void close_conn(std::vector<Conn*>& conn_list, Conn* conn) {
+    if (conn->kind == ConnKind::Replica) {
+      std::erase(replicas_, conn);
+    } else if (conn->kind == ConnKind::Leader) {
+      // keep leader_replid_ and leader_offset_ so we can partially resync
+      leader_conn_ = nullptr;
+      next_leader_retry_ = Clock::now() + LEADER_RETRY_INTERVAL;
+    }
+
+    if (conn->kind != ConnKind::Leader) stats_.client_disconnected();
+    if (conn->input_pending) std::erase(pending_input_, conn);
+    if (conn->blocked()) {
+      blocked_.unblock(conn);
+      stats_.blocked_changed(blocked_.size());
+    }
+    if (conn->subscribed()) pubsub_.unsubscribe_all(conn);
+    if (conn->tracking_bcast) tracking_.remove_prefixes(conn);
+    watches_.unwatch_all(conn->tx.watched);
+    stats_.conn_memory_changed(-static_cast<int64_t>(conn->reported_memory));
+
+    close(conn->fd);
+    conn_list[conn->fd] = nullptr;
+    delete conn;
+  }
+
+  Conn* handle_accept(int listen_fd) {
     /* Accept the first connection request in queue of pending connections to
-     * server */
-    struct sockaddr_in client_addr = {};
+     * listen_fd */
+    struct sockaddr_storage client_addr = {};
     socklen_t addrlen = sizeof(client_addr);
 
-    int conn_fd = accept(server_fd_, (struct sockaddr*)&client_addr, &addrlen);
+    int conn_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &addrlen);
     if (conn_fd < 0) {
       return nullptr;
     }
 
     fd_set_nb(conn_fd);
+    if (config_.socket_busy_poll_us > 0) {
+      // raising it above net.core.busy_read needs CAP_NET_ADMIN, failures
+      // leave the socket as it was
+      int us = static_cast<int>(config_.socket_busy_poll_us);
+      setsockopt(conn_fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+#ifdef SO_PREFER_BUSY_POLL
+      int prefer = 1;
+      setsockopt(conn_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+                 sizeof(prefer));
+#endif
+    }
+
     Conn* conn = new Conn;
     conn->fd = conn_fd;
     conn->want_read = true;
+    stats_.client_connected();
     return conn;
   }
 
-  void handle_read(Conn* conn) {
-    /* Non-blocking read from buffer */
-    uint8_t buf[64 * 1024];
-    auto rv = recv(conn->fd, buf, sizeof(buf) - 1, 0);
-    if (rv < 0) {
-      conn->want_close = true;
-      return;
-    }
-    if (rv == 0 && conn->read_buf.size() == 0) {
-      // client closed connection
+  void read_large_msg(Conn* conn) {
+    /* Non-blocking read of the rest of a large request into segments, at
+     * most MAX_READ_IOV segments per call */
+    static constexpr size_t MAX_READ_IOV = 16;
+    struct iovec iov[MAX_READ_IOV];
+    size_t msg_bytes = 4 + static_cast<size_t>(conn->large_msg_len);
+    size_t n_iov = conn->read_chain.prepare_read(
+        iov, MAX_READ_IOV, msg_bytes - conn->read_chain.size());
+
+    ssize_t rv = readv(conn->fd, iov, static_cast<int>(n_iov));
+    if (rv <= 0) {
+      if (rv < 0 && errno == EAGAIN) return;
       conn->want_close = true;
       return;
     }
 
-    conn->read_buf.append(buf, rv);
-    while (parse_buffer(conn)) {
-    };
+    conn->read_chain.commit_read(rv);
+    conn->last_active_ns = loop_now_ns_;
+    stats_shard_->add_bytes_in(rv);
+    loop_bytes_ += rv;
+    if (conn->read_chain.size() == msg_bytes) handle_large_msg(conn);
+  }
 
-    if (conn->write_buf.size() > 0) {
-      conn->want_read = false;
-      conn->want_write = true;
-      handle_write(conn);
+  void handle_read(Conn* conn) {
+    /* Non-blocking read from buffer */
+    if (conn->large_msg_len > 0) {
+      read_large_msg(conn);
+    } else {
+      uint8_t buf[64 * 1024];
+      auto rv = recv(conn->fd, buf, sizeof(buf) - 1, 0);
+      if (rv <= 0) {
+        // error or client closed connection
+        conn->want_close = true;
+        return;
+      }
+
+      conn->read_buf.append(buf, rv);
+      conn->read_peak = std::max(conn->read_peak, conn->read_buf.size());
+      conn->last_active_ns = loop_now_ns_;
+      stats_shard_->add_bytes_in(rv);
+      loop_bytes_ += rv;
+      if (conn->kind == ConnKind::Leader) {
+        while (parse_leader_stream(conn)) {
+        };
+      } else {
+        process_input(conn);
+        if (conn->input_pending) pending_input_.push_back(conn);
+      }
     }
+
+    update_conn_memory(conn);
+    update_interest(conn);
+    if (conn->want_write) handle_write(conn);
+  }
+
+  void update_interest(Conn* conn) {
+    /* Writes while there is output. Reads pause while requests are left over
+     * or the output is above the high watermark, the client then blocks on
+     * its full socket instead of growing our buffers. A blocked connection
+     * is read until it has pipelined a request, to notice it closing */
+    conn->want_write = conn->has_output();
+    conn->want_read = !conn->input_pending && !output_paused(conn) &&
+                      !(conn->blocked() && has_request(conn));
   }
 
   void handle_write(Conn* conn) {
-    /* Non-blocking write to buffer */
-    ssize_t rv = send(conn->fd, static_cast<void*>(conn->write_buf.data()),
-                      conn->write_buf.size(), 0);
+    /* Non-blocking write of write_buf followed by write_chain */
+    static constexpr size_t MAX_WRITE_IOV = 64;
+    struct iovec iov[MAX_WRITE_IOV];
+    size_t n_iov = 0;
+    if (conn->write_buf.size() > 0) {
+      iov[n_iov++] = {conn->write_buf.data(), conn->write_buf.size()};
+    }
+    n_iov += conn->write_chain.fill_iov(iov + n_iov, MAX_WRITE_IOV - n_iov);
+
+    ssize_t rv = writev(conn->fd, iov, static_cast<int>(n_iov));
     if (rv < 0) {
       if (errno != EAGAIN) conn->want_close = true;
       return;
     }
 
-    if (rv == static_cast<ssize_t>(conn->write_buf.size())) {
-      conn->want_write = false;
-      conn->want_read = true;
+    conn->last_active_ns = loop_now_ns_;
+    stats_shard_->add_bytes_out(rv);
+    loop_bytes_ += rv;
+
+    size_t written = static_cast<size_t>(rv);
+    conn->snapshot_bytes -= std::min(conn->snapshot_bytes, written);
+    if (written >= conn->write_buf.size()) {
+      written -= conn->write_buf.size();
       conn->write_buf.clear();
+      conn->write_chain.consume(written);
     } else {
-      conn->write_buf.consume(rv);
+      conn->write_buf.consume(written);
     }
+
+    update_interest(conn);
+    update_conn_memory(conn);
   }
 
  public:
-  ServerEventLoop(int port) : ServerBase(port) {}
+  ServerEventLoop(int port, const ServerConfig& config = {})
+      : ServerBase(port, config.unix_sockets),
+        config_(config),
+        replid_(generate_replid()),
+        backlog_(config.repl_backlog_size),
+        stats_({"get", "set", "del", "restore", "asking", "cluster", "role",
+                "psync", "info", "slowlog", "loopstats", "client", "subscribe",
+                "unsubscribe", "psubscribe", "punsubscribe", "publish",
+                "hotkeys", "bigkeys", "unlink", "flushall", "hset", "hget",
+                "hmget", "hdel", "hgetall", "hincrby", "lpush", "rpush",
+                "lpop", "rpop", "lrange", "llen", "blpop", "bf.reserve",
+                "bf.add", "bf.madd", "bf.exists", "pfadd", "pfcount",
+                "pfmerge", "keys", "scan", "range", "multi", "exec",
+                "discard", "watch", "unwatch", "cas"},
+               config.latency_tracking),
+        stats_shard_(stats_.acquire_shard()),
+        slowlog_(config.slowlog_slower_than_us, config.slowlog_max_len),
+        loop_monitor_(config.loop_budget_us),
+        busy_poll_(config.busy_poll_us),
+        tracking_(config.tracking_table_max_keys),
+        hot_keys_(config.hotkeys_sample, config.hotkeys_top),
+        big_keys_(config.hotkeys_top),
+        lazy_free_(&stats_) {
+    if (config.key_index) stats_.key_index_changed(0);
+    if (!config.cluster_nodes.empty()) {
+      cluster_ =
+          ClusterState(config.cluster_nodes, static_cast<uint16_t>(port));
+    }
+  }
 
   int run_server() {
-    std::vector<Conn*> conn_list;  // key = fd, val = connection info
+    std::vector<Conn*>& conn_list = conn_list_;
     std::vector<struct pollfd> poll_args;
 
+    if (config_.cpu >= 0 && !pin_current_thread(config_.cpu)) {
+      std::cerr << "Failed to pin the event loop to cpu " << config_.cpu
+                << "\n";
+    }
+
+    // the end of one iteration is the start of the next
+    uint64_t iter_start_ns = monotonic_ns();
+
     while (1) {
+      int timeout_ms = maintain_leader_link(conn_list);
+      if (reclaim_pending_) {
+        // wake up to shrink the buffers of connections that went idle
+        int reclaim_ms = static_cast<int>(RECLAIM_INTERVAL_NS / 1000000);
+        if (timeout_ms < 0 || timeout_ms > reclaim_ms) timeout_ms = reclaim_ms;
+      }
+      int block_ms = blocked_.timeout_ms(monotonic_ns());
+      if (block_ms >= 0 && (timeout_ms < 0 || timeout_ms > block_ms)) {
+        timeout_ms = block_ms;  // wake up for the first blpop timeout
+      }
+      if (has_runnable_input()) timeout_ms = 0;
+
+      // listeners first, see listen_fds_
       poll_args.clear();
-      struct pollfd pfd = {static_cast<int>(server_fd_), POLLIN, 0};
-      poll_args.push_back(pfd);
+      for (int listen_fd : listen_fds_) {
+        poll_args.push_back({listen_fd, POLLIN, 0});
+      }
 
       for (Conn* conn : conn_list) {
         if (conn == nullptr) continue;
+        if (conn->want_close) {
+          // cut off outside of its own events, e.g. a replica over its limit
+          close_conn(conn_list, conn);
+          continue;
+        }
 
         struct pollfd pfd = {conn->fd, POLLERR, 0};
         if (conn->want_read) pfd.events |= POLLIN;
@@ -148,42 +2417,81 @@ class ServerEventLoop final : private ServerBase {
         poll_args.push_back(pfd);
       }
 
-      // blocks until ANY of the fd in poll_args become ready to perform I/O
-      int rv =
-          poll(poll_args.data(), static_cast<nfds_t>(poll_args.size()), -1);
-      if (rv < 0 && errno == EINTR)
+      // blocks until ANY of the fd in poll_args become ready to perform I/O,
+      // in low-latency mode after spinning on non-blocking polls first
+      uint64_t poll_start_ns = monotonic_ns();
+      nfds_t nfds = static_cast<nfds_t>(poll_args.size());
+      uint64_t spin_ns = timeout_ms != 0 ? busy_poll_.window_ns() : 0;
+      uint64_t spun_ns = 0;
+      int rv = 0;
+      while (spun_ns < spin_ns) {
+        rv = poll(poll_args.data(), nfds, 0);
+        spun_ns = monotonic_ns() - poll_start_ns;
+        if (rv != 0) break;
+      }
+      bool spin_hit = rv != 0;
+      if (!spin_hit) rv = poll(poll_args.data(), nfds, timeout_ms);
+      uint64_t poll_end_ns = monotonic_ns();
+      if (busy_poll_.enabled() && timeout_ms != 0) {
+        // a timeout is no arrival, it counts as a long wait
+        uint64_t waited_ns = rv == 0 ? UINT64_MAX : poll_end_ns - poll_start_ns;
+        busy_poll_.record(spun_ns, waited_ns, spin_hit);
+      }
+      loop_now_ns_ = poll_end_ns;
+      if (rv < 0 && errno == EINTR) {
+        iter_start_ns = poll_end_ns;
         continue;
-      else if (rv < 0) {
+      } else if (rv < 0) {
         std::cerr << "Failed to connect";
         return 1;
       }
 
       // accept any new connections
-      if (poll_args[0].revents) {
-        if (Conn* conn = handle_accept()) {
-          if (conn_list.size() <= static_cast<size_t>(conn->fd)) {
-            conn_list.resize(conn->fd + 1);
-          }
-          conn_list[conn->fd] = conn;
+      size_t n_listen = listen_fds_.size();
+      for (size_t i = 0; i < n_listen; ++i) {
+        if (!poll_args[i].revents) continue;
+        if (Conn* conn = handle_accept(poll_args[i].fd)) {
+          track_conn(conn_list, conn);
         }
       }
 
+      // requests left over from earlier iterations go first, a connection
+      // only becomes pending while handling its own events below
+      run_pending_input();
+
       // handle all open connections
-      for (int i = 1; i < static_cast<int>(poll_args.size()); ++i) {
+      for (size_t i = n_listen; i < poll_args.size(); ++i) {
         uint32_t rdy = poll_args[i].revents;
         Conn* conn = conn_list[poll_args[i].fd];
         if (rdy & POLLIN) handle_read(conn);
         if (rdy & POLLOUT) handle_write(conn);
 
         if ((rdy & (POLLERR | POLLHUP)) || (conn->want_close)) {
-          close(conn->fd);
-          conn_list[conn->fd] = nullptr;
-          delete conn;
+          close_conn(conn_list, conn);
         }
       }
+
+      expire_blocked();
+
+      if (reclaim_pending_ && poll_end_ns >= next_reclaim_ns_) {
+        reclaim_buffers();
+        next_reclaim_ns_ = poll_end_ns + RECLAIM_INTERVAL_NS;
+      }
+
+      uint64_t iter_end_ns = monotonic_ns();
+      LoopMonitor::Iteration iter;
+      iter.start_ns = iter_start_ns;
+      iter.poll_ns = poll_end_ns - poll_start_ns;
+      iter.process_ns = (poll_start_ns - iter_start_ns) +
+                        (iter_end_ns - poll_end_ns);
+      iter.ready = static_cast<uint32_t>(rv);
+      iter.bytes = loop_bytes_;
+      loop_monitor_.record(iter);
+      loop_bytes_ = 0;
+      iter_start_ns = iter_end_ns;
     }
 
-    close(server_fd_);
+    for (int listen_fd : listen_fds_) close(listen_fd);
     return 0;
   }
 };
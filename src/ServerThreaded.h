@@ -1,8 +1,10 @@
 #pragma once
 
 #include <arpa/inet.h>
+#include <poll.h>
 #include <unistd.h>
 
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -10,34 +12,159 @@
 
 #include "Buffer.h"
 #include "ServerBase.h"
+#include "ServerConfig.h"
+#include "Stats.h"
+#include "Transaction.h"
 
 class ServerThreaded final : private ServerBase {
  private:
   std::unordered_map<std::string, std::string> server_data_;
-  std::mutex mtx_;  // to protect server_data_ from race conditions
+  WatchTable watches_;  // versions of keys watched by transactions
+  std::mutex mtx_;  // to protect server_data_ and watches_ from races
 
-  void respond_to_client(std::vector<std::string>& client_cmd,
-                         Buffer& write_buf) {
-    Response server_resp;
+  // every client thread records into its own shard, client threads are
+  // detached so they share ownership of the stats
+  std::shared_ptr<ServerStats> stats_;
+  uint64_t conn_idle_ns_;  // 0 never shrinks buffers
+
+  static bool is_data_cmd(const std::vector<std::string>& client_cmd) {
+    const std::string& name = client_cmd[0];
+    return name == "get" || name == "set" || name == "del" ||
+           (name == "cas" && client_cmd.size() == 4);
+  }
 
+  void run_data_cmd(const std::vector<std::string>& client_cmd,
+                    Response& server_resp) {
+    /* get, set, del or cas <key> <expected> <new>, which sets key to new
+     * and replies 1 if it holds expected and replies 0 otherwise. The
+     * caller holds mtx_ */
+    const std::string& key = client_cmd[1];
     if (client_cmd[0] == "get") {
-      std::scoped_lock lock_(mtx_);  // blocks until mutex free
-      auto it = server_data_.find(client_cmd[1]);
+      auto it = server_data_.find(key);
       if (it == server_data_.end()) {
         server_resp.status = Status::Invalid;
       } else {
         server_resp.data.append(reinterpret_cast<uint8_t*>(&it->second[0]),
                                 static_cast<uint32_t>(it->second.size()));
       }
-      // scoped_lock dtor called and mutex freed
     } else if (client_cmd[0] == "set") {
-      std::scoped_lock lock_(mtx_);  // blocks until mutex free
-      server_data_[client_cmd[1]] = client_cmd[2];
-      // scoped_lock dtor called and mutex freed
+      server_data_[key] = client_cmd[2];
+      watches_.touch(key);
     } else if (client_cmd[0] == "del") {
+      if (server_data_.erase(key) > 0) watches_.touch(key);
+    } else {
+      auto it = server_data_.find(key);
+      bool match = it != server_data_.end() && it->second == client_cmd[2];
+      if (match) {
+        it->second = client_cmd[3];
+        watches_.touch(key);
+      }
+      server_resp.append(match ? "1" : "0");
+    }
+  }
+
+  void exec_command(Transaction& tx, Response& server_resp) {
+    /* Runs the queued commands with mtx_ held throughout, so no other
+     * client's command lands in between, and replies with a list of their
+     * replies, see decode_replies. Nothing runs if a command was refused
+     * while queued, or if a watched key changed, the reply is then Invalid */
+    if (!tx.active) {
+      server_resp.status = Status::Error;
+      server_resp.append("ERR exec without multi");
+      return;
+    }
+    std::vector<std::string> replies;
+    bool changed = false;
+    {
+      std::scoped_lock lock_(mtx_);
+      changed = watches_.changed(tx.watched);
+      watches_.unwatch_all(tx.watched);
+      for (size_t i = 0; i < tx.queued.size() && !tx.failed && !changed;
+           ++i) {
+        Response reply;
+        run_data_cmd(tx.queued[i], reply);
+        std::string& out = replies.emplace_back(
+            reinterpret_cast<const char*>(&reply.status), 4);
+        out.append(reinterpret_cast<const char*>(reply.data.data()),
+                   reply.data.size());
+      }
+    }
+    if (tx.failed) {
+      server_resp.status = Status::Error;
+      server_resp.append(
+          "EXECABORT transaction discarded because of earlier errors");
+    } else if (changed) {
+      server_resp.status = Status::Invalid;
+    } else {
+      uint32_t n_strs = static_cast<uint32_t>(replies.size());
+      server_resp.data.append(reinterpret_cast<const uint8_t*>(&n_strs), 4U);
+      for (const std::string& reply : replies) {
+        uint32_t len = static_cast<uint32_t>(reply.size());
+        server_resp.data.append(reinterpret_cast<const uint8_t*>(&len), 4U);
+        server_resp.append(reply);
+      }
+    }
+    tx = Transaction();
+  }
+
+  void respond_to_client(std::vector<std::string>& client_cmd,
+                         Transaction& tx, ConnBuffer& write_buf) {
+    /* tx is the connection's multi state, after multi every command but
+     * exec and discard is queued, only get, set, del and cas are accepted */
+    Response server_resp;
+    const std::string& name = client_cmd[0];
+
+    if (tx.active && name != "exec" && name != "discard" &&
+        name != "multi" && name != "watch" && name != "unwatch") {
+      if (is_data_cmd(client_cmd)) {
+        tx.queued.push_back(std::move(client_cmd));
+        server_resp.append("QUEUED");
+      } else {
+        server_resp.status = Status::Error;
+        server_resp.append("ERR " + name + " is not allowed in a transaction");
+        tx.failed = true;
+      }
+    } else if (is_data_cmd(client_cmd)) {
       std::scoped_lock lock_(mtx_);  // blocks until mutex free
-      server_data_.erase(client_cmd[1]);
+      run_data_cmd(client_cmd, server_resp);
       // scoped_lock dtor called and mutex freed
+    } else if (name == "multi" && client_cmd.size() == 1) {
+      if (tx.active) {
+        server_resp.status = Status::Error;
+        server_resp.append("ERR multi calls can not be nested");
+      }
+      tx.active = true;
+    } else if (name == "exec" && client_cmd.size() == 1) {
+      exec_command(tx, server_resp);
+    } else if (name == "discard" && client_cmd.size() == 1) {
+      if (!tx.active) {
+        server_resp.status = Status::Error;
+        server_resp.append("ERR discard without multi");
+      }
+      std::scoped_lock lock_(mtx_);
+      watches_.unwatch_all(tx.watched);
+      tx = Transaction();
+    } else if (name == "watch" && client_cmd.size() >= 2) {
+      if (tx.active) {
+        server_resp.status = Status::Error;
+        server_resp.append("ERR watch inside multi is not allowed");
+      } else {
+        std::scoped_lock lock_(mtx_);
+        for (size_t i = 1; i < client_cmd.size(); ++i) {
+          watches_.watch(client_cmd[i], tx.watched);
+        }
+      }
+    } else if (name == "unwatch" && client_cmd.size() == 1) {
+      std::scoped_lock lock_(mtx_);
+      watches_.unwatch_all(tx.watched);
+    } else if (name == "info" && client_cmd.size() <= 2) {
+      size_t n_keys = 0;
+      {
+        std::scoped_lock lock_(mtx_);
+        n_keys = server_data_.size();
+      }
+      server_resp.append(
+          stats_->info(client_cmd.size() == 2 ? client_cmd[1] : "", n_keys));
     } else {
       server_resp.status = Status::Invalid;
     }
@@ -51,7 +178,8 @@ class ServerThreaded final : private ServerBase {
     }
   }
 
-  bool parse_buffer(Buffer& read_buf, Buffer& write_buf) {
+  bool parse_buffer(ConnBuffer& read_buf, ConnBuffer& write_buf,
+                    Transaction& tx, CommandClock& clock) {
     if (read_buf.size() < 4) return false;
 
     // first 4 bytes of msg stores total size of msg in bytes
@@ -66,16 +194,27 @@ class ServerThreaded final : private ServerBase {
       return false;
     }
 
-    respond_to_client(client_cmd, write_buf);
+    uint32_t cmd_id = stats_->command_id(client_cmd[0]);
+    respond_to_client(client_cmd, tx, write_buf);
+    clock.record(cmd_id);
     read_buf.consume(msg_len + 4);
 
     return true;
   }
 
-  void handle_request(int client_fd) {
-    Buffer read_buf{256};
-    Buffer write_buf{256};
+  void handle_request(int client_fd, std::shared_ptr<ServerStats> stats,
+                      uint64_t conn_idle_ns) {
+    ConnBuffer read_buf{CONN_BUF_SIZE};
+    ConnBuffer write_buf{CONN_BUF_SIZE};
+    Transaction tx;
     uint8_t temp_buffer[64 * 1024];
+    StatsShard* shard = stats->acquire_shard();
+    stats->client_connected();
+
+    // buffers are shrunk back once the client was idle for conn_idle_ns
+    size_t memory = read_buf.capacity() + write_buf.capacity();
+    uint64_t idle_since_ns = 0;
+    stats->conn_memory_changed(static_cast<int64_t>(memory));
 
     while (1) {
       ssize_t rv =
@@ -84,6 +223,7 @@ class ServerThreaded final : private ServerBase {
       if (rv > 0) {
         // got data, append to read buffer
         read_buf.append(temp_buffer, rv);
+        shard->add_bytes_in(rv);
       } else if (rv == 0) {
         // client closed connection
         break;
@@ -94,7 +234,8 @@ class ServerThreaded final : private ServerBase {
       }
 
       // process all complete messages in the buffer
-      while (parse_buffer(read_buf, write_buf)) {
+      CommandClock clock(shard);
+      while (parse_buffer(read_buf, write_buf, tx, clock)) {
       }
 
       // send any pending responses
@@ -105,44 +246,91 @@ class ServerThreaded final : private ServerBase {
                             write_buf.size() - sent, 0);
           if (rv <= 0) {
             std::cerr << "Error writing to client\n";
-            close(client_fd);
-            return;
+            break;
           }
           sent += rv;
         }
+        shard->add_bytes_out(sent);
+        if (sent < static_cast<ssize_t>(write_buf.size())) break;
         write_buf.clear();
       }
 
       // if no data was read and no data pending, wait a bit before trying again
       if (rv < 0 && read_buf.size() == 0) {
+        uint64_t now_ns = monotonic_ns();
+        if (idle_since_ns == 0) {
+          idle_since_ns = now_ns;
+        } else if (conn_idle_ns > 0 && now_ns - idle_since_ns >= conn_idle_ns) {
+          read_buf.shrink(CONN_BUF_SIZE);
+          write_buf.shrink(CONN_BUF_SIZE);
+        }
         usleep(1000);  // 1ms sleep to avoid busy waiting
+      } else {
+        idle_since_ns = 0;
+      }
+
+      size_t now_memory = read_buf.capacity() + write_buf.capacity();
+      if (now_memory != memory) {
+        stats->conn_memory_changed(static_cast<int64_t>(now_memory) -
+                                   static_cast<int64_t>(memory));
+        memory = now_memory;
       }
     }
 
+    {
+      std::scoped_lock lock_(mtx_);
+      watches_.unwatch_all(tx.watched);
+    }
+    stats->conn_memory_changed(-static_cast<int64_t>(memory));
+    stats->client_disconnected();
+    stats->release_shard(shard);
     close(client_fd);
   }
 
  public:
-  ServerThreaded(int port) : ServerBase(port) {}
+  ServerThreaded(int port, const ServerConfig& config = {})
+      : ServerBase(port, config.unix_sockets),
+        stats_(std::make_shared<ServerStats>(
+            std::initializer_list<std::string_view>{
+                "get", "set", "del", "info", "multi", "exec", "discard",
+                "watch", "unwatch", "cas"},
+            config.latency_tracking)),
+        conn_idle_ns_(config.conn_idle_ms * 1000000ULL) {}
 
   int run_server() {
-    while (1) {
-      // accept incoming connections and get connection fd
-      struct sockaddr_in client_addr = {};
-      socklen_t addrlen = sizeof(client_addr);
+    std::vector<struct pollfd> poll_args;
+    for (int listen_fd : listen_fds_) {
+      poll_args.push_back({listen_fd, POLLIN, 0});
+    }
 
-      int client_fd =
-          accept(server_fd_, (struct sockaddr*)&client_addr, &addrlen);
-      if (client_fd < 0) {
+    while (1) {
+      // wait for a connection on any listener, they are non-blocking
+      if (poll(poll_args.data(), static_cast<nfds_t>(poll_args.size()), -1) <
+          0) {
         continue;
       }
 
-      std::thread t(&ServerThreaded::handle_request, this, client_fd);
-      t.detach();
+      for (const struct pollfd& pfd : poll_args) {
+        if (!pfd.revents) continue;
+
+        // accept incoming connections and get connection fd
+        struct sockaddr_storage client_addr = {};
+        socklen_t addrlen = sizeof(client_addr);
+
+        int client_fd =
+            accept(pfd.fd, (struct sockaddr*)&client_addr, &addrlen);
+        if (client_fd < 0) {
+          continue;
+        }
+
+        std::thread t(&ServerThreaded::handle_request, this, client_fd,
+                      stats_, conn_idle_ns_);
+        t.detach();
+      }
     }
 
-    // close the listening server socket
-    close(server_fd_);
+    // close the listening server sockets
+    for (int listen_fd : listen_fds_) close(listen_fd);
     return 0;
   }
 };
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+/* Ring of the most recent commands whose execution took longer than a
+ * threshold. Only commands that are already slow pay for building an entry,
+ * and arguments are truncated so a slow "set" of a huge value does not pin a
+ * copy of it in memory */
+
+class SlowLog {
+ public:
+  static constexpr size_t MAX_ARGS = 32;       // args kept per entry
+  static constexpr size_t MAX_ARG_BYTES = 128;  // bytes kept per arg
+
+  struct Entry {
+    uint64_t id;
+    int64_t unix_time_us;  // when the command finished
+    uint64_t duration_us;
+    std::vector<std::string> args;
+  };
+
+ private:
+  int64_t threshold_us_;  // negative disables the log
+  size_t max_len_;
+  uint64_t next_id_ = 0;
+  std::deque<Entry> entries_;  // newest first
+
+ public:
+  static std::string truncate_arg(const std::string& arg) {
+    /* Printable copy of at most MAX_ARG_BYTES of arg, also used for keys
+     * in the hotkeys and bigkeys reports */
+    std::string out;
+    size_t n = std::min(arg.size(), MAX_ARG_BYTES);
+    for (size_t i = 0; i < n; ++i) {
+      unsigned char c = static_cast<unsigned char>(arg[i]);
+      if (c > 32 && c < 127 && c != '\\') {
+        out += static_cast<char>(c);
+      } else {
+        char hex[5];
+        snprintf(hex, sizeof(hex), "\\x%02x", c);
+        out += hex;
+      }
+    }
+    if (arg.size() > n) {
+      out += "...(" + std::to_string(arg.size() - n) + "_more_bytes)";
+    }
+    return out;
+  }
+
+  SlowLog(int64_t threshold_us, size_t max_len)
+      : threshold_us_(threshold_us), max_len_(max_len) {}
+
+  inline bool enabled() const noexcept {
+    return threshold_us_ >= 0 && max_len_ > 0;
+  }
+
+  inline size_t size() const noexcept { return entries_.size(); }
+
+  inline void reset() noexcept { entries_.clear(); }
+
+  void maybe_add(const std::vector<std::string>& cmd, uint64_t elapsed_ns) {
+    uint64_t duration_us = elapsed_ns / 1000;
+    if (!enabled() || duration_us < static_cast<uint64_t>(threshold_us_)) {
+      return;
+    }
+
+    Entry entry;
+    entry.id = next_id_++;
+    entry.unix_time_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    entry.duration_us = duration_us;
+
+    size_t n_args = cmd.size() > MAX_ARGS ? MAX_ARGS - 1 : cmd.size();
+    for (size_t i = 0; i < n_args; ++i) {
+      entry.args.push_back(truncate_arg(cmd[i]));
+    }
+    if (n_args < cmd.size()) {
+      entry.args.push_back("...(" + std::to_string(cmd.size() - n_args) +
+                           "_more_args)");
+    }
+
+    entries_.push_front(std::move(entry));
+    if (entries_.size() > max_len_) entries_.pop_back();
+  }
+
+  std::string get(size_t count) const {
+    /* Newest count entries, one per line as
+     * "<id> <unix time us> <duration us> <arg> <arg> ..." */
+    std::string out;
+    for (size_t i = 0; i < entries_.size() && i < count; ++i) {
+      const Entry& entry = entries_[i];
+      out += std::to_string(entry.id) + " " +
+             std::to_string(entry.unix_time_us) + " " +
+             std::to_string(entry.duration_us);
+      for (const auto& arg : entry.args) out += " " + arg;
+      out += "\n";
+    }
+    return out;
+  }
+};
@@ -0,0 +1,429 @@
+#pragma once
+
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Histogram.h"
+
+/* Server instrumentation. Every thread that executes commands records into its
+ * own StatsShard using relaxed loads and stores only, so the command path never
+ * takes a lock or writes a cache line shared with another thread. Readers such
+ * as the info command walk all shards and merge them on the fly */
+
+inline uint64_t monotonic_ns() noexcept {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+class ConcurrentHistogram {
+  /* LatencyHistogram layout with atomic counters, written by a single thread
+   * and readable from any thread at any time */
+ private:
+  static constexpr uint64_t MAX_VALUE = 10ULL * 1000000000ULL;  // 10s in ns
+  static constexpr size_t N_BUCKETS =
+      LatencyHistogram::bucket_index(MAX_VALUE) + 1;
+
+  std::array<std::atomic<uint64_t>, N_BUCKETS> counts_{};
+  std::atomic<uint64_t> max_{0};
+
+  static inline void bump(std::atomic<uint64_t>& c, uint64_t n) noexcept {
+    // single writer, so no locked read-modify-write is needed
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+ public:
+  inline void record(uint64_t value) noexcept {
+    value = std::min(value, MAX_VALUE);
+    bump(counts_[LatencyHistogram::bucket_index(value)], 1);
+    if (value > max_.load(std::memory_order_relaxed)) {
+      max_.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  void add(const ConcurrentHistogram& other) noexcept {
+    for (size_t i = 0; i < N_BUCKETS; ++i) {
+      uint64_t n = other.counts_[i].load(std::memory_order_relaxed);
+      if (n) bump(counts_[i], n);
+    }
+    uint64_t other_max = other.max_.load(std::memory_order_relaxed);
+    if (other_max > max_.load(std::memory_order_relaxed)) {
+      max_.store(other_max, std::memory_order_relaxed);
+    }
+  }
+
+  void snapshot(LatencyHistogram& out) const {
+    for (size_t i = 0; i < N_BUCKETS; ++i) {
+      uint64_t n = counts_[i].load(std::memory_order_relaxed);
+      if (n) {
+        out.record(std::min(LatencyHistogram::bucket_value(i),
+                            max_.load(std::memory_order_relaxed)),
+                   n);
+      }
+    }
+  }
+};
+
+struct CommandCounters {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<ConcurrentHistogram*> latency{nullptr};  // made on first call
+};
+
+class StatsShard {
+  /* Counters of one thread, only that thread may call the record functions */
+  friend class ServerStats;
+
+ private:
+  std::unique_ptr<CommandCounters[]> commands_;
+  size_t n_commands_;
+  bool timing_;
+  std::atomic<uint64_t> bytes_in_{0};
+  std::atomic<uint64_t> bytes_out_{0};
+
+  static inline void bump(std::atomic<uint64_t>& c, uint64_t n) noexcept {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  ConcurrentHistogram& latency(CommandCounters& cmd) {
+    ConcurrentHistogram* hist = cmd.latency.load(std::memory_order_relaxed);
+    if (hist == nullptr) {
+      hist = new ConcurrentHistogram;
+      cmd.latency.store(hist, std::memory_order_release);
+    }
+    return *hist;
+  }
+
+  void add(StatsShard& other) {
+    /* Folds other into this shard, caller must be the only writer of both */
+    for (size_t i = 0; i < n_commands_; ++i) {
+      CommandCounters& from = other.commands_[i];
+      bump(commands_[i].calls, from.calls.load(std::memory_order_relaxed));
+      bump(commands_[i].total_ns,
+           from.total_ns.load(std::memory_order_relaxed));
+      if (ConcurrentHistogram* hist = from.latency.load()) {
+        latency(commands_[i]).add(*hist);
+      }
+    }
+    bump(bytes_in_, other.bytes_in_.load(std::memory_order_relaxed));
+    bump(bytes_out_, other.bytes_out_.load(std::memory_order_relaxed));
+  }
+
+ public:
+  StatsShard(size_t n_commands, bool timing)
+      : commands_(new CommandCounters[n_commands]),
+        n_commands_(n_commands),
+        timing_(timing) {}
+
+  ~StatsShard() {
+    for (size_t i = 0; i < n_commands_; ++i) delete commands_[i].latency;
+  }
+
+  StatsShard(const StatsShard&) = delete;
+  StatsShard& operator=(const StatsShard&) = delete;
+
+  inline bool timing() const noexcept { return timing_; }
+
+  inline void record_call(uint32_t cmd_id, uint64_t elapsed_ns) {
+    CommandCounters& cmd = commands_[cmd_id];
+    bump(cmd.calls, 1);
+    if (timing_) {
+      bump(cmd.total_ns, elapsed_ns);
+      latency(cmd).record(elapsed_ns);
+    }
+  }
+
+  inline void add_bytes_in(uint64_t n) noexcept { bump(bytes_in_, n); }
+  inline void add_bytes_out(uint64_t n) noexcept { bump(bytes_out_, n); }
+};
+
+class CommandClock {
+  /* Times a run of consecutive commands with a single clock read per command,
+   * the end of one command is the start of the next. Create it right before
+   * the run so the first command does not include idle time. Commands are
+   * timed when the shard keeps latencies or always_time is set */
+ private:
+  StatsShard* shard_;
+  bool timed_;
+  uint64_t last_ns_;
+
+ public:
+  explicit CommandClock(StatsShard* shard, bool always_time = false)
+      : shard_(shard),
+        timed_(shard->timing() || always_time),
+        last_ns_(timed_ ? monotonic_ns() : 0) {}
+
+  inline uint64_t record(uint32_t cmd_id) {
+    /* Records one call of cmd_id, returns its duration or 0 if untimed */
+    uint64_t now_ns = timed_ ? monotonic_ns() : 0;
+    uint64_t elapsed_ns = now_ns - last_ns_;
+    shard_->record_call(cmd_id, elapsed_ns);
+    last_ns_ = now_ns;
+    return elapsed_ns;
+  }
+};
+
+class ServerStats {
+  /* Owns the shards of one server. The command table is fixed at
+   * construction, anything not in it is counted as "other" so that clients
+   * sending garbage cannot grow it */
+ public:
+  static constexpr uint32_t OTHER = 0;
+
+ private:
+  std::vector<std::string> names_;  // names_[OTHER] == "other"
+  std::unordered_map<std::string_view, uint32_t> ids_;  // views of names_
+  bool timing_;
+  uint64_t start_ns_;
+  std::atomic<int64_t> connected_clients_{0};
+  std::atomic<uint64_t> total_connections_{0};
+  std::atomic<uint64_t> blocked_clients_{0};  // in blpop
+  std::atomic<int64_t> conn_memory_{0};  // buffers of all connections
+  std::atomic<uint64_t> output_limit_disconnections_{0};
+  std::atomic<uint64_t> tracking_keys_{0};  // client-side caching table
+  std::atomic<uint64_t> tracking_invalidations_{0};
+  std::atomic<int64_t> lazyfree_pending_{0};  // see LazyFree.h
+  std::atomic<uint64_t> lazyfreed_objects_{0};
+  std::atomic<uint64_t> lazyfree_ns_{0};
+  std::atomic<int64_t> compressed_values_{0};
+  std::atomic<int64_t> compression_saved_bytes_{0};
+  std::atomic<int64_t> key_index_bytes_{-1};  // -1 without --key-index
+
+  mutable std::mutex mtx_;  // protects shards_ and retired_
+  std::vector<std::unique_ptr<StatsShard>> shards_;
+  StatsShard retired_;  // totals of released shards
+
+  static size_t rss_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  }
+
+  static std::string usec(uint64_t ns) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.2f", ns / 1000.0);
+    return buf;
+  }
+
+ public:
+  ServerStats(std::initializer_list<std::string_view> commands,
+              bool timing = true)
+      : names_(1, "other"),
+        timing_(timing),
+        start_ns_(monotonic_ns()),
+        retired_(commands.size() + 1, timing) {
+    names_.insert(names_.end(), commands.begin(), commands.end());
+    for (uint32_t i = 0; i < names_.size(); ++i) ids_.emplace(names_[i], i);
+  }
+
+  ServerStats(const ServerStats&) = delete;
+  ServerStats& operator=(const ServerStats&) = delete;
+
+  inline uint32_t command_id(std::string_view name) const {
+    auto it = ids_.find(name);
+    return it == ids_.end() ? OTHER : it->second;
+  }
+
+  StatsShard* acquire_shard() {
+    std::scoped_lock lock(mtx_);
+    shards_.push_back(std::make_unique<StatsShard>(names_.size(), timing_));
+    return shards_.back().get();
+  }
+
+  void release_shard(StatsShard* shard) {
+    /* Keeps the totals of a thread that is done executing commands */
+    std::scoped_lock lock(mtx_);
+    retired_.add(*shard);
+    std::erase_if(shards_, [shard](const auto& s) { return s.get() == shard; });
+  }
+
+  inline void client_connected() noexcept {
+    connected_clients_.fetch_add(1, std::memory_order_relaxed);
+    total_connections_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  inline void client_disconnected() noexcept {
+    connected_clients_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  inline void blocked_changed(size_t blocked) noexcept {
+    blocked_clients_.store(blocked, std::memory_order_relaxed);
+  }
+
+  inline void conn_memory_changed(int64_t delta) noexcept {
+    conn_memory_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  inline void tracking_changed(size_t keys, uint64_t invalidations) noexcept {
+    tracking_keys_.store(keys, std::memory_order_relaxed);
+    tracking_invalidations_.fetch_add(invalidations,
+                                      std::memory_order_relaxed);
+  }
+
+  inline void key_index_changed(size_t bytes) noexcept {
+    key_index_bytes_.store(static_cast<int64_t>(bytes),
+                           std::memory_order_relaxed);
+  }
+
+  inline void lazyfree_pending_changed(int64_t delta) noexcept {
+    lazyfree_pending_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  inline void lazyfree_done(uint64_t elapsed_ns) noexcept {
+    // called on the free thread
+    lazyfree_pending_.fetch_sub(1, std::memory_order_relaxed);
+    lazyfreed_objects_.fetch_add(1, std::memory_order_relaxed);
+    lazyfree_ns_.fetch_add(elapsed_ns, std::memory_order_relaxed);
+  }
+
+  inline void compression_changed(int64_t values,
+                                  int64_t saved_bytes) noexcept {
+    compressed_values_.fetch_add(values, std::memory_order_relaxed);
+    compression_saved_bytes_.fetch_add(saved_bytes, std::memory_order_relaxed);
+  }
+
+  inline void compression_reset() noexcept {
+    compressed_values_.store(0, std::memory_order_relaxed);
+    compression_saved_bytes_.store(0, std::memory_order_relaxed);
+  }
+
+  inline void output_limit_disconnected() noexcept {
+    output_limit_disconnections_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::string info(std::string_view section, size_t n_keys) const {
+    /* Redis style "key:value" lines grouped in sections, section is one of
+     * server, clients, memory, stats, keyspace, commandstats or empty for
+     * all of them. Latencies are in microseconds */
+    std::scoped_lock lock(mtx_);
+    std::vector<const StatsShard*> shards{&retired_};
+    for (const auto& shard : shards_) shards.push_back(shard.get());
+
+    auto sum = [&](auto field) {
+      uint64_t total = 0;
+      for (const StatsShard* shard : shards) {
+        total += field(*shard).load(std::memory_order_relaxed);
+      }
+      return total;
+    };
+
+    bool all = section.empty() || section == "all";
+    std::string out;
+
+    if (all || section == "server") {
+      out += "# Server\n";
+      out += "uptime_in_seconds:" +
+             std::to_string((monotonic_ns() - start_ns_) / 1000000000ULL) +
+             "\n";
+      out += "latency_tracking:" + std::string(timing_ ? "yes" : "no") + "\n";
+    }
+
+    if (all || section == "clients") {
+      out += "# Clients\n";
+      out += "connected_clients:" +
+             std::to_string(connected_clients_.load()) + "\n";
+      out += "blocked_clients:" + std::to_string(blocked_clients_.load()) +
+             "\n";
+    }
+
+    if (all || section == "memory") {
+      struct mallinfo2 mi = mallinfo2();
+      out += "# Memory\n";
+      out += "used_memory:" + std::to_string(mi.uordblks + mi.hblkhd) + "\n";
+      out += "used_memory_rss:" + std::to_string(rss_bytes()) + "\n";
+      out += "mem_clients:" + std::to_string(conn_memory_.load()) + "\n";
+      out += "compressed_values:" + std::to_string(compressed_values_.load()) +
+             "\n";
+      out += "compression_saved_bytes:" +
+             std::to_string(compression_saved_bytes_.load()) + "\n";
+      out += "lazyfree_pending_objects:" +
+             std::to_string(lazyfree_pending_.load()) + "\n";
+    }
+
+    if (all || section == "stats") {
+      uint64_t total_calls = 0;
+      for (uint32_t i = 0; i < names_.size(); ++i) {
+        total_calls += sum([i](const StatsShard& s) -> const auto& {
+          return s.commands_[i].calls;
+        });
+      }
+      out += "# Stats\n";
+      out += "total_connections_received:" +
+             std::to_string(total_connections_.load()) + "\n";
+      out += "total_commands_processed:" + std::to_string(total_calls) + "\n";
+      out += "client_output_limit_disconnections:" +
+             std::to_string(output_limit_disconnections_.load()) + "\n";
+      out += "tracking_total_keys:" + std::to_string(tracking_keys_.load()) +
+             "\n";
+      out += "tracking_invalidations:" +
+             std::to_string(tracking_invalidations_.load()) + "\n";
+      out += "lazyfreed_objects:" + std::to_string(lazyfreed_objects_.load()) +
+             "\n";
+      out += "lazyfree_usec:" + std::to_string(lazyfree_ns_.load() / 1000) +
+             "\n";
+      out += "total_net_input_bytes:" +
+             std::to_string(sum([](const StatsShard& s) -> const auto& {
+               return s.bytes_in_;
+             })) +
+             "\n";
+      out += "total_net_output_bytes:" +
+             std::to_string(sum([](const StatsShard& s) -> const auto& {
+               return s.bytes_out_;
+             })) +
+             "\n";
+    }
+
+    if (all || section == "keyspace") {
+      out += "# Keyspace\n";
+      out += "keys:" + std::to_string(n_keys) + "\n";
+      if (key_index_bytes_.load() >= 0) {
+        out += "key_index_bytes:" + std::to_string(key_index_bytes_.load()) +
+               "\n";
+      }
+    }
+
+    if (all || section == "commandstats") {
+      out += "# Commandstats\n";
+      for (uint32_t i = 0; i < names_.size(); ++i) {
+        LatencyHistogram latency;
+        uint64_t calls = 0, total_ns = 0;
+        for (const StatsShard* shard : shards) {
+          const CommandCounters& cmd = shard->commands_[i];
+          calls += cmd.calls.load(std::memory_order_relaxed);
+          total_ns += cmd.total_ns.load(std::memory_order_relaxed);
+          if (ConcurrentHistogram* hist = cmd.latency.load()) {
+            hist->snapshot(latency);
+          }
+        }
+        if (calls == 0) continue;
+
+        out += "cmdstat_" + names_[i] + ":calls=" + std::to_string(calls);
+        if (timing_) {
+          out += ",usec=" + std::to_string(total_ns / 1000) +
+                 ",usec_per_call=" + usec(total_ns / calls) +
+                 ",p50=" + usec(latency.percentile(50)) +
+                 ",p99=" + usec(latency.percentile(99)) +
+                 ",p99.9=" + usec(latency.percentile(99.9)) +
+                 ",max=" + usec(latency.max());
+        }
+        out += "\n";
+      }
+    }
+
+    return out;
+  }
+};
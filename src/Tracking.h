@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "ServerBase.h"
+
+/* Server side of client-side caching. A connection with tracking on has the
+ * keys it reads recorded here, and is sent an invalidation once such a key
+ * changes so it can drop its cached copy. The table holds at most max_keys
+ * keys, the readers of a key pushed out are invalidated early. Connections
+ * in broadcast mode are not recorded per key, they are sent invalidations
+ * for every change of a key starting with one of their prefixes.
+ *
+ * Readers are kept as fd and connection id, a reader that closed or turned
+ * tracking off is only noticed and skipped on its next invalidation */
+
+class TrackingTable {
+ public:
+  struct Reader {
+    int fd;
+    uint64_t id;
+  };
+
+ private:
+  size_t max_keys_;
+  std::unordered_map<std::string, std::vector<Reader>> keys_;
+  std::vector<std::pair<std::string, Reader>> prefixes_;  // broadcast mode
+
+ public:
+  explicit TrackingTable(size_t max_keys) : max_keys_(max_keys) {}
+
+  inline size_t size() const noexcept { return keys_.size(); }
+
+  // nothing to invalidate, writes can skip the table
+  inline bool empty() const noexcept {
+    return keys_.empty() && prefixes_.empty();
+  }
+
+  template <typename Notify>
+  void track(const std::string& key, const Conn* conn, Notify&& notify) {
+    /* Records that conn read key. notify(reader, &key) is called for the
+     * readers of a key evicted to stay within max_keys */
+    auto [it, added] = keys_.try_emplace(key);
+    std::vector<Reader>& readers = it->second;
+    for (const Reader& r : readers) {
+      if (r.id == conn->id) return;
+    }
+    readers.push_back({conn->fd, conn->id});
+    if (!added || keys_.size() <= max_keys_) return;
+
+    // any other key, the hash order is as good as random
+    auto victim = keys_.begin();
+    if (victim == it) ++victim;
+    for (const Reader& r : victim->second) notify(r, &victim->first);
+    keys_.erase(victim);
+  }
+
+  void add_prefix(const Conn* conn, const std::string& prefix) {
+    prefixes_.push_back({prefix, {conn->fd, conn->id}});
+  }
+
+  void remove_prefixes(const Conn* conn) {
+    std::erase_if(prefixes_, [conn](const auto& p) {
+      return p.second.id == conn->id;
+    });
+  }
+
+  template <typename Notify>
+  void invalidate(const std::string& key, Notify&& notify) {
+    /* key changed, notify(reader, &key) for everyone who may cache it */
+    auto it = keys_.find(key);
+    if (it != keys_.end()) {
+      for (const Reader& r : it->second) notify(r, &key);
+      keys_.erase(it);
+    }
+    for (const auto& [prefix, r] : prefixes_) {
+      if (key.starts_with(prefix)) notify(r, &key);
+    }
+  }
+
+  template <typename Notify>
+  void invalidate_all(Notify&& notify) {
+    /* The whole keyspace changed, notify(reader, nullptr) once per
+     * tracking connection */
+    std::unordered_set<uint64_t> done;
+    auto once = [&](const Reader& r) {
+      if (done.insert(r.id).second) notify(r, nullptr);
+    };
+    for (const auto& [key, readers] : keys_) {
+      for (const Reader& r : readers) once(r);
+    }
+    for (const auto& [prefix, r] : prefixes_) once(r);
+    keys_.clear();
+  }
+};
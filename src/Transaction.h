@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/* multi queues a connection's commands until exec runs them all at once,
+ * with no other command in between, or discard drops them. A command that
+ * is refused while queued fails the whole transaction.
+ *
+ * WatchTable keeps version counters of the keys watched for optimistic
+ * transactions. watch records a key's current version with the connection
+ * and every change of the key bumps it, so exec only has to compare
+ * versions to know whether any watched key changed since, deletes and
+ * re-creations included. Only keys with a watcher have a counter: writes
+ * to other keys cost a lookup, or nothing while nobody watches, and a
+ * key's entry goes away with its last watcher */
+
+class WatchTable {
+ public:
+  // key and its version when it was watched, kept by the connection
+  using Watched = std::vector<std::pair<std::string, uint64_t>>;
+
+ private:
+  struct Entry {
+    uint64_t version = 0;
+    size_t watchers = 0;
+  };
+
+  std::unordered_map<std::string, Entry> keys_;
+
+ public:
+  inline size_t size() const noexcept { return keys_.size(); }
+
+  void watch(const std::string& key, Watched& watched) {
+    for (const auto& [k, version] : watched) {
+      if (k == key) return;
+    }
+    Entry& entry = keys_[key];
+    ++entry.watchers;
+    watched.emplace_back(key, entry.version);
+  }
+
+  void unwatch_all(Watched& watched) {
+    for (const auto& [key, version] : watched) {
+      auto it = keys_.find(key);
+      if (it != keys_.end() && --it->second.watchers == 0) keys_.erase(it);
+    }
+    watched.clear();
+  }
+
+  bool changed(const Watched& watched) const {
+    /* True if any key changed since it was watched */
+    for (const auto& [key, version] : watched) {
+      auto it = keys_.find(key);
+      if (it == keys_.end() || it->second.version != version) return true;
+    }
+    return false;
+  }
+
+  inline void touch(const std::string& key) {
+    if (keys_.empty()) return;
+    auto it = keys_.find(key);
+    if (it != keys_.end()) ++it->second.version;
+  }
+
+  void touch_all() {
+    /* Every key may have changed, e.g. after flushall */
+    for (auto& [key, entry] : keys_) ++entry.version;
+  }
+};
+
+// per connection state of multi, exec and watch
+struct Transaction {
+  bool active = false;  // between multi and exec or discard
+  bool failed = false;  // a command was refused while queued
+  std::vector<std::vector<std::string>> queued;
+  WatchTable::Watched watched;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "Bloom.h"
+#include "BufferChain.h"
+#include "Compression.h"
+#include "Hash.h"
+#include "HyperLogLog.h"
+#include "List.h"
+
+/* A stored value. Values arrive as strings, except large ones which keep the
+ * segments they were received in so that they are never copied on their way
+ * into the store or out to clients. A compressed value keeps an LZ block of
+ * its bytes in place of the string, see Compression.h. Values of other
+ * types hold their object instead, see Hash.h, List.h, Bloom.h and
+ * HyperLogLog.h */
+
+enum class ValueType : uint8_t { String, Hash, List, Bloom, HyperLogLog };
+
+class Value {
+ private:
+  std::string str_;
+  BufferChain chain_;  // non-empty only for large values
+  size_t raw_size_ = 0;  // of a compressed value, 0 otherwise
+  std::unique_ptr<Hash> hash_;
+  std::unique_ptr<List> list_;
+  std::unique_ptr<Bloom> bloom_;
+  std::unique_ptr<HyperLogLog> hll_;
+
+ public:
+  Value() = default;
+  Value(std::string str) : str_(std::move(str)) {}
+  explicit Value(BufferChain&& chain) : chain_(std::move(chain)) {}
+
+  static Value empty_hash() {
+    Value val;
+    val.hash_ = std::make_unique<Hash>();
+    return val;
+  }
+
+  static Value empty_list() {
+    Value val;
+    val.list_ = std::make_unique<List>();
+    return val;
+  }
+
+  static Value empty_bloom(double error_rate, uint64_t capacity) {
+    Value val;
+    val.bloom_ = std::make_unique<Bloom>(error_rate, capacity);
+    return val;
+  }
+
+  static Value empty_hll() {
+    Value val;
+    val.hll_ = std::make_unique<HyperLogLog>();
+    return val;
+  }
+
+  static Value compressed(std::string&& block, size_t raw_size) {
+    Value val(std::move(block));
+    val.raw_size_ = raw_size;
+    return val;
+  }
+
+  inline ValueType type() const noexcept {
+    if (hash_) return ValueType::Hash;
+    if (list_) return ValueType::List;
+    if (bloom_) return ValueType::Bloom;
+    return hll_ ? ValueType::HyperLogLog : ValueType::String;
+  }
+
+  inline bool chained() const noexcept { return !chain_.empty(); }
+  inline bool compressed() const noexcept { return raw_size_ > 0; }
+
+  // the value's own size, compressed or not, of a hash its fields and
+  // values, of a list its elements and of a sketch its registers or bits
+  inline size_t size() const noexcept {
+    if (hash_) return hash_->bytes();
+    if (list_) return list_->bytes();
+    if (bloom_) return bloom_->bytes();
+    if (hll_) return hll_->bytes();
+    return chained() ? chain_.size() : compressed() ? raw_size_ : str_.size();
+  }
+
+  // bytes kept in memory
+  inline size_t stored_size() const noexcept {
+    if (hash_) return hash_->bytes();
+    if (list_) return list_->bytes();
+    if (bloom_) return bloom_->bytes();
+    if (hll_) return hll_->bytes();
+    return chained() ? chain_.size() : str_.size();
+  }
+
+  // only meaningful for type() == ValueType::Hash
+  inline Hash& hash() noexcept { return *hash_; }
+  inline const Hash& hash() const noexcept { return *hash_; }
+
+  // only meaningful for type() == ValueType::List
+  inline List& list() noexcept { return *list_; }
+  inline const List& list() const noexcept { return *list_; }
+
+  // only meaningful for type() == ValueType::Bloom
+  inline Bloom& bloom() noexcept { return *bloom_; }
+  inline const Bloom& bloom() const noexcept { return *bloom_; }
+
+  // only meaningful for type() == ValueType::HyperLogLog
+  inline HyperLogLog& hll() noexcept { return *hll_; }
+  inline const HyperLogLog& hll() const noexcept { return *hll_; }
+
+  // only meaningful when !chained(), the LZ block if compressed()
+  inline const std::string& str() const noexcept { return str_; }
+  inline const BufferChain& chain() const noexcept { return chain_; }
+
+  bool decompress_into(uint8_t* dst) const {
+    /* Writes the size() bytes of a compressed value to dst */
+    return lz_decompress(reinterpret_cast<const uint8_t*>(str_.data()),
+                         str_.size(), dst, raw_size_);
+  }
+
+  std::string to_string() const {
+    if (chained()) return chain_.to_string();
+    if (!compressed()) return str_;
+    std::string out(raw_size_, '\0');
+    decompress_into(reinterpret_cast<uint8_t*>(out.data()));
+    return out;
+  }
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* LEB128 varints, 7 bits per byte with the high bit set on all but the last
+ * byte. Used by the packed encodings of Keyspace.h and Hash.h */
+
+inline size_t put_varint(uint8_t* p, uint64_t v) {
+  size_t n = 0;
+  for (; v >= 0x80; v >>= 7) p[n++] = static_cast<uint8_t>(v | 0x80);
+  p[n++] = static_cast<uint8_t>(v);
+  return n;
+}
+
+inline uint64_t get_varint(const uint8_t*& p) {
+  /* Decodes the varint at p and moves p past it, p must hold a complete
+   * one */
+  uint64_t v = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t b = *p++;
+    v |= static_cast<uint64_t>(b & 0x7F) << shift;
+    if (b < 0x80) return v;
+  }
+}
+
+inline bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+  /* Bounds-checked get_varint for untrusted input */
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    v |= static_cast<uint64_t>(b & 0x7F) << shift;
+    if (b < 0x80) return true;
+  }
+  return false;
+}
+
+inline size_t varint_size(uint64_t v) {
+  size_t n = 1;
+  for (; v >= 0x80; v >>= 7) ++n;
+  return n;
+}
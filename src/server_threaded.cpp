@@ -1,8 +1,11 @@
+#include "ServerConfig.h"
 #include "ServerThreaded.h"
 
-int main() {
-  const int PORT = 1234;
-  ServerThreaded server(PORT);
+int main(int argc, char** argv) {
+  ServerConfig config;
+  if (!parse_server_args(argc, argv, config)) return 1;
+
+  ServerThreaded server(config.port, config);
 
   return server.run_server();
-}
\ No newline at end of file
+}
@@ -0,0 +1,63 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "Buffer.h"
+#include "RingBuffer.h"
+
+// partial consume - a 16 KiB recv is appended and consumed again, but
+// state.range(0) bytes of an incomplete message always stay behind
+template <typename BufferType>
+static void PartialConsume(benchmark::State& state) {
+  const size_t leftover = state.range(0);
+  const size_t chunk = 16 * 1024;
+  BufferType buf(64 * 1024);
+  std::vector<uint8_t> data(chunk, 'x');
+
+  buf.append(data.data(), static_cast<uint32_t>(leftover));
+  for (auto _ : state) {
+    buf.append(data.data(), static_cast<uint32_t>(chunk));
+    benchmark::DoNotOptimize(buf.data());
+    buf.consume(chunk);
+  }
+
+  state.SetBytesProcessed(state.iterations() * chunk);
+}
+
+// byte stream - MTU sized recvs split into 100 byte messages, only complete
+// messages are consumed like parse_buffer does
+template <typename BufferType>
+static void MessageStream(benchmark::State& state) {
+  const size_t recv_size = state.range(0);
+  const size_t msg_size = 100;
+  BufferType buf(64 * 1024);
+  std::vector<uint8_t> data(recv_size, 'x');
+
+  for (auto _ : state) {
+    buf.append(data.data(), static_cast<uint32_t>(recv_size));
+    while (buf.size() >= msg_size) {
+      benchmark::DoNotOptimize(buf.data()[msg_size - 1]);
+      buf.consume(msg_size);
+    }
+  }
+
+  state.SetBytesProcessed(state.iterations() * recv_size);
+}
+
+BENCHMARK_TEMPLATE(PartialConsume, Buffer)
+    ->Arg(64)
+    ->Arg(4096)
+    ->Arg(32768);  // bytes left behind
+
+BENCHMARK_TEMPLATE(PartialConsume, RingBuffer)
+    ->Arg(64)
+    ->Arg(4096)
+    ->Arg(32768);  // bytes left behind
+
+BENCHMARK_TEMPLATE(MessageStream, Buffer)->Arg(1460)->Arg(16384);  // recv size
+
+BENCHMARK_TEMPLATE(MessageStream, RingBuffer)
+    ->Arg(1460)
+    ->Arg(16384);  // recv size
+
+BENCHMARK_MAIN();
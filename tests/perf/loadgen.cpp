@@ -0,0 +1,540 @@
+/* Open-loop load generator.
+ *
+ * Requests are scheduled at a constant rate no matter how fast the server
+ * answers, and every latency is measured from the moment a request was
+ * scheduled to be sent rather than from when it actually left. A server that
+ * stalls therefore shows up as queueing delay in the tail percentiles instead
+ * of silently lowering the offered load (coordinated omission), which is what
+ * the closed-loop servers_benchmark measurements hide.
+ *
+ * ./loadgen --rate 50000 --duration 10 --connections 8 --pipeline 16 \
+ *           --key-dist zipf:0.99 --value-size uniform:16:1024 --get-ratio 0.9 \
+ *           --json results.json */
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Buffer.h"
+#include "Histogram.h"
+#include "Protocol.h"
+
+struct LoadgenOptions {
+  std::string host = "127.0.0.1";
+  uint16_t port = 1234;
+  std::string unix_path;  // used instead of host and port when set
+  double rate = 10000;  // requests per second over all connections
+  double duration = 10;
+  double warmup = 1;  // seconds of load before recording starts
+  size_t connections = 4;
+  size_t threads = 1;
+  size_t pipeline = 16;  // max requests in flight per connection
+  uint64_t keys = 100000;
+  std::string key_dist = "uniform";
+  std::string value_size = "fixed:32";
+  double get_ratio = 0.9;
+  bool prefill = false;
+  std::string json_path;
+};
+
+static int connect_server(const LoadgenOptions& opts) {
+  /* Blocking connection to the server, TCP or Unix domain */
+  if (!opts.unix_path.empty()) return connect_unix(opts.unix_path);
+
+  int fd = connect_tcp(opts.host, opts.port);
+  if (fd < 0) return -1;
+  int flag = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  return fd;
+}
+
+static std::vector<std::string> split(const std::string& spec, char delim) {
+  std::vector<std::string> parts;
+  std::istringstream iss(spec);
+  std::string part;
+  while (std::getline(iss, part, delim)) parts.push_back(part);
+  return parts;
+}
+
+static inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+class KeyChooser {
+  /* uniform              every key equally likely
+   * zipf:<s>             key i drawn with probability proportional to 1/i^s
+   * hotset:<frac>:<prob> prob of requests go to the first frac of the keys */
+ private:
+  enum class Kind { Uniform, Zipf, HotSet } kind_ = Kind::Uniform;
+  uint64_t n_keys_;
+  std::vector<double> zipf_cdf_;
+  uint64_t hot_keys_ = 0;
+  double hot_prob_ = 0;
+
+ public:
+  KeyChooser(const std::string& spec, uint64_t n_keys) : n_keys_(n_keys) {
+    std::vector<std::string> parts = split(spec, ':');
+    if (parts.size() == 1 && parts[0] == "uniform") {
+      kind_ = Kind::Uniform;
+    } else if (parts.size() == 2 && parts[0] == "zipf") {
+      kind_ = Kind::Zipf;
+      double s = std::stod(parts[1]);
+      zipf_cdf_.resize(n_keys_);
+      double total = 0;
+      for (uint64_t i = 0; i < n_keys_; ++i) {
+        total += 1.0 / std::pow(static_cast<double>(i + 1), s);
+        zipf_cdf_[i] = total;
+      }
+      for (double& c : zipf_cdf_) c /= total;
+    } else if (parts.size() == 3 && parts[0] == "hotset") {
+      kind_ = Kind::HotSet;
+      hot_keys_ = std::max<uint64_t>(
+          1, static_cast<uint64_t>(std::stod(parts[1]) * n_keys_));
+      hot_prob_ = std::stod(parts[2]);
+    } else {
+      throw std::invalid_argument("Invalid key distribution " + spec);
+    }
+  }
+
+  uint64_t next(std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    switch (kind_) {
+      case Kind::Zipf: {
+        auto it = std::lower_bound(zipf_cdf_.begin(), zipf_cdf_.end(),
+                                   unit(rng));
+        return std::min<uint64_t>(it - zipf_cdf_.begin(), n_keys_ - 1);
+      }
+      case Kind::HotSet:
+        if (hot_keys_ < n_keys_ && unit(rng) >= hot_prob_) {
+          return hot_keys_ + rng() % (n_keys_ - hot_keys_);
+        }
+        return rng() % hot_keys_;
+      case Kind::Uniform:
+      default:
+        return rng() % n_keys_;
+    }
+  }
+};
+
+class ValueSizer {
+  /* fixed:<n> | uniform:<min>:<max> | normal:<mean>:<stddev> */
+ private:
+  std::vector<std::string> parts_;
+  size_t a_ = 0, b_ = 0;
+
+ public:
+  explicit ValueSizer(const std::string& spec) : parts_(split(spec, ':')) {
+    if (parts_.size() == 2 && parts_[0] == "fixed") {
+      a_ = b_ = std::stoull(parts_[1]);
+    } else if (parts_.size() == 3 &&
+               (parts_[0] == "uniform" || parts_[0] == "normal")) {
+      a_ = std::stoull(parts_[1]);
+      b_ = std::stoull(parts_[2]);
+    } else {
+      throw std::invalid_argument("Invalid value size distribution " + spec);
+    }
+  }
+
+  size_t max_size() const {
+    return parts_[0] == "normal" ? a_ + 6 * b_ : std::max(a_, b_);
+  }
+
+  size_t next(std::mt19937_64& rng) {
+    size_t sz = a_;
+    if (parts_[0] == "uniform") {
+      sz = std::uniform_int_distribution<size_t>(a_, b_)(rng);
+    } else if (parts_[0] == "normal") {
+      double v = std::normal_distribution<double>(a_, b_)(rng);
+      sz = static_cast<size_t>(std::clamp(v, 1.0, double(max_size())));
+    }
+    return std::max<size_t>(sz, 1);  // the protocol has no empty strings
+  }
+};
+
+struct WorkerResult {
+  LatencyHistogram all, get, set;
+  uint64_t sent = 0;
+  uint64_t errors = 0;
+  uint64_t misses = 0;
+  uint64_t unanswered = 0;
+};
+
+class Worker {
+  /* Drives a share of the connections and of the request rate from a single
+   * thread using non-blocking sockets */
+ private:
+  struct Request {
+    uint64_t intended_ns;
+    bool is_get;
+  };
+
+  struct Connection {
+    int fd = -1;
+    std::vector<uint8_t> write_buf;
+    size_t write_off = 0;
+    Buffer read_buf{64 * 1024};
+    std::deque<uint64_t> due;  // scheduled but waiting for a pipeline slot
+    std::deque<Request> in_flight;
+  };
+
+  const LoadgenOptions& opts_;
+  std::vector<Connection> conns_;
+  KeyChooser keys_;
+  ValueSizer sizes_;
+  std::string value_bytes_;
+  std::mt19937_64 rng_;
+  WorkerResult result_;
+
+  void issue(Connection& conn) {
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    while (!conn.due.empty() && conn.in_flight.size() < opts_.pipeline) {
+      bool is_get = unit(rng_) < opts_.get_ratio;
+      std::string key = "key:" + std::to_string(keys_.next(rng_));
+      if (is_get) {
+        encode_request({"get", key}, conn.write_buf);
+      } else {
+        std::string_view val(value_bytes_.data(), sizes_.next(rng_));
+        encode_request({"set", key, val}, conn.write_buf);
+      }
+      conn.in_flight.push_back({conn.due.front(), is_get});
+      conn.due.pop_front();
+      result_.sent++;
+    }
+
+    while (conn.write_off < conn.write_buf.size()) {
+      ssize_t rv = send(conn.fd, conn.write_buf.data() + conn.write_off,
+                        conn.write_buf.size() - conn.write_off, MSG_NOSIGNAL);
+      if (rv <= 0) break;
+      conn.write_off += rv;
+    }
+    if (conn.write_off == conn.write_buf.size()) {
+      conn.write_buf.clear();
+      conn.write_off = 0;
+    }
+  }
+
+  void complete(Connection& conn, uint64_t record_from) {
+    uint8_t temp_buffer[64 * 1024];
+    ssize_t rv;
+    while ((rv = recv(conn.fd, temp_buffer, sizeof(temp_buffer), 0)) > 0) {
+      conn.read_buf.append(temp_buffer, static_cast<uint32_t>(rv));
+    }
+    if (rv == 0) throw std::runtime_error("Server closed the connection");
+
+    uint64_t now = now_ns();
+    while (conn.read_buf.size() >= 8) {
+      uint32_t resp_len = 0;
+      memcpy(&resp_len, conn.read_buf.data(), 4U);
+      if (4 + static_cast<size_t>(resp_len) > conn.read_buf.size()) break;
+
+      Status status;
+      memcpy(&status, conn.read_buf.data() + 4U, 4U);
+      conn.read_buf.consume(4 + resp_len);
+      if (conn.in_flight.empty()) throw std::runtime_error("Unexpected reply");
+
+      Request req = conn.in_flight.front();
+      conn.in_flight.pop_front();
+      if (req.intended_ns < record_from) continue;  // warmup
+
+      uint64_t latency = now - req.intended_ns;
+      result_.all.record(latency);
+      (req.is_get ? result_.get : result_.set).record(latency);
+      if (status == Status::Invalid && req.is_get) {
+        result_.misses++;
+      } else if (status != Status::Valid) {
+        result_.errors++;
+      }
+    }
+  }
+
+ public:
+  Worker(const LoadgenOptions& opts, size_t n_conns, uint64_t seed)
+      : opts_(opts),
+        conns_(n_conns),
+        keys_(opts.key_dist, opts.keys),
+        sizes_(opts.value_size),
+        value_bytes_(sizes_.max_size(), 'x'),
+        rng_(seed) {
+    for (auto& conn : conns_) {
+      conn.fd = connect_server(opts);
+      if (conn.fd < 0) throw std::runtime_error("Failed to connect");
+      fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+  }
+
+  ~Worker() {
+    for (auto& conn : conns_) close(conn.fd);
+  }
+
+  WorkerResult& run(uint64_t start_ns, double rate) {
+    const double interval_ns = 1e9 / rate;
+    const uint64_t record_from = start_ns + opts_.warmup * 1e9;
+    const uint64_t end_ns = record_from + opts_.duration * 1e9;
+    const uint64_t drain_deadline = end_ns + 5000000000ULL;
+
+    uint64_t scheduled = 0;
+    size_t next_conn = 0;
+    std::vector<struct pollfd> pfds(conns_.size());
+
+    while (1) {
+      uint64_t now = now_ns();
+      uint64_t next_ns = start_ns + scheduled * interval_ns;
+
+      // hand every request that is due by now to a connection, even if the
+      // connection cannot send it yet
+      while (next_ns <= now && next_ns < end_ns) {
+        conns_[next_conn].due.push_back(next_ns);
+        next_conn = (next_conn + 1) % conns_.size();
+        next_ns = start_ns + ++scheduled * interval_ns;
+      }
+
+      bool idle = next_ns >= end_ns;
+      for (size_t i = 0; i < conns_.size(); ++i) {
+        issue(conns_[i]);
+        idle &= conns_[i].due.empty() && conns_[i].in_flight.empty();
+        pfds[i] = {conns_[i].fd, POLLIN, 0};
+        if (!conns_[i].write_buf.empty()) pfds[i].events |= POLLOUT;
+      }
+      if (idle || now > drain_deadline) break;
+
+      // sleep until the next request is due, after the end only wait for
+      // the remaining replies
+      uint64_t wait_ns = 1000000;
+      if (next_ns < end_ns) wait_ns = next_ns > now ? next_ns - now : 0;
+      struct timespec timeout = {static_cast<time_t>(wait_ns / 1000000000),
+                                 static_cast<long>(wait_ns % 1000000000)};
+      if (ppoll(pfds.data(), pfds.size(), &timeout, nullptr) < 0 &&
+          errno != EINTR) {
+        throw std::runtime_error("poll failed");
+      }
+
+      for (size_t i = 0; i < conns_.size(); ++i) {
+        if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+          complete(conns_[i], record_from);
+        }
+      }
+    }
+
+    for (auto& conn : conns_) {
+      result_.unanswered += conn.due.size() + conn.in_flight.size();
+    }
+    return result_;
+  }
+};
+
+static void prefill(const LoadgenOptions& opts) {
+  /* Sets every key once so that gets hit, pipelined in batches */
+  int fd = connect_server(opts);
+  if (fd < 0) throw std::runtime_error("Failed to connect");
+
+  ValueSizer sizes(opts.value_size);
+  std::string value_bytes(sizes.max_size(), 'x');
+  std::mt19937_64 rng(1);
+  std::vector<uint8_t> batch;
+  const uint64_t BATCH = 1000;
+
+  for (uint64_t first = 0; first < opts.keys; first += BATCH) {
+    uint64_t last = std::min(opts.keys, first + BATCH);
+    batch.clear();
+    for (uint64_t k = first; k < last; ++k) {
+      std::string key = "key:" + std::to_string(k);
+      encode_request({"set", key, std::string_view(value_bytes.data(),
+                                                   sizes.next(rng))},
+                     batch);
+    }
+    if (!send_all(fd, batch.data(), batch.size())) {
+      throw std::runtime_error("Prefill failed");
+    }
+    for (uint64_t k = first; k < last; ++k) {
+      uint32_t hdr[2];
+      if (!recv_all(fd, hdr, sizeof(hdr))) {
+        throw std::runtime_error("Prefill failed");
+      }
+    }
+  }
+  close(fd);
+}
+
+static void print_row(std::ostream& os, const std::string& name,
+                      const LatencyHistogram& h) {
+  auto us = [](double ns) { return ns / 1000.0; };
+  os << std::left << std::setw(6) << name << std::right << std::setw(12)
+     << h.count() << std::fixed << std::setprecision(2);
+  for (double v : {h.mean(), double(h.percentile(50)), double(h.percentile(90)),
+                   double(h.percentile(99)), double(h.percentile(99.9)),
+                   double(h.percentile(99.99)), double(h.max())}) {
+    os << std::setw(11) << us(v);
+  }
+  os << "\n";
+}
+
+static std::string json_row(const LatencyHistogram& h) {
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(3) << "{\"count\": " << h.count()
+     << ", \"mean_us\": " << h.mean() / 1000.0;
+  const std::pair<const char*, double> pcts[] = {
+      {"p50", 50},    {"p90", 90},      {"p99", 99},
+      {"p99.9", 99.9}, {"p99.99", 99.99}, {"p100", 100}};
+  for (const auto& [name, pct] : pcts) {
+    os << ", \"" << name << "_us\": " << h.percentile(pct) / 1000.0;
+  }
+  os << "}";
+  return os.str();
+}
+
+static bool parse_args(int argc, char** argv, LoadgenOptions& opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc && arg != "--prefill") return false;
+
+    if (arg == "--host") {
+      opts.host = argv[++i];
+    } else if (arg == "--port") {
+      opts.port = std::atoi(argv[++i]);
+    } else if (arg == "--unix-socket") {
+      opts.unix_path = argv[++i];
+    } else if (arg == "--rate") {
+      opts.rate = std::atof(argv[++i]);
+    } else if (arg == "--duration") {
+      opts.duration = std::atof(argv[++i]);
+    } else if (arg == "--warmup") {
+      opts.warmup = std::atof(argv[++i]);
+    } else if (arg == "--connections") {
+      opts.connections = std::atoi(argv[++i]);
+    } else if (arg == "--threads") {
+      opts.threads = std::atoi(argv[++i]);
+    } else if (arg == "--pipeline") {
+      opts.pipeline = std::atoi(argv[++i]);
+    } else if (arg == "--keys") {
+      opts.keys = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--key-dist") {
+      opts.key_dist = argv[++i];
+    } else if (arg == "--value-size") {
+      opts.value_size = argv[++i];
+    } else if (arg == "--get-ratio") {
+      opts.get_ratio = std::atof(argv[++i]);
+    } else if (arg == "--json") {
+      opts.json_path = argv[++i];
+    } else if (arg == "--prefill") {
+      opts.prefill = true;
+    } else {
+      return false;
+    }
+  }
+  return opts.rate > 0 && opts.connections > 0 && opts.threads > 0 &&
+         opts.pipeline > 0 && opts.keys > 0;
+}
+
+int main(int argc, char** argv) {
+  LoadgenOptions opts;
+  if (!parse_args(argc, argv, opts)) {
+    std::cerr
+        << "Usage: " << argv[0] << " [options]\n"
+        << "  --host <host> --port <port>      server address\n"
+        << "  --unix-socket <path>             or a unix socket, @ abstract\n"
+        << "  --rate <req/s>                   total request rate\n"
+        << "  --duration <s> --warmup <s>      measured and unmeasured time\n"
+        << "  --connections <n> --threads <n>  connections and threads\n"
+        << "  --pipeline <n>                   max in flight per connection\n"
+        << "  --keys <n>                       keyspace size\n"
+        << "  --key-dist <dist>                uniform | zipf:<s> |\n"
+        << "                                   hotset:<frac>:<prob>\n"
+        << "  --value-size <dist>              fixed:<n> | uniform:<min>:<max>"
+           " |\n"
+        << "                                   normal:<mean>:<stddev>\n"
+        << "  --get-ratio <0..1>               fraction of gets\n"
+        << "  --prefill                        set every key before the run\n"
+        << "  --json <path>                    also write results as JSON\n";
+    return 1;
+  }
+  opts.threads = std::min(opts.threads, opts.connections);
+
+  WorkerResult total;
+  try {
+    if (opts.prefill) prefill(opts);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t t = 0; t < opts.threads; ++t) {
+      size_t n_conns = opts.connections / opts.threads +
+                       (t < opts.connections % opts.threads ? 1 : 0);
+      workers.push_back(std::make_unique<Worker>(opts, n_conns, 42 + t));
+    }
+
+    // start all workers on the same schedule slightly in the future
+    uint64_t start_ns = now_ns() + 10000000;
+    std::vector<std::thread> threads;
+    std::vector<WorkerResult*> results(opts.threads);
+    for (size_t t = 0; t < opts.threads; ++t) {
+      threads.emplace_back([&, t]() {
+        size_t n_conns = opts.connections / opts.threads +
+                         (t < opts.connections % opts.threads ? 1 : 0);
+        double share = double(n_conns) / opts.connections;
+        results[t] = &workers[t]->run(start_ns, opts.rate * share);
+      });
+    }
+    for (auto& t : threads) t.join();
+
+    for (WorkerResult* r : results) {
+      total.all.merge(r->all);
+      total.get.merge(r->get);
+      total.set.merge(r->set);
+      total.sent += r->sent;
+      total.errors += r->errors;
+      total.misses += r->misses;
+      total.unanswered += r->unanswered;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "loadgen: " << e.what() << "\n";
+    return 1;
+  }
+
+  double achieved = total.all.count() / opts.duration;
+  std::cout << "target " << opts.rate << " req/s, achieved " << std::fixed
+            << std::setprecision(0) << achieved << " req/s over "
+            << opts.duration << " s, " << total.errors << " errors, "
+            << total.misses << " get misses, " << total.unanswered
+            << " unanswered\n";
+  std::cout << std::left << std::setw(6) << "op" << std::right << std::setw(12)
+            << "count";
+  for (const char* col :
+       {"mean", "p50", "p90", "p99", "p99.9", "p99.99", "max"}) {
+    std::cout << std::setw(11) << col;
+  }
+  std::cout << "  (us)\n";
+  print_row(std::cout, "ALL", total.all);
+  print_row(std::cout, "GET", total.get);
+  print_row(std::cout, "SET", total.set);
+
+  if (!opts.json_path.empty()) {
+    std::ofstream out(opts.json_path);
+    out << std::fixed << std::setprecision(1) << "{\"target_rate\": "
+        << opts.rate << ", \"achieved_rate\": " << achieved
+        << ", \"duration_s\": " << opts.duration
+        << ", \"connections\": " << opts.connections
+        << ", \"pipeline\": " << opts.pipeline
+        << ", \"errors\": " << total.errors
+        << ", \"get_misses\": " << total.misses
+        << ", \"unanswered\": " << total.unanswered
+        << ",\n \"all\": " << json_row(total.all)
+        << ",\n \"get\": " << json_row(total.get)
+        << ",\n \"set\": " << json_row(total.set) << "}\n";
+  }
+  return 0;
+}
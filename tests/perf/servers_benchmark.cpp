@@ -1,8 +1,20 @@
 #include <benchmark/benchmark.h>
 #include <netinet/tcp.h>
-
+#include <malloc.h>
+#include <sys/epoll.h>
+
+#include <random>
+
+#include "Client.h"
+#include "Compression.h"
+#include "Histogram.h"
+#include "HotKeys.h"
+#include "KeyIndex.h"
+#include "Keyspace.h"
+#include "NearCache.h"
 #include "ServerEventLoop.h"
 #include "ServerThreaded.h"
+#include "Stats.h"
 
 // global port counter to avoid conflicts
 static std::atomic<uint16_t> g_port_counter{20000};
@@ -58,6 +70,14 @@ class BenchmarkClient {
     }
   }
 
+  // Unix domain socket, "@name" is in the abstract namespace
+  BenchmarkClient(const std::string& unix_path) : response_buffer_(4096) {
+    fd_ = connect_unix(unix_path);
+    if (fd_ < 0) {
+      throw std::runtime_error("Failed to connect to " + unix_path);
+    }
+  }
+
   ~BenchmarkClient() {
     if (fd_ >= 0) close(fd_);
   }
@@ -76,6 +96,9 @@ class BenchmarkClient {
 
     uint32_t msg_len;
     memcpy(&msg_len, response_buffer_.data(), 4);
+    if (response_buffer_.size() < 4 + static_cast<size_t>(msg_len)) {
+      response_buffer_.resize(4 + static_cast<size_t>(msg_len));
+    }
 
     // read rest of message
     n = recv(fd_, response_buffer_.data() + 4, msg_len, MSG_WAITALL);
@@ -84,6 +107,8 @@ class BenchmarkClient {
     }
   }
 
+  int fd() const { return fd_; }
+
   void round_trip(const std::vector<uint8_t>& msg) {
     send_request(msg);
     receive_response();
@@ -98,9 +123,18 @@ class ServerBenchmarkFixture : public benchmark::Fixture {
   uint16_t port_;
   std::atomic<bool> server_running_{false};
 
+  virtual ServerConfig make_config(const ::benchmark::State&) {
+    return {};
+  }
+
+ public:
+  uint16_t port() const { return port_; }
+
+ protected:
+
   void SetUp(const ::benchmark::State& state) override {
     port_ = g_port_counter.fetch_add(1);
-    server_ = std::make_unique<ServerType>(port_);
+    server_ = std::make_unique<ServerType>(port_, make_config(state));
 
     server_thread_ = std::thread([this]() {
       server_running_ = true;
@@ -339,6 +373,849 @@ BENCHMARK_DEFINE_F(EventLoopFixture, MixedWorkload)(benchmark::State& state) {
   state.SetLabel("EventLoop");
 }
 
+// pipelined throughput - one AsyncClient with state.range(0) requests in flight
+BENCHMARK_DEFINE_F(EventLoopFixture, Pipelined_AsyncClient)
+(benchmark::State& state) {
+  const size_t depth = state.range(0);
+  AsyncClient client("127.0.0.1", port_);
+  client.call({"set", "key1", "value1"}).get();
+
+  std::vector<std::future<Reply>> replies;
+  replies.reserve(depth);
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < depth; ++i) {
+      replies.push_back(client.call({"get", "key1"}));
+    }
+    for (auto& reply : replies) {
+      benchmark::DoNotOptimize(reply.get());
+    }
+    replies.clear();
+  }
+
+  state.SetItemsProcessed(state.iterations() * depth);
+  state.SetLabel("EventLoop");
+}
+
+// large value throughput - one set and one get of state.range(0) bytes
+template <typename Fixture>
+void large_value_set_get(Fixture& fixture, benchmark::State& state) {
+  const size_t size = state.range(0);
+  AsyncClient client("127.0.0.1", fixture.port());
+  std::string value(size, 'v');
+
+  for (auto _ : state) {
+    client.call({"set", "large", value}).get();
+    benchmark::DoNotOptimize(client.call({"get", "large"}).get());
+  }
+
+  state.SetBytesProcessed(state.iterations() * 2 * size);
+}
+
+BENCHMARK_DEFINE_F(EventLoopFixture, LargeValue_SetGet)
+(benchmark::State& state) {
+  large_value_set_get(*this, state);
+  state.SetLabel("EventLoop");
+}
+
+BENCHMARK_DEFINE_F(ThreadedFixture, LargeValue_SetGet)
+(benchmark::State& state) {
+  large_value_set_get(*this, state);
+  state.SetLabel("Threaded");
+}
+
+// cost of the stats recording, state.range(0) turns latency tracking on/off
+class StatsOverheadFixture : public EventLoopFixture {
+ protected:
+  ServerConfig make_config(const ::benchmark::State& state) override {
+    ServerConfig config;
+    config.latency_tracking = state.range(0) != 0;
+    return config;
+  }
+};
+
+BENCHMARK_DEFINE_F(StatsOverheadFixture, Pipelined_LatencyTracking)
+(benchmark::State& state) {
+  const size_t num_clients = 4;
+  const size_t depth = 128;
+  std::vector<std::unique_ptr<AsyncClient>> clients;
+  for (size_t i = 0; i < num_clients; ++i) {
+    clients.push_back(std::make_unique<AsyncClient>("127.0.0.1", port_));
+  }
+  clients[0]->call({"set", "key1", "value1"}).get();
+
+  std::vector<std::future<Reply>> replies;
+  replies.reserve(num_clients * depth);
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < depth; ++i) {
+      for (auto& client : clients) {
+        replies.push_back(client->call({"get", "key1"}));
+      }
+    }
+    for (auto& reply : replies) {
+      benchmark::DoNotOptimize(reply.get());
+    }
+    replies.clear();
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_clients * depth);
+  state.SetLabel(state.range(0) ? "tracking on" : "tracking off");
+}
+
+// fairness - one client pipelining batches of 10k gets next to light clients
+// doing single round trips, state.range(0) is the per-connection command
+// budget (0 unlimited). Reports the light clients' latency percentiles
+class FairnessFixture : public EventLoopFixture {
+ protected:
+  ServerConfig make_config(const ::benchmark::State& state) override {
+    ServerConfig config;
+    config.conn_cmd_budget = static_cast<size_t>(state.range(0));
+    return config;
+  }
+};
+
+BENCHMARK_DEFINE_F(FairnessFixture, HeavyPipeline_LightLatency)
+(benchmark::State& state) {
+  const size_t num_light = 8;
+  const size_t batch_size = 10000;
+  BenchmarkClient setup(port_);
+  setup.round_trip(build_message({"set", "key1", "value1"}));
+
+  std::vector<uint8_t> batch;
+  auto get_msg = build_message({"get", "key1"});
+  for (size_t i = 0; i < batch_size; ++i) {
+    batch.insert(batch.end(), get_msg.begin(), get_msg.end());
+  }
+
+  LatencyHistogram light_latency;
+  std::mutex hist_mtx;
+  int64_t heavy_ops = 0, light_ops = 0;
+
+  for (auto _ : state) {
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+
+    threads.emplace_back([&]() {
+      BenchmarkClient heavy(port_);
+      int64_t ops = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        heavy.send_request(batch);
+        for (size_t i = 0; i < batch_size; ++i) heavy.receive_response();
+        ops += batch_size;
+      }
+      std::scoped_lock lock(hist_mtx);
+      heavy_ops += ops;
+    });
+
+    for (size_t i = 0; i < num_light; ++i) {
+      threads.emplace_back([&]() {
+        BenchmarkClient light(port_);
+        LatencyHistogram hist;
+        while (!stop.load(std::memory_order_relaxed)) {
+          uint64_t start_ns = monotonic_ns();
+          light.round_trip(get_msg);
+          hist.record(monotonic_ns() - start_ns);
+        }
+        std::scoped_lock lock(hist_mtx);
+        light_latency.merge(hist);
+        light_ops += hist.count();
+      });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    stop = true;
+    for (auto& t : threads) t.join();
+    state.SetIterationTime(1.0);
+  }
+
+  state.counters["heavy_ops"] =
+      benchmark::Counter(heavy_ops, benchmark::Counter::kIsRate);
+  state.counters["light_ops"] =
+      benchmark::Counter(light_ops, benchmark::Counter::kIsRate);
+  state.counters["light_p50_us"] = light_latency.percentile(50) / 1000.0;
+  state.counters["light_p99_us"] = light_latency.percentile(99) / 1000.0;
+  state.counters["light_max_us"] = light_latency.max() / 1000.0;
+  state.SetLabel(state.range(0) ? "budget " + std::to_string(state.range(0))
+                                : "unlimited");
+}
+
+// low-latency mode - single client round trips with the event loop spinning
+// for up to state.range(0) us before it blocks (0 is the default blocking
+// loop). Spinning only pays off when the loop has a core of its own
+class BusyPollFixture : public EventLoopFixture {
+ protected:
+  ServerConfig make_config(const ::benchmark::State& state) override {
+    ServerConfig config;
+    config.busy_poll_us = static_cast<uint64_t>(state.range(0));
+    return config;
+  }
+};
+
+BENCHMARK_DEFINE_F(BusyPollFixture, Latency_SingleClient)
+(benchmark::State& state) {
+  BenchmarkClient client(port_);
+  auto msg = build_message({"get", "nonexistent_key"});
+  for (size_t i = 0; i < 1000; ++i) client.round_trip(msg);
+
+  LatencyHistogram latency;
+  for (auto _ : state) {
+    uint64_t start_ns = monotonic_ns();
+    client.round_trip(msg);
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    latency.record(elapsed_ns);
+    state.SetIterationTime(elapsed_ns / 1e9);
+  }
+
+  state.counters["p50_us"] = latency.percentile(50) / 1000.0;
+  state.counters["p99_us"] = latency.percentile(99) / 1000.0;
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(state.range(0) ? "busy poll " + std::to_string(state.range(0))
+                                : "blocking");
+}
+
+// Unix domain socket vs TCP loopback, state.range(0) is 1 for clients on
+// the server's abstract unix socket and 0 for TCP
+class UnixSocketFixture : public EventLoopFixture {
+ protected:
+  ServerConfig make_config(const ::benchmark::State&) override {
+    ServerConfig config;
+    config.unix_sockets = {unix_path()};
+    return config;
+  }
+
+ public:
+  std::string unix_path() const {
+    return "@kv-bench-" + std::to_string(port_);
+  }
+
+  std::unique_ptr<BenchmarkClient> connect(const ::benchmark::State& state) {
+    if (state.range(0)) return std::make_unique<BenchmarkClient>(unix_path());
+    return std::make_unique<BenchmarkClient>(port_);
+  }
+};
+
+BENCHMARK_DEFINE_F(UnixSocketFixture, Latency_SingleClient)
+(benchmark::State& state) {
+  auto client = connect(state);
+  auto msg = build_message({"get", "nonexistent_key"});
+  for (size_t i = 0; i < 1000; ++i) client->round_trip(msg);
+
+  LatencyHistogram latency;
+  for (auto _ : state) {
+    uint64_t start_ns = monotonic_ns();
+    client->round_trip(msg);
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    latency.record(elapsed_ns);
+    state.SetIterationTime(elapsed_ns / 1e9);
+  }
+
+  state.counters["p50_us"] = latency.percentile(50) / 1000.0;
+  state.counters["p99_us"] = latency.percentile(99) / 1000.0;
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(state.range(0) ? "unix" : "tcp");
+}
+
+BENCHMARK_DEFINE_F(UnixSocketFixture, Throughput_MultiClient)
+(benchmark::State& state) {
+  const size_t num_clients = 8;
+  std::vector<std::unique_ptr<BenchmarkClient>> clients;
+  for (size_t i = 0; i < num_clients; ++i) clients.push_back(connect(state));
+  auto get_msg = build_message({"get", "key1"});
+  clients[0]->round_trip(build_message({"set", "key1", "value1"}));
+
+  int64_t total_ops = 0;
+  for (auto _ : state) {
+    std::atomic<bool> stop{false};
+    std::atomic<int64_t> ops{0};
+    std::vector<std::thread> threads;
+    for (auto& client : clients) {
+      threads.emplace_back([&, c = client.get()]() {
+        int64_t n = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+          c->round_trip(get_msg);
+          ++n;
+        }
+        ops += n;
+      });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    stop = true;
+    for (auto& t : threads) t.join();
+    total_ops += ops;
+    state.SetIterationTime(1.0);
+  }
+
+  state.counters["ops_per_sec"] =
+      benchmark::Counter(total_ops, benchmark::Counter::kIsRate);
+  state.SetLabel(state.range(0) ? "unix" : "tcp");
+}
+
+// pub/sub fan-out - one publisher pipelining batches of 16 publishes of a
+// 64 byte message to a channel with state.range(0) subscribers, which are
+// drained by a single epoll thread. Reports messages delivered per second
+BENCHMARK_DEFINE_F(EventLoopFixture, PubSub_FanOut)
+(benchmark::State& state) {
+  const size_t n_subs = state.range(0);
+  const size_t batch_size = 16;
+  const std::string channel = "chan";
+  const std::string payload(64, 'm');
+  // resp_len, status, n_strs and "message", channel and payload with lengths
+  const size_t frame = 12 + (4 + 7) + (4 + channel.size()) + (4 + 64);
+
+  std::vector<std::unique_ptr<BenchmarkClient>> subs;
+  int ep = epoll_create1(0);
+  auto sub_msg = build_message({"subscribe", channel});
+  for (size_t i = 0; i < n_subs; ++i) {
+    subs.push_back(std::make_unique<BenchmarkClient>(port_));
+    subs.back()->round_trip(sub_msg);
+    int fd = subs.back()->fd();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  BenchmarkClient publisher(port_);
+  std::vector<uint8_t> batch;
+  auto pub_msg = build_message({"publish", channel, payload});
+  for (size_t i = 0; i < batch_size; ++i) {
+    batch.insert(batch.end(), pub_msg.begin(), pub_msg.end());
+  }
+
+  std::vector<struct epoll_event> events(1024);
+  std::vector<uint8_t> buf(64 * 1024);
+  for (auto _ : state) {
+    publisher.send_request(batch);
+    for (size_t i = 0; i < batch_size; ++i) publisher.receive_response();
+
+    size_t remaining = n_subs * batch_size * frame;
+    while (remaining > 0) {
+      int n = epoll_wait(ep, events.data(), events.size(), 1000);
+      if (n <= 0) throw std::runtime_error("Fan-out stalled");
+      for (int i = 0; i < n; ++i) {
+        ssize_t rv;
+        while ((rv = recv(events[i].data.fd, buf.data(), buf.size(), 0)) > 0) {
+          remaining -= rv;
+        }
+      }
+    }
+  }
+  close(ep);
+
+  state.counters["deliveries"] = benchmark::Counter(
+      state.iterations() * batch_size * n_subs, benchmark::Counter::kIsRate);
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+// client-side caching - gets of 100 hot keys with state.range(0) 1 served
+// by a NearCache and 0 by plain AsyncClient round trips. Every 100th
+// operation is a set from another client, invalidating one cached key
+BENCHMARK_DEFINE_F(EventLoopFixture, NearCache_HotKeys)
+(benchmark::State& state) {
+  const size_t n_keys = 100;
+  AsyncClient writer("127.0.0.1", port_);
+  for (size_t i = 0; i < n_keys; ++i) {
+    writer.call({"set", "hot" + std::to_string(i), "value"}).get();
+  }
+
+  AsyncClient plain("127.0.0.1", port_);
+  NearCache cache("127.0.0.1", port_, n_keys);
+  size_t i = 0;
+  for (auto _ : state) {
+    std::string key = "hot" + std::to_string(i % n_keys);
+    if (++i % 100 == 0) writer.call({"set", key, "value"}).get();
+    Reply reply =
+        state.range(0) ? cache.get(key) : plain.call({"get", key}).get();
+    benchmark::DoNotOptimize(reply);
+  }
+
+  if (state.range(0)) {
+    state.counters["hit_ratio"] =
+        static_cast<double>(cache.hits()) / (cache.hits() + cache.misses());
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(state.range(0) ? "near cache" : "round trip");
+}
+
+// lazy freeing, state.range(0) is 1 to free in the background and 0 to
+// free inline. Times the command that drops the data, which is how long
+// every other client of the loop waits
+class LazyFreeFixture : public EventLoopFixture {
+ protected:
+  ServerConfig make_config(const ::benchmark::State& state) override {
+    ServerConfig config;
+    if (state.range(0) == 0) config.lazyfree_threshold = 0;
+    return config;
+  }
+};
+
+BENCHMARK_DEFINE_F(LazyFreeFixture, Flushall_Keys)(benchmark::State& state) {
+  const size_t n_keys = 200000;
+  AsyncClient client("127.0.0.1", port_);
+  std::vector<std::future<Reply>> replies;
+  replies.reserve(n_keys);
+  std::vector<std::string> cmd = {"flushall"};
+  if (state.range(0)) cmd.push_back("async");
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < n_keys; ++i) {
+      replies.push_back(
+          client.call({"set", "key:" + std::to_string(i), "value"}));
+    }
+    for (auto& reply : replies) reply.get();
+    replies.clear();
+
+    uint64_t start_ns = monotonic_ns();
+    client.call(cmd).get();
+    state.SetIterationTime((monotonic_ns() - start_ns) / 1e9);
+  }
+
+  state.SetLabel(state.range(0) ? "async" : "sync");
+}
+
+BENCHMARK_DEFINE_F(LazyFreeFixture, Del_LargeValue)(benchmark::State& state) {
+  AsyncClient client("127.0.0.1", port_);
+  std::string value(64 << 20, 'v');
+
+  for (auto _ : state) {
+    client.call({"set", "large", value}).get();
+
+    uint64_t start_ns = monotonic_ns();
+    client.call({"del", "large"}).get();
+    state.SetIterationTime((monotonic_ns() - start_ns) / 1e9);
+  }
+
+  state.SetLabel(state.range(0) ? "background" : "inline");
+}
+
+// JSON-like records, the kind of value compression is meant for
+static std::string json_blob(size_t size, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::string out = "[";
+  while (out.size() < size) {
+    out += "{\"id\":" + std::to_string(rng() % 100000) +
+           ",\"name\":\"user" + std::to_string(rng() % 1000) +
+           "\",\"active\":" + (rng() % 2 ? "true" : "false") +
+           ",\"score\":" + std::to_string(rng() % 1000) + "},";
+  }
+  out.resize(size);
+  return out;
+}
+
+// the codec alone, state.range(0) is the value size
+static void Lz_Compress(benchmark::State& state) {
+  std::string value = json_blob(state.range(0), 1);
+  std::vector<uint8_t> block(lz_compress_bound(value.size()));
+  size_t n = 0;
+  for (auto _ : state) {
+    n = lz_compress(reinterpret_cast<const uint8_t*>(value.data()),
+                    value.size(), block.data(), block.size());
+    benchmark::DoNotOptimize(n);
+  }
+  state.counters["ratio"] = static_cast<double>(value.size()) / n;
+  state.SetBytesProcessed(state.iterations() * value.size());
+}
+
+static void Lz_Decompress(benchmark::State& state) {
+  std::string value = json_blob(state.range(0), 1);
+  std::string block = lz_compress(value);
+  std::string out(value.size(), '\0');
+  for (auto _ : state) {
+    lz_decompress(reinterpret_cast<const uint8_t*>(block.data()),
+                  block.size(), reinterpret_cast<uint8_t*>(out.data()),
+                  out.size());
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * value.size());
+}
+
+// gets of compressed values, state.range(0) is the value size and
+// state.range(1) turns compression on. Also reports the memory saved over
+// 1000 such values
+class CompressionFixture : public EventLoopFixture {
+ protected:
+  ServerConfig make_config(const ::benchmark::State& state) override {
+    ServerConfig config;
+    config.compress_threshold = state.range(1) ? 1024 : 0;
+    return config;
+  }
+};
+
+BENCHMARK_DEFINE_F(CompressionFixture, Get_Value)(benchmark::State& state) {
+  const size_t n_keys = 1000;
+  AsyncClient client("127.0.0.1", port_);
+  for (size_t i = 0; i < n_keys; ++i) {
+    client.call({"set", "key:" + std::to_string(i),
+                 json_blob(state.range(0), static_cast<uint32_t>(i))});
+  }
+  std::string info = "\n" + client.call({"info", "memory"}).get().data;
+
+  BenchmarkClient reader(port_);
+  auto msg = build_message({"get", "key:1"});
+  LatencyHistogram latency;
+  for (auto _ : state) {
+    uint64_t start_ns = monotonic_ns();
+    reader.round_trip(msg);
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    latency.record(elapsed_ns);
+    state.SetIterationTime(elapsed_ns / 1e9);
+  }
+
+  size_t pos = info.find("\ncompression_saved_bytes:");
+  double saved = std::stod(info.substr(pos + 25));
+  state.counters["saved_pct"] = 100.0 * saved / (n_keys * state.range(0));
+  state.counters["p50_us"] = latency.percentile(50) / 1000.0;
+  state.counters["p99_us"] = latency.percentile(99) / 1000.0;
+  state.SetLabel(state.range(1) ? "compressed" : "raw");
+}
+
+// the recording itself, without any I/O around it
+static void StatsShard_RecordCall(benchmark::State& state) {
+  ServerStats stats({"get", "set", "del"}, state.range(0) != 0);
+  StatsShard* shard = stats.acquire_shard();
+  uint32_t cmd_id = stats.command_id("get");
+
+  CommandClock clock(shard);
+  for (auto _ : state) {
+    clock.record(cmd_id);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  stats.release_shard(shard);
+}
+
+// hot key sampling on the command path, state.range(0) is the sample rate
+// (0 disables) over 10k keys with 1% of the accesses going to one hot key
+static void HotKeys_MaybeRecord(benchmark::State& state) {
+  HotKeys hot(static_cast<uint32_t>(state.range(0)), 16);
+  std::vector<std::string> keys;
+  for (int i = 0; i < 10000; ++i) {
+    keys.push_back(i % 100 ? "key:" + std::to_string(i) : "hot");
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    hot.maybe_record(keys[i]);
+    if (++i == keys.size()) i = 0;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+// a set of a value that is not among the largest
+static void BigKeys_Update(benchmark::State& state) {
+  BigKeys big(16);
+  for (int i = 0; i < 16; ++i) {
+    big.update("big" + std::to_string(i), 0, 1 << 20);
+  }
+  std::string key = "key:12345";
+
+  for (auto _ : state) {
+    big.update(key, 100, 100);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+// heap bytes per key and get latency of state.range(1) small entries,
+// state.range(0) picks the keyspace: 0 is the unordered_map of Values it
+// replaced, 1 is Keyspace. Half of the values are integers, half short
+// strings
+template <typename Map>
+static void fill_and_probe(benchmark::State& state, Map& map) {
+  const size_t n_keys = static_cast<size_t>(state.range(1));
+  auto key = [](size_t i) { return "key:" + std::to_string(i); };
+  auto val = [](size_t i) {
+    return i % 2 ? std::to_string(i % 100000) : "val:" + std::to_string(i);
+  };
+
+  size_t before = mallinfo2().uordblks;
+  uint64_t start_ns = monotonic_ns();
+  for (size_t i = 0; i < n_keys; ++i) map.put(key(i), Value(val(i)));
+  uint64_t put_ns = monotonic_ns() - start_ns;
+  size_t bytes = mallinfo2().uordblks - before;
+
+  std::mt19937 rng(1);
+  const size_t n_gets = 1000000;
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < n_gets; ++i) keys.push_back(key(rng() % n_keys));
+  start_ns = monotonic_ns();
+  for (const std::string& k : keys) benchmark::DoNotOptimize(map.get(k));
+  uint64_t get_ns = monotonic_ns() - start_ns;
+
+  state.counters["bytes_per_key"] = static_cast<double>(bytes) / n_keys;
+  state.counters["put_ns"] = static_cast<double>(put_ns) / n_keys;
+  state.counters["get_ns"] = static_cast<double>(get_ns) / n_gets;
+}
+
+static void Keyspace_SmallEntries(benchmark::State& state) {
+  struct Before {
+    std::unordered_map<std::string, Value> map;
+    void put(std::string&& key, Value&& val) {
+      map.insert_or_assign(std::move(key), std::move(val));
+    }
+    size_t get(const std::string& key) {
+      auto it = map.find(key);
+      return it == map.end() ? 0 : it->second.str().size();
+    }
+  };
+  struct After {
+    Keyspace keyspace;
+    void put(const std::string& key, Value&& val) {
+      keyspace.put(key, std::move(val));
+    }
+    size_t get(const std::string& key) {
+      ValueView view;
+      return keyspace.find(key, view) ? view.size() : 0;
+    }
+  };
+
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      Before map;
+      fill_and_probe(state, map);
+    } else {
+      After map;
+      fill_and_probe(state, map);
+    }
+  }
+  state.SetLabel(state.range(0) ? "keyspace" : "unordered_map");
+}
+
+// hget of 10k hashes with state.range(0) short fields each, state.range(1)
+// is 0 for an unordered_map per hash and 1 for Hash, which stays packed up
+// to Hash::PACKED_MAX_FIELDS fields. Also reports heap bytes per field
+static void Hash_Get(benchmark::State& state) {
+  using Table = std::unordered_map<std::string, std::string>;
+  const size_t n_hashes = 10000;
+  const size_t n_fields = static_cast<size_t>(state.range(0));
+  const bool packed = state.range(1) != 0;
+  std::vector<std::string> fields;
+  for (size_t i = 0; i < n_fields; ++i) {
+    fields.push_back("field:" + std::to_string(i));
+  }
+
+  size_t before = mallinfo2().uordblks;
+  std::vector<Table> tables(packed ? 0 : n_hashes);
+  std::vector<Hash> hashes(packed ? n_hashes : 0);
+  for (size_t h = 0; h < n_hashes; ++h) {
+    for (size_t i = 0; i < n_fields; ++i) {
+      std::string val = "value:" + std::to_string(h * n_fields + i);
+      if (packed) {
+        hashes[h].set(fields[i], val);
+      } else {
+        tables[h][fields[i]] = val;
+      }
+    }
+  }
+  size_t bytes = mallinfo2().uordblks - before;
+
+  std::mt19937 rng(1);
+  std::string_view val;
+  for (auto _ : state) {
+    size_t h = rng() % n_hashes;
+    const std::string& field = fields[rng() % n_fields];
+    if (packed) {
+      benchmark::DoNotOptimize(hashes[h].get(field, val));
+    } else {
+      benchmark::DoNotOptimize(tables[h].find(field));
+    }
+  }
+
+  state.counters["bytes_per_field"] =
+      static_cast<double>(bytes) / (n_hashes * n_fields);
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(packed ? "hash" : "unordered_map");
+}
+
+static void List_PushPop(benchmark::State& state) {
+  /* A queue of n_elems 16 byte elements, each iteration pushes one to the
+   * back and pops one from the front */
+  const size_t n_elems = static_cast<size_t>(state.range(0));
+  const bool quicklist = state.range(1) != 0;
+  std::string elem(16, 'e');
+
+  size_t before = mallinfo2().uordblks;
+  std::deque<std::string> deque;
+  List list;
+  for (size_t i = 0; i < n_elems; ++i) {
+    if (quicklist) {
+      list.push_back(elem);
+    } else {
+      deque.push_back(elem);
+    }
+  }
+  size_t bytes = mallinfo2().uordblks - before;
+
+  std::string out;
+  for (auto _ : state) {
+    if (quicklist) {
+      list.push_back(elem);
+      list.pop_front(out);
+    } else {
+      deque.push_back(elem);
+      out = std::move(deque.front());
+      deque.pop_front();
+    }
+    benchmark::DoNotOptimize(out);
+  }
+
+  state.counters["bytes_per_elem"] = static_cast<double>(bytes) / n_elems;
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(quicklist ? "list" : "deque");
+}
+
+// Dedup and distinct counting of state.range(1) items: state.range(0) is 0
+// for a key per item in a Keyspace, the string-key approach, 1 for a Bloom
+// filter at 1% error and 2 for a HyperLogLog. Reports heap bytes per item,
+// the cost of an add and of a membership check, and of an uncached count
+// for the HyperLogLog
+static void Sketch_VsKeys(benchmark::State& state) {
+  const int mode = static_cast<int>(state.range(0));
+  const size_t n_items = static_cast<size_t>(state.range(1));
+  auto item = [](size_t i) { return "visitor:" + std::to_string(i); };
+
+  for (auto _ : state) {
+    size_t before = mallinfo2().uordblks;
+    Keyspace keys;
+    Bloom bloom(0.01, mode == 1 ? n_items : 1);
+    HyperLogLog hll;
+    uint64_t start_ns = monotonic_ns();
+    for (size_t i = 0; i < n_items; ++i) {
+      if (mode == 0) {
+        keys.put(item(i), Value("1"));
+      } else if (mode == 1) {
+        bloom.add(item(i));
+      } else {
+        hll.add(item(i));
+      }
+    }
+    uint64_t add_ns = monotonic_ns() - start_ns;
+    size_t bytes = mallinfo2().uordblks - before;
+
+    // half of the checks are for items never added
+    const size_t n_checks = 1000000;
+    std::mt19937 rng(1);
+    std::vector<std::string> checks;
+    for (size_t i = 0; i < n_checks; ++i) {
+      checks.push_back(item(rng() % (2 * n_items)));
+    }
+    start_ns = monotonic_ns();
+    for (const std::string& c : checks) {
+      if (mode == 0) {
+        benchmark::DoNotOptimize(keys.contains(c));
+      } else if (mode == 1) {
+        benchmark::DoNotOptimize(bloom.contains(c));
+      }
+    }
+    uint64_t check_ns = monotonic_ns() - start_ns;
+
+    if (mode == 2) {
+      const size_t n_counts = 1000;
+      uint64_t count_ns = 0;
+      for (size_t i = 0; i < n_counts; ++i) {
+        HyperLogLog copy;
+        copy.merge(hll);  // leaves the count to compute
+        start_ns = monotonic_ns();
+        benchmark::DoNotOptimize(copy.count());
+        count_ns += monotonic_ns() - start_ns;
+      }
+      state.counters["count_ns"] = static_cast<double>(count_ns) / n_counts;
+    }
+
+    state.counters["bytes_per_item"] = static_cast<double>(bytes) / n_items;
+    state.counters["add_ns"] = static_cast<double>(add_ns) / n_items;
+    if (mode != 2) {
+      state.counters["check_ns"] = static_cast<double>(check_ns) / n_checks;
+    }
+  }
+  state.SetLabel(mode == 0 ? "keys" : mode == 1 ? "bloom" : "hll");
+}
+
+static void KeyIndex_Update(benchmark::State& state) {
+  // The cost of keeping keys ordered next to the Keyspace: extra bytes and
+  // time per key for KeyIndex or a std::set, and one tenant's keys found by
+  // a prefix scan or, with no index, by visiting every key
+  const int mode = static_cast<int>(state.range(0));
+  const size_t n_keys = static_cast<size_t>(state.range(1));
+  const size_t n_tenants = 1000;
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < n_keys; ++i) {
+    keys.push_back("tenant:" + std::to_string(i % n_tenants) + ":user:" +
+                   std::to_string(i));
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+
+  for (auto _ : state) {
+    Keyspace keyspace;
+    for (const std::string& key : keys) keyspace.put(key, Value("1"));
+    size_t before = mallinfo2().uordblks;
+    KeyIndex index;
+    std::set<std::string, std::less<>> ordered;
+    uint64_t start_ns = monotonic_ns();
+    for (const std::string& key : keys) {
+      if (mode == 1) {
+        index.insert(key);
+      } else if (mode == 2) {
+        ordered.insert(key);
+      }
+    }
+    uint64_t insert_ns = monotonic_ns() - start_ns;
+    size_t bytes = mallinfo2().uordblks - before;
+
+    const size_t n_scans = 100;
+    size_t found = 0;
+    start_ns = monotonic_ns();
+    for (size_t t = 0; t < n_scans; ++t) {
+      std::string prefix = "tenant:" + std::to_string(t * 7) + ":";
+      auto count = [&](std::string_view key) {
+        found += key.starts_with(prefix);
+        return true;
+      };
+      if (mode == 0) {
+        keyspace.for_each(
+            [&](std::string_view key, const ValueView&) { count(key); });
+      } else if (mode == 1) {
+        index.scan_prefix(prefix, count);
+      } else {
+        for (auto it = ordered.lower_bound(prefix);
+             it != ordered.end() && it->starts_with(prefix); ++it) {
+          count(*it);
+        }
+      }
+    }
+    uint64_t scan_ns = monotonic_ns() - start_ns;
+    benchmark::DoNotOptimize(found);
+
+    // erase and put back a tenth of the keys, as updates do
+    start_ns = monotonic_ns();
+    for (size_t i = 0; i < n_keys / 10; ++i) {
+      if (mode == 1) {
+        index.erase(keys[i]);
+        index.insert(keys[i]);
+      } else if (mode == 2) {
+        ordered.erase(keys[i]);
+        ordered.insert(keys[i]);
+      }
+    }
+    uint64_t update_ns = monotonic_ns() - start_ns;
+
+    state.counters["bytes_per_key"] = static_cast<double>(bytes) / n_keys;
+    state.counters["insert_ns"] = static_cast<double>(insert_ns) / n_keys;
+    state.counters["update_ns"] =
+        static_cast<double>(update_ns) / (n_keys / 10);
+    state.counters["scan_us"] = static_cast<double>(scan_ns) / n_scans / 1000;
+    if (mode == 1) {
+      state.counters["index_bytes_per_key"] =
+          static_cast<double>(index.bytes()) / n_keys;
+    }
+  }
+  state.SetLabel(mode == 0 ? "none" : mode == 1 ? "keyindex" : "std::set");
+}
+
 BENCHMARK_REGISTER_F(EventLoopFixture, Latency_SingleClient)
     ->UseManualTime()
     ->Unit(benchmark::kMicrosecond);
@@ -367,4 +1244,122 @@ BENCHMARK_REGISTER_F(EventLoopFixture, MixedWorkload)
     ->UseManualTime()
     ->Unit(benchmark::kMillisecond);
 
+BENCHMARK_REGISTER_F(EventLoopFixture, Pipelined_AsyncClient)
+    ->Arg(1)
+    ->Arg(16)
+    ->Arg(128)  // requests in flight
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_REGISTER_F(EventLoopFixture, LargeValue_SetGet)
+    ->Arg(1 << 20)
+    ->Arg(16 << 20)
+    ->Arg(64 << 20)  // value size
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_REGISTER_F(ThreadedFixture, LargeValue_SetGet)
+    ->Arg(1 << 20)
+    ->Arg(16 << 20)
+    ->Arg(64 << 20)  // value size
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_REGISTER_F(StatsOverheadFixture, Pipelined_LatencyTracking)
+    ->Arg(0)
+    ->Arg(1)  // latency tracking off/on
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_REGISTER_F(FairnessFixture, HeavyPipeline_LightLatency)
+    ->Arg(0)
+    ->Arg(256)
+    ->Arg(32)  // command budget per connection
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_REGISTER_F(BusyPollFixture, Latency_SingleClient)
+    ->Arg(0)
+    ->Arg(50)  // busy poll us
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_REGISTER_F(UnixSocketFixture, Latency_SingleClient)
+    ->Arg(0)
+    ->Arg(1)  // tcp/unix
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_REGISTER_F(UnixSocketFixture, Throughput_MultiClient)
+    ->Arg(0)
+    ->Arg(1)  // tcp/unix
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+// both ends of every subscriber live in this process and a cancelled server
+// keeps its connections open, so 10k subscribers would need far more than
+// the common limit of 20k fds
+BENCHMARK_REGISTER_F(EventLoopFixture, PubSub_FanOut)
+    ->Arg(1)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Arg(4000)  // subscribers
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_REGISTER_F(EventLoopFixture, NearCache_HotKeys)
+    ->Arg(0)
+    ->Arg(1)  // near cache off/on
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_REGISTER_F(LazyFreeFixture, Flushall_Keys)
+    ->Arg(0)
+    ->Arg(1)  // inline/background
+    ->Iterations(5)
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_REGISTER_F(LazyFreeFixture, Del_LargeValue)
+    ->Arg(0)
+    ->Arg(1)  // inline/background
+    ->Iterations(20)
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_REGISTER_F(CompressionFixture, Get_Value)
+    ->ArgsProduct({{4096, 16384, 65536}, {0, 1}})  // value size, compression
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(StatsShard_RecordCall)->Arg(0)->Arg(1);
+
+BENCHMARK(HotKeys_MaybeRecord)->Arg(0)->Arg(1)->Arg(10)->Arg(100);
+
+BENCHMARK(BigKeys_Update);
+
+BENCHMARK(Lz_Compress)->Arg(1024)->Arg(4096)->Arg(16384)->Arg(65536);
+
+BENCHMARK(Lz_Decompress)->Arg(1024)->Arg(4096)->Arg(16384)->Arg(65536);
+
+BENCHMARK(Hash_Get)->ArgsProduct({{4, 16, 32, 64}, {0, 1}});  // fields, hash
+
+BENCHMARK(List_PushPop)->ArgsProduct({{1000, 1000000}, {0, 1}});  // elems
+
+BENCHMARK(Sketch_VsKeys)
+    ->ArgsProduct({{0, 1, 2}, {1000000, 10000000}})  // structure, items
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK(KeyIndex_Update)
+    ->ArgsProduct({{0, 1, 2}, {1000000}})  // index, keys
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK(Keyspace_SmallEntries)
+    ->Args({0, 1000000})  // keyspace, entries
+    ->Args({1, 1000000})
+    ->Args({1, 10000000})  // the unordered_map needs about 8 GB for this
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond);
+
 BENCHMARK_MAIN();
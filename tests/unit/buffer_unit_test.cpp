@@ -1,8 +1,14 @@
 #include <gtest/gtest.h>
 
 #include <random>
+#include <string>
+
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "Buffer.h"
+#include "BufferChain.h"
+#include "RingBuffer.h"
 
 class BufferTest : public ::testing::Test {
  protected:
@@ -109,6 +115,31 @@ TEST_F(BufferTest, ReallocationTest) {
   EXPECT_EQ(buf.capacity() % 64, 0);
 }
 
+TEST_F(BufferTest, ShrinkTest) {
+  Buffer buf(64);
+  std::vector<uint8_t> data(10000);
+  for (size_t i = 0; i < data.size(); ++i) data[i] = i % 256;
+  buf.append(data.data(), data.size());
+  size_t grown = buf.capacity();
+  EXPECT_GE(grown, 10000);
+
+  // never below the data it holds
+  EXPECT_FALSE(buf.shrink(100));
+  EXPECT_FALSE(buf.shrink(grown));
+
+  buf.consume(9000);
+  EXPECT_TRUE(buf.shrink(1000));
+  EXPECT_EQ(buf.capacity(), 1024);
+  EXPECT_EQ(buf.size(), 1000);
+  EXPECT_EQ(memcmp(buf.data(), data.data() + 9000, 1000), 0);
+
+  buf.clear();
+  EXPECT_TRUE(buf.shrink(1));
+  EXPECT_EQ(buf.capacity(), 64);
+  buf.append(data.data(), 100);
+  EXPECT_EQ(memcmp(buf.data(), data.data(), 100), 0);
+}
+
 TEST_F(BufferTest, StressTest) {
   Buffer buf(64);
   std::mt19937 rng(42);
@@ -154,6 +185,232 @@ TEST_F(BufferTest, StressTest) {
   }
 }
 
+class BufferChainTest : public ::testing::Test {
+ protected:
+  void SetUp() override {}
+  void TearDown() override {}
+
+  // bytes that differ at every offset so misplaced segments are caught
+  static std::string pattern(size_t n) {
+    std::string s(n, '\0');
+    for (size_t i = 0; i < n; ++i) s[i] = static_cast<char>((i * 7 + i / 251));
+    return s;
+  }
+
+  static void append(BufferChain& chain, const std::string& s) {
+    chain.append(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+  }
+};
+
+TEST_F(BufferChainTest, AppendConsumeAcrossSegmentsTest) {
+  BufferChain chain;
+  std::string data = pattern(3 * SEGMENT_SIZE + 100);
+  append(chain, data.substr(0, 10));
+  append(chain, data.substr(10));
+
+  EXPECT_EQ(chain.size(), data.size());
+  EXPECT_EQ(chain.n_segments(), 4);
+  EXPECT_EQ(chain.to_string(), data);
+
+  // consume into the middle of the second segment
+  chain.consume(SEGMENT_SIZE + 5);
+  EXPECT_EQ(chain.n_segments(), 3);
+  EXPECT_EQ(chain.to_string(), data.substr(SEGMENT_SIZE + 5));
+
+  std::string mid(20, '\0');
+  chain.copy_out(SEGMENT_SIZE - 10, mid.data(), 20);
+  EXPECT_EQ(mid, data.substr(2 * SEGMENT_SIZE - 5, 20));
+
+  chain.consume(chain.size());
+  EXPECT_TRUE(chain.empty());
+  EXPECT_EQ(chain.n_segments(), 0);
+}
+
+TEST_F(BufferChainTest, SplitAndShareWithoutCopyTest) {
+  BufferChain chain;
+  std::string data = pattern(2 * SEGMENT_SIZE);
+  append(chain, data);
+
+  // the cut segment ends up in both chains, nothing is copied
+  BufferChain front = chain.split_front(SEGMENT_SIZE + 1);
+  EXPECT_EQ(front.to_string(), data.substr(0, SEGMENT_SIZE + 1));
+  EXPECT_EQ(chain.to_string(), data.substr(SEGMENT_SIZE + 1));
+  EXPECT_EQ(front.n_segments() + chain.n_segments(), 3);
+
+  // appending to a chain whose last segment is shared must not overwrite the
+  // other chain's bytes
+  BufferChain out;
+  out.append_shared(front);
+  append(out, "tail");
+  EXPECT_EQ(front.to_string(), data.substr(0, SEGMENT_SIZE + 1));
+  EXPECT_EQ(out.to_string(), data.substr(0, SEGMENT_SIZE + 1) + "tail");
+
+  // the shared bytes stay valid after the original chain is gone
+  chain.clear();
+  front.clear();
+  EXPECT_EQ(out.size(), SEGMENT_SIZE + 5);
+  EXPECT_EQ(out.to_string().substr(0, 100), data.substr(0, 100));
+}
+
+TEST_F(BufferChainTest, ReadvWritevTest) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  std::string data = pattern(SEGMENT_SIZE / 2);
+
+  // partially filled tail segment is used first, then a new one
+  BufferChain in;
+  append(in, "abc");
+  ASSERT_EQ(write(fds[0], data.data(), data.size()),
+            static_cast<ssize_t>(data.size()));
+  struct iovec iov[4];
+  size_t n_iov = in.prepare_read(iov, 4, SEGMENT_SIZE);
+  EXPECT_EQ(n_iov, 2);
+  EXPECT_EQ(iov[0].iov_len + iov[1].iov_len, SEGMENT_SIZE);
+
+  ssize_t rv = readv(fds[1], iov, static_cast<int>(n_iov));
+  ASSERT_EQ(rv, static_cast<ssize_t>(data.size()));
+  in.commit_read(rv);
+  EXPECT_EQ(in.n_segments(), 1);
+  EXPECT_EQ(in.to_string(), "abc" + data);
+
+  // and back out through writev
+  n_iov = in.fill_iov(iov, 4);
+  rv = writev(fds[0], iov, static_cast<int>(n_iov));
+  ASSERT_EQ(rv, static_cast<ssize_t>(in.size()));
+  std::string echoed(in.size(), '\0');
+  ASSERT_EQ(recv(fds[1], echoed.data(), echoed.size(), MSG_WAITALL), rv);
+  EXPECT_EQ(echoed, "abc" + data);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(BufferChainTest, SegmentPoolReuseTest) {
+  SegmentPool& pool = SegmentPool::local();
+  {
+    BufferChain chain;
+    append(chain, pattern(4 * SEGMENT_SIZE));
+  }
+  size_t cached = pool.cached();
+  EXPECT_GE(cached, 4);
+
+  // the blocks released above are handed out again
+  BufferChain chain;
+  append(chain, pattern(4 * SEGMENT_SIZE));
+  EXPECT_EQ(pool.cached(), cached - 4);
+}
+
+class RingBufferTest : public ::testing::Test {
+ protected:
+  void SetUp() override {}
+  void TearDown() override {}
+};
+
+TEST_F(RingBufferTest, CapacityTest) {
+  // capacity is rounded up to a power of two of at least a page
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  RingBuffer buf1(1);
+  EXPECT_EQ(buf1.capacity(), page);
+  RingBuffer buf2(3 * page);
+  EXPECT_EQ(buf2.capacity(), 4 * page);
+  EXPECT_EQ(buf2.size(), 0);
+}
+
+TEST_F(RingBufferTest, WrapAroundContiguousTest) {
+  RingBuffer buf(4096);
+  size_t cap = buf.capacity();
+  std::vector<uint8_t> data(cap + 50);
+  for (size_t i = 0; i < data.size(); ++i) data[i] = i % 251;
+
+  // move head close to the end of the ring, then append across the end
+  buf.append(data.data(), cap - 10);
+  buf.consume(cap - 10);
+  EXPECT_EQ(buf.size(), 0);
+  buf.append(data.data(), 100);
+  EXPECT_EQ(buf.size(), 100);
+  EXPECT_EQ(buf.capacity(), cap);  // no growth and no compaction
+  EXPECT_EQ(memcmp(buf.data(), data.data(), 100), 0);
+
+  // the whole ring can be filled and read contiguously from any head
+  buf.consume(50);
+  buf.append(data.data() + 100, cap - 50);
+  EXPECT_EQ(buf.size(), cap);
+  EXPECT_EQ(buf.capacity(), cap);
+  EXPECT_EQ(memcmp(buf.data(), data.data() + 50, cap), 0);
+}
+
+TEST_F(RingBufferTest, GrowTest) {
+  RingBuffer buf(4096);
+  size_t cap = buf.capacity();
+  std::vector<uint8_t> data(4 * cap);
+  for (size_t i = 0; i < data.size(); ++i) data[i] = i % 253;
+
+  // grow while the data wraps around the end
+  buf.append(data.data(), cap - 8);
+  buf.consume(cap - 16);
+  buf.append(data.data() + cap - 8, 3 * cap);
+  EXPECT_EQ(buf.size(), 3 * cap + 8);
+  EXPECT_EQ(buf.capacity(), 4 * cap);
+  EXPECT_EQ(memcmp(buf.data(), data.data() + cap - 16, buf.size()), 0);
+
+  buf.clear();
+  EXPECT_EQ(buf.size(), 0);
+  EXPECT_EQ(buf.capacity(), 4 * cap);
+}
+
+TEST_F(RingBufferTest, ShrinkTest) {
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  RingBuffer buf(page);
+  std::vector<uint8_t> data(8 * page);
+  for (size_t i = 0; i < data.size(); ++i) data[i] = i % 251;
+
+  // wrapped data is kept by a smaller ring
+  buf.append(data.data(), page - 16);
+  buf.consume(page - 16);
+  buf.append(data.data(), 8 * page);
+  EXPECT_EQ(buf.capacity(), 8 * page);
+  EXPECT_FALSE(buf.shrink(page));
+  buf.consume(7 * page);
+  EXPECT_TRUE(buf.shrink(1));
+  EXPECT_EQ(buf.capacity(), page);
+  EXPECT_EQ(memcmp(buf.data(), data.data() + 7 * page, page), 0);
+  EXPECT_FALSE(buf.shrink(1));
+}
+
+TEST_F(RingBufferTest, StressTest) {
+  RingBuffer buf(64);
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> size_dist(1, 3000);
+  std::uniform_int_distribution<int> op_dist(0, 5);
+  std::vector<uint8_t> reference_data;
+
+  for (size_t iter = 0; iter < 5000; ++iter) {
+    int op = op_dist(rng);
+
+    if (op <= 2 || reference_data.empty()) {  // append
+      size_t append_size = size_dist(rng);
+      std::vector<uint8_t> data(append_size);
+      for (size_t i = 0; i < append_size; ++i) data[i] = (iter + i) % 256;
+      buf.append(data.data(), append_size);
+      reference_data.insert(reference_data.end(), data.begin(), data.end());
+
+    } else if (op <= 4) {  // consume
+      size_t consume_size =
+          std::min(reference_data.size(), static_cast<size_t>(size_dist(rng)));
+      buf.consume(consume_size);
+      reference_data.erase(reference_data.begin(),
+                           reference_data.begin() + consume_size);
+
+    } else {  // clear
+      buf.clear();
+      reference_data.clear();
+    }
+
+    ASSERT_EQ(buf.size(), reference_data.size());
+    ASSERT_EQ(memcmp(buf.data(), reference_data.data(), buf.size()), 0);
+  }
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
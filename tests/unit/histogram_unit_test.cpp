@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+
+#include "Histogram.h"
+
+class HistogramTest : public ::testing::Test {
+ protected:
+  void SetUp() override {}
+  void TearDown() override {}
+};
+
+TEST_F(HistogramTest, SmallValuesExactTest) {
+  // values below 256 have their own bucket
+  LatencyHistogram h;
+  for (uint64_t v = 1; v <= 100; ++v) {
+    h.record(v);
+  }
+
+  EXPECT_EQ(h.count(), 100);
+  EXPECT_EQ(h.min(), 1);
+  EXPECT_EQ(h.max(), 100);
+  EXPECT_DOUBLE_EQ(h.mean(), 50.5);
+  EXPECT_EQ(h.percentile(50), 50);
+  EXPECT_EQ(h.percentile(99), 99);
+  EXPECT_EQ(h.percentile(100), 100);
+}
+
+TEST_F(HistogramTest, RelativeErrorTest) {
+  // every percentile must be within 1% of the exact value
+  LatencyHistogram h;
+  std::mt19937_64 rng(42);
+  std::lognormal_distribution<double> dist(10.0, 2.0);
+  std::vector<uint64_t> values;
+  for (size_t i = 0; i < 100000; ++i) {
+    uint64_t v = static_cast<uint64_t>(dist(rng)) + 1;
+    values.push_back(v);
+    h.record(v);
+  }
+  std::sort(values.begin(), values.end());
+
+  for (double pct : {50.0, 90.0, 99.0, 99.9, 99.99}) {
+    size_t rank = static_cast<size_t>(pct / 100 * values.size() + 0.5);
+    uint64_t exact = values[rank - 1];
+    uint64_t approx = h.percentile(pct);
+    EXPECT_NEAR(static_cast<double>(approx), static_cast<double>(exact),
+                exact * 0.01)
+        << "p" << pct;
+  }
+}
+
+TEST_F(HistogramTest, MergeAndResetTest) {
+  LatencyHistogram a, b;
+  a.record(1000, 3);
+  b.record(5000000);
+
+  a.merge(b);
+  EXPECT_EQ(a.count(), 4);
+  EXPECT_EQ(a.min(), 1000);
+  EXPECT_EQ(a.max(), 5000000);
+  EXPECT_NEAR(a.percentile(50), 1000, 10);
+
+  a.reset();
+  EXPECT_EQ(a.count(), 0);
+  EXPECT_EQ(a.percentile(99), 0);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
+#include <netinet/tcp.h>
 
 #include "Buffer.h"
+#include "Client.h"
+#include "ClusterClient.h"
+#include "NearCache.h"
+#include "ServerConfig.h"
 #include "ServerEventLoop.h"
 #include "ServerThreaded.h"
 
@@ -70,17 +75,36 @@ uint8_t read_all(int client_fd, char* buffer, int n_bytes) {
 void parse_response(int client_fd, uint32_t& res_len, uint32_t& res_status,
                     std::string& res_msg) {
   // get response length
-  char buffer[1024] = {};
-  uint8_t err = read_all(client_fd, buffer, 4);
-  memcpy(&res_len, buffer, 4);
+  uint8_t err = read_all(client_fd, reinterpret_cast<char*>(&res_len), 4);
+  ASSERT_EQ(err, 0);
 
   // read the response now that we know the length
-  err = read_all(client_fd, buffer + 4, res_len);
+  std::vector<char> buffer(res_len);
+  err = read_all(client_fd, buffer.data(), res_len);
   ASSERT_EQ(err, 0);
 
   // place response into its respective variables
-  memcpy(&res_status, buffer + 4U, 4U);
-  res_msg.assign(buffer + 8, res_len - 4);
+  memcpy(&res_status, buffer.data(), 4U);
+  res_msg.assign(buffer.data() + 4, res_len - 4);
+}
+
+// helper that sends a single message and parses its response
+void round_trip(int client_fd, const std::vector<std::string>& parts,
+                uint32_t& res_status, std::string& res_msg) {
+  auto msg = build_message(parts);
+  ASSERT_EQ(send(client_fd, msg.data(), msg.size(), 0),
+            static_cast<ssize_t>(msg.size()));
+
+  uint32_t res_len{};
+  parse_response(client_fd, res_len, res_status, res_msg);
+}
+
+// helper that returns the value of one "field:value" line of info output
+std::string info_field(const std::string& info, const std::string& field) {
+  size_t pos = info.find("\n" + field + ":");
+  if (pos == std::string::npos) return "";
+  pos += field.size() + 2;
+  return info.substr(pos, info.find('\n', pos) - pos);
 }
 
 class ServerTestBase : public ::testing::Test {
@@ -206,73 +230,2463 @@ TEST_F(ServerEventLoopTest, MultipleConnectionsTest) {
   server_thread.detach();
 }
 
-class ServerThreadedTest : public ServerTestBase {};
+TEST_F(ServerEventLoopTest, ReplicationTest) {
+  uint16_t leader_port = get_next_port();
+  uint16_t follower_port = get_next_port();
 
-TEST_F(ServerThreadedTest, ConcurrentAccessTest) {
+  ServerConfig config;
+  config.leader_host = "127.0.0.1";
+  config.leader_port = leader_port;
+  ServerEventLoop leader(leader_port);
+  ServerEventLoop follower(follower_port, config);
+
+  std::thread leader_thread([&leader]() { leader.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  int leader_fd = create_client_connection(leader_port);
+  ASSERT_GT(leader_fd, 0);
+
+  // written before the follower attaches, so it arrives in the snapshot
+  uint32_t res_status{};
+  std::string res_msg{};
+  round_trip(leader_fd, {"set", "snapkey", "snapval"}, res_status, res_msg);
+  EXPECT_EQ(res_status, 0U);
+  std::string snap_large_val(1 << 20, 'S');
+  {
+    AsyncClient client("127.0.0.1", leader_port);
+    EXPECT_EQ(client.call({"set", "snaplarge", snap_large_val}).get().status,
+              Status::Valid);
+  }
+
+  // restore is only accepted for a slot being imported
+  round_trip(leader_fd, {"restore", "k", "v"}, res_status, res_msg);
+  EXPECT_EQ(res_status, 2U);
+
+  std::thread follower_thread([&follower]() { follower.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  // written after the follower attaches, so it arrives through the stream
+  round_trip(leader_fd, {"set", "streamkey", "streamval"}, res_status,
+             res_msg);
+  round_trip(leader_fd, {"del", "snapkey"}, res_status, res_msg);
+
+  // a large value is streamed straight from its segments
+  std::string large_val(1 << 20, 'L');
+  AsyncClient leader_client("127.0.0.1", leader_port);
+  EXPECT_EQ(leader_client.call({"set", "largekey", large_val}).get().status,
+            Status::Valid);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  int follower_fd = create_client_connection(follower_port);
+  ASSERT_GT(follower_fd, 0);
+
+  round_trip(follower_fd, {"get", "streamkey"}, res_status, res_msg);
+  EXPECT_EQ(res_status, 0U);
+  EXPECT_EQ(res_msg, "streamval");
+
+  AsyncClient follower_client("127.0.0.1", follower_port);
+  EXPECT_TRUE(follower_client.call({"get", "largekey"}).get().data ==
+              large_val);
+  EXPECT_TRUE(follower_client.call({"get", "snaplarge"}).get().data ==
+              snap_large_val);
+
+  round_trip(follower_fd, {"get", "snapkey"}, res_status, res_msg);
+  EXPECT_EQ(res_status, 1U);
+
+  // followers reject writes
+  round_trip(follower_fd, {"set", "k", "v"}, res_status, res_msg);
+  EXPECT_EQ(res_status, 2U);
+  round_trip(follower_fd, {"restore", "k", "v"}, res_status, res_msg);
+  EXPECT_EQ(res_status, 2U);
+  EXPECT_EQ(res_msg.rfind("READONLY", 0), 0U);
+
+  round_trip(follower_fd, {"role"}, res_status, res_msg);
+  EXPECT_EQ(res_msg.rfind("follower 127.0.0.1", 0), 0U);
+  EXPECT_NE(res_msg.find(" up "), std::string::npos);
+
+  close(follower_fd);
+  close(leader_fd);
+  pthread_cancel(follower_thread.native_handle());
+  follower_thread.detach();
+  pthread_cancel(leader_thread.native_handle());
+  leader_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, SnapshotOutsideReplicaLimitTest) {
   uint16_t port = get_next_port();
-  ServerThreaded server(port);
+  ServerConfig config;
+  config.replica_output_limit.hard = 64 * 1024;
+  ServerEventLoop server(port, config);
 
   std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", port);
+  std::string val(60000, 'v');
+  for (int i = 0; i < 20; ++i) {
+    client.call({"set", "key" + std::to_string(i), val}).get();
+  }
 
+  // a replica that does not read its 1.2 MB snapshot yet
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int bufsize = 4096;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  ASSERT_EQ(connect(fd, (struct sockaddr*)&addr, sizeof(addr)), 0);
+  auto psync = build_message({"psync", "?", "0"});
+  ASSERT_EQ(send(fd, psync.data(), psync.size(), 0),
+            static_cast<ssize_t>(psync.size()));
   std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-  const int NUM_THREADS = 20;
-  const int OPS_PER_THREAD = 100;
-  std::vector<std::thread> client_threads;
-  std::atomic<int> success_count{0};
+  // writes streamed behind the snapshot stay under the limit
+  client.call({"set", "after", "sync"}).get();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  Reply reply = client.call({"info", "stats"}).get();
+  EXPECT_EQ(info_field(reply.data, "client_output_limit_disconnections"),
+            "0");
 
-  for (int t = 0; t < NUM_THREADS; t++) {
-    client_threads.emplace_back([&, t]() {
-      int client_fd = create_client_connection(port);
-      if (client_fd < 0) return;
+  size_t received = 0;
+  char buf[64 * 1024];
+  while (received < 20 * val.size()) {
+    ssize_t rv = recv(fd, buf, sizeof(buf), 0);
+    ASSERT_GT(rv, 0);
+    received += rv;
+  }
+  close(fd);
 
-      for (int op = 0; op < OPS_PER_THREAD; op++) {
-        std::string key = "key" + std::to_string(t) + "_" + std::to_string(op);
-        std::string value =
-            "value" + std::to_string(t) + "_" + std::to_string(op);
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
 
-        // SET operation
-        auto set_msg = build_message({"set", key, value});
-        if (send(client_fd, set_msg.data(), set_msg.size(), 0) !=
-            static_cast<ssize_t>(set_msg.size())) {
-          break;
-        }
+TEST_F(ServerEventLoopTest, PartialResyncTest) {
+  uint16_t port = get_next_port();
+  ServerEventLoop server(port);
 
-        uint8_t response[1024];
-        ssize_t n = recv(client_fd, response, sizeof(response), 0);
-        if (n <= 0) break;
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-        // GET operation to verify
-        auto get_msg = build_message({"get", key});
-        if (send(client_fd, get_msg.data(), get_msg.size(), 0) !=
-            static_cast<ssize_t>(get_msg.size())) {
-          break;
-        }
+  // unknown replid forces a full resync, the keyspace is empty so the
+  // snapshot is 0 bytes
+  int replica_fd = create_client_connection(port);
+  ASSERT_GT(replica_fd, 0);
+  uint32_t res_status{};
+  std::string res_msg{};
+  round_trip(replica_fd, {"psync", "?", "0"}, res_status, res_msg);
+  ASSERT_EQ(res_msg.rfind("fullresync ", 0), 0U);
+  std::string replid = res_msg.substr(11, 40);
+  EXPECT_EQ(res_msg, "fullresync " + replid + " 0 0");
+  close(replica_fd);
 
-        n = recv(client_fd, response, sizeof(response), 0);
-        if (n > 8) {
-          uint32_t msg_len, status;
-          memcpy(&msg_len, response, 4);
-          memcpy(&status, response + 4, 4);
-          if (status == 0) {
-            std::string retrieved(reinterpret_cast<char*>(response + 8),
-                                  msg_len - 4);
-            if (retrieved == value) {
-              success_count++;
-            }
-          }
-        }
-      }
+  int client_fd = create_client_connection(port);
+  ASSERT_GT(client_fd, 0);
+  round_trip(client_fd, {"set", "key", "val"}, res_status, res_msg);
 
-      close(client_fd);
-    });
+  // reconnecting with the same replid resends only the missed writes
+  replica_fd = create_client_connection(port);
+  ASSERT_GT(replica_fd, 0);
+  round_trip(replica_fd, {"psync", replid, "0"}, res_status, res_msg);
+  EXPECT_EQ(res_msg, "continue " + replid + " 0");
+
+  auto expected = build_message({"set", "key", "val"});
+  std::vector<uint8_t> streamed(expected.size());
+  ASSERT_EQ(read_all(replica_fd, reinterpret_cast<char*>(streamed.data()),
+                     streamed.size()),
+            0);
+  EXPECT_EQ(streamed, expected);
+
+  close(replica_fd);
+  close(client_fd);
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, ClusterRedirectTest) {
+  uint16_t port_a = get_next_port();
+  uint16_t port_b = get_next_port();
+
+  ServerConfig config;
+  config.cluster_nodes = {"127.0.0.1:" + std::to_string(port_a),
+                          "127.0.0.1:" + std::to_string(port_b)};
+  ServerEventLoop node_a(port_a, config);
+  ServerEventLoop node_b(port_b, config);
+
+  std::thread thread_a([&node_a]() { node_a.run_server(); });
+  std::thread thread_b([&node_b]() { node_b.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // slots are split evenly, so node_b owns the upper half
+  std::string key_b = "key";
+  while (key_hash_slot(key_b) < CLUSTER_SLOTS / 2) key_b += "x";
+
+  int client_fd = create_client_connection(port_a);
+  ASSERT_GT(client_fd, 0);
+  uint32_t res_status{};
+  std::string res_msg{};
+  round_trip(client_fd, {"set", key_b, "val"}, res_status, res_msg);
+  EXPECT_EQ(res_status, static_cast<uint32_t>(Status::Moved));
+  EXPECT_EQ(res_msg, std::to_string(key_hash_slot(key_b)) + " 127.0.0.1:" +
+                         std::to_string(port_b));
+
+  // the cluster client routes by its cached slot map
+  ClusterClient cluster("127.0.0.1", port_a);
+  for (int i = 0; i < 100; ++i) {
+    std::string key = "key" + std::to_string(i);
+    EXPECT_EQ(cluster.call({"set", key, "val" + std::to_string(i)}).status,
+              Status::Valid);
+  }
+  for (int i = 0; i < 100; ++i) {
+    Reply reply = cluster.call({"get", "key" + std::to_string(i)});
+    EXPECT_EQ(reply.status, Status::Valid);
+    EXPECT_EQ(reply.data, "val" + std::to_string(i));
   }
 
-  for (auto& t : client_threads) {
-    t.join();
+  close(client_fd);
+  pthread_cancel(thread_a.native_handle());
+  thread_a.detach();
+  pthread_cancel(thread_b.native_handle());
+  thread_b.detach();
+}
+
+TEST_F(ServerEventLoopTest, ClusterMigrationTest) {
+  uint16_t port_a = get_next_port();
+  uint16_t port_b = get_next_port();
+  std::string addr_b = "127.0.0.1:" + std::to_string(port_b);
+
+  ServerConfig config;
+  config.cluster_nodes = {"127.0.0.1:" + std::to_string(port_a), addr_b};
+  ServerEventLoop node_a(port_a, config);
+  ServerEventLoop node_b(port_b, config);
+
+  std::thread thread_a([&node_a]() { node_a.run_server(); });
+  std::thread thread_b([&node_b]() { node_b.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // {tag} forces all keys into the same slot, pick one owned by node_a
+  std::string tag = "{t}";
+  for (int i = 0; key_hash_slot(tag) >= CLUSTER_SLOTS / 2; ++i) {
+    tag = "{t" + std::to_string(i) + "}";
   }
+  uint16_t slot = key_hash_slot(tag);
 
-  EXPECT_EQ(success_count, NUM_THREADS * OPS_PER_THREAD);
+  ClusterClient admin("127.0.0.1", port_a);
+  ClusterClient stale("127.0.0.1", port_a);
+  for (int i = 0; i < 25; ++i) {
+    admin.call({"set", tag + std::to_string(i), std::to_string(i)});
+  }
+  admin.call({"hset", tag + "hash", "f", "v", "g", "w"});
+  admin.call({"rpush", tag + "list", "a", "b"});
+  admin.call({"bf.madd", tag + "bloom", "x", "y"});
+  admin.call({"pfadd", tag + "hll", "x", "y", "z"});
+
+  // a target that never answers fails the batch instead of hanging node_a,
+  // and the node itself is refused as a target
+  int silent_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in silent_addr = {};
+  silent_addr.sin_family = AF_INET;
+  silent_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  socklen_t addr_len = sizeof(silent_addr);
+  ASSERT_EQ(bind(silent_fd, (struct sockaddr*)&silent_addr, addr_len), 0);
+  ASSERT_EQ(listen(silent_fd, 1), 0);
+  getsockname(silent_fd, (struct sockaddr*)&silent_addr, &addr_len);
+  std::string silent =
+      "127.0.0.1:" + std::to_string(ntohs(silent_addr.sin_port));
+  std::string self = "127.0.0.1:" + std::to_string(port_a);
+  std::string slot_str = std::to_string(slot);
+
+  AsyncClient raw("127.0.0.1", port_a);
+  raw.call({"cluster", "setslot", slot_str, "migrating", self}).get();
+  Reply reply = raw.call({"cluster", "migrate", self, slot_str, "10"}).get();
+  EXPECT_EQ(reply.status, Status::Error);
+  raw.call({"cluster", "setslot", slot_str, "migrating", silent}).get();
+  reply = raw.call({"cluster", "migrate", silent, slot_str, "10"}).get();
+  EXPECT_EQ(reply.status, Status::Error);
+  raw.call({"cluster", "setslot", slot_str, "stable"}).get();
+  close(silent_fd);
+  EXPECT_EQ(admin.call({"get", tag + "0"}).data, "0");
+
+  admin.migrate_slot(slot, addr_b, 10);
+  EXPECT_EQ(admin.slot_owner(slot).port, port_b);
+
+  // stale still thinks node_a owns the slot and must follow MOVED
+  for (int i = 0; i < 25; ++i) {
+    Reply reply = stale.call({"get", tag + std::to_string(i)});
+    EXPECT_EQ(reply.status, Status::Valid);
+    EXPECT_EQ(reply.data, std::to_string(i));
+  }
+  EXPECT_EQ(stale.slot_owner(slot).port, port_b);
+  EXPECT_EQ(stale.call({"hget", tag + "hash", "g"}).data, "w");
+  EXPECT_EQ(stale.call({"rpop", tag + "list"}).data, "b");
+  EXPECT_EQ(stale.call({"bf.exists", tag + "bloom", "y"}).data, "1");
+  EXPECT_EQ(stale.call({"pfcount", tag + "hll"}).data, "3");
+
+  pthread_cancel(thread_a.native_handle());
+  thread_a.detach();
+  pthread_cancel(thread_b.native_handle());
+  thread_b.detach();
+}
+
+TEST_F(ServerEventLoopTest, AsyncClientPipelineTest) {
+  uint16_t port = get_next_port();
+  ServerEventLoop server(port);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", port);
+
+  // many requests in flight at once, replies complete in order
+  const int NUM_KEYS = 1000;
+  std::vector<std::future<Reply>> sets, gets;
+  for (int i = 0; i < NUM_KEYS; ++i) {
+    std::string key = "key" + std::to_string(i);
+    sets.push_back(client.call({"set", key, "value" + std::to_string(i)}));
+    gets.push_back(client.call({"get", key}));
+  }
+  for (int i = 0; i < NUM_KEYS; ++i) {
+    EXPECT_EQ(sets[i].get().status, Status::Valid);
+    Reply reply = gets[i].get();
+    EXPECT_EQ(reply.status, Status::Valid);
+    EXPECT_EQ(reply.data, "value" + std::to_string(i));
+  }
+
+  // values far larger than a single read
+  std::string large_val(4 << 20, 'v');
+  client.call({"set", "large", large_val}).get();
+  EXPECT_EQ(client.call({"get", "large"}).get().data, large_val);
+
+  // callbacks and pooled connections
+  std::atomic<int> completed{0};
+  ClientPool pool("127.0.0.1", port, 4);
+  for (int i = 0; i < NUM_KEYS; ++i) {
+    pool.get()->call({"get", "key" + std::to_string(i)},
+                     [&completed, i](Reply&& reply) {
+                       if (reply.data == "value" + std::to_string(i)) {
+                         completed++;
+                       }
+                     });
+  }
+  EXPECT_EQ(pool.call({"get", "key0"}).get().data, "value0");
+  for (int i = 0; i < 100 && completed < NUM_KEYS; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(completed, NUM_KEYS);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, AsyncClientReplyBeforeCloseTest) {
+  // a peer that answers and closes right away
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  socklen_t addr_len = sizeof(addr);
+  ASSERT_EQ(bind(listen_fd, (struct sockaddr*)&addr, addr_len), 0);
+  ASSERT_EQ(listen(listen_fd, 1), 0);
+  getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len);
+
+  std::thread peer([listen_fd]() {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    uint32_t msg_len = 0;
+    recv_all(fd, &msg_len, 4);
+    std::vector<uint8_t> msg(msg_len);
+    recv_all(fd, msg.data(), msg_len);
+    uint32_t reply[3] = {4 + 2, static_cast<uint32_t>(Status::Valid), 0};
+    memcpy(&reply[2], "ok", 2);
+    // corked so the reply and the FIN arrive together
+    int cork = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    send_all(fd, reply, 10);
+    close(fd);
+  });
+
+  AsyncClient client("127.0.0.1", ntohs(addr.sin_port));
+  auto first = client.call({"get", "key"});
+  Reply reply = first.get();
+  EXPECT_EQ(reply.status, Status::Valid);
+  EXPECT_EQ(reply.data, "ok");
+
+  peer.join();
+  close(listen_fd);
+}
+
+TEST_F(ServerEventLoopTest, InfoStatsTest) {
+  uint16_t port = get_next_port();
+  ServerEventLoop server(port);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", port);
+  for (int i = 0; i < 10; ++i) {
+    client.call({"set", "key" + std::to_string(i), "value"}).get();
+  }
+  for (int i = 0; i < 20; ++i) client.call({"get", "key0"}).get();
+  client.call({"nosuchcmd"}).get();
+
+  Reply reply = client.call({"info"}).get();
+  ASSERT_EQ(reply.status, Status::Valid);
+  EXPECT_EQ(info_field(reply.data, "connected_clients"), "1");
+  EXPECT_EQ(info_field(reply.data, "keys"), "10");
+  EXPECT_EQ(info_field(reply.data, "total_commands_processed"), "31");
+  EXPECT_GT(std::stoull(info_field(reply.data, "total_net_input_bytes")), 0);
+  EXPECT_GT(std::stoull(info_field(reply.data, "used_memory")), 0);
+
+  std::string get_stats = info_field(reply.data, "cmdstat_get");
+  EXPECT_EQ(get_stats.rfind("calls=20,usec=", 0), 0U) << get_stats;
+  EXPECT_NE(get_stats.find(",p99="), std::string::npos);
+  EXPECT_EQ(info_field(reply.data, "cmdstat_set").rfind("calls=10,", 0), 0U);
+  EXPECT_EQ(info_field(reply.data, "cmdstat_other").rfind("calls=1,", 0), 0U);
+
+  // a single section
+  reply = client.call({"info", "keyspace"}).get();
+  EXPECT_EQ(reply.data, "# Keyspace\nkeys:10\n");
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, SlowLogAndLoopStatsTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.slowlog_slower_than_us = 0;  // log every command
+  config.slowlog_max_len = 4;
+  config.loop_budget_us = 1;  // every busy iteration is a stall
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", port);
+  std::string big_val(300, 'v');
+  client.call({"set", "key", big_val}).get();
+  std::vector<std::string> many_args(40, "a");
+  many_args[0] = "nosuchcmd";
+  client.call(many_args).get();
+
+  // newest first, args truncated to 128 bytes and 32 args
+  Reply reply = client.call({"slowlog", "get", "2"}).get();
+  ASSERT_EQ(reply.status, Status::Valid);
+  std::istringstream lines(reply.data);
+  std::string line;
+  std::getline(lines, line);
+  EXPECT_NE(line.find(" nosuchcmd a a "), std::string::npos) << line;
+  EXPECT_TRUE(line.ends_with(" a ...(9_more_args)")) << line;
+  std::getline(lines, line);
+  EXPECT_NE(line.find(" set key " + std::string(128, 'v') +
+                      "...(172_more_bytes)"),
+            std::string::npos)
+      << line;
+  EXPECT_FALSE(std::getline(lines, line));
+
+  EXPECT_EQ(client.call({"slowlog", "len"}).get().data, "3");
+  client.call({"slowlog", "reset"}).get();
+  EXPECT_EQ(client.call({"slowlog", "len"}).get().data, "1");
+
+  reply = client.call({"loopstats"}).get();
+  ASSERT_EQ(reply.status, Status::Valid);
+  EXPECT_GT(std::stoull(info_field("\n" + reply.data, "iterations")), 0);
+  EXPECT_GT(std::stoull(info_field("\n" + reply.data, "bytes")), 300);
+  EXPECT_GT(std::stoull(info_field("\n" + reply.data, "stalls")), 0);
+  EXPECT_NE(reply.data.find("\nstall:"), std::string::npos);
+
+  client.call({"loopstats", "reset"}).get();
+  reply = client.call({"loopstats"}).get();
+  EXPECT_LT(std::stoull(info_field("\n" + reply.data, "iterations")), 5);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, LargeValueTest) {
+  uint16_t port = get_next_port();
+  ServerEventLoop server(port);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::string large_val(5 << 20, '\0');
+  for (size_t i = 0; i < large_val.size(); ++i) {
+    large_val[i] = static_cast<char>(i % 251);
+  }
+  std::string big_key(LARGE_ARG_BYTES, 'k');
+
+  // small requests before and after the large ones keep their order
+  AsyncClient client("127.0.0.1", port);
+  auto r1 = client.call({"set", "small", "value"});
+  auto r2 = client.call({"set", "large", large_val});
+  auto r3 = client.call({"get", "large"});
+  auto r4 = client.call({"get", "small"});
+  auto r5 = client.call({"get", "large"});
+  auto r6 = client.call({"set", big_key, large_val});  // large key is copied
+  auto r7 = client.call({"get", big_key});
+
+  EXPECT_EQ(r1.get().status, Status::Valid);
+  EXPECT_EQ(r2.get().status, Status::Valid);
+  Reply reply = r3.get();
+  EXPECT_EQ(reply.status, Status::Valid);
+  EXPECT_TRUE(reply.data == large_val);
+  EXPECT_EQ(r4.get().data, "value");
+  EXPECT_TRUE(r5.get().data == large_val);
+  EXPECT_EQ(r6.get().status, Status::Valid);
+  EXPECT_TRUE(r7.get().data == large_val);
+
+  // overwriting and deleting the large value
+  EXPECT_EQ(client.call({"set", "large", "small now"}).get().status,
+            Status::Valid);
+  EXPECT_EQ(client.call({"get", "large"}).get().data, "small now");
+  EXPECT_EQ(client.call({"del", big_key}).get().status, Status::Valid);
+  EXPECT_EQ(client.call({"get", big_key}).get().status, Status::Invalid);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, BufferReclaimTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.conn_idle_ms = 300;
+  config.conn_buf_keep = 1 << 30;  // only idle connections shrink
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // below LARGE_MSG_BYTES so both contiguous buffers grow
+  std::string val(200000, 'v');
+  AsyncClient client("127.0.0.1", port);
+  client.call({"set", "key", val}).get();
+  EXPECT_TRUE(client.call({"get", "key"}).get().data == val);
+
+  AsyncClient observer("127.0.0.1", port);
+  Reply reply = observer.call({"info", "memory"}).get();
+  EXPECT_GT(std::stoull(info_field(reply.data, "mem_clients")), 2 * 200000);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(700));
+  reply = observer.call({"info", "memory"}).get();
+  EXPECT_LT(std::stoull(info_field(reply.data, "mem_clients")), 64 * 1024);
+
+  reply = observer.call({"client", "list"}).get();
+  ASSERT_EQ(reply.status, Status::Valid);
+  std::istringstream lines(reply.data);
+  std::string line;
+  int n_lines = 0;
+  while (std::getline(lines, line)) {
+    ++n_lines;
+    EXPECT_NE(line.find(" kind=client "), std::string::npos) << line;
+    size_t pos = line.find(" tot-mem=");
+    ASSERT_NE(pos, std::string::npos) << line;
+    EXPECT_LT(std::stoull(line.substr(pos + 9)), 32 * 1024) << line;
+  }
+  EXPECT_EQ(n_lines, 2);
+
+  // the shrunk buffers grow again
+  EXPECT_TRUE(client.call({"get", "key"}).get().data == val);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, OutputLimitTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.client_output_limit.hard = 1 << 20;
+  config.write_high_watermark = 0;  // would pause the client below the limit
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::string val(60000, 'v');
+  AsyncClient client("127.0.0.1", port);
+  client.call({"set", "key", val}).get();
+  EXPECT_TRUE(client.call({"get", "key"}).get().data == val);
+
+  // 100 pipelined gets would queue 6 MB of replies
+  int fd = create_client_connection(port);
+  ASSERT_GE(fd, 0);
+  std::vector<uint8_t> batch;
+  for (int i = 0; i < 100; ++i) {
+    auto msg = build_message({"get", "key"});
+    batch.insert(batch.end(), msg.begin(), msg.end());
+  }
+  ASSERT_EQ(send(fd, batch.data(), batch.size(), 0),
+            static_cast<ssize_t>(batch.size()));
+
+  size_t received = 0;
+  char buf[64 * 1024];
+  ssize_t rv;
+  while ((rv = recv(fd, buf, sizeof(buf), 0)) > 0) received += rv;
+  EXPECT_LT(received, 100 * val.size());
+  close(fd);
+
+  Reply reply = client.call({"info", "stats"}).get();
+  EXPECT_EQ(info_field(reply.data, "client_output_limit_disconnections"),
+            "1");
+  EXPECT_TRUE(client.call({"get", "key"}).get().data == val);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, CommandBudgetTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.conn_cmd_budget = 4;
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient observer("127.0.0.1", port);
+  observer.call({"loopstats", "reset"}).get();
+
+  // a pipeline of 1000 requests is carried over, 4 per iteration
+  int fd = create_client_connection(port);
+  ASSERT_GE(fd, 0);
+  std::vector<uint8_t> batch;
+  for (int i = 0; i < 500; ++i) {
+    auto set = build_message({"set", "key" + std::to_string(i), "v"});
+    auto get = build_message({"get", "key" + std::to_string(i)});
+    batch.insert(batch.end(), set.begin(), set.end());
+    batch.insert(batch.end(), get.begin(), get.end());
+  }
+  ASSERT_EQ(send(fd, batch.data(), batch.size(), 0),
+            static_cast<ssize_t>(batch.size()));
+
+  for (int i = 0; i < 500; ++i) {
+    uint32_t res_len{}, res_status{};
+    std::string res_msg;
+    parse_response(fd, res_len, res_status, res_msg);
+    ASSERT_EQ(res_status, static_cast<uint32_t>(Status::Valid));
+    parse_response(fd, res_len, res_status, res_msg);
+    ASSERT_EQ(res_status, static_cast<uint32_t>(Status::Valid));
+    ASSERT_EQ(res_msg, "v");
+  }
+  close(fd);
+
+  Reply reply = observer.call({"loopstats"}).get();
+  EXPECT_GE(std::stoull(info_field("\n" + reply.data, "iterations")), 250);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, WriteHighWatermarkTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.conn_cmd_budget = 0;
+  config.write_high_watermark = 16 * 1024;
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::string val(10000, 'v');
+  AsyncClient observer("127.0.0.1", port);
+  observer.call({"set", "key", val}).get();
+
+  // 20 MB of replies to a client that does not read, far more than the
+  // socket buffers hold
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int bufsize = 4096;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  ASSERT_EQ(connect(fd, (struct sockaddr*)&addr, sizeof(addr)), 0);
+
+  const int n_gets = 2000;
+  std::vector<uint8_t> batch;
+  for (int i = 0; i < n_gets; ++i) {
+    auto msg = build_message({"get", "key"});
+    batch.insert(batch.end(), msg.begin(), msg.end());
+  }
+  ASSERT_EQ(send(fd, batch.data(), batch.size(), 0),
+            static_cast<ssize_t>(batch.size()));
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  // the server stopped running its requests at the watermark
+  Reply reply = observer.call({"client", "list"}).get();
+  auto field = [](const std::string& line, const std::string& name) {
+    size_t pos = line.find(" " + name + "=");
+    return std::stoull(line.substr(pos + name.size() + 2));
+  };
+  std::istringstream lines(reply.data);
+  std::string line;
+  bool found = false;
+  while (std::getline(lines, line)) {
+    if (field(line, "qbuf") == 0) continue;
+    found = true;
+    EXPECT_LT(field(line, "obuf") + field(line, "ochain"),
+              config.write_high_watermark + val.size() + 8)
+        << line;
+  }
+  EXPECT_TRUE(found) << reply.data;
+
+  // and resumes them as the client reads
+  std::vector<char> buf(val.size() + 8);
+  for (int i = 0; i < n_gets; ++i) {
+    ASSERT_EQ(read_all(fd, buf.data(), static_cast<int>(buf.size())), 0);
+    ASSERT_EQ(memcmp(buf.data() + 8, val.data(), val.size()), 0);
+  }
+  close(fd);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, UnixSocketTest) {
+  uint16_t port = get_next_port();
+  std::string path = "/tmp/kv-test-" + std::to_string(port) + ".sock";
+  std::string abstract = "@kv-test-" + std::to_string(port);
+  ServerConfig config;
+  config.unix_sockets = {path, abstract};
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // every listener reaches the same data
+  AsyncClient tcp("127.0.0.1", port);
+  AsyncClient file(path);
+  AsyncClient hidden(abstract);
+  EXPECT_EQ(file.call({"set", "key", "file"}).get().status, Status::Valid);
+  EXPECT_EQ(hidden.call({"get", "key"}).get().data, "file");
+  EXPECT_EQ(hidden.call({"set", "key", "abstract"}).get().status,
+            Status::Valid);
+  EXPECT_EQ(tcp.call({"get", "key"}).get().data, "abstract");
+
+  // large values take the same path as on TCP
+  std::string val(1 << 20, 'v');
+  EXPECT_EQ(file.call({"set", "big", val}).get().status, Status::Valid);
+  EXPECT_EQ(hidden.call({"get", "big"}).get().data, val);
+
+  Reply reply = tcp.call({"info"}).get();
+  EXPECT_EQ(info_field(reply.data, "connected_clients"), "3");
+
+  EXPECT_THROW(AsyncClient("@kv-test-missing"), std::runtime_error);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+  unlink(path.c_str());
+}
+
+// collects the pub/sub messages of an AsyncClient
+class MessageLog {
+ private:
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::vector<std::vector<std::string>> msgs_;
+
+ public:
+  explicit MessageLog(AsyncClient& client) {
+    client.on_message([this](std::vector<std::string>&& msg) {
+      std::scoped_lock lock(mtx_);
+      msgs_.push_back(std::move(msg));
+      cv_.notify_all();
+    });
+  }
+
+  std::vector<std::vector<std::string>> wait_for(size_t n) {
+    std::unique_lock lock(mtx_);
+    cv_.wait_for(lock, std::chrono::seconds(5),
+                 [&] { return msgs_.size() >= n; });
+    return msgs_;
+  }
+};
+
+TEST_F(ServerEventLoopTest, PubSubTest) {
+  uint16_t port = get_next_port();
+  ServerEventLoop server(port);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient sub1("127.0.0.1", port);
+  AsyncClient sub2("127.0.0.1", port);
+  AsyncClient publisher("127.0.0.1", port);
+  MessageLog log1(sub1);
+  MessageLog log2(sub2);
+
+  EXPECT_EQ(sub1.call({"subscribe", "news", "sports"}).get().data, "2");
+  EXPECT_EQ(sub1.call({"subscribe", "news"}).get().data, "2");
+  EXPECT_EQ(sub2.call({"psubscribe", "n*"}).get().data, "1");
+  EXPECT_EQ(sub2.call({"subscribe"}).get().status, Status::Invalid);
+
+  EXPECT_EQ(publisher.call({"publish", "news", "hello"}).get().data, "2");
+  EXPECT_EQ(publisher.call({"publish", "sports", "goal"}).get().data, "1");
+  EXPECT_EQ(publisher.call({"publish", "weather", "rain"}).get().data, "0");
+
+  // subscribed connections still run commands in between messages
+  EXPECT_EQ(sub1.call({"set", "key", "val"}).get().status, Status::Valid);
+
+  auto msgs = log1.wait_for(2);
+  ASSERT_EQ(msgs.size(), 2);
+  EXPECT_EQ(msgs[0], (std::vector<std::string>{"message", "news", "hello"}));
+  EXPECT_EQ(msgs[1], (std::vector<std::string>{"message", "sports", "goal"}));
+  msgs = log2.wait_for(1);
+  ASSERT_EQ(msgs.size(), 1);
+  EXPECT_EQ(msgs[0],
+            (std::vector<std::string>{"pmessage", "n*", "news", "hello"}));
+
+  // a large payload is shared by both receivers
+  std::string big(1 << 20, 'p');
+  EXPECT_EQ(publisher.call({"publish", "news", big}).get().data, "2");
+  msgs = log1.wait_for(3);
+  ASSERT_EQ(msgs.size(), 3);
+  EXPECT_EQ(msgs[2][2], big);
+  msgs = log2.wait_for(2);
+  ASSERT_EQ(msgs.size(), 2);
+  EXPECT_EQ(msgs[1][3], big);
+
+  EXPECT_EQ(sub1.call({"unsubscribe", "news"}).get().data, "1");
+  EXPECT_EQ(publisher.call({"publish", "news", "x"}).get().data, "1");
+  EXPECT_EQ(sub1.call({"unsubscribe"}).get().data, "0");
+  EXPECT_EQ(publisher.call({"publish", "sports", "x"}).get().data, "0");
+
+  {
+    // closed connections are unsubscribed
+    AsyncClient sub3("127.0.0.1", port);
+    EXPECT_EQ(sub3.call({"psubscribe", "*"}).get().data, "1");
+    EXPECT_EQ(publisher.call({"publish", "news", "x"}).get().data, "2");
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(publisher.call({"publish", "news", "x"}).get().data, "1");
+  EXPECT_EQ(sub2.call({"punsubscribe", "n*"}).get().data, "0");
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, PubSubOutputLimitTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.pubsub_output_limit = {256 * 1024, 0, 0};
+  config.write_high_watermark = 0;
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // a subscriber that never reads
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int bufsize = 4096;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  ASSERT_EQ(connect(fd, (struct sockaddr*)&addr, sizeof(addr)), 0);
+  auto msg = build_message({"subscribe", "feed"});
+  ASSERT_EQ(send(fd, msg.data(), msg.size(), 0),
+            static_cast<ssize_t>(msg.size()));
+
+  AsyncClient publisher("127.0.0.1", port);
+  std::string payload(16 * 1024, 'm');
+  size_t delivered = 0;
+  for (int i = 0; i < 200; ++i) {
+    delivered += std::stoull(
+        publisher.call({"publish", "feed", payload}).get().data);
+  }
+
+  // it was cut off at its limit instead of buffering 3 MB
+  EXPECT_GT(delivered, 0);
+  EXPECT_LT(delivered, 200);
+  Reply reply = publisher.call({"info", "stats"}).get();
+  EXPECT_EQ(info_field(reply.data, "client_output_limit_disconnections"),
+            "1");
+  EXPECT_EQ(publisher.call({"publish", "feed", "x"}).get().data, "0");
+  close(fd);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, TrackingTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.tracking_table_max_keys = 3;
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient writer("127.0.0.1", port);
+  AsyncClient reader("127.0.0.1", port);
+  MessageLog log(reader);
+  using Msg = std::vector<std::string>;
+
+  EXPECT_EQ(reader.call({"client", "tracking", "on", "prefix", "a"})
+                .get()
+                .status,
+            Status::Error);
+  ASSERT_EQ(reader.call({"client", "tracking", "on"}).get().status,
+            Status::Valid);
+  writer.call({"set", "k1", "v1"}).get();
+  EXPECT_EQ(reader.call({"get", "k1"}).get().data, "v1");
+  EXPECT_EQ(reader.call({"get", "missing"}).get().status, Status::Invalid);
+
+  // only keys that were read are invalidated, and only once per read
+  writer.call({"set", "k1", "v2"}).get();
+  writer.call({"set", "k1", "v3"}).get();
+  writer.call({"set", "missing", "v"}).get();
+  auto msgs = log.wait_for(1);
+  ASSERT_EQ(msgs.size(), 1);
+  EXPECT_EQ(msgs[0], (Msg{"invalidate", "k1"}));
+
+  // the table holds 3 keys, reading a 4th pushes one out early
+  for (std::string key : {"a", "b", "c", "d"}) {
+    writer.call({"set", key, "v"}).get();
+    reader.call({"get", key}).get();
+  }
+  msgs = log.wait_for(2);
+  ASSERT_EQ(msgs.size(), 2);
+  EXPECT_EQ(msgs[1][0], "invalidate");
+  Reply reply = writer.call({"info", "stats"}).get();
+  EXPECT_EQ(info_field(reply.data, "tracking_total_keys"), "3");
+  EXPECT_EQ(info_field(reply.data, "tracking_invalidations"), "2");
+
+  writer.call({"del", "d"}).get();
+  writer.call({"del", msgs[1][1]}).get();  // no longer tracked
+  msgs = log.wait_for(3);
+  ASSERT_EQ(msgs.size(), 3);
+  EXPECT_EQ(msgs[2], (Msg{"invalidate", "d"}));
+
+  // broadcast mode covers every key with the prefix, read or not
+  ASSERT_EQ(reader.call({"client", "tracking", "on", "bcast", "prefix",
+                         "user:"})
+                .get()
+                .status,
+            Status::Valid);
+  writer.call({"set", "user:1", "x"}).get();
+  writer.call({"set", "item:1", "x"}).get();
+  msgs = log.wait_for(4);
+  ASSERT_EQ(msgs.size(), 4);
+  EXPECT_EQ(msgs[3], (Msg{"invalidate", "user:1"}));
+
+  ASSERT_EQ(reader.call({"client", "tracking", "off"}).get().status,
+            Status::Valid);
+  writer.call({"set", "user:2", "x"}).get();
+  writer.call({"del", "a"}).get();
+  writer.call({"set", "last", "x"}).get();
+  reader.call({"get", "last"}).get();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(log.wait_for(0).size(), 4);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, NearCacheTest) {
+  uint16_t port = get_next_port();
+  ServerEventLoop server(port);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient writer("127.0.0.1", port);
+  writer.call({"set", "hot", "v1"}).get();
+
+  NearCache cache("127.0.0.1", port, 2);
+  EXPECT_EQ(cache.get("hot").data, "v1");
+  for (int i = 0; i < 100; ++i) EXPECT_EQ(cache.get("hot").data, "v1");
+  EXPECT_EQ(cache.hits(), 100);
+  EXPECT_EQ(cache.misses(), 1);
+
+  // only the first get reached the server
+  Reply reply = writer.call({"info", "commandstats"}).get();
+  EXPECT_EQ(info_field(reply.data, "cmdstat_get").substr(0, 8), "calls=1,")
+      << reply.data;
+
+  // a write by another client is seen on the next get
+  writer.call({"set", "hot", "v2"}).get();
+  for (int i = 0; i < 100 && cache.size() > 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.get("hot").data, "v2");
+
+  // and so is its own write
+  cache.call({"del", "hot"}).get();
+  EXPECT_EQ(cache.get("hot").status, Status::Invalid);
+
+  // bounded by max_entries
+  for (std::string key : {"a", "b", "c"}) {
+    writer.call({"set", key, key}).get();
+    EXPECT_EQ(cache.get(key).data, key);
+  }
+  EXPECT_EQ(cache.size(), 2);
+
+  NearCache bcast("127.0.0.1", port, 10, {"a"});
+  EXPECT_EQ(bcast.get("a").data, "a");
+  writer.call({"set", "a", "new"}).get();
+  for (int i = 0; i < 100 && bcast.size() > 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(bcast.get("a").data, "new");
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST(BusyPollWindowTest, AdaptsToArrivals) {
+  BusyPollWindow window(100);  // 100 us at most
+  EXPECT_TRUE(window.enabled());
+  EXPECT_EQ(window.window_ns(), 0);
+
+  // events shortly after blocking open the window up to the maximum
+  window.record(0, 20000, false);
+  EXPECT_EQ(window.window_ns(), BusyPollWindow::MIN_WINDOW_NS);
+  for (int i = 0; i < 10; ++i) {
+    window.record(window.window_ns(), window.window_ns() + 20000, false);
+  }
+  EXPECT_EQ(window.window_ns(), 100000);
+
+  // hits keep it, long waits close it again
+  window.record(3000, 3000, true);
+  EXPECT_EQ(window.window_ns(), 100000);
+  for (int i = 0; i < 10; ++i) {
+    window.record(window.window_ns(), 50000000, false);
+  }
+  EXPECT_EQ(window.window_ns(), 0);
+
+  std::string report = "\n" + window.report();
+  EXPECT_EQ(info_field(report, "busy_poll_hits"), "1");
+  EXPECT_EQ(info_field(report, "busy_poll_misses"), "15");
+
+  EXPECT_FALSE(BusyPollWindow(0).enabled());
+}
+
+TEST_F(ServerEventLoopTest, BusyPollTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.busy_poll_us = 200;
+  config.socket_busy_poll_us = 50;
+  config.cpu = 0;
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", port);
+  for (int i = 0; i < 1000; ++i) {
+    std::string key = "key" + std::to_string(i % 10);
+    ASSERT_EQ(client.call({"set", key, "val"}).get().status, Status::Valid);
+    ASSERT_EQ(client.call({"get", key}).get().data, "val");
+  }
+
+  // back to back round trips are found while spinning
+  Reply reply = client.call({"loopstats"}).get();
+  ASSERT_EQ(reply.status, Status::Valid);
+  std::string stats = "\n" + reply.data;
+  EXPECT_EQ(info_field(stats, "busy_poll_max_usec"), "200");
+  EXPECT_GT(std::stoull(info_field(stats, "busy_poll_hits")), 0) << stats;
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST(HotKeysTest, FindsSkewedKeys) {
+  HotKeys hot(1, 4);  // every access, top 4
+  std::mt19937 rng(1);
+  for (int i = 0; i < 100000; ++i) {
+    // key0 to key3 take 40%, 10% and two times 5%, the rest is spread
+    // over 10000 cold keys
+    uint32_t r = rng() % 100;
+    std::string key = r < 40   ? "key0"
+                      : r < 50 ? "key1"
+                      : r < 55 ? "key2"
+                      : r < 60 ? "key3"
+                               : "cold" + std::to_string(rng() % 10000);
+    hot.maybe_record(key);
+  }
+
+  std::istringstream lines(hot.report(10));
+  std::vector<std::pair<uint64_t, std::string>> top;
+  uint64_t count;
+  std::string key;
+  while (lines >> count >> key) top.push_back({count, key});
+  ASSERT_EQ(top.size(), 4);
+  EXPECT_EQ(top[0].second, "key0");
+  EXPECT_EQ(top[1].second, "key1");
+  // estimates never undercount and stay close for hot keys
+  EXPECT_GE(top[0].first, 39000);
+  EXPECT_LE(top[0].first, 41500);
+  EXPECT_GE(top[1].first, 9000);
+  EXPECT_LE(top[1].first, 11500);
+  EXPECT_TRUE(top[2].second == "key2" || top[2].second == "key3");
+
+  hot.reset();
+  EXPECT_EQ(hot.report(10), "");
+  EXPECT_FALSE(HotKeys(0, 4).enabled());
+}
+
+TEST(BigKeysTest, TracksLargestValues) {
+  BigKeys big(2);
+  big.update("a", 0, 10);
+  big.update("b", 0, 30);
+  big.update("c", 0, 20);  // pushes out a
+  big.update("d", 0, 5);   // too small
+  EXPECT_EQ(big.report(10), "30 b\n20 c\n");
+
+  big.update("c", 20, 50);  // grows in place
+  big.remove("b", 30);
+  EXPECT_EQ(big.report(10), "50 c\n");
+  big.update("e", 0, 1);  // the list has room again
+  EXPECT_EQ(big.report(1), "50 c\n");
+  EXPECT_EQ(big.report(10), "50 c\n1 e\n");
+
+  big.clear();
+  EXPECT_EQ(big.size(), 0);
+}
+
+TEST_F(ServerEventLoopTest, HotKeysAndBigKeysTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.hotkeys_sample = 1;
+  config.hotkeys_top = 3;
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", port);
+  client.call({"set", "small", "v"}).get();
+  client.call({"set", "big", std::string(1000, 'v')}).get();
+  client.call({"set", "bigger", std::string(5000, 'v')}).get();
+  client.call({"set", "huge key", std::string(100000, 'v')}).get();
+  for (int i = 0; i < 100; ++i) client.call({"get", "big"}).get();
+
+  Reply reply = client.call({"bigkeys"}).get();
+  ASSERT_EQ(reply.status, Status::Valid);
+  EXPECT_EQ(reply.data, "100000 huge\\x20key\n5000 bigger\n1000 big\n");
+  client.call({"del", "huge key"}).get();
+  EXPECT_EQ(client.call({"bigkeys", "1"}).get().data, "5000 bigger\n");
+
+  reply = client.call({"hotkeys", "1"}).get();
+  ASSERT_EQ(reply.status, Status::Valid);
+  EXPECT_EQ(reply.data, "101 big\n");
+
+  client.call({"hotkeys", "reset"}).get();
+  EXPECT_EQ(client.call({"hotkeys"}).get().data, "");
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST(LazyFreerTest, FreesOnBackgroundThread) {
+  struct Tracked {
+    std::atomic<int>* freed;
+    std::thread::id* freed_on;
+    Tracked(std::atomic<int>* f, std::thread::id* t) : freed(f), freed_on(t) {}
+    Tracked(Tracked&& other) noexcept
+        : freed(std::exchange(other.freed, nullptr)),
+          freed_on(other.freed_on) {}
+    ~Tracked() {
+      if (!freed) return;  // moved from
+      *freed_on = std::this_thread::get_id();
+      freed->fetch_add(1);
+    }
+  };
+
+  std::atomic<int> freed{0};
+  std::thread::id freed_on;
+  {
+    ServerStats stats({"get"});
+    LazyFreer freer(&stats);
+    freer.defer(Tracked(&freed, &freed_on));
+    for (int i = 0; i < 100 && freed.load() == 0; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(freed.load(), 1);
+    EXPECT_NE(freed_on, std::this_thread::get_id());
+    EXPECT_EQ(freer.pending(), 0);
+
+    std::string info = "\n" + stats.info("", 0);
+    EXPECT_EQ(info_field(info, "lazyfreed_objects"), "1");
+    EXPECT_EQ(info_field(info, "lazyfree_pending_objects"), "0");
+
+    // whatever is still queued is freed before the destructor returns
+    for (int i = 0; i < 2000; ++i) freer.defer(Tracked(&freed, &freed_on));
+  }
+  EXPECT_EQ(freed.load(), 2001);
+}
+
+TEST_F(ServerEventLoopTest, LazyFreeTest) {
+  uint16_t leader_port = get_next_port();
+  uint16_t follower_port = get_next_port();
+
+  ServerConfig config;
+  config.leader_host = "127.0.0.1";
+  config.leader_port = leader_port;
+  ServerEventLoop leader(leader_port);
+  ServerEventLoop follower(follower_port, config);
+
+  std::thread leader_thread([&leader]() { leader.run_server(); });
+  std::thread follower_thread([&follower]() { follower.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+  AsyncClient client("127.0.0.1", leader_port);
+  AsyncClient follower_client("127.0.0.1", follower_port);
+  auto info = [](AsyncClient& c, const std::string& field) {
+    return info_field("\n" + c.call({"info"}).get().data, field);
+  };
+
+  // values below the threshold are freed inline
+  std::string large_val(1 << 20, 'L');
+  ASSERT_EQ(client.call({"set", "large", large_val}).get().status,
+            Status::Valid);
+  ASSERT_EQ(client.call({"set", "small", "v"}).get().status, Status::Valid);
+  EXPECT_EQ(client.call({"unlink", "small"}).get().status, Status::Valid);
+  EXPECT_EQ(client.call({"unlink", "small"}).get().status, Status::Valid);
+  EXPECT_EQ(client.call({"get", "small"}).get().status, Status::Invalid);
+
+  // an overwrite and a delete of the large value both go to the free thread
+  ASSERT_EQ(client.call({"set", "large", large_val}).get().status,
+            Status::Valid);
+  EXPECT_EQ(client.call({"del", "large"}).get().status, Status::Valid);
+  EXPECT_EQ(client.call({"get", "large"}).get().status, Status::Invalid);
+
+  for (int i = 0; i < 1000; ++i) {
+    client.call({"set", "key" + std::to_string(i), "val"});
+  }
+  EXPECT_EQ(client.call({"flushall", "async"}).get().status, Status::Valid);
+  EXPECT_EQ(info(client, "keys"), "0");
+  EXPECT_EQ(client.call({"flushall", "later"}).get().status, Status::Invalid);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(info(client, "lazyfreed_objects"), "3");
+  EXPECT_EQ(info(client, "lazyfree_pending_objects"), "0");
+
+  // replicated like the other writes
+  EXPECT_EQ(info(follower_client, "keys"), "0");
+  EXPECT_EQ(follower_client.call({"flushall"}).get().status, Status::Error);
+
+  pthread_cancel(follower_thread.native_handle());
+  follower_thread.detach();
+  pthread_cancel(leader_thread.native_handle());
+  leader_thread.detach();
+}
+
+std::string json_blob(size_t size, uint32_t seed) {
+  /* JSON-like records that compress a few times, like typical values */
+  std::mt19937 rng(seed);
+  std::string out = "[";
+  while (out.size() < size) {
+    out += "{\"id\":" + std::to_string(rng() % 100000) +
+           ",\"name\":\"user" + std::to_string(rng() % 1000) +
+           "\",\"active\":" + (rng() % 2 ? "true" : "false") +
+           ",\"score\":" + std::to_string(rng() % 1000) + "},";
+  }
+  out.resize(size);
+  return out;
+}
+
+TEST(CompressionTest, RoundTrip) {
+  std::mt19937 rng(7);
+  std::string random(10000, '\0');
+  for (char& c : random) c = static_cast<char>(rng());
+
+  std::vector<std::string> inputs = {
+      "", "a", "abcdefghijklm", std::string(100000, 'x'),  // overlapping
+      json_blob(300, 1), json_blob(64 * 1024, 2), random,
+      random + random  // matches longer than 255 + 15
+  };
+  for (const std::string& in : inputs) {
+    std::vector<uint8_t> block(lz_compress_bound(in.size()));
+    size_t n = lz_compress(reinterpret_cast<const uint8_t*>(in.data()),
+                           in.size(), block.data(), block.size());
+    ASSERT_GT(n, 0);
+    std::string out(in.size(), '\0');
+    ASSERT_TRUE(lz_decompress(block.data(), n,
+                              reinterpret_cast<uint8_t*>(out.data()),
+                              out.size()));
+    EXPECT_TRUE(out == in) << in.size();
+
+    // truncated blocks and wrong sizes are rejected
+    if (in.size() > 20) {
+      EXPECT_FALSE(lz_decompress(block.data(), n / 2,
+                                 reinterpret_cast<uint8_t*>(out.data()),
+                                 out.size()));
+      EXPECT_FALSE(lz_decompress(block.data(), n,
+                                 reinterpret_cast<uint8_t*>(out.data()),
+                                 out.size() - 1));
+    }
+  }
+
+  EXPECT_LT(lz_compress(json_blob(16 * 1024, 3)).size(), 16 * 1024 / 2);
+  EXPECT_EQ(lz_compress(random), "");  // does not get smaller
+}
+
+TEST_F(ServerEventLoopTest, CompressionTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.compress_threshold = 1024;
+  ServerEventLoop server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", port);
+  auto info = [&client](const std::string& field) {
+    return std::stoll(info_field("\n" + client.call({"info"}).get().data,
+                                 field));
+  };
+
+  std::string blob = json_blob(16 * 1024, 4);
+  ASSERT_EQ(client.call({"set", "json", blob}).get().status, Status::Valid);
+  ASSERT_EQ(client.call({"set", "short", "x"}).get().status, Status::Valid);
+  EXPECT_EQ(info("compressed_values"), 1);
+  EXPECT_GT(info("compression_saved_bytes"), 8 * 1024);
+
+  // decompressed by the server
+  Reply reply = client.call({"get", "json"}).get();
+  EXPECT_EQ(reply.status, Status::Valid);
+  EXPECT_TRUE(reply.data == blob);
+
+  // or sent compressed and decompressed by a client that asked for it
+  int fd = create_client_connection(port);
+  ASSERT_GT(fd, 0);
+  uint32_t res_status{};
+  std::string res_msg{};
+  round_trip(fd, {"client", "compression", "on"}, res_status, res_msg);
+  round_trip(fd, {"get", "json"}, res_status, res_msg);
+  EXPECT_EQ(res_status, static_cast<uint32_t>(Status::Compressed));
+  EXPECT_LT(res_msg.size(), blob.size() / 2);
+  close(fd);
+
+  client.call({"client", "compression", "on"}).get();
+  reply = client.call({"get", "json"}).get();
+  EXPECT_EQ(reply.status, Status::Valid);
+  EXPECT_TRUE(reply.data == blob);
+
+  // overwritten and deleted values no longer count
+  client.call({"set", "json", "small"}).get();
+  EXPECT_EQ(info("compressed_values"), 0);
+  EXPECT_EQ(info("compression_saved_bytes"), 0);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+class ServerThreadedTest : public ServerTestBase {};
+
+TEST(KeyspaceTest, MatchesReferenceMap) {
+  // mixed encodings: inline, heap, integers and look-alikes, boxed
+  std::vector<std::string> vals = {"",       "v",     "0",   "-0",  "007",
+                                   "12345",  "-9223372036854775808",
+                                   "18446744073709551616", "3.5",
+                                   std::string(13, 'x'), std::string(100, 'y'),
+                                   std::string(2000, 'z')};
+  std::mt19937 rng(3);
+  Keyspace keyspace;
+  std::unordered_map<std::string, std::string> ref;
+  for (int i = 0; i < 20000; ++i) {
+    uint32_t r = rng() % 1000;
+    std::string key = r % 3 ? "k" + std::to_string(r)
+                            : "a longer key that is never inline " +
+                                  std::to_string(r);
+    if (rng() % 4 == 0) {
+      Keyspace::Removed old = keyspace.erase(key);
+      EXPECT_EQ(old.found, ref.erase(key) == 1);
+    } else {
+      const std::string& val = vals[rng() % vals.size()];
+      auto it = ref.find(key);
+      Keyspace::Removed old = keyspace.put(key, Value(val));
+      ASSERT_EQ(old.found, it != ref.end());
+      if (old.found) {
+        EXPECT_EQ(old.size, it->second.size());
+      }
+      EXPECT_EQ(old.boxed != nullptr, old.found && it->second.size() >= 512);
+      ref[key] = val;
+    }
+    ASSERT_EQ(keyspace.size(), ref.size());
+  }
+
+  for (const auto& [key, val] : ref) {
+    ValueView view;
+    ASSERT_TRUE(keyspace.find(key, view)) << key;
+    EXPECT_EQ(view.to_string(), val);
+    EXPECT_EQ(view.size(), val.size());
+  }
+  size_t visited = 0;
+  keyspace.for_each([&](std::string_view key, const ValueView& view) {
+    EXPECT_EQ(ref.at(std::string(key)), view.to_string());
+    ++visited;
+  });
+  EXPECT_EQ(visited, ref.size());
+  EXPECT_FALSE(keyspace.contains("missing"));
+
+  // compressed values stay boxed as they are
+  std::string json = json_blob(300, 4);
+  keyspace.put("packed", Value::compressed(lz_compress(json), json.size()));
+  ValueView view;
+  ASSERT_TRUE(keyspace.find("packed", view));
+  ASSERT_TRUE(view.boxed() && view.value().compressed());
+  EXPECT_EQ(view.to_string(), json);
+
+  Keyspace moved(std::move(keyspace));
+  EXPECT_TRUE(keyspace.empty());
+  EXPECT_EQ(moved.size(), ref.size() + 1);
+  moved.clear();
+  EXPECT_FALSE(moved.find("packed", view));
+}
+
+TEST_F(ServerEventLoopTest, SmallEncodingsTest) {
+  uint16_t port = get_next_port();
+  ServerEventLoop server(port);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // integers come back as written, look-alikes as they are
+  AsyncClient client("127.0.0.1", port);
+  std::vector<std::string> vals = {"42",  "-7",    "1234567890123",
+                                   "007", "+1",    "short",
+                                   std::string(600, 's')};
+  for (const std::string& val : vals) {
+    client.call({"set", "key", val}).get();
+    Reply reply = client.call({"get", "key"}).get();
+    ASSERT_EQ(reply.status, Status::Valid);
+    EXPECT_EQ(reply.data, val);
+  }
+  client.call({"set", "an inline key", "1"}).get();
+  EXPECT_EQ(client.call({"get", "an inline key"}).get().data, "1");
+  client.call({"del", "key"}).get();
+  EXPECT_EQ(client.call({"get", "key"}).get().status, Status::Invalid);
+  EXPECT_EQ(info_field(client.call({"info", "keyspace"}).get().data, "keys"),
+            "1");
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST(HashTest, PackedAndTableEncodings) {
+  Hash hash;
+  EXPECT_TRUE(hash.set("name", "ada"));
+  EXPECT_TRUE(hash.set("age", "36"));
+  EXPECT_TRUE(hash.set("city", "london"));
+  EXPECT_FALSE(hash.set("name", "ada lovelace"));  // in place, longer
+  EXPECT_FALSE(hash.set("city", "ldn"));  // shorter
+  EXPECT_TRUE(hash.erase("age"));
+  EXPECT_FALSE(hash.erase("age"));
+  EXPECT_TRUE(hash.packed());
+  EXPECT_EQ(hash.size(), 2);
+  EXPECT_EQ(hash.bytes(), 4 + 12 + 4 + 3);
+
+  std::string_view val;
+  ASSERT_TRUE(hash.get("name", val));
+  EXPECT_EQ(val, "ada lovelace");
+  EXPECT_FALSE(hash.get("age", val));
+  std::vector<std::string> fields;
+  hash.for_each([&](std::string_view field, std::string_view value) {
+    fields.push_back(std::string(field) + "=" + std::string(value));
+  });
+  EXPECT_EQ(fields,
+            (std::vector<std::string>{"name=ada lovelace", "city=ldn"}));
+
+  // a long value and too many fields both convert to the table
+  Hash long_val;
+  long_val.set("f", "v");
+  long_val.set("g", std::string(Hash::PACKED_MAX_LEN + 1, 'x'));
+  EXPECT_FALSE(long_val.packed());
+  ASSERT_TRUE(long_val.get("f", val));
+  EXPECT_EQ(val, "v");
+
+  Hash many;
+  for (size_t i = 0; i <= Hash::PACKED_MAX_FIELDS; ++i) {
+    EXPECT_EQ(many.packed(), i < Hash::PACKED_MAX_FIELDS + 1);
+    many.set("field" + std::to_string(i), std::to_string(i));
+  }
+  EXPECT_FALSE(many.packed());
+  EXPECT_EQ(many.size(), Hash::PACKED_MAX_FIELDS + 1);
+  ASSERT_TRUE(many.get("field7", val));
+  EXPECT_EQ(val, "7");
+  EXPECT_TRUE(many.erase("field7"));
+  EXPECT_FALSE(many.get("field7", val));
+
+  // both encodings round trip through encode and decode
+  for (const Hash* src : {&hash, &many}) {
+    Hash copy;
+    ASSERT_TRUE(Hash::decode(src->encode(), copy));
+    EXPECT_EQ(copy.size(), src->size());
+    EXPECT_EQ(copy.bytes(), src->bytes());
+    src->for_each([&](std::string_view field, std::string_view value) {
+      ASSERT_TRUE(copy.get(field, val));
+      EXPECT_EQ(val, value);
+    });
+  }
+  Hash bad;
+  std::string encoded = hash.encode();
+  EXPECT_FALSE(Hash::decode(encoded.substr(0, encoded.size() - 1), bad));
+}
+
+TEST(ListTest, ChunksAndEncoding) {
+  List list;
+  std::deque<std::string> ref;
+  std::mt19937 rng(7);
+  std::string out;
+  // lengths around the 1 and 2 byte varint boundaries and whole chunks
+  std::vector<size_t> lens = {1, 5, 127, 128, 300, List::CHUNK_BYTES};
+  for (int i = 0; i < 20000; ++i) {
+    std::string elem(lens[rng() % lens.size()],
+                     static_cast<char>('a' + i % 26));
+    switch (rng() % 4) {
+      case 0:
+        list.push_back(elem);
+        ref.push_back(elem);
+        break;
+      case 1:
+        list.push_front(elem);
+        ref.push_front(elem);
+        break;
+      case 2:
+        ASSERT_EQ(list.pop_front(out), !ref.empty());
+        if (!ref.empty()) {
+          EXPECT_EQ(out, ref.front());
+          ref.pop_front();
+        }
+        break;
+      default:
+        ASSERT_EQ(list.pop_back(out), !ref.empty());
+        if (!ref.empty()) {
+          EXPECT_EQ(out, ref.back());
+          ref.pop_back();
+        }
+    }
+    ASSERT_EQ(list.size(), ref.size());
+  }
+
+  size_t bytes = 0;
+  for (const std::string& elem : ref) bytes += elem.size();
+  EXPECT_EQ(list.bytes(), bytes);
+  std::vector<std::string> all;
+  list.for_each([&](std::string_view elem) { all.emplace_back(elem); });
+  EXPECT_TRUE(std::equal(all.begin(), all.end(), ref.begin(), ref.end()));
+
+  List copy;
+  ASSERT_TRUE(List::decode(list.encode(), copy));
+  EXPECT_EQ(copy.size(), list.size());
+  EXPECT_EQ(copy.bytes(), list.bytes());
+  std::string encoded = list.encode();
+  if (!encoded.empty()) {
+    List bad;
+    EXPECT_FALSE(List::decode(encoded.substr(0, encoded.size() - 1), bad));
+  }
+}
+
+TEST(ListTest, RangeIndexes) {
+  List list;
+  for (int i = 0; i < 10; ++i) list.push_back(std::to_string(i));
+  auto range = [&](int64_t start, int64_t stop) {
+    std::string out;
+    list.for_range(start, stop, [&](std::string_view elem) { out += elem; });
+    return out;
+  };
+  EXPECT_EQ(range(0, -1), "0123456789");
+  EXPECT_EQ(range(2, 4), "234");
+  EXPECT_EQ(range(-3, -1), "789");
+  EXPECT_EQ(range(-100, 1), "01");
+  EXPECT_EQ(range(8, 100), "89");
+  EXPECT_EQ(range(5, 2), "");
+  EXPECT_EQ(range(10, 20), "");
+}
+
+TEST(BloomTest, ErrorRateAndScaling) {
+  // the error rate holds at capacity, with items never added
+  for (double rate : {0.01, 0.001}) {
+    Bloom bloom(rate, 100000);
+    for (int i = 0; i < 100000; ++i) bloom.add("item:" + std::to_string(i));
+    EXPECT_EQ(bloom.filters(), 1);
+    EXPECT_GT(bloom.size(), 100000 * (1 - rate));
+    size_t false_positives = 0;
+    for (int i = 0; i < 200000; ++i) {
+      false_positives += bloom.contains("other:" + std::to_string(i));
+    }
+    EXPECT_LT(false_positives / 200000.0, rate * 1.2);
+    for (int i = 0; i < 100000; i += 97) {
+      EXPECT_TRUE(bloom.contains("item:" + std::to_string(i)));
+    }
+  }
+
+  // filters are added once full and the rate stays below twice the target
+  Bloom scaled(0.01, 1000);
+  for (int i = 0; i < 15000; ++i) scaled.add("item:" + std::to_string(i));
+  EXPECT_EQ(scaled.filters(), 4);  // 1000 + 2000 + 4000 + 8000
+  EXPECT_GT(scaled.size(), 14800);  // the rest were false positives
+  size_t false_positives = 0;
+  for (int i = 0; i < 100000; ++i) {
+    false_positives += scaled.contains("other:" + std::to_string(i));
+  }
+  EXPECT_LT(false_positives / 100000.0, 0.02);
+
+  Bloom copy;
+  std::string encoded = scaled.encode();
+  ASSERT_TRUE(Bloom::decode(encoded, copy));
+  EXPECT_EQ(copy.filters(), scaled.filters());
+  EXPECT_EQ(copy.size(), scaled.size());
+  EXPECT_EQ(copy.encode(), encoded);
+  EXPECT_TRUE(copy.contains("item:14999"));
+  EXPECT_FALSE(Bloom::decode(encoded.substr(0, encoded.size() - 1), copy));
+}
+
+TEST(HyperLogLogTest, CountsAndEncodings) {
+  // within 4 standard errors, sparse at first and dense later
+  HyperLogLog hll;
+  uint64_t added = 0;
+  for (uint64_t n : {10, 100, 1000, 10000, 100000, 1000000}) {
+    for (; added < n; ++added) hll.add("user:" + std::to_string(added));
+    EXPECT_EQ(hll.dense(), n > HyperLogLog::SPARSE_MAX);
+    double error = std::abs(static_cast<double>(hll.count()) - n) / n;
+    EXPECT_LT(error, 4 * 0.0081) << n;
+  }
+  EXPECT_FALSE(hll.add("user:7"));
+  EXPECT_EQ(hll.bytes(), HyperLogLog::DENSE_BYTES + 1);
+
+  // a merge is the union, whatever the encodings
+  HyperLogLog a, b, both;
+  for (int i = 0; i < 300; ++i) {
+    a.add("x" + std::to_string(i));
+    both.add("x" + std::to_string(i));
+  }
+  for (int i = 200; i < 5000; ++i) {
+    b.add("x" + std::to_string(i));
+    both.add("x" + std::to_string(i));
+  }
+  HyperLogLog sparse_merge = a;
+  EXPECT_FALSE(sparse_merge.merge(a));
+  EXPECT_TRUE(sparse_merge.merge(b));
+  EXPECT_EQ(sparse_merge.count(), both.count());
+  EXPECT_TRUE(b.merge(a));
+  EXPECT_EQ(b.count(), both.count());
+
+  for (const HyperLogLog* src : {&a, &b}) {
+    HyperLogLog copy;
+    std::string encoded = src->encode();
+    ASSERT_TRUE(HyperLogLog::decode(encoded, copy));
+    EXPECT_EQ(copy.dense(), src->dense());
+    EXPECT_EQ(copy.count(), src->count());
+    EXPECT_FALSE(
+        HyperLogLog::decode(encoded.substr(0, encoded.size() - 1), copy));
+  }
+}
+
+TEST(KeyIndexTest, MatchesReferenceSet) {
+  std::mt19937 rng(5);
+  KeyIndex index;
+  std::set<std::string> ref;
+  auto random_key = [&]() {
+    uint32_t r = rng() % 5000;
+    if (r % 97 == 0) return std::string(KeyIndex::LEAF_BYTES + r, 'L');
+    return "user:" + std::to_string(r % 50) + ":item:" + std::to_string(r);
+  };
+  for (int i = 0; i < 40000; ++i) {
+    std::string key = random_key();
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(index.erase(key), ref.erase(key) == 1);
+    } else {
+      EXPECT_EQ(index.insert(key), ref.insert(key).second);
+    }
+    ASSERT_EQ(index.size(), ref.size());
+  }
+  EXPECT_GT(index.leaves(), 1U);
+
+  std::vector<std::string> all;
+  index.scan("", [&](std::string_view key) {
+    all.emplace_back(key);
+    return true;
+  });
+  EXPECT_TRUE(std::equal(all.begin(), all.end(), ref.begin(), ref.end()));
+
+  // scans start at any key, present or not, and stop when told to
+  for (const char* start : {"user:1", "user:17:item:17", "user:3:", "v"}) {
+    std::vector<std::string> got;
+    index.scan(start, [&](std::string_view key) {
+      got.emplace_back(key);
+      return got.size() < 100;
+    });
+    std::vector<std::string> want;
+    for (auto it = ref.lower_bound(start);
+         it != ref.end() && want.size() < 100; ++it) {
+      want.push_back(*it);
+    }
+    EXPECT_EQ(got, want) << start;
+  }
+  size_t n_prefix = 0;
+  index.scan_prefix("user:42:", [&](std::string_view key) {
+    EXPECT_TRUE(key.starts_with("user:42:"));
+    ++n_prefix;
+    return true;
+  });
+  size_t want_prefix = 0;
+  for (const std::string& key : ref) want_prefix += key.starts_with("user:42:");
+  EXPECT_EQ(n_prefix, want_prefix);
+
+  // the cost stays close to the key bytes once leaves merge back
+  for (const std::string& key : all) {
+    if (key[0] == 'L') index.erase(key);
+  }
+  size_t key_bytes = 0;
+  index.scan("", [&](std::string_view key) {
+    key_bytes += key.size();
+    return true;
+  });
+  EXPECT_LT(index.bytes(), key_bytes * 2);
+  for (const std::string& key : all) index.erase(key);
+  EXPECT_EQ(index.size(), 0U);
+  EXPECT_EQ(index.leaves(), 1U);
+  index.clear();
+  EXPECT_EQ(index.bytes(), 0U);
+}
+
+TEST(WatchTableTest, VersionsOfWatchedKeys) {
+  WatchTable table;
+  WatchTable::Watched a, b;
+  table.touch("k");  // nobody watches, nothing is kept
+  EXPECT_EQ(table.size(), 0U);
+
+  table.watch("k", a);
+  table.watch("k", a);
+  table.watch("k", b);
+  table.watch("other", b);
+  EXPECT_EQ(a.size(), 1U);
+  EXPECT_EQ(table.size(), 2U);
+  EXPECT_FALSE(table.changed(a));
+  table.touch("unwatched");
+  EXPECT_FALSE(table.changed(b));
+  table.touch("other");
+  EXPECT_FALSE(table.changed(a));
+  EXPECT_TRUE(table.changed(b));
+
+  // a key watched after a change starts from the new version
+  table.unwatch_all(b);
+  EXPECT_TRUE(b.empty());
+  table.watch("other", b);
+  EXPECT_FALSE(table.changed(b));
+  table.touch_all();
+  EXPECT_TRUE(table.changed(a));
+  EXPECT_TRUE(table.changed(b));
+  table.unwatch_all(a);
+  table.unwatch_all(b);
+  EXPECT_EQ(table.size(), 0U);
+}
+
+TEST_F(ServerEventLoopTest, HashTest) {
+  uint16_t leader_port = get_next_port();
+  uint16_t follower_port = get_next_port();
+  ServerEventLoop leader(leader_port);
+  std::thread leader_thread([&leader]() { leader.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", leader_port);
+  auto list = [](const Reply& reply) {
+    std::vector<std::string> strs;
+    EXPECT_EQ(reply.status, Status::Valid);
+    EXPECT_TRUE(decode_strings(reply.data, strs));
+    return strs;
+  };
+
+  Reply reply = client.call({"hset", "user", "name", "ada", "age", "36"}).get();
+  EXPECT_EQ(reply.data, "2");
+  EXPECT_EQ(client.call({"hset", "user", "name", "bob", "x", "1"}).get().data,
+            "1");
+  EXPECT_EQ(client.call({"hget", "user", "name"}).get().data, "bob");
+  EXPECT_EQ(client.call({"hget", "user", "none"}).get().status,
+            Status::Invalid);
+  EXPECT_EQ(client.call({"hget", "nokey", "name"}).get().status,
+            Status::Invalid);
+  EXPECT_EQ(list(client.call({"hmget", "user", "age", "none", "x"}).get()),
+            (std::vector<std::string>{"36", "", "1"}));
+  EXPECT_EQ(list(client.call({"hgetall", "user"}).get()),
+            (std::vector<std::string>{"name", "bob", "age", "36", "x", "1"}));
+  EXPECT_TRUE(list(client.call({"hgetall", "nokey"}).get()).empty());
+
+  EXPECT_EQ(client.call({"hincrby", "user", "age", "-6"}).get().data, "30");
+  EXPECT_EQ(client.call({"hincrby", "user", "visits", "5"}).get().data, "5");
+  EXPECT_EQ(client.call({"hincrby", "user", "name", "1"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"hincrby", "user", "age", "1.5"}).get().status,
+            Status::Error);
+  client.call({"hset", "user", "max", "9223372036854775807"}).get();
+  EXPECT_EQ(client.call({"hincrby", "user", "max", "1"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"hdel", "user", "x", "none", "max"}).get().data, "2");
+
+  // types do not mix, set replaces a hash like any value
+  client.call({"set", "str", "v"}).get();
+  EXPECT_EQ(client.call({"hset", "str", "f", "v"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"hget", "str", "f"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"get", "user"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"hset", "user", "odd"}).get().status,
+            Status::Invalid);
+  client.call({"hset", "tmp", "f", "v"}).get();
+  client.call({"set", "tmp", "now a string"}).get();
+  EXPECT_EQ(client.call({"get", "tmp"}).get().data, "now a string");
+
+  // the last field takes the key with it
+  client.call({"hset", "gone", "f", "v"}).get();
+  EXPECT_EQ(client.call({"hdel", "gone", "f"}).get().data, "1");
+  EXPECT_EQ(client.call({"hgetall", "gone"}).get().data,
+            std::string(4, '\0'));
+  EXPECT_EQ(client.call({"hdel", "gone", "f"}).get().data, "0");
+
+  // a follower gets hashes from the snapshot and then from the stream
+  std::vector<std::string> big = {"hset", "big"};
+  for (int i = 0; i < 300; ++i) {
+    big.push_back("f" + std::to_string(i));
+    big.push_back(std::to_string(i));
+  }
+  EXPECT_EQ(client.call(big).get().data, "300");
+  ServerConfig config;
+  config.leader_host = "127.0.0.1";
+  config.leader_port = leader_port;
+  ServerEventLoop follower(follower_port, config);
+  std::thread follower_thread([&follower]() { follower.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  client.call({"hincrby", "big", "f7", "100"}).get();
+  client.call({"hdel", "user", "visits"}).get();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient follower_client("127.0.0.1", follower_port);
+  EXPECT_EQ(follower_client.call({"hget", "big", "f7"}).get().data, "107");
+  EXPECT_EQ(follower_client.call({"hget", "big", "f299"}).get().data, "299");
+  EXPECT_EQ(list(follower_client.call({"hgetall", "user"}).get()),
+            (std::vector<std::string>{"name", "bob", "age", "30"}));
+  EXPECT_EQ(follower_client.call({"hset", "user", "f", "v"}).get().status,
+            Status::Error);
+
+  pthread_cancel(follower_thread.native_handle());
+  follower_thread.detach();
+  pthread_cancel(leader_thread.native_handle());
+  leader_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, ListTest) {
+  uint16_t leader_port = get_next_port();
+  uint16_t follower_port = get_next_port();
+  ServerEventLoop leader(leader_port);
+  std::thread leader_thread([&leader]() { leader.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", leader_port);
+  auto list = [](const Reply& reply) {
+    std::vector<std::string> strs;
+    EXPECT_EQ(reply.status, Status::Valid);
+    EXPECT_TRUE(decode_strings(reply.data, strs));
+    return strs;
+  };
+
+  EXPECT_EQ(client.call({"rpush", "q", "b", "c"}).get().data, "2");
+  EXPECT_EQ(client.call({"lpush", "q", "a", "z"}).get().data, "4");
+  EXPECT_EQ(list(client.call({"lrange", "q", "0", "-1"}).get()),
+            (std::vector<std::string>{"z", "a", "b", "c"}));
+  EXPECT_EQ(list(client.call({"lrange", "q", "-2", "10"}).get()),
+            (std::vector<std::string>{"b", "c"}));
+  EXPECT_TRUE(list(client.call({"lrange", "none", "0", "-1"}).get()).empty());
+  EXPECT_EQ(client.call({"lrange", "q", "0", "x"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"lpop", "q"}).get().data, "z");
+  EXPECT_EQ(client.call({"rpop", "q"}).get().data, "c");
+  EXPECT_EQ(client.call({"llen", "q"}).get().data, "2");
+  EXPECT_EQ(client.call({"llen", "none"}).get().data, "0");
+  EXPECT_EQ(client.call({"rpop", "none"}).get().status, Status::Invalid);
+
+  // types do not mix, the last element takes the key with it
+  client.call({"set", "str", "v"}).get();
+  EXPECT_EQ(client.call({"rpush", "str", "x"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"llen", "str"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"blpop", "str", "0"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"get", "q"}).get().status, Status::Error);
+  client.call({"lpop", "q"}).get();
+  client.call({"lpop", "q"}).get();
+  EXPECT_EQ(client.call({"get", "q"}).get().status, Status::Invalid);
+
+  // an element already there is popped right away
+  client.call({"rpush", "q2", "x"}).get();
+  EXPECT_EQ(list(client.call({"blpop", "q1", "q2", "1"}).get()),
+            (std::vector<std::string>{"q2", "x"}));
+  EXPECT_EQ(client.call({"blpop", "q", "-1"}).get().status, Status::Error);
+
+  // a timeout replies Invalid, the loop wakes up for it on its own
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(client.call({"blpop", "q", "0.2"}).get().status, Status::Invalid);
+  auto waited = std::chrono::steady_clock::now() - start;
+  EXPECT_GE(waited, std::chrono::milliseconds(190));
+  EXPECT_LT(waited, std::chrono::milliseconds(1000));
+
+  // blocked clients are woken in the order they blocked, requests they
+  // pipelined after the blpop wait for it
+  AsyncClient first("127.0.0.1", leader_port);
+  AsyncClient second("127.0.0.1", leader_port);
+  auto first_pop = first.call({"blpop", "jobs", "0"});
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  auto second_pop = second.call({"blpop", "other", "jobs", "0"});
+  auto second_get = second.call({"get", "str"});
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(second_get.wait_for(std::chrono::milliseconds(0)),
+            std::future_status::timeout);
+  EXPECT_NE(client.call({"info", "clients"}).get().data.find(
+                "blocked_clients:2"),
+            std::string::npos);
+  EXPECT_EQ(client.call({"rpush", "jobs", "j1", "j2", "j3"}).get().data, "3");
+  EXPECT_EQ(list(first_pop.get()), (std::vector<std::string>{"jobs", "j1"}));
+  EXPECT_EQ(list(second_pop.get()), (std::vector<std::string>{"jobs", "j2"}));
+  EXPECT_EQ(second_get.get().data, "v");
+  EXPECT_EQ(client.call({"llen", "jobs"}).get().data, "1");
+
+  // a follower gets lists from the snapshot, and the pops of blocked
+  // clients from the stream
+  std::vector<std::string> big = {"rpush", "big"};
+  for (int i = 0; i < 3000; ++i) big.push_back("elem" + std::to_string(i));
+  EXPECT_EQ(client.call(big).get().data, "3000");
+  ServerConfig config;
+  config.leader_host = "127.0.0.1";
+  config.leader_port = leader_port;
+  ServerEventLoop follower(follower_port, config);
+  std::thread follower_thread([&follower]() { follower.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  auto woken = first.call({"blpop", "wake", "0"});
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  client.call({"rpush", "wake", "w1", "w2"}).get();
+  EXPECT_EQ(list(woken.get()), (std::vector<std::string>{"wake", "w1"}));
+  client.call({"lpop", "big"}).get();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient follower_client("127.0.0.1", follower_port);
+  EXPECT_EQ(follower_client.call({"llen", "big"}).get().data, "2999");
+  EXPECT_EQ(list(follower_client.call({"lrange", "big", "-1", "-1"}).get()),
+            (std::vector<std::string>{"elem2999"}));
+  EXPECT_EQ(list(follower_client.call({"lrange", "wake", "0", "-1"}).get()),
+            (std::vector<std::string>{"w2"}));
+  EXPECT_EQ(follower_client.call({"blpop", "big", "0"}).get().status,
+            Status::Error);
+
+  pthread_cancel(follower_thread.native_handle());
+  follower_thread.detach();
+  pthread_cancel(leader_thread.native_handle());
+  leader_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, SketchTest) {
+  uint16_t leader_port = get_next_port();
+  uint16_t follower_port = get_next_port();
+  ServerEventLoop leader(leader_port);
+  std::thread leader_thread([&leader]() { leader.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", leader_port);
+  auto list = [](const Reply& reply) {
+    std::vector<std::string> strs;
+    EXPECT_EQ(reply.status, Status::Valid);
+    EXPECT_TRUE(decode_strings(reply.data, strs));
+    return strs;
+  };
+
+  EXPECT_EQ(client.call({"bf.add", "seen", "a"}).get().data, "1");
+  EXPECT_EQ(client.call({"bf.add", "seen", "a"}).get().data, "0");
+  EXPECT_EQ(list(client.call({"bf.madd", "seen", "a", "b", "b"}).get()),
+            (std::vector<std::string>{"0", "1", "0"}));
+  EXPECT_EQ(client.call({"bf.exists", "seen", "b"}).get().data, "1");
+  EXPECT_EQ(client.call({"bf.exists", "seen", "c"}).get().data, "0");
+  EXPECT_EQ(client.call({"bf.exists", "none", "c"}).get().data, "0");
+  EXPECT_EQ(client.call({"bf.reserve", "seen", "0.01", "100"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"bf.reserve", "r", "1.5", "100"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"bf.reserve", "r", "0.001", "0"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"bf.reserve", "r", "0.001", "5000"}).get().status,
+            Status::Valid);
+
+  EXPECT_EQ(client.call({"pfadd", "day1", "u1", "u2", "u3"}).get().data, "1");
+  EXPECT_EQ(client.call({"pfadd", "day1", "u2"}).get().data, "0");
+  EXPECT_EQ(client.call({"pfadd", "day2", "u3", "u4"}).get().data, "1");
+  EXPECT_EQ(client.call({"pfadd", "empty"}).get().data, "1");
+  EXPECT_EQ(client.call({"pfcount", "day1"}).get().data, "3");
+  EXPECT_EQ(client.call({"pfcount", "day1", "day2", "none"}).get().data, "4");
+  EXPECT_EQ(client.call({"pfcount", "none"}).get().data, "0");
+  EXPECT_EQ(client.call({"pfmerge", "week", "day1", "day2"}).get().status,
+            Status::Valid);
+  EXPECT_EQ(client.call({"pfcount", "week"}).get().data, "4");
+
+  // types do not mix
+  client.call({"set", "str", "v"}).get();
+  EXPECT_EQ(client.call({"bf.add", "str", "a"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"pfcount", "day1", "seen"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"pfmerge", "week", "str"}).get().status,
+            Status::Error);
+  EXPECT_EQ(client.call({"pfadd", "seen", "a"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"get", "week"}).get().status, Status::Error);
+
+  // a follower gets sketches from the snapshot and then from the stream
+  std::vector<std::string> visits = {"pfadd", "visits"};
+  for (int i = 0; i < 5000; ++i) visits.push_back("v" + std::to_string(i));
+  client.call(visits).get();
+  std::string visits_count = client.call({"pfcount", "visits"}).get().data;
+  ServerConfig config;
+  config.leader_host = "127.0.0.1";
+  config.leader_port = leader_port;
+  ServerEventLoop follower(follower_port, config);
+  std::thread follower_thread([&follower]() { follower.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  client.call({"bf.add", "seen", "late"}).get();
+  client.call({"pfadd", "day1", "u9"}).get();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient follower_client("127.0.0.1", follower_port);
+  EXPECT_EQ(follower_client.call({"pfcount", "visits"}).get().data,
+            visits_count);
+  EXPECT_EQ(follower_client.call({"pfcount", "week"}).get().data, "4");
+  EXPECT_EQ(follower_client.call({"pfcount", "day1"}).get().data, "4");
+  EXPECT_EQ(follower_client.call({"bf.exists", "seen", "b"}).get().data, "1");
+  EXPECT_EQ(follower_client.call({"bf.exists", "seen", "late"}).get().data,
+            "1");
+  EXPECT_EQ(follower_client.call({"bf.add", "seen", "x"}).get().status,
+            Status::Error);
+
+  pthread_cancel(follower_thread.native_handle());
+  follower_thread.detach();
+  pthread_cancel(leader_thread.native_handle());
+  leader_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, KeyIndexTest) {
+  uint16_t leader_port = get_next_port();
+  uint16_t follower_port = get_next_port();
+  uint16_t plain_port = get_next_port();
+  ServerConfig config;
+  config.key_index = true;
+  ServerEventLoop leader(leader_port, config);
+  std::thread leader_thread([&leader]() { leader.run_server(); });
+  ServerEventLoop plain(plain_port);
+  std::thread plain_thread([&plain]() { plain.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", leader_port);
+  auto list = [](const Reply& reply) {
+    std::vector<std::string> strs;
+    EXPECT_EQ(reply.status, Status::Valid);
+    EXPECT_TRUE(decode_strings(reply.data, strs));
+    return strs;
+  };
+  for (const char* key : {"user:2", "user:10", "user:1", "order:1", "usr"}) {
+    client.call({"set", key, "v"}).get();
+  }
+  client.call({"hset", "user:3", "name", "c"}).get();
+  client.call({"rpush", "user:4", "a"}).get();
+  client.call({"del", "user:10"}).get();
+  client.call({"lpop", "user:4"}).get();  // the list is gone with its last
+
+  using Strs = std::vector<std::string>;
+  EXPECT_EQ(list(client.call({"keys", "user:*"}).get()),
+            (Strs{"user:1", "user:2", "user:3"}));
+  EXPECT_EQ(list(client.call({"keys", "us*r*"}).get()),
+            (Strs{"user:1", "user:2", "user:3", "usr"}));
+  EXPECT_EQ(list(client.call({"keys", "user:[13]"}).get()),
+            (Strs{"user:1", "user:3"}));
+  EXPECT_EQ(list(client.call({"keys", "usr"}).get()), (Strs{"usr"}));
+  EXPECT_EQ(list(client.call({"keys", "nope*"}).get()), (Strs{}));
+
+  // a scan pages through the keys with its cursor
+  Strs scanned;
+  std::string cursor = "0";
+  int pages = 0;
+  do {
+    Strs page = list(client.call({"scan", cursor, "count", "2"}).get());
+    ASSERT_FALSE(page.empty());
+    EXPECT_LE(page.size(), 3U);
+    cursor = page[0];
+    scanned.insert(scanned.end(), page.begin() + 1, page.end());
+    ++pages;
+  } while (cursor != "0");
+  EXPECT_EQ(scanned,
+            (Strs{"order:1", "user:1", "user:2", "user:3", "usr"}));
+  EXPECT_EQ(pages, 3);
+  Strs page = list(client.call({"scan", "0", "match", "user:*", "count",
+                                "2"}).get());
+  EXPECT_EQ(page, (Strs{">user:2", "user:1", "user:2"}));
+  EXPECT_EQ(list(client.call({"scan", page[0], "match", "user:*"}).get()),
+            (Strs{"0", "user:3"}));
+  EXPECT_EQ(client.call({"scan", "x"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"scan", "0", "count", "0"}).get().status,
+            Status::Error);
+
+  EXPECT_EQ(list(client.call({"range", "user:1", "user:3"}).get()),
+            (Strs{"user:1", "user:2", "user:3"}));
+  EXPECT_EQ(list(client.call({"range", "a", "user:2", "2"}).get()),
+            (Strs{"order:1", "user:1"}));
+  EXPECT_EQ(list(client.call({"range", "v", "z"}).get()), (Strs{}));
+  std::string info = client.call({"info", "keyspace"}).get().data;
+  EXPECT_NE(info.find("key_index_bytes:"), std::string::npos);
+  EXPECT_EQ(info.find("key_index_bytes:0\n"), std::string::npos);
+
+  // without the index keys visits every key and the rest is refused
+  AsyncClient plain_client("127.0.0.1", plain_port);
+  plain_client.call({"set", "user:1", "v"}).get();
+  plain_client.call({"set", "other", "v"}).get();
+  EXPECT_EQ(list(plain_client.call({"keys", "user:*"}).get()),
+            (Strs{"user:1"}));
+  EXPECT_EQ(plain_client.call({"scan", "0"}).get().status, Status::Error);
+  EXPECT_EQ(plain_client.call({"range", "a", "z"}).get().status,
+            Status::Error);
+
+  // a follower with the index builds it from the snapshot and the stream
+  ServerConfig follower_config;
+  follower_config.key_index = true;
+  follower_config.leader_host = "127.0.0.1";
+  follower_config.leader_port = leader_port;
+  ServerEventLoop follower(follower_port, follower_config);
+  std::thread follower_thread([&follower]() { follower.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  client.call({"set", "user:5", "v"}).get();
+  client.call({"del", "user:1"}).get();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient follower_client("127.0.0.1", follower_port);
+  EXPECT_EQ(list(follower_client.call({"range", "user:", "user:~"}).get()),
+            (Strs{"user:2", "user:3", "user:5"}));
+  client.call({"flushall"}).get();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(list(follower_client.call({"scan", "0"}).get()), (Strs{"0"}));
+  EXPECT_EQ(list(client.call({"keys", "*"}).get()), (Strs{}));
+
+  pthread_cancel(follower_thread.native_handle());
+  follower_thread.detach();
+  pthread_cancel(plain_thread.native_handle());
+  plain_thread.detach();
+  pthread_cancel(leader_thread.native_handle());
+  leader_thread.detach();
+}
+
+TEST_F(ServerEventLoopTest, TransactionTest) {
+  uint16_t leader_port = get_next_port();
+  uint16_t follower_port = get_next_port();
+  ServerEventLoop leader(leader_port);
+  std::thread leader_thread([&leader]() { leader.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", leader_port);
+  AsyncClient other("127.0.0.1", leader_port);
+  auto exec = [&client]() {
+    Reply reply = client.call({"exec"}).get();
+    std::vector<Reply> replies;
+    EXPECT_EQ(reply.status, Status::Valid);
+    EXPECT_TRUE(decode_replies(reply.data, replies));
+    return replies;
+  };
+
+  // commands are queued and run together, other clients see all or none
+  EXPECT_EQ(client.call({"multi"}).get().status, Status::Valid);
+  EXPECT_EQ(client.call({"set", "a", "1"}).get().data, "QUEUED");
+  EXPECT_EQ(client.call({"rpush", "l", "x", "y"}).get().data, "QUEUED");
+  EXPECT_EQ(client.call({"get", "a"}).get().data, "QUEUED");
+  EXPECT_EQ(client.call({"get", "missing"}).get().data, "QUEUED");
+  EXPECT_EQ(client.call({"hget", "l", "f"}).get().data, "QUEUED");
+  EXPECT_EQ(other.call({"get", "a"}).get().status, Status::Invalid);
+  std::vector<Reply> replies = exec();
+  ASSERT_EQ(replies.size(), 5U);
+  EXPECT_EQ(replies[0].status, Status::Valid);
+  EXPECT_EQ(replies[1].data, "2");
+  EXPECT_EQ(replies[2].data, "1");
+  EXPECT_EQ(replies[3].status, Status::Invalid);
+  EXPECT_EQ(replies[4].status, Status::Error);  // runs on, like the rest
+  EXPECT_EQ(other.call({"get", "a"}).get().data, "1");
+
+  EXPECT_EQ(client.call({"exec"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"discard"}).get().status, Status::Error);
+  client.call({"multi"}).get();
+  EXPECT_EQ(client.call({"multi"}).get().status, Status::Error);
+  client.call({"set", "a", "2"}).get();
+  EXPECT_EQ(client.call({"discard"}).get().status, Status::Valid);
+  EXPECT_EQ(client.call({"get", "a"}).get().data, "1");
+
+  // a refused command fails the whole transaction
+  client.call({"multi"}).get();
+  client.call({"set", "a", "3"}).get();
+  EXPECT_EQ(client.call({"blpop", "l", "0"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"nosuchcmd"}).get().status, Status::Error);
+  Reply aborted = client.call({"exec"}).get();
+  EXPECT_EQ(aborted.status, Status::Error);
+  EXPECT_EQ(aborted.data.rfind("EXECABORT", 0), 0U);
+  EXPECT_EQ(client.call({"get", "a"}).get().data, "1");
+
+  // watch: exec does nothing once a watched key changed
+  EXPECT_EQ(client.call({"watch", "a", "l"}).get().status, Status::Valid);
+  other.call({"rpush", "l", "z"}).get();
+  client.call({"multi"}).get();
+  EXPECT_EQ(client.call({"watch", "a"}).get().status, Status::Error);
+  client.call({"set", "a", "4"}).get();
+  EXPECT_EQ(client.call({"exec"}).get().status, Status::Invalid);
+  EXPECT_EQ(client.call({"get", "a"}).get().data, "1");
+
+  // exec and discard drop the watches, deletes and flushes count as changes
+  client.call({"multi"}).get();
+  client.call({"set", "a", "5"}).get();
+  EXPECT_EQ(exec().size(), 1U);
+  client.call({"watch", "a"}).get();
+  other.call({"del", "a"}).get();
+  other.call({"set", "a", "5"}).get();
+  client.call({"multi"}).get();
+  EXPECT_EQ(client.call({"exec"}).get().status, Status::Invalid);
+  client.call({"watch", "b"}).get();
+  other.call({"flushall"}).get();
+  client.call({"multi"}).get();
+  EXPECT_EQ(client.call({"exec"}).get().status, Status::Invalid);
+  client.call({"watch", "b"}).get();
+  client.call({"unwatch"}).get();
+  other.call({"set", "b", "1"}).get();
+  client.call({"multi"}).get();
+  EXPECT_EQ(exec().size(), 0U);
+
+  // cas
+  EXPECT_EQ(client.call({"cas", "c", "1", "2"}).get().data, "0");
+  client.call({"set", "c", "1"}).get();
+  EXPECT_EQ(client.call({"cas", "c", "0", "2"}).get().data, "0");
+  EXPECT_EQ(client.call({"cas", "c", "1", "2"}).get().data, "1");
+  EXPECT_EQ(client.call({"get", "c"}).get().data, "2");
+  std::string big(100000, 'v');
+  client.call({"set", "big", big}).get();
+  EXPECT_EQ(client.call({"cas", "big", big, "small"}).get().data, "1");
+  client.call({"hset", "h", "f", "v"}).get();
+  EXPECT_EQ(client.call({"cas", "h", "v", "w"}).get().status, Status::Error);
+
+  // the follower gets the writes of a transaction and cas
+  ServerConfig config;
+  config.leader_host = "127.0.0.1";
+  config.leader_port = leader_port;
+  ServerEventLoop follower(follower_port, config);
+  std::thread follower_thread([&follower]() { follower.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  client.call({"multi"}).get();
+  client.call({"cas", "c", "2", "3"}).get();
+  client.call({"lpush", "l2", "q"}).get();
+  EXPECT_EQ(exec().size(), 2U);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient follower_client("127.0.0.1", follower_port);
+  EXPECT_EQ(follower_client.call({"get", "c"}).get().data, "3");
+  EXPECT_EQ(follower_client.call({"get", "big"}).get().data, "small");
+  EXPECT_EQ(follower_client.call({"llen", "l2"}).get().data, "1");
+  EXPECT_EQ(follower_client.call({"cas", "c", "3", "4"}).get().status,
+            Status::Error);
+
+  pthread_cancel(follower_thread.native_handle());
+  follower_thread.detach();
+  pthread_cancel(leader_thread.native_handle());
+  leader_thread.detach();
+}
+
+TEST_F(ServerThreadedTest, ConcurrentAccessTest) {
+  uint16_t port = get_next_port();
+  ServerThreaded server(port);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  const int NUM_THREADS = 20;
+  const int OPS_PER_THREAD = 100;
+  std::vector<std::thread> client_threads;
+  std::atomic<int> success_count{0};
+
+  for (int t = 0; t < NUM_THREADS; t++) {
+    client_threads.emplace_back([&, t]() {
+      int client_fd = create_client_connection(port);
+      if (client_fd < 0) return;
+
+      for (int op = 0; op < OPS_PER_THREAD; op++) {
+        std::string key = "key" + std::to_string(t) + "_" + std::to_string(op);
+        std::string value =
+            "value" + std::to_string(t) + "_" + std::to_string(op);
+
+        // SET operation
+        auto set_msg = build_message({"set", key, value});
+        if (send(client_fd, set_msg.data(), set_msg.size(), 0) !=
+            static_cast<ssize_t>(set_msg.size())) {
+          break;
+        }
+
+        uint8_t response[1024];
+        ssize_t n = recv(client_fd, response, sizeof(response), 0);
+        if (n <= 0) break;
+
+        // GET operation to verify
+        auto get_msg = build_message({"get", key});
+        if (send(client_fd, get_msg.data(), get_msg.size(), 0) !=
+            static_cast<ssize_t>(get_msg.size())) {
+          break;
+        }
+
+        n = recv(client_fd, response, sizeof(response), 0);
+        if (n > 8) {
+          uint32_t msg_len, status;
+          memcpy(&msg_len, response, 4);
+          memcpy(&status, response + 4, 4);
+          if (status == 0) {
+            std::string retrieved(reinterpret_cast<char*>(response + 8),
+                                  msg_len - 4);
+            if (retrieved == value) {
+              success_count++;
+            }
+          }
+        }
+      }
+
+      close(client_fd);
+    });
+  }
+
+  for (auto& t : client_threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(success_count, NUM_THREADS * OPS_PER_THREAD);
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerThreadedTest, UnixSocketTest) {
+  uint16_t port = get_next_port();
+  std::string abstract = "@kv-test-" + std::to_string(port);
+  ServerConfig config;
+  config.unix_sockets = {abstract};
+  ServerThreaded server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient tcp("127.0.0.1", port);
+  AsyncClient local(abstract);
+  EXPECT_EQ(local.call({"set", "key", "val"}).get().status, Status::Valid);
+  EXPECT_EQ(tcp.call({"get", "key"}).get().data, "val");
+  EXPECT_EQ(local.call({"get", "key"}).get().data, "val");
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerThreadedTest, InfoStatsTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.latency_tracking = false;
+  ServerThreaded server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // counts of clients that already disconnected must be kept
+  for (int i = 0; i < 4; ++i) {
+    AsyncClient client("127.0.0.1", port);
+    client.call({"set", "key" + std::to_string(i), "value"}).get();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  AsyncClient client("127.0.0.1", port);
+  Reply reply = client.call({"info"}).get();
+  ASSERT_EQ(reply.status, Status::Valid);
+  EXPECT_EQ(info_field(reply.data, "connected_clients"), "1");
+  EXPECT_EQ(info_field(reply.data, "total_connections_received"), "5");
+  EXPECT_EQ(info_field(reply.data, "keys"), "4");
+  EXPECT_EQ(info_field(reply.data, "latency_tracking"), "no");
+  EXPECT_EQ(info_field(reply.data, "cmdstat_set"), "calls=4");
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerThreadedTest, TransactionTest) {
+  uint16_t port = get_next_port();
+  ServerThreaded server(port);
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  AsyncClient client("127.0.0.1", port);
+  client.call({"set", "a", "1"}).get();
+  client.call({"multi"}).get();
+  EXPECT_EQ(client.call({"get", "a"}).get().data, "QUEUED");
+  EXPECT_EQ(client.call({"set", "a", "2"}).get().data, "QUEUED");
+  EXPECT_EQ(client.call({"cas", "a", "2", "3"}).get().data, "QUEUED");
+  EXPECT_EQ(client.call({"del", "none"}).get().data, "QUEUED");
+  Reply reply = client.call({"exec"}).get();
+  std::vector<Reply> replies;
+  ASSERT_TRUE(decode_replies(reply.data, replies));
+  ASSERT_EQ(replies.size(), 4U);
+  EXPECT_EQ(replies[0].data, "1");
+  EXPECT_EQ(replies[2].data, "1");
+  EXPECT_EQ(client.call({"get", "a"}).get().data, "3");
+  client.call({"multi"}).get();
+  EXPECT_EQ(client.call({"info"}).get().status, Status::Error);
+  EXPECT_EQ(client.call({"exec"}).get().status, Status::Error);
+
+  // read-modify-write from many clients loses no update, with watch and
+  // with cas
+  const int n_threads = 4;
+  const int n_incrs = 50;
+  std::vector<std::thread> threads;
+  std::atomic<int> retries{0};
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&]() {
+      AsyncClient c("127.0.0.1", port);
+      for (int i = 0; i < n_incrs; ++i) {
+        while (true) {
+          c.call({"watch", "w"}).get();
+          Reply cur = c.call({"get", "w"}).get();
+          int n = cur.status == Status::Valid ? std::stoi(cur.data) : 0;
+          c.call({"multi"}).get();
+          c.call({"set", "w", std::to_string(n + 1)}).get();
+          if (c.call({"exec"}).get().status == Status::Valid) break;
+          ++retries;
+        }
+        while (true) {
+          int n = std::stoi(c.call({"get", "a"}).get().data);
+          if (c.call({"cas", "a", std::to_string(n), std::to_string(n + 1)})
+                  .get()
+                  .data == "1") {
+            break;
+          }
+          ++retries;
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads) t.join();
+  EXPECT_EQ(client.call({"get", "w"}).get().data,
+            std::to_string(n_threads * n_incrs));
+  EXPECT_EQ(client.call({"get", "a"}).get().data,
+            std::to_string(3 + n_threads * n_incrs));
+
+  pthread_cancel(server_thread.native_handle());
+  server_thread.detach();
+}
+
+TEST_F(ServerThreadedTest, BufferReclaimTest) {
+  uint16_t port = get_next_port();
+  ServerConfig config;
+  config.conn_idle_ms = 200;
+  ServerThreaded server(port, config);
+
+  std::thread server_thread([&server]() { server.run_server(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::string val(200000, 'v');
+  AsyncClient client("127.0.0.1", port);
+  client.call({"set", "key", val}).get();
+  EXPECT_TRUE(client.call({"get", "key"}).get().data == val);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(600));
+  AsyncClient observer("127.0.0.1", port);
+  Reply reply = observer.call({"info", "memory"}).get();
+  EXPECT_LT(std::stoull(info_field(reply.data, "mem_clients")), 64 * 1024);
+  EXPECT_TRUE(client.call({"get", "key"}).get().data == val);
 
   pthread_cancel(server_thread.native_handle());
   server_thread.detach();